@@ -4,11 +4,16 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <utility>
 
 namespace ASTImpl {
 
@@ -67,17 +72,79 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+//Инструкция байткода: операнд (число или ячейка) хранится прямо в инструкции.
+//Бинарная операция с числом или ячейкой справа - одна инструкция с непосредственным операндом
+struct Instruction {
+    enum class Op : uint8_t {
+        PushNumber,
+        PushCell,
+        //lhs и rhs на стеке
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        //lhs на стеке, rhs - number
+        AddNumber,
+        SubtractNumber,
+        MultiplyNumber,
+        DivideNumber,
+        //lhs на стеке, rhs - значение cell
+        AddCell,
+        SubtractCell,
+        MultiplyCell,
+        DivideCell,
+        UnaryMinus,
+        //агрегатная функция: scalar_count значений на стеке заменяются результатом function
+        Aggregate,
+    };
+
+    //Смещение от Add..Divide к вариантам с непосредственным операндом
+    static constexpr int NUMBER_OPERAND_SHIFT = static_cast<int>(Op::AddNumber) - static_cast<int>(Op::Add);
+    static constexpr int CELL_OPERAND_SHIFT = static_cast<int>(Op::AddCell) - static_cast<int>(Op::Add);
+
+    //Тривиальная копия Position, чтобы поместиться в union
+    struct CellRef {
+        int row;
+        int col;
+    };
+
+    Op op = Op::PushNumber;
+    //Aggregate: число аргументов-значений на стеке (остальные аргументы - ссылки на ячейки)
+    uint32_t scalar_count = 0;
+    union {
+        double number = 0;
+        CellRef cell;
+        //Aggregate: узел FunctionExpr
+        const Expr* function;
+    };
+};
+
+static_assert(sizeof(Instruction) == 16, "Instruction must stay compact");
+
+//Буфер для сборки байткода при компиляции
+using Bytecode = std::pmr::vector<Instruction>;
+
 class Expr {
 public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    //offset - сдвиг всех ссылок формулы (общая формула в другой ячейке, см. FormulaAST::Execute)
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const = 0;
+    virtual double Evaluate(const SheetInterface& sheet, Position offset) const = 0;
+
+    //Дописывает в code постфиксный байткод поддерева
+    virtual void Compile(Bytecode& code) const = 0;
+
+    //Ячейки, если узел - ссылка (ячейка или диапазон): такой аргумент функции берется по ссылке,
+    //пустые и текстовые ячейки пропускаются
+    virtual std::optional<Range> GetReferencedArea() const {
+        return std::nullopt;
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position offset,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,7 +153,7 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, offset);
 
         if (parens_needed) {
             out << ')';
@@ -95,6 +162,91 @@ public:
 };
 
 namespace {
+//Ошибки передаются по вычислению упакованными в NaN (FormulaError::Box), без исключений.
+//Нечисловой результат операции - ошибка первого (в порядке вычисления) ошибочного операнда,
+//а если операнды - числа, то арифметическая ошибка. Проверка - одно сравнение на быстром пути
+double CheckFinite(double result, double lhs, double rhs = 0) {
+    if(std::isfinite(result)) {
+        return result;
+    }
+    if(FormulaError::IsBoxed(lhs)) {
+        return lhs;
+    }
+    if(FormulaError::IsBoxed(rhs)) {
+        return rhs;
+    }
+    return FormulaError(FormulaError::Category::Arithmetic).Box();
+}
+
+Position Shift(Position pos, Position offset) {
+    return {pos.row + offset.row, pos.col + offset.col};
+}
+
+Range Shift(Range range, Position offset) {
+    return {Shift(range.first, offset), Shift(range.last, offset)};
+}
+
+//Значение ячейки как операнда формулы; общее для дерева и байткода
+double GetCellOperand(const SheetInterface& sheet, Position pos) {
+    //If no such cell, evaluates to 0
+    const auto cell_ptr = sheet.GetCell(pos);
+    return cell_ptr ? cell_ptr->GetOperandValue() : 0;
+}
+
+//Бинарная операция Add..Divide - так же, как в BinaryOpExpr::Evaluate
+double ComputeBinaryOp(Instruction::Op op, double lhs, double rhs) {
+    switch(op) {
+    case Instruction::Op::Add:
+        return 1.0 * lhs + 1.0 * rhs;
+    case Instruction::Op::Subtract:
+        return 1.0 * lhs - 1.0 * rhs;
+    case Instruction::Op::Multiply:
+        return 1.0 * lhs * rhs;
+    case Instruction::Op::Divide:
+        return 1.0 * lhs / rhs;
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+//Дописывает бинарную операцию op (Add..Divide) с оптимизациями:
+//две константы сворачиваются в одну, если результат конечен (иначе ошибка остается на время вычисления),
+//число или ячейка справа становятся непосредственным операндом
+void EmitBinaryOp(Bytecode& code, Instruction::Op op) {
+    const size_t size = code.size();
+    if(size >= 2 && code[size - 1].op == Instruction::Op::PushNumber
+       && code[size - 2].op == Instruction::Op::PushNumber) {
+        const double result = ComputeBinaryOp(op, code[size - 2].number, code[size - 1].number);
+        if(std::isfinite(result)) {
+            code.pop_back();
+            code.back().number = result;
+            return;
+        }
+    }
+
+    if(size >= 1 && (code.back().op == Instruction::Op::PushNumber || code.back().op == Instruction::Op::PushCell)) {
+        const int shift = code.back().op == Instruction::Op::PushNumber ? Instruction::NUMBER_OPERAND_SHIFT
+                                                                        : Instruction::CELL_OPERAND_SHIFT;
+        code.back().op = static_cast<Instruction::Op>(static_cast<int>(op) + shift);
+        return;
+    }
+
+    Instruction instruction;
+    instruction.op = op;
+    code.push_back(instruction);
+}
+
+void EmitUnaryMinus(Bytecode& code) {
+    if(!code.empty() && code.back().op == Instruction::Op::PushNumber) {
+        code.back().number = -1.0 * code.back().number;
+        return;
+    }
+    Instruction instruction;
+    instruction.op = Instruction::Op::UnaryMinus;
+    code.push_back(instruction);
+}
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -105,7 +257,7 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, ExprPtr lhs, ExprPtr rhs)
         : type_(type)
         , lhs_(std::move(lhs))
         , rhs_(std::move(rhs)) {
@@ -119,10 +271,10 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
+        lhs_->PrintFormula(out, precedence, offset);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, offset, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -142,36 +294,56 @@ public:
         }
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        double result;
+    double Evaluate(const SheetInterface& sheet, Position offset) const override {
+        //lhs is evaluated first: its error takes precedence
+        const double lhs = lhs_->Evaluate(sheet, offset);
+        const double rhs = rhs_->Evaluate(sheet, offset);
+
+        double result = 0;
         switch(type_) {
         case Add:
-            result = 1.0 * lhs_->Evaluate(sheet) + 1.0 * rhs_->Evaluate(sheet);
+            result = 1.0 * lhs + 1.0 * rhs;
             break;
         case Subtract:
-            result = 1.0 * lhs_->Evaluate(sheet) - 1.0 * rhs_->Evaluate(sheet);
+            result = 1.0 * lhs - 1.0 * rhs;
             break;
         case Multiply:
-            result = 1.0 * lhs_->Evaluate(sheet) * rhs_->Evaluate(sheet);
+            result = 1.0 * lhs * rhs;
             break;
         case Divide:
-            result = 1.0 * lhs_->Evaluate(sheet) / rhs_->Evaluate(sheet);
+            result = 1.0 * lhs / rhs;
             break;
         default:
             break;
         }
 
-        if(!std::isfinite(result)) {
-            throw FormulaError(FormulaError::Category::Arithmetic);
-        }
+        return CheckFinite(result, lhs, rhs);
+    }
 
-        return result;
+    void Compile(Bytecode& code) const override {
+        lhs_->Compile(code);
+        rhs_->Compile(code);
+
+        switch(type_) {
+        case Add:
+            EmitBinaryOp(code, Instruction::Op::Add);
+            break;
+        case Subtract:
+            EmitBinaryOp(code, Instruction::Op::Subtract);
+            break;
+        case Multiply:
+            EmitBinaryOp(code, Instruction::Op::Multiply);
+            break;
+        case Divide:
+            EmitBinaryOp(code, Instruction::Op::Divide);
+            break;
+        }
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    ExprPtr lhs_;
+    ExprPtr rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -182,7 +354,7 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, ExprPtr operand)
         : type_(type)
         , operand_(std::move(operand)) {
     }
@@ -193,89 +365,83 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, offset);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        double result;
+    double Evaluate(const SheetInterface& sheet, Position offset) const override {
+        const double operand = operand_->Evaluate(sheet, offset);
+
+        double result = 0;
         switch(type_) {
         case Type::UnaryPlus:
-            result = 1.0 * operand_->Evaluate(sheet);
+            result = 1.0 * operand;
             break;
         case Type::UnaryMinus:
-            result = -1.0 * operand_->Evaluate(sheet);
+            result = -1.0 * operand;
         }
 
-        if(!std::isfinite(result)) {
-            throw FormulaError(FormulaError::Category::Arithmetic);
-        }
+        return CheckFinite(result, operand);
+    }
 
-        return result;
+    void Compile(Bytecode& code) const override {
+        operand_->Compile(code);
+
+        //Unary plus gives the same (finite) value: 1.0 * x == x, no instruction needed
+        if(type_ == UnaryMinus) {
+            EmitUnaryMinus(code);
+        }
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    ExprPtr operand_;
 };
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
+    explicit CellExpr(Position cell)
         : cell_(cell) {
     }
 
     void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
+        if (!cell_.IsValid()) {
             out << FormulaError::Category::Ref;
         } else {
-            out << cell_->ToString();
+            out << cell_.ToString();
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+        CellExpr(Shift(cell_, offset)).Print(out);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        //If no such cell, evaluates to 0
-        const auto cell_ptr = sheet.GetCell(*cell_);
-
-        if(!cell_ptr) {
-            return 0;
-        }
-
-        auto result = cell_ptr->GetValue();
-
-        if(std::holds_alternative<FormulaError>(result)) {
-            throw std::get<FormulaError>(result);
-        }
-
-        //If cell is not empty, but text could not be converted to double, error
-        else if(std::holds_alternative<std::string>(result)
-                 && !std::get<std::string>(result).empty()) {
-            throw FormulaError(FormulaError::Category::Value);
-        }
+    double Evaluate(const SheetInterface& sheet, Position offset) const override {
+        return GetCellOperand(sheet, Shift(cell_, offset));
+    }
 
-        //return 0 for empty/non-existent cells
-        else if(!std::holds_alternative<double>(result)) {
-            return 0;
-        }
+    std::optional<Range> GetReferencedArea() const override {
+        return Range{cell_, cell_};
+    }
 
-        return std::get<double>(result);
+    void Compile(Bytecode& code) const override {
+        Instruction instruction;
+        instruction.op = Instruction::Op::PushCell;
+        instruction.cell = {cell_.row, cell_.col};
+        code.push_back(instruction);
     }
 
 private:
-    const Position* cell_;
+    Position cell_;
 };
 
 class NumberExpr final : public Expr {
@@ -288,7 +454,7 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* offset */) const override {
         out << value_;
     }
 
@@ -296,17 +462,312 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
+    double Evaluate(const SheetInterface& /* sheet */, Position /* offset */) const override {
         return value_;
     }
 
+    void Compile(Bytecode& code) const override {
+        Instruction instruction;
+        instruction.op = Instruction::Op::PushNumber;
+        instruction.number = value_;
+        code.push_back(instruction);
+    }
+
 private:
     double value_;
 };
 
+//Диапазон A1:B5 - только аргумент функции, значением сам по себе не вычисляется
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(Range range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!range_.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range_.ToString();
+        }
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+        RangeExpr(Shift(range_, offset)).Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& /* sheet */, Position /* offset */) const override {
+        //grammar allows a range only as a function argument
+        assert(false);
+        return FormulaError(FormulaError::Category::Value).Box();
+    }
+
+    void Compile(Bytecode& /* code */) const override {
+        //function arguments-ranges are read by the Aggregate instruction itself
+        assert(false);
+    }
+
+    std::optional<Range> GetReferencedArea() const override {
+        return range_;
+    }
+
+private:
+    Range range_;
+};
+
+//==== Агрегатные функции ====
+//Значения всех аргументов собираются в непрерывный буфер, ядра проходят его в KERNEL_LANES
+//независимых аккумуляторов: короткие цепочки зависимостей, цикл векторизуется компилятором
+constexpr size_t KERNEL_LANES = 4;
+
+double SumKernel(const double* values, size_t count) {
+    double acc[KERNEL_LANES] = {0, 0, 0, 0};
+    size_t idx = 0;
+    for(; idx + KERNEL_LANES <= count; idx += KERNEL_LANES) {
+        for(size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+            acc[lane] += values[idx + lane];
+        }
+    }
+    for(; idx < count; ++idx) {
+        acc[idx % KERNEL_LANES] += values[idx];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+//Число значений-чисел: значение формулы - конечное число или упакованная ошибка (NaN)
+size_t CountKernel(const double* values, size_t count) {
+    size_t acc[KERNEL_LANES] = {0, 0, 0, 0};
+    size_t idx = 0;
+    for(; idx + KERNEL_LANES <= count; idx += KERNEL_LANES) {
+        for(size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+            acc[lane] += values[idx + lane] == values[idx + lane];
+        }
+    }
+    for(; idx < count; ++idx) {
+        acc[0] += values[idx] == values[idx];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+//count > 0, ошибок среди значений нет. Less - сравнение, которое выбирает результат (min или max)
+template <typename Less>
+double ExtremumKernel(const double* values, size_t count, Less less) {
+    double acc[KERNEL_LANES] = {values[0], values[0], values[0], values[0]};
+    size_t idx = 0;
+    for(; idx + KERNEL_LANES <= count; idx += KERNEL_LANES) {
+        for(size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+            acc[lane] = less(values[idx + lane], acc[lane]) ? values[idx + lane] : acc[lane];
+        }
+    }
+    for(; idx < count; ++idx) {
+        acc[0] = less(values[idx], acc[0]) ? values[idx] : acc[0];
+    }
+    double result = acc[0];
+    for(size_t lane = 1; lane < KERNEL_LANES; ++lane) {
+        result = less(acc[lane], result) ? acc[lane] : result;
+    }
+    return result;
+}
+
+//Первая в порядке аргументов ошибка, иначе арифметическая (переполнение)
+double FirstError(const double* values, size_t count) {
+    const auto error = std::find_if(values, values + count, [](double value) {
+        return FormulaError::IsBoxed(value);
+    });
+    return error != values + count ? *error : FormulaError(FormulaError::Category::Arithmetic).Box();
+}
+
+class FunctionExpr final : public Expr {
+public:
+    enum Type : uint8_t {
+        Sum,
+        Min,
+        Max,
+        Average,
+        Count,
+    };
+
+    static constexpr std::array<std::string_view, 5> NAMES{"SUM", "MIN", "MAX", "AVERAGE", "COUNT"};
+
+    static std::optional<Type> FromName(std::string_view name) {
+        const auto it = std::find(NAMES.begin(), NAMES.end(), name);
+        if (it == NAMES.end()) {
+            return std::nullopt;
+        }
+        return static_cast<Type>(it - NAMES.begin());
+    }
+
+    //Аргументы [first, last) переносятся в массив в арене формулы
+    template <typename It>
+    explicit FunctionExpr(Type type, std::pmr::memory_resource* arena, It first, It last)
+        : type_(type)
+        , arg_count_(static_cast<size_t>(last - first)) {
+        args_ = static_cast<ExprPtr*>(arena->allocate(sizeof(ExprPtr) * arg_count_, alignof(ExprPtr)));
+        std::uninitialized_move(first, last, args_);
+    }
+
+    ~FunctionExpr() override {
+        std::destroy_n(args_, arg_count_);
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << NAMES[type_];
+        for (size_t idx = 0; idx < arg_count_; ++idx) {
+            out << ' ';
+            args_[idx]->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+        out << NAMES[type_] << '(';
+        for (size_t idx = 0; idx < arg_count_; ++idx) {
+            if (idx > 0) {
+                out << ',';
+            }
+            args_[idx]->PrintFormula(out, EP_ATOM, offset);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet, Position offset) const override {
+        return Aggregate(sheet, offset, [&sheet, offset](const Expr& arg) {
+            return arg.Evaluate(sheet, offset);
+        });
+    }
+
+    //Для байткода: scalars - уже вычисленные аргументы-значения в порядке аргументов
+    double AggregateEvaluated(const SheetInterface& sheet, Position offset, const double* scalars) const {
+        return Aggregate(sheet, offset, [&scalars](const Expr&) {
+            return *scalars++;
+        });
+    }
+
+    void Compile(Bytecode& code) const override {
+        Instruction instruction;
+        instruction.op = Instruction::Op::Aggregate;
+        instruction.function = this;
+        for (size_t idx = 0; idx < arg_count_; ++idx) {
+            if (!args_[idx]->GetReferencedArea()) {
+                args_[idx]->Compile(code);
+                ++instruction.scalar_count;
+            }
+        }
+        code.push_back(instruction);
+    }
+
+private:
+    Type type_;
+    size_t arg_count_;
+    ExprPtr* args_;
+
+    //Собирает значения аргументов в буфер потока и вычисляет функцию.
+    //Вложенное вычисление (формула в ячейке диапазона) дописывает свои значения после base и убирает их
+    template <typename ScalarGetter>
+    double Aggregate(const SheetInterface& sheet, Position offset, ScalarGetter get_scalar) const {
+        auto& values = aggregate_values_;
+        const size_t base = values.size();
+        //SUM, COUNT и AVERAGE берут готовые итоги диапазона, если они есть у таблицы.
+        //Сумма складывается по аргументам: диапазон без итогов - ядром, как и его итоги,
+        //поэтому результат не зависит от того, есть ли итоги
+        const bool uses_totals = type_ == Sum || type_ == Count || type_ == Average;
+        SheetInterface::RangeTotals totals;
+        for (size_t idx = 0; idx < arg_count_; ++idx) {
+            if (auto area = args_[idx]->GetReferencedArea()) {
+                area = Shift(*area, offset);
+                if (const auto range_totals = uses_totals ? sheet.GetRangeTotals(*area) : std::nullopt) {
+                    totals.sum += range_totals->sum;
+                    totals.count += range_totals->count;
+                } else {
+                    const size_t first = values.size();
+                    sheet.GetRangeValues(*area, values);
+                    if (uses_totals) {
+                        totals.sum += SumKernel(values.data() + first, values.size() - first);
+                    }
+                }
+            } else {
+                const double value = get_scalar(*args_[idx]);
+                values.push_back(value);
+                totals.sum += value;
+            }
+        }
+
+        const double result = Compute(values.data() + base, values.size() - base, totals);
+        values.resize(base);
+        return result;
+    }
+
+    //totals - сумма всех аргументов и число значений диапазонов с итогами, не попавших в values
+    double Compute(const double* values, size_t count, const SheetInterface::RangeTotals& totals) const {
+        switch (type_) {
+            case Sum: {
+                const double sum = totals.sum;
+                return std::isfinite(sum) ? sum : FirstError(values, count);
+            }
+            case Average: {
+                const size_t total_count = count + totals.count;
+                if (total_count == 0) {
+                    return FormulaError(FormulaError::Category::Arithmetic).Box();
+                }
+                const double average = totals.sum / static_cast<double>(total_count);
+                return std::isfinite(average) ? average : FirstError(values, count);
+            }
+            case Min:
+            case Max:
+                if (CountKernel(values, count) != count) {
+                    return FirstError(values, count);
+                }
+                if (count == 0) {
+                    return 0;
+                }
+                return type_ == Min ? ExtremumKernel(values, count, std::less<double>{})
+                                    : ExtremumKernel(values, count, std::greater<double>{});
+            case Count:
+                //ошибки не считаются, как и пропущенные текстовые ячейки
+                return static_cast<double>(CountKernel(values, count) + totals.count);
+        }
+        assert(false);
+        return 0;
+    }
+
+    //Буфер значений аргументов, свой у каждого потока пересчета
+    static thread_local std::vector<double> aggregate_values_;
+};
+
+thread_local std::vector<double> FunctionExpr::aggregate_values_;
+
+template <typename T, typename... Args>
+ExprPtr MakeExpr(std::pmr::memory_resource* arena, Args&&... args) {
+    void* mem = arena->allocate(sizeof(T), alignof(T));
+    return ExprPtr(new (mem) T(std::forward<Args>(args)...));
+}
+
+//Число литерала так же, как его читает istream (для эталонного разбора ANTLR)
+double ParseNumberWithStream(const std::string& text) {
+    double value = 0;
+    std::istringstream in(text);
+    in >> value;
+    if (!in) {
+        throw ParsingError("Invalid number: " + text);
+    }
+    return value;
+}
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    explicit ParseASTListener(std::pmr::memory_resource* arena)
+        : arena_(arena) {
+    }
+
+    ExprPtr MoveRoot() {
         assert(args_.size() == 1);
         auto root = std::move(args_.front());
         args_.clear();
@@ -314,10 +775,14 @@ public:
         return root;
     }
 
-    std::forward_list<Position> MoveCells() {
+    std::vector<Position> MoveCells() {
         return std::move(cells_);
     }
 
+    std::vector<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -332,20 +797,14 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+        auto node = MakeExpr<UnaryOpExpr>(type, std::move(operand));
         args_.back() = std::move(node);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
-        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
-        }
+        double value = ParseNumberWithStream(ctx->NUMBER()->getSymbol()->getText());
 
-        auto node = std::make_unique<NumberExpr>(value);
+        auto node = MakeExpr<NumberExpr>(value);
         args_.push_back(std::move(node));
     }
 
@@ -356,8 +815,8 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
+        cells_.push_back(value);
+        auto node = MakeExpr<CellExpr>(value);
         args_.push_back(std::move(node));
     }
 
@@ -381,17 +840,59 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        auto node = MakeExpr<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
         args_.back() = std::move(node);
     }
 
+    void exitRangeArgument(FormulaParser::RangeArgumentContext* ctx) override {
+        Position corners[2];
+        for (size_t idx = 0; idx < 2; ++idx) {
+            auto value_str = ctx->CELL(idx)->getSymbol()->getText();
+            corners[idx] = Position::FromString(value_str);
+            if (!corners[idx].IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
+        }
+
+        const auto range = Range::FromCorners(corners[0], corners[1]);
+        ranges_.push_back(range);
+        auto node = MakeExpr<RangeExpr>(range);
+        args_.push_back(std::move(node));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const size_t arg_count = ctx->argument().size();
+        assert(args_.size() >= arg_count);
+
+        const auto type = FunctionExpr::FromName(ctx->FUNCTION()->getSymbol()->getText());
+        assert(type.has_value());
+
+        const auto first_arg = args_.end() - arg_count;
+        //Ячейка-аргумент читается как диапазон из одной ячейки (пустая и текст пропускаются)
+        for (auto arg = first_arg; arg != args_.end(); ++arg) {
+            if (const auto area = (*arg)->GetReferencedArea(); area && area->CellCount() == 1) {
+                ranges_.push_back(*area);
+            }
+        }
+        auto node = MakeExpr<FunctionExpr>(*type, arena_, first_arg, args_.end());
+        args_.erase(first_arg, args_.end());
+        args_.push_back(std::move(node));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    std::pmr::memory_resource* arena_;
+    std::vector<ExprPtr> args_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+
+    template <typename T, typename... Args>
+    ExprPtr MakeExpr(Args&&... args) {
+        return ASTImpl::MakeExpr<T>(arena_, std::forward<Args>(args)...);
+    }
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -404,10 +905,661 @@ public:
     }
 };
 
+//Стековая машина: один цикл по инструкциям без виртуальных вызовов.
+//Ошибки лежат на стеке упакованными в NaN и проверяются так же, как при обходе дерева
+//(CheckFinite после каждой операции), поэтому значения и ошибки совпадают побитово.
+//stack - не меньше stack_depth слотов
+double RunBytecode(const Instruction* first, const Instruction* last, double* stack,
+                   const SheetInterface& sheet, Position offset) {
+    //top указывает на первый свободный слот
+    double* top = stack;
+
+    auto read_cell = [&](const Instruction& instruction) {
+        return GetCellOperand(sheet, {instruction.cell.row + offset.row, instruction.cell.col + offset.col});
+    };
+
+    for(auto instruction = first; instruction != last; ++instruction) {
+        //каждая бинарная операция задает rhs в первом switch, остальные инструкции выходят по continue
+        double rhs = 0;
+        switch(instruction->op) {
+        case Instruction::Op::PushNumber:
+            *top++ = instruction->number;
+            continue;
+        case Instruction::Op::PushCell:
+            *top++ = read_cell(*instruction);
+            continue;
+
+        case Instruction::Op::UnaryMinus:
+            top[-1] = CheckFinite(-1.0 * top[-1], top[-1]);
+            continue;
+
+        case Instruction::Op::Aggregate:
+            top -= instruction->scalar_count;
+            *top = static_cast<const FunctionExpr*>(instruction->function)->AggregateEvaluated(sheet, offset, top);
+            ++top;
+            continue;
+
+        case Instruction::Op::Add:
+        case Instruction::Op::Subtract:
+        case Instruction::Op::Multiply:
+        case Instruction::Op::Divide:
+            --top;
+            rhs = top[0];
+            break;
+
+        case Instruction::Op::AddNumber:
+        case Instruction::Op::SubtractNumber:
+        case Instruction::Op::MultiplyNumber:
+        case Instruction::Op::DivideNumber:
+            rhs = instruction->number;
+            break;
+
+        case Instruction::Op::AddCell:
+        case Instruction::Op::SubtractCell:
+        case Instruction::Op::MultiplyCell:
+        case Instruction::Op::DivideCell:
+            rhs = read_cell(*instruction);
+            break;
+        }
+
+        const double lhs = top[-1];
+        double result;
+        switch(instruction->op) {
+        case Instruction::Op::Add:
+        case Instruction::Op::AddNumber:
+        case Instruction::Op::AddCell:
+            result = 1.0 * lhs + 1.0 * rhs;
+            break;
+        case Instruction::Op::Subtract:
+        case Instruction::Op::SubtractNumber:
+        case Instruction::Op::SubtractCell:
+            result = 1.0 * lhs - 1.0 * rhs;
+            break;
+        case Instruction::Op::Multiply:
+        case Instruction::Op::MultiplyNumber:
+        case Instruction::Op::MultiplyCell:
+            result = 1.0 * lhs * rhs;
+            break;
+        default:
+            result = 1.0 * lhs / rhs;
+            break;
+        }
+        top[-1] = CheckFinite(result, lhs, rhs);
+    }
+
+    assert(top == stack + 1);
+    return top[-1];
+}
+
+//Глубокие формулы - редкость, стек для них выделяется в куче
+double RunBytecodeOnHeap(const Instruction* first, const Instruction* last, size_t stack_depth,
+                         const SheetInterface& sheet, Position offset) {
+    std::vector<double> stack(stack_depth);
+    return RunBytecode(first, last, stack.data(), sheet, offset);
+}
+
+//==== Вычисление по столбцу ====
+//Байткод выполняется сразу для COLUMN_CHUNK строк: слот стека - столбец значений, операция - цикл
+//по столбцу без ветвлений, который векторизуется компилятором. Ошибки проверяются так же, как в RunBytecode:
+//если в столбце результата есть неконечное значение, он проходится еще раз с CheckFinite по строкам
+constexpr size_t COLUMN_CHUNK = 256;
+
+//Неконечное значение (бесконечность или NaN, в том числе упакованная ошибка) - по битам экспоненты,
+//чтобы признак собирался в цикле через OR без ветвлений
+inline uint64_t NonFiniteBit(double value) {
+    constexpr uint64_t EXPONENT_MASK = 0x7ff0000000000000ull;
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return (bits & EXPONENT_MASK) == EXPONENT_MASK;
+}
+
+//Значения ячейки cell как операнда для строк [0, count) столбца со сдвигом offset
+void GatherCells(const SheetInterface& sheet, Instruction::CellRef cell, Position offset, size_t count,
+                 double* out) {
+    for(size_t idx = 0; idx < count; ++idx) {
+        out[idx] = GetCellOperand(sheet, {cell.row + offset.row + static_cast<int>(idx), cell.col + offset.col});
+    }
+}
+
+template <typename Op>
+void ColumnBinaryOp(const double* lhs, const double* rhs, double* out, size_t count, Op op) {
+    uint64_t non_finite = 0;
+    for(size_t idx = 0; idx < count; ++idx) {
+        out[idx] = op(lhs[idx], rhs[idx]);
+        non_finite |= NonFiniteBit(out[idx]);
+    }
+    if(non_finite) {
+        for(size_t idx = 0; idx < count; ++idx) {
+            out[idx] = CheckFinite(out[idx], lhs[idx], rhs[idx]);
+        }
+    }
+}
+
+//Бинарная операция Add..Divide по столбцам - те же выражения, что в RunBytecode, побитово те же значения
+void ColumnBinaryOp(Instruction::Op op, const double* lhs, const double* rhs, double* out, size_t count) {
+    switch(op) {
+    case Instruction::Op::Add:
+        ColumnBinaryOp(lhs, rhs, out, count, [](double l, double r) {
+            return 1.0 * l + 1.0 * r;
+        });
+        break;
+    case Instruction::Op::Subtract:
+        ColumnBinaryOp(lhs, rhs, out, count, [](double l, double r) {
+            return 1.0 * l - 1.0 * r;
+        });
+        break;
+    case Instruction::Op::Multiply:
+        ColumnBinaryOp(lhs, rhs, out, count, [](double l, double r) {
+            return 1.0 * l * r;
+        });
+        break;
+    default:
+        ColumnBinaryOp(lhs, rhs, out, count, [](double l, double r) {
+            return 1.0 * l / r;
+        });
+        break;
+    }
+}
+
+//Буферы вычисления по столбцу, свои у каждого потока пересчета
+struct ColumnBuffers {
+    std::vector<double> storage;
+    //Слоты стека и два запасных столбца (результат операции и непосредственный операнд) -
+    //указатели в storage: операция пишет результат в запасной столбец и меняет его местами со слотом
+    std::vector<double*> columns;
+    std::vector<double> scalars;
+
+    void Reserve(size_t stack_depth) {
+        const size_t column_count = stack_depth + 2;
+        if(columns.size() >= column_count) {
+            return;
+        }
+        storage.resize(column_count * COLUMN_CHUNK);
+        columns.resize(column_count);
+        for(size_t idx = 0; idx < column_count; ++idx) {
+            columns[idx] = storage.data() + idx * COLUMN_CHUNK;
+        }
+    }
+};
+
+thread_local ColumnBuffers column_buffers;
+
+//RunBytecode для строк [0, count) столбца, count <= COLUMN_CHUNK: out[i] - значение со сдвигом offset + {i, 0}
+void RunBytecodeColumn(const Instruction* first, const Instruction* last, size_t stack_depth,
+                       const SheetInterface& sheet, Position offset, size_t count, double* out) {
+    auto& buffers = column_buffers;
+    buffers.Reserve(stack_depth);
+    double** stack = buffers.columns.data();
+    double*& result = buffers.columns[stack_depth];
+    double*& operand = buffers.columns[stack_depth + 1];
+    //top - число занятых слотов
+    size_t top = 0;
+
+    for(auto instruction = first; instruction != last; ++instruction) {
+        switch(instruction->op) {
+        case Instruction::Op::PushNumber:
+            std::fill_n(stack[top++], count, instruction->number);
+            continue;
+        case Instruction::Op::PushCell:
+            GatherCells(sheet, instruction->cell, offset, count, stack[top++]);
+            continue;
+
+        case Instruction::Op::UnaryMinus: {
+            const double* operand_column = stack[top - 1];
+            uint64_t non_finite = 0;
+            for(size_t idx = 0; idx < count; ++idx) {
+                result[idx] = -1.0 * operand_column[idx];
+                non_finite |= NonFiniteBit(result[idx]);
+            }
+            if(non_finite) {
+                for(size_t idx = 0; idx < count; ++idx) {
+                    result[idx] = CheckFinite(result[idx], operand_column[idx]);
+                }
+            }
+            std::swap(stack[top - 1], result);
+            continue;
+        }
+
+        case Instruction::Op::Aggregate: {
+            //функция вычисляется по строкам: аргументы-значения строки собираются из столбцов стека
+            const size_t scalar_count = instruction->scalar_count;
+            const auto function = static_cast<const FunctionExpr*>(instruction->function);
+            top -= scalar_count;
+            buffers.scalars.resize(scalar_count);
+            for(size_t idx = 0; idx < count; ++idx) {
+                for(size_t arg = 0; arg < scalar_count; ++arg) {
+                    buffers.scalars[arg] = stack[top + arg][idx];
+                }
+                result[idx] = function->AggregateEvaluated(
+                    sheet, {offset.row + static_cast<int>(idx), offset.col}, buffers.scalars.data());
+            }
+            std::swap(stack[top++], result);
+            continue;
+        }
+
+        case Instruction::Op::Add:
+        case Instruction::Op::Subtract:
+        case Instruction::Op::Multiply:
+        case Instruction::Op::Divide:
+            --top;
+            ColumnBinaryOp(instruction->op, stack[top - 1], stack[top], result, count);
+            break;
+
+        case Instruction::Op::AddNumber:
+        case Instruction::Op::SubtractNumber:
+        case Instruction::Op::MultiplyNumber:
+        case Instruction::Op::DivideNumber:
+            std::fill_n(operand, count, instruction->number);
+            ColumnBinaryOp(static_cast<Instruction::Op>(static_cast<int>(instruction->op)
+                                                        - Instruction::NUMBER_OPERAND_SHIFT),
+                           stack[top - 1], operand, result, count);
+            break;
+
+        case Instruction::Op::AddCell:
+        case Instruction::Op::SubtractCell:
+        case Instruction::Op::MultiplyCell:
+        case Instruction::Op::DivideCell:
+            GatherCells(sheet, instruction->cell, offset, count, operand);
+            ColumnBinaryOp(static_cast<Instruction::Op>(static_cast<int>(instruction->op)
+                                                        - Instruction::CELL_OPERAND_SHIFT),
+                           stack[top - 1], operand, result, count);
+            break;
+        }
+        std::swap(stack[top - 1], result);
+    }
+
+    assert(top == 1);
+    std::copy_n(stack[0], count, out);
+}
+
+//Рукописный парсер грамматики Formula.g4: рекурсивный спуск с уровнями приоритета.
+//Читает текст через string_view без копий, числа и строки ячеек - через from_chars,
+//узлы AST размещает в арене формулы, ячейки собирает в буфер на стеке.
+//Куча используется только для формул больше чем с INLINE_CELLS ссылками и для формул с функциями
+class NativeParser {
+public:
+    explicit NativeParser(std::string_view text, std::pmr::memory_resource* arena)
+        : text_(text)
+        , arena_(arena) {
+    }
+
+    //main: expr EOF
+    ExprPtr ParseMain() {
+        Advance();
+        auto root = ParseExpr(ADDITIVE);
+        if (current_.type != TokenType::End) {
+            throw ParsingError("Error when parsing: extraneous input '" + std::string(current_.text) + "'");
+        }
+        //Как и в ANTLR, неверная позиция проверяется после синтаксиса всей формулы
+        if (!invalid_cell_.empty()) {
+            throw FormulaException("Invalid position: " + std::string(invalid_cell_));
+        }
+        return root;
+    }
+
+    size_t CellCount() const {
+        return cell_count_;
+    }
+
+    void CopyCells(Position* out) const {
+        const size_t inline_count = std::min(cell_count_, INLINE_CELLS);
+        out = std::copy(inline_cells_.begin(), inline_cells_.begin() + inline_count, out);
+        std::copy(overflow_cells_.begin(), overflow_cells_.end(), out);
+    }
+
+    std::vector<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
+    //Относительная запись текста (см. MakeRelativeFormulaKey): только лексер, AST не строится
+    bool BuildRelativeKey(Position anchor, std::string& key) {
+        key.clear();
+        size_t copied = 0;
+        try {
+            for (Advance(); current_.type != TokenType::End; Advance()) {
+                if (current_.type != TokenType::Cell) {
+                    continue;
+                }
+                const auto pos = Position::FromString(current_.text);
+                if (!pos.IsValid()) {
+                    return false;
+                }
+                const size_t start = current_.text.data() - text_.data();
+                key.append(text_.substr(copied, start - copied));
+                AppendOffset(key, 'R', pos.row - anchor.row);
+                AppendOffset(key, 'C', pos.col - anchor.col);
+                copied = start + current_.text.size();
+            }
+        } catch (const ParsingError&) {
+            return false;
+        }
+        key.append(text_.substr(copied));
+        return true;
+    }
+
+private:
+    //Токены-операции совпадают по значению с типами узлов BinaryOpExpr
+    enum class TokenType : char {
+        End = '\0',
+        Number = 'n',
+        Cell = 'c',
+        Add = '+',
+        Subtract = '-',
+        Multiply = '*',
+        Divide = '/',
+        LeftParen = '(',
+        RightParen = ')',
+        Function = 'f',
+        Colon = ':',
+        Comma = ',',
+    };
+
+    struct Token {
+        TokenType type = TokenType::End;
+        std::string_view text;
+    };
+
+    //Приоритеты бинарных операций; унарные операции связывают сильнее любых бинарных
+    static constexpr int NOT_BINARY = 0;
+    static constexpr int ADDITIVE = 1;
+    static constexpr int MULTIPLICATIVE = 2;
+
+    static constexpr size_t INLINE_CELLS = 32;
+
+    std::string_view text_;
+    size_t pos_ = 0;
+    Token current_;
+
+    std::pmr::memory_resource* arena_;
+    std::array<Position, INLINE_CELLS> inline_cells_;
+    std::vector<Position> overflow_cells_;
+    size_t cell_count_ = 0;
+    std::string_view invalid_cell_;
+    std::vector<Range> ranges_;
+    //Аргументы разбираемых (в том числе вложенных) функций, буфер общий для всей формулы
+    std::vector<ExprPtr> function_args_;
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (pos < text_.size() && IsDigit(text_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    //Лексер: следующий токен в current_
+    void Advance() {
+        while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+            ++pos_;
+        }
+        if (pos_ == text_.size()) {
+            current_ = {TokenType::End, {}};
+            return;
+        }
+
+        const size_t start = pos_;
+        const char c = text_[pos_];
+        switch (c) {
+            case '+':
+            case '-':
+            case '*':
+            case '/':
+            case '(':
+            case ')':
+            case ':':
+            case ',':
+                ++pos_;
+                current_ = {static_cast<TokenType>(c), text_.substr(start, 1)};
+                return;
+            default:
+                break;
+        }
+
+        //CELL: [A-Z]+[0-9]+ | FUNCTION
+        if (IsUpper(c)) {
+            while (pos_ < text_.size() && IsUpper(text_[pos_])) {
+                ++pos_;
+            }
+            const size_t digits_start = pos_;
+            pos_ = SkipDigits(pos_);
+            if (pos_ == digits_start && FunctionExpr::FromName(text_.substr(start, pos_ - start))) {
+                current_ = {TokenType::Function, text_.substr(start, pos_ - start)};
+                return;
+            }
+            if (pos_ == digits_start) {
+                throw ParsingError("Error when lexing: token recognition error at: '"
+                                   + std::string(text_.substr(start, pos_ - start + 1)) + "'");
+            }
+            current_ = {TokenType::Cell, text_.substr(start, pos_ - start)};
+            return;
+        }
+
+        //NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+        if (IsDigit(c) || c == '.') {
+            size_t end = SkipDigits(pos_);
+            const bool has_int_part = end > pos_;
+            if (end + 1 < text_.size() && text_[end] == '.' && IsDigit(text_[end + 1])) {
+                end = SkipDigits(end + 1);
+            } else if (!has_int_part) {
+                throw ParsingError("Error when lexing: token recognition error at: '.'");
+            }
+
+            //EXPONENT: [eE] [-+]? UINT, иначе 'e' не входит в число
+            if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+                size_t exponent = end + 1;
+                if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                    ++exponent;
+                }
+                if (exponent < text_.size() && IsDigit(text_[exponent])) {
+                    end = SkipDigits(exponent);
+                }
+            }
+
+            pos_ = end;
+            current_ = {TokenType::Number, text_.substr(start, end - start)};
+            return;
+        }
+
+        throw ParsingError(std::string("Error when lexing: token recognition error at: '") + c + "'");
+    }
+
+    static int GetBinaryPrecedence(TokenType type) {
+        switch (type) {
+            case TokenType::Add:
+            case TokenType::Subtract:
+                return ADDITIVE;
+            case TokenType::Multiply:
+            case TokenType::Divide:
+                return MULTIPLICATIVE;
+            default:
+                return NOT_BINARY;
+        }
+    }
+
+    //expr с бинарными операциями приоритета не ниже min_precedence, левоассоциативно
+    ExprPtr ParseExpr(int min_precedence) {
+        auto lhs = ParseUnary();
+        while (true) {
+            const int precedence = GetBinaryPrecedence(current_.type);
+            if (precedence == NOT_BINARY || precedence < min_precedence) {
+                return lhs;
+            }
+            const auto type = static_cast<BinaryOpExpr::Type>(current_.type);
+            Advance();
+
+            auto rhs = ParseExpr(precedence + 1);
+            lhs = MakeExpr<BinaryOpExpr>(arena_, type, std::move(lhs), std::move(rhs));
+        }
+    }
+
+    //Следующий непробельный символ после текущего токена, '\0' в конце текста
+    char PeekChar() const {
+        size_t pos = pos_;
+        while (pos < text_.size() && IsSpace(text_[pos])) {
+            ++pos;
+        }
+        return pos < text_.size() ? text_[pos] : '\0';
+    }
+
+    //Позиция ячейки; неверная позиция запоминается и сообщается после разбора синтаксиса
+    Position ParseCellPosition(std::string_view text) {
+        const auto pos = Position::FromString(text);
+        if (!pos.IsValid() && invalid_cell_.empty()) {
+            invalid_cell_ = text;
+        }
+        return pos;
+    }
+
+    //FUNCTION '(' argument (',' argument)* ')'
+    ExprPtr ParseFunction() {
+        const auto type = *FunctionExpr::FromName(current_.text);
+        Advance();
+        if (current_.type != TokenType::LeftParen) {
+            throw ParsingError("Error when parsing: missing '(' after " + std::string(FunctionExpr::NAMES[type]));
+        }
+
+        const size_t args_base = function_args_.size();
+        do {
+            Advance();
+            auto arg = ParseArgument();
+            function_args_.push_back(std::move(arg));
+        } while (current_.type == TokenType::Comma);
+        if (current_.type != TokenType::RightParen) {
+            throw ParsingError("Error when parsing: missing ')'");
+        }
+        Advance();
+
+        const auto first_arg = function_args_.begin() + args_base;
+        auto node = MakeExpr<FunctionExpr>(arena_, type, arena_, first_arg, function_args_.end());
+        function_args_.erase(first_arg, function_args_.end());
+        return node;
+    }
+
+    //argument: CELL ':' CELL | expr
+    ExprPtr ParseArgument() {
+        if (current_.type != TokenType::Cell || PeekChar() != ':') {
+            //Ячейка-аргумент читается как диапазон из одной ячейки (пустая и текст пропускаются)
+            auto arg = ParseExpr(ADDITIVE);
+            if (const auto area = arg->GetReferencedArea(); area && area->first.IsValid()) {
+                ranges_.push_back(*area);
+            }
+            return arg;
+        }
+
+        const auto first = ParseCellPosition(current_.text);
+        Advance();
+        Advance();
+        if (current_.type != TokenType::Cell) {
+            throw ParsingError("Error when parsing: range must end with a cell");
+        }
+        const auto last = ParseCellPosition(current_.text);
+        Advance();
+
+        const auto range = Range::FromCorners(first, last);
+        if (first.IsValid() && last.IsValid()) {
+            ranges_.push_back(range);
+        }
+        return MakeExpr<RangeExpr>(arena_, range);
+    }
+
+    //'(' expr ')' | (ADD | SUB) expr | function | CELL | NUMBER
+    ExprPtr ParseUnary() {
+        switch (current_.type) {
+            case TokenType::Add:
+            case TokenType::Subtract: {
+                const auto type = current_.type == TokenType::Subtract ? UnaryOpExpr::UnaryMinus
+                                                                       : UnaryOpExpr::UnaryPlus;
+                Advance();
+                auto operand = ParseUnary();
+                return MakeExpr<UnaryOpExpr>(arena_, type, std::move(operand));
+            }
+            case TokenType::LeftParen: {
+                Advance();
+                auto expr = ParseExpr(ADDITIVE);
+                if (current_.type != TokenType::RightParen) {
+                    throw ParsingError("Error when parsing: missing ')'");
+                }
+                Advance();
+                return expr;
+            }
+            case TokenType::Number: {
+                const double value = ParseNumber(current_.text);
+                Advance();
+                return MakeExpr<NumberExpr>(arena_, value);
+            }
+            case TokenType::Function:
+                return ParseFunction();
+            case TokenType::Cell: {
+                const auto pos = ParseCellPosition(current_.text);
+                if (pos.IsValid()) {
+                    AddCell(pos);
+                }
+                Advance();
+                return MakeExpr<CellExpr>(arena_, pos);
+            }
+            default:
+                throw ParsingError("Error when parsing: unexpected '" + std::string(current_.text) + "'");
+        }
+    }
+
+    static double ParseNumber(std::string_view text) {
+        double value = 0;
+        const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec == std::errc::result_out_of_range) {
+            //istream читает исчезающе малые числа как 0, а слишком большие отвергает: редкий путь,
+            //разбор тем же способом, что и эталонный парсер
+            return ParseNumberWithStream(std::string(text));
+        }
+        if (ec != std::errc{} || end != text.data() + text.size()) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+        return value;
+    }
+
+    //R[-1] - смещение в скобках, чтобы запись не сливалась с соседними лексемами
+    static void AppendOffset(std::string& key, char axis, int offset) {
+        char buffer[16];
+        const auto end = std::to_chars(buffer, buffer + sizeof(buffer), offset).ptr;
+        key += axis;
+        key += '[';
+        key.append(buffer, end);
+        key += ']';
+    }
+
+    void AddCell(Position pos) {
+        if (cell_count_ < INLINE_CELLS) {
+            inline_cells_[cell_count_] = pos;
+        } else {
+            overflow_cells_.push_back(pos);
+        }
+        ++cell_count_;
+    }
+};
+
 }  // namespace
+
+void ExprDeleter::operator()(Expr* expr) const {
+    expr->~Expr();
+}
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+namespace {
+//Начальный размер буфера арены формулы, хватает на типичную формулу из десятка узлов
+constexpr size_t FORMULA_ARENA_INITIAL_SIZE = 256;
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in, std::pmr::memory_resource* resource,
+                                    FormulaAST::Evaluator evaluator) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -425,15 +1577,53 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    auto arena = MakeArenaUnique<FormulaAST::Arena>(resource, FORMULA_ARENA_INITIAL_SIZE, resource);
+    ASTImpl::ParseASTListener listener(arena.get());
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    auto root = listener.MoveRoot();
+    return FormulaAST(std::move(arena), std::move(root), listener.MoveCells(), listener.MoveRanges(), evaluator);
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+FormulaAST ParseFormulaASTNative(std::string_view text, std::pmr::memory_resource* resource,
+                                 FormulaAST::Evaluator evaluator) {
+    auto arena = MakeArenaUnique<FormulaAST::Arena>(resource, FORMULA_ARENA_INITIAL_SIZE, resource);
+    ASTImpl::NativeParser parser(text, arena.get());
+    auto root = parser.ParseMain();
+
+    auto cells = static_cast<Position*>(arena->allocate(sizeof(Position) * parser.CellCount(),
+                                                        alignof(Position)));
+    parser.CopyCells(cells);
+    return FormulaAST(std::move(arena), std::move(root), cells, cells + parser.CellCount(), parser.MoveRanges(),
+                      evaluator);
+}
+}  // namespace
+
+FormulaAST ParseFormulaAST(std::istream& in, std::pmr::memory_resource* resource,
+                           FormulaAST::Evaluator evaluator, FormulaAST::Parser parser) {
+    if (parser == FormulaAST::Parser::antlr) {
+        return ParseFormulaASTWithAntlr(in, resource, evaluator);
+    }
+    const std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaASTNative(text, resource, evaluator);
+}
+
+FormulaAST ParseFormulaAST(std::string_view text, std::pmr::memory_resource* resource,
+                           FormulaAST::Evaluator evaluator, FormulaAST::Parser parser) {
+    if (parser == FormulaAST::Parser::antlr) {
+        std::istringstream in{std::string(text)};
+        return ParseFormulaASTWithAntlr(in, resource, evaluator);
+    }
+    return ParseFormulaASTNative(text, resource, evaluator);
+}
+
+bool MakeRelativeFormulaKey(std::string_view text, Position anchor, std::string& key) {
+    ASTImpl::NativeParser lexer(text, nullptr);
+    return lexer.BuildRelativeKey(anchor, key);
+}
+
+double SumRangeValues(const double* values, size_t count) {
+    return ASTImpl::SumKernel(values, count);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -446,18 +1636,124 @@ void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, offset);
+}
+
+FormulaAST::Value FormulaAST::Execute(const SheetInterface& sheet, Position offset) const {
+    const double result = ExecuteBoxed(sheet, offset);
+    if(FormulaError::IsBoxed(result)) {
+        return FormulaError::Unbox(result);
+    }
+    return result;
+}
+
+double FormulaAST::ExecuteBoxed(const SheetInterface& sheet, Position offset) const {
+    if(code_first_) {
+        constexpr size_t SMALL_STACK_SIZE = 32;
+        if(stack_depth_ > SMALL_STACK_SIZE) {
+            return ASTImpl::RunBytecodeOnHeap(code_first_, code_last_, stack_depth_, sheet, offset);
+        }
+        double stack[SMALL_STACK_SIZE];
+        return ASTImpl::RunBytecode(code_first_, code_last_, stack, sheet, offset);
+    }
+    return root_expr_->Evaluate(sheet, offset);
+}
+
+bool FormulaAST::ExecuteColumnBoxed(const SheetInterface& sheet, Position offset, size_t count,
+                                    double* results) const {
+    if(!code_first_) {
+        return false;
+    }
+    for(size_t done = 0; done < count; done += ASTImpl::COLUMN_CHUNK) {
+        const size_t chunk = std::min(ASTImpl::COLUMN_CHUNK, count - done);
+        ASTImpl::RunBytecodeColumn(code_first_, code_last_, stack_depth_, sheet,
+                                   {offset.row + static_cast<int>(done), offset.col}, chunk, results + done);
+    }
+    return true;
+}
+
+FormulaAST::FormulaAST(ArenaPtr<Arena> arena, ASTImpl::ExprPtr root_expr,
+                       std::vector<Position> cells, std::vector<Range> ranges, Evaluator evaluator)
+    : arena_(std::move(arena))
+    , root_expr_(std::move(root_expr)) {
+    //copy cells into the formula arena
+    auto arena_cells = static_cast<Position*>(arena_->allocate(sizeof(Position) * cells.size(),
+                                                               alignof(Position)));
+    std::uninitialized_copy(cells.begin(), cells.end(), arena_cells);
+    Init(arena_cells, arena_cells + cells.size(), std::move(ranges), evaluator);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+FormulaAST::FormulaAST(ArenaPtr<Arena> arena, ASTImpl::ExprPtr root_expr,
+                       Position* cells_first, Position* cells_last, std::vector<Range> ranges,
+                       Evaluator evaluator)
+    : arena_(std::move(arena))
+    , root_expr_(std::move(root_expr)) {
+    Init(cells_first, cells_last, std::move(ranges), evaluator);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+void FormulaAST::Init(Position* cells_first, Position* cells_last, std::vector<Range> ranges,
+                      Evaluator evaluator) {
+    std::sort(cells_first, cells_last);  // to avoid sorting in GetReferencedCells
+    cells_ = {cells_first, cells_last};
+
+    //a range used twice is one reference
+    std::sort(ranges.begin(), ranges.end());
+    ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+    if(!ranges.empty()) {
+        auto arena_ranges = static_cast<Range*>(arena_->allocate(sizeof(Range) * ranges.size(), alignof(Range)));
+        std::uninitialized_copy(ranges.begin(), ranges.end(), arena_ranges);
+        ranges_ = {arena_ranges, arena_ranges + ranges.size()};
+    }
+
+    if(evaluator == Evaluator::bytecode) {
+        Compile();
+    }
+}
+
+void FormulaAST::Compile() {
+    //bytecode is built in a stack buffer, the heap is used only for very long formulas
+    std::array<std::byte, 64 * sizeof(ASTImpl::Instruction)> buffer;
+    std::pmr::monotonic_buffer_resource buffer_resource(buffer.data(), buffer.size());
+    ASTImpl::Bytecode code(&buffer_resource);
+    root_expr_->Compile(code);
+
+    //Глубина стека: операнд кладет значение, бинарная операция над стеком снимает два и кладет одно,
+    //функция снимает свои аргументы-значения и кладет результат, остальные инструкции заменяют верхнее значение
+    using Op = ASTImpl::Instruction::Op;
+    size_t depth = 0;
+    for(const auto& instruction : code) {
+        if(instruction.op == Op::PushNumber || instruction.op == Op::PushCell) {
+            stack_depth_ = std::max(stack_depth_, ++depth);
+        } else if(instruction.op >= Op::Add && instruction.op <= Op::Divide) {
+            --depth;
+        } else if(instruction.op == Op::Aggregate) {
+            depth -= instruction.scalar_count;
+            stack_depth_ = std::max(stack_depth_, ++depth);
+        }
+    }
+
+    //copy bytecode into the formula arena
+    auto arena_code = static_cast<ASTImpl::Instruction*>(
+        arena_->allocate(sizeof(ASTImpl::Instruction) * code.size(), alignof(ASTImpl::Instruction)));
+    std::uninitialized_copy(code.begin(), code.end(), arena_code);
+    code_first_ = arena_code;
+    code_last_ = arena_code + code.size();
+}
+
+FormulaAST& FormulaAST::operator=(FormulaAST&& other) {
+    if (this != &other) {
+        //nodes must be destroyed while their arena is still alive
+        root_expr_.reset();
+        arena_ = std::move(other.arena_);
+        root_expr_ = std::move(other.root_expr_);
+        cells_ = std::exchange(other.cells_, CellsRange{});
+        ranges_ = std::exchange(other.ranges_, RangesList{});
+        code_first_ = std::exchange(other.code_first_, nullptr);
+        code_last_ = std::exchange(other.code_last_, nullptr);
+        stack_depth_ = std::exchange(other.stack_depth_, 0);
+    }
+    return *this;
 }
 
 FormulaAST::~FormulaAST() = default;
@@ -1,14 +1,27 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
+#include "formula.h"
 
-#include <forward_list>
 #include <functional>
+#include <memory_resource>
 #include <stdexcept>
+#include <string_view>
+#include <variant>
 
 namespace ASTImpl {
 class Expr;
+struct Instruction;
+
+//Узлы AST размещаются в арене формулы: удалитель только вызывает деструктор,
+//память освобождается целиком вместе с ареной
+struct ExprDeleter {
+    void operator()(Expr* expr) const;
+};
+
+using ExprPtr = std::unique_ptr<Expr, ExprDeleter>;
 }
 
 class ParsingError : public std::runtime_error {
@@ -17,35 +30,110 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    //Монотонная арена формулы: узлы AST, байткод и массив ячеек, одно освобождение на формулу
+    using Arena = std::pmr::monotonic_buffer_resource;
+
+    using Value = std::variant<double, FormulaError>;
+
+    //Способ вычисления формулы: обход дерева виртуальными вызовами
+    //или стековая машина по постфиксному байткоду, построенному из дерева
+    enum class Evaluator {
+        tree,
+        bytecode,
+    };
+
+    //Парсер текста формулы: рукописный (по умолчанию) или сгенерированный ANTLR,
+    //который остается эталоном для дифференциального тестирования
+    enum class Parser {
+        native,
+        antlr,
+    };
+
+    //Непрерывный отсортированный массив ячеек в арене формулы
+    using CellsRange = FormulaInterface::CellsRange;
+    //Диапазоны аргументов функций (SUM(A1:B5)) в арене формулы
+    using RangesList = FormulaInterface::RangesList;
+
+    explicit FormulaAST(ArenaPtr<Arena> arena, ASTImpl::ExprPtr root_expr,
+                        std::vector<Position> cells, std::vector<Range> ranges = {},
+                        Evaluator evaluator = Evaluator::bytecode);
+    //cells_first, cells_last - массив ячеек, уже размещенный в арене формулы
+    explicit FormulaAST(ArenaPtr<Arena> arena, ASTImpl::ExprPtr root_expr,
+                        Position* cells_first, Position* cells_last, std::vector<Range> ranges,
+                        Evaluator evaluator);
     FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    FormulaAST& operator=(FormulaAST&& other);
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    //Вычисление не бросает FormulaError: ошибки формулы и ее операндов возвращаются как значения.
+    //offset - сдвиг всех ссылок: общая формула вычисляется для другой ячейки (см. FormulaCache)
+    Value Execute(const SheetInterface& sheet, Position offset = {}) const;
+    //То же, ошибка упакована в double (FormulaError::Box)
+    double ExecuteBoxed(const SheetInterface& sheet, Position offset = {}) const;
+    //Вычисляет формулу для count ячеек столбца подряд: results[i] - то же, что
+    //ExecuteBoxed(sheet, {offset.row + i, offset.col}), но байткод выполняется над столбцами операндов.
+    //false - у формулы нет байткода (вычисляется обходом дерева), results не заполнен
+    bool ExecuteColumnBoxed(const SheetInterface& sheet, Position offset, size_t count, double* results) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position offset = {}) const;
 
-    //Returns cells sorted
-    std::forward_list<Position>& GetReferencedCells() {
+    //Returns cells sorted (cells of ranges are not included)
+    CellsRange GetReferencedCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetReferencedCells() const {
-        return cells_;
+    //Returns ranges sorted and unique
+    RangesList GetReferencedRanges() const {
+        return ranges_;
+    }
+
+    Evaluator GetEvaluator() const {
+        return code_first_ ? Evaluator::bytecode : Evaluator::tree;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    //NB: arena_ must be declared first - it is destroyed after the nodes it holds
+    ArenaPtr<Arena> arena_;
+
+    ASTImpl::ExprPtr root_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     // NB: The cells are sorted in the constructor!!!
-    std::forward_list<Position> cells_;
+    CellsRange cells_;
+    RangesList ranges_;
+
+    //Постфиксный байткод в арене формулы; nullptr - формула вычисляется обходом дерева
+    const ASTImpl::Instruction* code_first_ = nullptr;
+    const ASTImpl::Instruction* code_last_ = nullptr;
+    //Максимальная глубина стека значений при выполнении байткода
+    size_t stack_depth_ = 0;
+
+    //Сортирует ячейки в арене, копирует туда диапазоны без повторов и строит байткод, если он нужен
+    void Init(Position* cells_first, Position* cells_last, std::vector<Range> ranges, Evaluator evaluator);
+    void Compile();
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+//resource - память, из которой выделяется арена формулы (обычно арена листа)
+//evaluator - вычислять ли формулу по байткоду (по умолчанию) или обходом дерева,
+//parser - каким парсером разбирать текст; оба строят одинаковое AST и бросают исключения на одних входах
+FormulaAST ParseFormulaAST(std::istream& in,
+                           std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+                           FormulaAST::Evaluator evaluator = FormulaAST::Evaluator::bytecode,
+                           FormulaAST::Parser parser = FormulaAST::Parser::native);
+FormulaAST ParseFormulaAST(std::string_view text,
+                           std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+                           FormulaAST::Evaluator evaluator = FormulaAST::Evaluator::bytecode,
+                           FormulaAST::Parser parser = FormulaAST::Parser::native);
+
+//Относительная запись (R1C1) текста формулы ячейки anchor: каждая ссылка заменена смещением
+//от anchor (C2: A2*B2 -> R[0]C[-2]*R[0]C[-1]), остальной текст не меняется.
+//Тексты с одинаковой записью разбираются в одинаковое AST, ссылки которого сдвинуты на разность ячеек.
+//false - в тексте неверная лексема или позиция: такую формулу нужно разобрать, чтобы получить ошибку
+bool MakeRelativeFormulaKey(std::string_view text, Position anchor, std::string& key);
+
+//Сумма значений диапазона тем же ядром и в том же порядке, что и в SUM: итоги диапазонов таблицы
+//(SheetInterface::GetRangeTotals) считаются ею, поэтому SUM с итогами и без них дает одно и то же число
+double SumRangeValues(const double* values, size_t count);
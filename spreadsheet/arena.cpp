@@ -0,0 +1,47 @@
+#include "arena.h"
+
+#include <algorithm>
+
+//==== CountingResource ====
+CountingResource::CountingResource(std::pmr::memory_resource* upstream)
+    : upstream_(upstream) {
+}
+
+const AllocationStats& CountingResource::GetStats() const {
+    return stats_;
+}
+
+void* CountingResource::do_allocate(size_t bytes, size_t alignment) {
+    void* ptr = upstream_->allocate(bytes, alignment);
+
+    ++stats_.allocations;
+    stats_.bytes_allocated += bytes;
+    stats_.bytes_in_use += bytes;
+    stats_.peak_bytes_in_use = std::max(stats_.peak_bytes_in_use, stats_.bytes_in_use);
+    return ptr;
+}
+
+void CountingResource::do_deallocate(void* ptr, size_t bytes, size_t alignment) {
+    upstream_->deallocate(ptr, bytes, alignment);
+
+    ++stats_.deallocations;
+    stats_.bytes_in_use -= bytes;
+}
+
+bool CountingResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+//==== SheetArena ====
+SheetArena::SheetArena()
+    : pool_(&upstream_)
+    , requested_(&pool_) {
+}
+
+std::pmr::memory_resource* SheetArena::Resource() {
+    return &requested_;
+}
+
+SheetArena::Stats SheetArena::GetStats() const {
+    return {requested_.GetStats(), upstream_.GetStats()};
+}
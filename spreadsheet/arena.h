@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//Статистика выделений памяти через memory_resource
+struct AllocationStats {
+    size_t allocations = 0;
+    size_t deallocations = 0;
+    size_t bytes_allocated = 0;
+    size_t bytes_in_use = 0;
+    size_t peak_bytes_in_use = 0;
+};
+
+//Обертка над memory_resource, считающая выделения и освобождения
+class CountingResource : public std::pmr::memory_resource {
+public:
+    explicit CountingResource(std::pmr::memory_resource* upstream = std::pmr::new_delete_resource());
+
+    const AllocationStats& GetStats() const;
+
+private:
+    std::pmr::memory_resource* upstream_;
+    AllocationStats stats_;
+
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+//Арена листа: slab-пул (pmr::unsynchronized_pool_resource) поверх кучи.
+//requested - запросы клиентов арены (ячейки, их тексты и данные формул, формулы, узлы AST, списки ссылок),
+//upstream - обращения пула к куче: большие блоки, из которых нарезаются мелкие запросы.
+//Память ячеек возвращается в пул по одной (деструктор каждой ячейки), в кучу - вместе с листом
+class SheetArena {
+public:
+    struct Stats {
+        AllocationStats requested;
+        AllocationStats upstream;
+    };
+
+    SheetArena();
+
+    SheetArena(const SheetArena&) = delete;
+    SheetArena& operator=(const SheetArena&) = delete;
+
+    std::pmr::memory_resource* Resource();
+
+    Stats GetStats() const;
+
+private:
+    CountingResource upstream_;
+    std::pmr::unsynchronized_pool_resource pool_;
+    CountingResource requested_;
+};
+
+//Удалитель для объектов, размещенных в memory_resource через MakeArenaUnique
+template <typename T>
+struct ArenaDeleter {
+    std::pmr::memory_resource* resource = nullptr;
+
+    void operator()(T* ptr) const {
+        ptr->~T();
+        resource->deallocate(ptr, sizeof(T), alignof(T));
+    }
+};
+
+template <typename T>
+using ArenaPtr = std::unique_ptr<T, ArenaDeleter<T>>;
+
+template <typename T, typename... Args>
+ArenaPtr<T> MakeArenaUnique(std::pmr::memory_resource* resource, Args&&... args) {
+    void* mem = resource->allocate(sizeof(T), alignof(T));
+    try {
+        return ArenaPtr<T>(new (mem) T(std::forward<Args>(args)...), ArenaDeleter<T>{resource});
+    } catch(...) {
+        resource->deallocate(mem, sizeof(T), alignof(T));
+        throw;
+    }
+}
+
+//Удалитель объекта производного класса по указателю на базовый (формула ячейки - FormulaInterface):
+//размер и выравнивание производного класса запоминаются при создании, см. MakeArenaUniqueAs
+template <typename Base>
+struct ArenaBaseDeleter {
+    std::pmr::memory_resource* resource = nullptr;
+    size_t size = 0;
+    size_t alignment = 0;
+
+    void operator()(Base* ptr) const {
+        void* mem = dynamic_cast<void*>(ptr);
+        ptr->~Base();
+        resource->deallocate(mem, size, alignment);
+    }
+};
+
+template <typename Base>
+using ArenaBasePtr = std::unique_ptr<Base, ArenaBaseDeleter<Base>>;
+
+template <typename Base, typename T, typename... Args>
+ArenaBasePtr<Base> MakeArenaUniqueAs(std::pmr::memory_resource* resource, Args&&... args) {
+    static_assert(std::is_base_of_v<Base, T> && std::has_virtual_destructor_v<Base>);
+    T* ptr = MakeArenaUnique<T>(resource, std::forward<Args>(args)...).release();
+    return ArenaBasePtr<Base>(ptr, ArenaBaseDeleter<Base>{resource, sizeof(T), alignof(T)});
+}
+
+//Удалитель без состояния для объектов, которые сами знают свой memory_resource (get_allocator(),
+//как у pmr-строки): указатель - 8 байт, поэтому помещается в компактную ячейку
+template <typename T>
+struct ArenaSelfDeleter {
+    void operator()(T* ptr) const {
+        std::pmr::memory_resource* resource = ptr->get_allocator().resource();
+        ptr->~T();
+        resource->deallocate(ptr, sizeof(T), alignof(T));
+    }
+};
+
+template <typename T>
+using ArenaSelfPtr = std::unique_ptr<T, ArenaSelfDeleter<T>>;
+
+//Как MakeArenaUnique. Объект должен использовать тот же resource: pmr-строка получает его в конструкторе
+template <typename T, typename... Args>
+ArenaSelfPtr<T> MakeArenaSelfUnique(std::pmr::memory_resource* resource, Args&&... args) {
+    ArenaSelfPtr<T> ptr(MakeArenaUnique<T>(resource, std::forward<Args>(args)...).release());
+    assert(ptr->get_allocator().resource() == resource);
+    return ptr;
+}
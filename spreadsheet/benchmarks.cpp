@@ -0,0 +1,1315 @@
+#include "benchmarks.h"
+
+#include "FormulaAST.h"
+#include "common.h"
+#include "dependency_graph.h"
+#include "range_index.h"
+#include "sheet.h"
+#include "tiled_index.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+//Возвращает время выполнения func в миллисекундах
+template <typename Func>
+double MeasureMs(Func func) {
+    const auto start = std::chrono::steady_clock::now();
+    func();
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void PrintRow(std::ostream& out, const std::string& name, double ms, const std::string& extra = {}) {
+    out << "  " << std::left << std::setw(40) << name
+        << std::right << std::setw(10) << std::fixed << std::setprecision(2) << ms << " ms"
+        << (extra.empty() ? "" : "  " + extra) << '\n';
+}
+
+//==== Cell index: deque<deque<ptr>> (старая схема Sheet) vs TiledIndex ====
+struct Payload {
+    int value = 0;
+};
+
+//Копия старого индекса Sheet::cell_index_ для сравнения
+class LegacyDequeIndex {
+public:
+    void Insert(Position pos, std::unique_ptr<Payload> value) {
+        if(index_.size() <= static_cast<size_t>(pos.row)) {
+            index_.resize(pos.row + 1);
+        }
+        if(index_[pos.row].size() <= static_cast<size_t>(pos.col)) {
+            index_[pos.row].resize(pos.col + 1);
+        }
+        index_[pos.row][pos.col] = std::move(value);
+    }
+
+    const Payload* Find(Position pos) const {
+        return static_cast<size_t>(pos.row) < index_.size()
+               && static_cast<size_t>(pos.col) < index_[pos.row].size()
+               ? index_[pos.row][pos.col].get()
+               : nullptr;
+    }
+
+    size_t MemoryUsage() const {
+        size_t slots = 0;
+        for(const auto& row : index_) {
+            slots += row.size();
+        }
+        return index_.size() * sizeof(std::deque<std::unique_ptr<Payload>>)
+               + slots * sizeof(std::unique_ptr<Payload>);
+    }
+
+private:
+    std::deque<std::deque<std::unique_ptr<Payload>>> index_;
+};
+
+template <typename Index>
+void RunIndexWorkload(std::ostream& out, const std::string& name, const std::vector<Position>& positions) {
+    Index index;
+    const double insert_ms = MeasureMs([&] {
+        for(const auto& pos : positions) {
+            index.Insert(pos, std::make_unique<Payload>());
+        }
+    });
+
+    long long found = 0;
+    const double lookup_ms = MeasureMs([&] {
+        for(int repeat = 0; repeat < 10; ++repeat) {
+            for(const auto& pos : positions) {
+                auto slot = index.Find(pos);
+                found += (slot != nullptr);
+            }
+        }
+    });
+
+    PrintRow(out, name + " insert", insert_ms);
+    PrintRow(out, name + " lookup x10", lookup_ms,
+             "mem ~" + std::to_string(index.MemoryUsage() / 1024) + " KiB, found " + std::to_string(found));
+}
+
+//Адаптер TiledIndex к интерфейсу workload-а
+struct TiledPayloadIndex {
+    TiledIndex<std::unique_ptr<Payload>> index;
+
+    void Insert(Position pos, std::unique_ptr<Payload> value) {
+        if(auto slot = index.Find(pos); slot && *slot) {
+            *slot = std::move(value);
+            return;
+        }
+        index.Insert(pos, std::move(value));
+    }
+
+    const Payload* Find(Position pos) const {
+        auto slot = index.Find(pos);
+        return slot ? slot->get() : nullptr;
+    }
+
+    size_t MemoryUsage() const {
+        return index.MemoryUsage();
+    }
+};
+
+void BenchmarkCellIndex(std::ostream& out) {
+    out << "Cell index: deque<deque> vs tiled\n";
+
+    std::vector<Position> dense;
+    for(int row = 0; row < 1000; ++row) {
+        for(int col = 0; col < 200; ++col) {
+            dense.push_back({row, col});
+        }
+    }
+
+    //Полосы по 20 столбцов через каждые 1000 столбцов
+    std::vector<Position> banded;
+    for(int row = 0; row < 2000; ++row) {
+        for(int band = 0; band < 5; ++band) {
+            for(int col = 0; col < 20; ++col) {
+                banded.push_back({row, band * 1000 + col});
+            }
+        }
+    }
+
+    //Тысячи блоков 8x8, разбросанных по всей таблице
+    std::vector<Position> scattered;
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> coord(0, Position::MAX_ROWS - 8);
+    for(int block = 0; block < 3000; ++block) {
+        const int top = coord(rng);
+        const int left = coord(rng);
+        for(int row = 0; row < 8; ++row) {
+            for(int col = 0; col < 8; ++col) {
+                scattered.push_back({top + row, left + col});
+            }
+        }
+    }
+
+    RunIndexWorkload<LegacyDequeIndex>(out, "dense   deque", dense);
+    RunIndexWorkload<TiledPayloadIndex>(out, "dense   tiled", dense);
+    RunIndexWorkload<LegacyDequeIndex>(out, "banded  deque", banded);
+    RunIndexWorkload<TiledPayloadIndex>(out, "banded  tiled", banded);
+    RunIndexWorkload<LegacyDequeIndex>(out, "scatter deque", scattered);
+    RunIndexWorkload<TiledPayloadIndex>(out, "scatter tiled", scattered);
+}
+//==== Sheet arena: число обращений к куче при загрузке формул ====
+void PrintAllocationStats(std::ostream& out, const std::string& name, const AllocationStats& stats) {
+    out << "  " << std::left << std::setw(40) << name << std::right
+        << std::setw(10) << stats.allocations << " allocs, "
+        << stats.peak_bytes_in_use / 1024 << " KiB peak\n";
+}
+
+void BenchmarkSheetArena(std::ostream& out) {
+    out << "Sheet arena: 192k cells, 128k formulas\n";
+
+    const int rows = 16000;
+    const int groups = 4;
+    auto sheet = std::make_unique<Sheet>();
+    const double load_ms = MeasureMs([&] {
+        for(int group = 0; group < groups; ++group) {
+            const int col = group * 3;
+            const auto a = Position{0, col}.ToString();
+            const auto b = Position{0, col + 1}.ToString();
+            const auto a_col = a.substr(0, a.size() - 1);
+            const auto b_col = b.substr(0, b.size() - 1);
+            for(int row = 0; row < rows; ++row) {
+                const auto n = std::to_string(row + 1);
+                sheet->SetCell({row, col}, n);
+                sheet->SetCell({row, col + 1}, "=" + a_col + n + "*2+(" + a_col + n + "-1)/3");
+                sheet->SetCell({row, col + 2}, "=" + b_col + n + "+1");
+            }
+        }
+    });
+    PrintRow(out, "load", load_ms);
+
+    const auto stats = sheet->GetAllocationStats();
+    PrintAllocationStats(out, "requested from arena", stats.requested);
+    PrintAllocationStats(out, "upstream (pool blocks from the heap)", stats.upstream);
+
+    const double teardown_ms = MeasureMs([&] {
+        sheet.reset();
+    });
+    PrintRow(out, "teardown", teardown_ms);
+}
+//==== Cell layout: память на ячейку для числовых и текстовых ячеек ====
+void BenchmarkCellLayout(std::ostream& out) {
+    out << "Cell layout: 1M number/text cells, sizeof(Cell) = " << sizeof(Cell) << "\n";
+
+    auto sheet = std::make_unique<Sheet>();
+    const int rows = 10000;
+    const int cols = 100;
+    const double load_ms = MeasureMs([&] {
+        for(int row = 0; row < rows; ++row) {
+            for(int col = 0; col < cols; ++col) {
+                sheet->SetCell({row, col}, col % 2 == 0 ? std::to_string(row * cols + col) : "txt");
+            }
+        }
+    });
+    const auto stats = sheet->GetAllocationStats();
+    PrintRow(out, "load", load_ms,
+             std::to_string(stats.requested.bytes_in_use / (rows * cols)) + " arena bytes/cell");
+}
+//==== Dependency graph: память на цепочке A(n)=A(n-1)+1 ====
+Position ChainPos(int i) {
+    return {i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+}
+
+void BenchmarkDependencyChain(std::ostream& out) {
+    out << "Dependency graph: chain A(n)=A(n-1)+1\n";
+
+    for(int length : {1000, 10000, 100000}) {
+        DependencyGraph graph;
+        const double ms = MeasureMs([&] {
+            for(int i = 1; i < length; ++i) {
+                graph.SetPrecedents(ChainPos(i), {ChainPos(i - 1)});
+            }
+        });
+        PrintRow(out, "csr graph, n = " + std::to_string(length), ms,
+                 std::to_string(graph.EdgeCount()) + " edges, mem ~"
+                 + std::to_string(graph.MemoryUsage() / 1024) + " KiB");
+    }
+
+    //Старая схема: ячейка копирует себе зависимые ячейки ссылающейся ячейки.
+    //При заполнении цепочки с конца число записей растет квадратично
+    for(int length : {1000, 2000, 4000}) {
+        std::unordered_map<Position, CellsPosSet, PositionHash> dependents;
+        const double ms = MeasureMs([&] {
+            for(int i = length - 1; i >= 1; --i) {
+                auto& ref_dependents = dependents[ChainPos(i - 1)];
+                ref_dependents.insert(ChainPos(i));
+                if(auto it = dependents.find(ChainPos(i)); it != dependents.end()) {
+                    ref_dependents.insert(it->second.begin(), it->second.end());
+                }
+            }
+        });
+        size_t entries = 0;
+        for(const auto& [pos, cells] : dependents) {
+            entries += cells.size();
+        }
+        PrintRow(out, "per-cell sets, n = " + std::to_string(length), ms,
+                 std::to_string(entries) + " entries");
+    }
+}
+
+//==== Cycle check: загрузка листа с проверкой цикла на каждую формулу ====
+//Цепочка в графе в обоих направлениях и решетка в листе (ячейка = левая + верхняя, много ромбов)
+void LoadChainGraph(DependencyGraph& graph, int length, bool reverse) {
+    for(int k = 1; k < length; ++k) {
+        const int i = reverse ? length - k : k;
+        graph.SetPrecedents(ChainPos(i), {ChainPos(i - 1)});
+    }
+}
+
+void LoadLatticeSheet(Sheet& sheet, int side) {
+    sheet.SetCell({0, 0}, "1");
+    for(int row = 0; row < side; ++row) {
+        for(int col = 0; col < side; ++col) {
+            if(row == 0 && col == 0) {
+                continue;
+            }
+            std::string text = "=0";
+            if(row > 0) {
+                text += "+" + Position{row - 1, col}.ToString();
+            }
+            if(col > 0) {
+                text += "+" + Position{row, col - 1}.ToString();
+            }
+            sheet.SetCell({row, col}, text);
+        }
+    }
+}
+
+//Старая схема: полный DFS по всем транзитивно влияющим ячейкам на каждую формулу
+size_t LegacyFullDfsLoad(int length, bool reverse) {
+    std::unordered_map<Position, std::vector<Position>, PositionHash> refs;
+    size_t visited_total = 0;
+    for(int k = 1; k < length; ++k) {
+        const int i = reverse ? length - k : k;
+        refs[ChainPos(i)] = {ChainPos(i - 1)};
+
+        CellsPosSet visited{ChainPos(i)};
+        std::vector<Position> stack{ChainPos(i)};
+        while(!stack.empty()) {
+            const Position pos = stack.back();
+            stack.pop_back();
+            if(auto it = refs.find(pos); it != refs.end()) {
+                for(const Position& next : it->second) {
+                    if(visited.insert(next).second) {
+                        stack.push_back(next);
+                    }
+                }
+            }
+        }
+        visited_total += visited.size();
+    }
+    return visited_total;
+}
+
+void BenchmarkCycleCheck(std::ostream& out) {
+    out << "Cycle check on bulk load: incremental topological order\n";
+
+    for(int length : {4000, 16000, 64000}) {
+        for(bool reverse : {false, true}) {
+            DependencyGraph graph;
+            const double ms = MeasureMs([&] {
+                LoadChainGraph(graph, length, reverse);
+            });
+            PrintRow(out, std::string(reverse ? "chain, reverse" : "chain, forward")
+                     + ", n = " + std::to_string(length), ms);
+        }
+    }
+    for(int side : {64, 128, 256}) {
+        auto sheet = std::make_unique<Sheet>();
+        const double ms = MeasureMs([&] {
+            LoadLatticeSheet(*sheet, side);
+        });
+        PrintRow(out, "lattice " + std::to_string(side) + "x" + std::to_string(side), ms,
+                 std::to_string(sheet->GetDependencyGraph().EdgeCount()) + " edges");
+    }
+
+    for(int length : {2000, 4000}) {
+        size_t visited = 0;
+        const double ms = MeasureMs([&] {
+            visited = LegacyFullDfsLoad(length, false);
+        });
+        PrintRow(out, "legacy full dfs, n = " + std::to_string(length), ms,
+                 std::to_string(visited) + " cells visited");
+    }
+}
+
+//==== Batch edit: импорт с повторными правками, SetCell по одной vs один пакет ====
+//Каждая ячейка сначала получает черновое значение, потом формулу; формулы - решетка (левая + верхняя)
+void RunImport(Sheet& sheet, int side) {
+    for(int row = 0; row < side; ++row) {
+        for(int col = 0; col < side; ++col) {
+            sheet.SetCell({row, col}, "0");
+        }
+    }
+    for(int row = side - 1; row >= 0; --row) {
+        for(int col = side - 1; col >= 0; --col) {
+            std::string text = "=1";
+            if(row > 0) {
+                text += "+" + Position{row - 1, col}.ToString();
+            }
+            if(col > 0) {
+                text += "+" + Position{row, col - 1}.ToString();
+            }
+            sheet.SetCell({row, col}, text);
+        }
+    }
+}
+
+void BenchmarkBatchEdit(std::ostream& out) {
+    out << "Batch edit: import of a lattice, every cell set twice\n";
+
+    for(auto mode : {Sheet::RecalcMode::lazy, Sheet::RecalcMode::eager}) {
+        const std::string mode_name = mode == Sheet::RecalcMode::lazy ? "lazy" : "eager";
+        //eager SetCell пересчитывает растущую решетку на каждую формулу - только небольшие размеры
+        const std::vector<int> sides = mode == Sheet::RecalcMode::lazy ? std::vector{128, 256} : std::vector{64, 128};
+        for(int side : sides) {
+            const std::string size_name = std::to_string(side) + "x" + std::to_string(side);
+            for(bool batch : {false, true}) {
+                Sheet sheet;
+                sheet.SetRecalcMode(mode);
+                const double ms = MeasureMs([&] {
+                    if(batch) {
+                        sheet.BeginBatch();
+                    }
+                    RunImport(sheet, side);
+                    sheet.CommitBatch();
+                });
+                PrintRow(out, std::string(batch ? "batch, " : "set cell, ") + mode_name + ", " + size_name, ms,
+                         std::to_string(sheet.GetFormulaEvaluationCount()) + " evaluations");
+            }
+        }
+    }
+}
+
+//==== Recalc mode: lazy (при чтении) vs eager (при изменении, в топологическом порядке) ====
+//После каждого изменения влияющей ячейки читаются все зависимые ячейки
+void RunRecalcWorkload(std::ostream& out, const std::string& name, Sheet::RecalcMode mode,
+                       const std::function<void(Sheet&)>& load, Position edited,
+                       const std::vector<Position>& read_cells) {
+    Sheet sheet;
+    sheet.SetRecalcMode(mode);
+    load(sheet);
+
+    const int edits = 50;
+    double edit_ms = 0;
+    double read_ms = 0;
+    double checksum = 0;
+    for(int i = 0; i < edits; ++i) {
+        edit_ms += MeasureMs([&] {
+            sheet.SetCell(edited, std::to_string(i + 2));
+        });
+        read_ms += MeasureMs([&] {
+            for(const Position& pos : read_cells) {
+                checksum += std::get<double>(sheet.GetCell(pos)->GetValue());
+            }
+        });
+    }
+    const bool is_eager = mode == Sheet::RecalcMode::eager;
+    PrintRow(out, name + (is_eager ? ", eager edit" : ", lazy edit"), edit_ms);
+    PrintRow(out, name + (is_eager ? ", eager read" : ", lazy read"), read_ms,
+             "checksum " + std::to_string(checksum));
+}
+
+void BenchmarkRecalcMode(std::ostream& out) {
+    out << "Recalc mode: 50 edits of the source cell, all dependents read after each\n";
+
+    //Fan-out: 16000 ячеек ссылаются на A1
+    const int fan_out = 16000;
+    std::vector<Position> fan_cells;
+    for(int row = 0; row < fan_out; ++row) {
+        fan_cells.push_back({row, 1});
+    }
+    auto load_fan_out = [&](Sheet& sheet) {
+        for(int row = 0; row < fan_out; ++row) {
+            sheet.SetCell({row, 1}, "=A1*" + std::to_string(row) + "+1");
+        }
+    };
+
+    //Цепочка: B(n) = B(n-1) + 1, B1 = A1
+    const int chain_length = 2000;
+    std::vector<Position> chain_cells;
+    for(int row = 0; row < chain_length; ++row) {
+        chain_cells.push_back({row, 1});
+    }
+    auto load_chain = [&](Sheet& sheet) {
+        sheet.SetCell({0, 1}, "=A1");
+        for(int row = 1; row < chain_length; ++row) {
+            sheet.SetCell({row, 1}, "=" + Position{row - 1, 1}.ToString() + "+1");
+        }
+    };
+
+    for(auto mode : {Sheet::RecalcMode::lazy, Sheet::RecalcMode::eager}) {
+        RunRecalcWorkload(out, "fan-out 16000", mode, load_fan_out, {0, 0}, fan_cells);
+    }
+    for(auto mode : {Sheet::RecalcMode::lazy, Sheet::RecalcMode::eager}) {
+        RunRecalcWorkload(out, "chain 2000", mode, load_chain, {0, 0}, chain_cells);
+    }
+}
+
+//==== Invalidation: сброс кеша 1M зависимых ячеек при правке в lazy режиме ====
+void BenchmarkInvalidation(std::ostream& out) {
+    const int cols = 64;
+    const int rows = Position::MAX_ROWS;
+    out << "Invalidation: edits of A1 with " << cols * rows << " dependents, lazy mode\n";
+
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "1");
+    const double load_ms = MeasureMs([&] {
+        for(int col = 1; col <= cols; ++col) {
+            for(int row = 0; row < rows; ++row) {
+                sheet.SetCell({row, col}, "=A1+1");
+            }
+        }
+    });
+    PrintRow(out, "load", load_ms);
+
+    auto read_all = [&] {
+        double checksum = 0;
+        for(int col = 1; col <= cols; ++col) {
+            for(int row = 0; row < rows; ++row) {
+                checksum += std::get<double>(sheet.GetCell({row, col})->GetValue());
+            }
+        }
+        return checksum;
+    };
+
+    const int edits = 5;
+    double warm_ms = 0;
+    double checksum = 0;
+    for(int i = 0; i < edits; ++i) {
+        checksum += read_all();
+        warm_ms += MeasureMs([&] {
+            sheet.SetCell({0, 0}, std::to_string(i + 2));
+        });
+    }
+    PrintRow(out, "edit after reading all dependents", warm_ms / edits, "per edit, checksum " + std::to_string(checksum));
+
+    //Зависимые уже без кеша: обход останавливается на них
+    const double cold_ms = MeasureMs([&] {
+        for(int i = 0; i < edits; ++i) {
+            sheet.SetCell({0, 0}, std::to_string(i + 10));
+        }
+    });
+    PrintRow(out, "edit with dependents already dirty", cold_ms / edits, "per edit");
+
+    //Цепочка, загружаемая от зависимых к влияющим: каждая правка сбрасывает кеш всех уже загруженных ячеек
+    for(int length : {4000, 16000}) {
+        Sheet chain_sheet;
+        const double ms = MeasureMs([&] {
+            for(int row = 0; row + 1 < length; ++row) {
+                chain_sheet.SetCell({row, 0}, "=" + Position{row + 1, 0}.ToString() + "+1");
+            }
+        });
+        PrintRow(out, "reverse chain load, n = " + std::to_string(length), ms);
+    }
+}
+
+//==== Deep chains: холодное вычисление нарастающего итога в lazy режиме ====
+void BenchmarkDeepChain(std::ostream& out) {
+    out << "Deep chain: cold read of the last running total (C(n) = C(n-1) + B(n)), lazy mode\n";
+
+    //Цепочка идет змейкой по парам колонок, т.к. в листе не больше MAX_ROWS строк
+    auto value_pos = [](int idx) {
+        return Position{idx % Position::MAX_ROWS, 2 * (idx / Position::MAX_ROWS)};
+    };
+    for(int length : {10000, 50000, 200000}) {
+        Sheet sheet;
+        for(int idx = 0; idx < length; ++idx) {
+            const Position value = value_pos(idx);
+            const std::string prev = idx == 0 ? "0" : Position{value_pos(idx - 1).row, value_pos(idx - 1).col + 1}.ToString();
+            sheet.SetCell(value, "1");
+            sheet.SetCell({value.row, value.col + 1}, "=" + prev + "+" + value.ToString());
+        }
+
+        const Position last = value_pos(length - 1);
+        double total = 0;
+        const double ms = MeasureMs([&] {
+            total = std::get<double>(sheet.GetCell({last.row, last.col + 1})->GetValue());
+        });
+        PrintRow(out, "chain " + std::to_string(length), ms, "total " + std::to_string(total));
+    }
+}
+
+//==== Early cutoff: правки, не меняющие значение ячейки, в eager режиме ====
+void BenchmarkEarlyCutoff(std::ostream& out) {
+    out << "Early cutoff: 100 edits of A1 with 16000 dependents, eager mode\n";
+
+    Sheet sheet;
+    sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+    sheet.SetCell({0, 0}, "5");
+    for(int row = 0; row < 16000; ++row) {
+        sheet.SetCell({row, 1}, "=A1*" + std::to_string(row) + "+1");
+    }
+
+    //"Touch": текст меняется, значение нет
+    const int edits = 100;
+    auto run_edits = [&](const std::string& name, const std::function<std::string(int)>& text) {
+        const uint64_t evaluations_before = sheet.GetFormulaEvaluationCount();
+        const double ms = MeasureMs([&] {
+            for(int i = 0; i < edits; ++i) {
+                sheet.SetCell({0, 0}, text(i));
+            }
+        });
+        PrintRow(out, name, ms, std::to_string(sheet.GetFormulaEvaluationCount() - evaluations_before) + " evaluations");
+    };
+    run_edits("same value (5 / =5 / =10/2)", [](int i) {
+        static const std::string texts[] = {"=5", "5", "=10/2"};
+        return texts[i % 3];
+    });
+    run_edits("new value", [](int i) {
+        return std::to_string(i + 6);
+    });
+}
+
+//==== Parallel recalc: полный пересчет независимых кластеров на 1..N потоках ====
+void BenchmarkParallelRecalc(std::ostream& out) {
+    const unsigned hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    out << "Parallel recalc: 512 clusters x 200 formulas, hardware threads = " << hardware_threads << "\n";
+
+    Sheet sheet;
+    for(int cluster = 0; cluster < 512; ++cluster) {
+        const int col = cluster * 2;
+        const auto source = Position{0, col}.ToString();
+        sheet.SetCell({0, col}, std::to_string(cluster + 1));
+        for(int row = 1; row <= 100; ++row) {
+            const auto prev = Position{row - 1, col}.ToString();
+            sheet.SetCell({row, col}, "=" + prev + "*0.5+" + source + "/" + std::to_string(row));
+            sheet.SetCell({row, col + 1}, "=" + prev + "*" + prev + "+(" + source + "-1)/3");
+        }
+    }
+
+    double serial_ms = 0;
+    for(unsigned threads = 1; threads <= std::max(4u, hardware_threads); threads *= 2) {
+        sheet.SetRecalcThreads(threads);
+        const int rounds = 5;
+        const double ms = MeasureMs([&] {
+            for(int round = 0; round < rounds; ++round) {
+                sheet.Recalculate();
+            }
+        }) / rounds;
+        if(threads == 1) {
+            serial_ms = ms;
+        }
+        std::ostringstream speedup;
+        speedup << std::fixed << std::setprecision(2) << serial_ms / ms << "x";
+        PrintRow(out, "recalculate, threads = " + std::to_string(threads), ms, speedup.str());
+    }
+}
+
+//==== Formula evaluation: обход дерева vs байткод ====
+void BenchmarkFormulaEvaluation(std::ostream& out) {
+    out << "Formula evaluation: tree walker vs bytecode VM\n";
+
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "3");
+    sheet.SetCell({0, 1}, "0.25");
+    sheet.SetCell({0, 2}, "7");
+    sheet.SetCell({0, 3}, "-2");
+
+    const std::vector<std::pair<std::string, std::string>> formulas{
+        {"constants", "1+2*3-4/5+(6-7)*8"},
+        {"cells", "(A1+B1)*C1-D1/2+(A1-B1)*(C1+D1)/3"},
+        {"deep", "A1*(B1+(C1-(D1*(A1+(B1/(C1+(D1-(A1*(B1+1)))))))))"},
+    };
+
+    const int evaluations = 1000000;
+    for(const auto& [name, formula] : formulas) {
+        for(auto evaluator : {FormulaAST::Evaluator::tree, FormulaAST::Evaluator::bytecode}) {
+            const auto ast = ParseFormulaAST(formula, std::pmr::get_default_resource(), evaluator);
+            double checksum = 0;
+            const double ms = MeasureMs([&] {
+                for(int i = 0; i < evaluations; ++i) {
+                    checksum += ast.ExecuteBoxed(sheet);
+                }
+            });
+            const bool is_tree = evaluator == FormulaAST::Evaluator::tree;
+            PrintRow(out, name + (is_tree ? ", tree" : ", bytecode"), ms,
+                     std::to_string(static_cast<long long>(evaluations / ms * 1000)) + " evals/s, checksum "
+                     + std::to_string(checksum));
+        }
+    }
+}
+
+//==== Error propagation: пересчет формул над числами vs над текстом (#VALUE!) ====
+void BenchmarkErrorPropagation(std::ostream& out) {
+    out << "Error propagation: 10 full recalcs of 16000 formulas over a numeric or a text column\n";
+
+    const int rows = 16000;
+    for(const std::string source : {"1.5", "n/a"}) {
+        Sheet sheet;
+        sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+        for(int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, source);
+            sheet.SetCell({row, 1}, "=" + Position{row, 0}.ToString() + "*2+1");
+        }
+
+        const double ms = MeasureMs([&] {
+            for(int i = 0; i < 10; ++i) {
+                sheet.Recalculate();
+            }
+        });
+        size_t errors = 0;
+        for(int row = 0; row < rows; ++row) {
+            errors += std::holds_alternative<FormulaError>(sheet.GetCell({row, 1})->GetValue());
+        }
+        PrintRow(out, source == "n/a" ? "text column, #VALUE!" : "numeric column", ms,
+                 std::to_string(errors) + " errors");
+    }
+
+    //Ошибка в корне цепочки: PrintValues читает каждую ячейку цепочки
+    const int chain_length = 2000;
+    for(const std::string root : {"=1", "=1/0"}) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, root);
+        for(int row = 0; row < chain_length; ++row) {
+            const Position ref = row == 0 ? Position{0, 0} : Position{row - 1, 1};
+            sheet.SetCell({row, 1}, "=" + ref.ToString() + "+1");
+        }
+
+        const uint64_t evaluations_before = sheet.GetFormulaEvaluationCount();
+        std::ostringstream values;
+        const double ms = MeasureMs([&] {
+            sheet.PrintValues(values);
+        });
+        PrintRow(out, "chain " + std::to_string(chain_length) + ", root " + root + ", print values", ms,
+                 std::to_string(sheet.GetFormulaEvaluationCount() - evaluations_before) + " evaluations");
+    }
+}
+
+void BenchmarkFormulaParsing(std::ostream& out) {
+    out << "Formula parsing: ANTLR vs native parser\n";
+
+    const std::vector<std::pair<std::string, std::string>> formulas{
+        {"short", "A1+1"},
+        {"typical", "(A1+B12)*C3-D4/2.5+(AA10-B1)*1e3"},
+        {"long", "A1*(B1+(C1-(D1*(A1+(B1/(C1+(D1-(A1*(B1+1)))))))))+ZZ100-3.25*(XX7+YY8/2)-1"},
+    };
+
+    const int parses = 100000;
+    for(const auto& [name, formula] : formulas) {
+        for(auto parser : {FormulaAST::Parser::antlr, FormulaAST::Parser::native}) {
+            //Счетчик под ареной формулы: выделения самой арены, а не узлов
+            CountingResource counter;
+            size_t checksum = 0;
+            const double ms = MeasureMs([&] {
+                for(int i = 0; i < parses; ++i) {
+                    const auto ast = ParseFormulaAST(formula, &counter, FormulaAST::Evaluator::bytecode, parser);
+                    const auto cells = ast.GetReferencedCells();
+                    checksum += cells.end() - cells.begin();
+                }
+            });
+            const bool is_antlr = parser == FormulaAST::Parser::antlr;
+            PrintRow(out, name + (is_antlr ? ", antlr" : ", native"), ms,
+                     std::to_string(static_cast<long long>(parses / ms * 1000)) + " formulas/s, arena allocs/formula "
+                     + std::to_string(counter.GetStats().allocations / parses) + ", checksum "
+                     + std::to_string(checksum));
+        }
+    }
+}
+
+//==== Shared formulas: AST на каждую ячейку vs одно AST на протянутую формулу ====
+void BenchmarkSharedFormulas(std::ostream& out) {
+    out << "Shared formulas: 100k fill-down formulas =A2*B2, =A3*B3, ... (arena bytes in use)\n";
+
+    //MAX_ROWS меньше 100k: формула протянута в нескольких столбцах, везде одной формы R[0]C[-2]*R[0]C[-1]
+    const int formula_count = 100000;
+    std::vector<std::pair<Position, std::string>> formulas;
+    formulas.reserve(formula_count);
+    for(int idx = 0; idx < formula_count; ++idx) {
+        const Position pos{idx % (Position::MAX_ROWS - 1) + 1, 2 + 3 * (idx / (Position::MAX_ROWS - 1))};
+        formulas.emplace_back(pos, Position{pos.row, pos.col - 2}.ToString() + "*"
+                                   + Position{pos.row, pos.col - 1}.ToString());
+    }
+
+    auto report = [&](const std::string& name, double ms, const CountingResource& counter) {
+        PrintRow(out, name, ms,
+                 std::to_string(static_cast<long long>(formula_count / ms * 1000)) + " formulas/s, "
+                 + std::to_string(counter.GetStats().bytes_in_use / formula_count) + " arena bytes/formula");
+    };
+
+    {
+        CountingResource counter;
+        std::vector<FormulaAST> asts;
+        asts.reserve(formula_count);
+        const double ms = MeasureMs([&] {
+            for(const auto& [pos, text] : formulas) {
+                asts.push_back(ParseFormulaAST(text, &counter, FormulaAST::Evaluator::bytecode,
+                                               FormulaAST::Parser::antlr));
+            }
+        });
+        report("AST per cell, antlr", ms, counter);
+    }
+    {
+        CountingResource counter;
+        std::vector<std::unique_ptr<FormulaInterface>> parsed;
+        parsed.reserve(formula_count);
+        const double ms = MeasureMs([&] {
+            for(const auto& [pos, text] : formulas) {
+                parsed.push_back(ParseFormula(text, &counter));
+            }
+        });
+        report("AST per cell, native", ms, counter);
+    }
+    {
+        CountingResource counter;
+        std::vector<FormulaCache::FormulaPtr> parsed;
+        parsed.reserve(formula_count);
+        FormulaCache cache(&counter);
+        const double ms = MeasureMs([&] {
+            for(const auto& [pos, text] : formulas) {
+                parsed.push_back(cache.Parse(text, pos));
+            }
+        });
+        report("shared AST (FormulaCache)", ms, counter);
+    }
+}
+
+//==== Блоки формул одной формы: по ячейкам vs по столбцу ====
+void BenchmarkColumnBlocks(std::ostream& out) {
+    out << "Column blocks: 128k formulas =A1*B1+C1, 16000-row fill-down blocks\n";
+
+    const int rows = 16000;
+    const int groups = 8;
+    //every other row: та же форма, но блоков нет - формулы вычисляются по одной
+    for(const int row_step : {1, 2}) {
+        Sheet sheet;
+        sheet.BeginBatch();
+        for(int group = 0; group < groups * row_step; ++group) {
+            const int col = group * 4;
+            for(int row = 0; row < rows; ++row) {
+                sheet.SetCell({row, col}, std::to_string(row % 100));
+                sheet.SetCell({row, col + 1}, std::to_string(row % 7) + ".5");
+                sheet.SetCell({row, col + 2}, row % 1000 == 0 ? "text" : std::to_string(-row));
+                if(row % row_step == 0) {
+                    sheet.SetCell({row, col + 3}, "=" + Position{row, col}.ToString() + "*"
+                                                  + Position{row, col + 1}.ToString() + "+"
+                                                  + Position{row, col + 2}.ToString());
+                }
+            }
+        }
+        sheet.CommitBatch();
+
+        const int rounds = 5;
+        const double ms = MeasureMs([&] {
+            for(int round = 0; round < rounds; ++round) {
+                sheet.Recalculate();
+            }
+        }) / rounds;
+        PrintRow(out, row_step == 1 ? "recalculate, fill-down blocks" : "recalculate, every other row (no blocks)",
+                 ms, "includes cache reset and ordering");
+
+        if(row_step != 1) {
+            continue;
+        }
+        //Только вычисление формул одного столбца: по ячейкам vs одним проходом по столбцу
+        std::vector<const FormulaInterface*> formulas;
+        for(int row = 0; row < rows; ++row) {
+            formulas.push_back(static_cast<const Cell*>(sheet.GetCell({row, 3}))->GetFormula());
+        }
+        const int evaluation_rounds = 50;
+        double scalar_checksum = 0;
+        const double scalar_ms = MeasureMs([&] {
+            for(int round = 0; round < evaluation_rounds; ++round) {
+                for(const auto formula : formulas) {
+                    const auto value = formula->Evaluate(sheet);
+                    scalar_checksum += std::holds_alternative<double>(value) ? std::get<double>(value) : 1;
+                }
+            }
+        }) / evaluation_rounds;
+        std::vector<double> values(rows);
+        double column_checksum = 0;
+        const double column_ms = MeasureMs([&] {
+            for(int round = 0; round < evaluation_rounds; ++round) {
+                formulas.front()->EvaluateColumnBoxed(sheet, rows, values.data());
+                for(const double value : values) {
+                    column_checksum += FormulaError::IsBoxed(value) ? 1 : value;
+                }
+            }
+        }) / evaluation_rounds;
+        PrintRow(out, "16000 cells, evaluate per cell", scalar_ms, "checksum " + std::to_string(scalar_checksum));
+        PrintRow(out, "16000 cells, evaluate by column", column_ms, "checksum " + std::to_string(column_checksum));
+    }
+}
+
+//==== Bulk load: LoadTexts из tsv vs цикл SetCell ====
+//Таблица массовой загрузки: числа, текст и формулы, протянутые вниз; rows x (groups * 5)
+std::vector<std::string> MakeBulkCells(int rows, int groups) {
+    std::vector<std::string> cells;
+    cells.reserve(static_cast<size_t>(rows) * groups * 5);
+    for(int row = 0; row < rows; ++row) {
+        for(int group = 0; group < groups; ++group) {
+            const int col = group * 5;
+            const std::string a = Position{row, col}.ToString();
+            const std::string c = Position{row, col + 2}.ToString();
+            const std::string d = Position{row, col + 3}.ToString();
+            cells.push_back(std::to_string(row));
+            cells.push_back("item " + std::to_string(row % 1000));
+            cells.push_back(std::to_string(row % 97) + ".25");
+            cells.push_back("=" + a + "*" + c + "+1");
+            cells.push_back("=SUM(" + a + ":" + d + ")");
+        }
+    }
+    return cells;
+}
+
+std::string JoinTable(const std::vector<std::string>& cells, int rows, int cols) {
+    std::string table;
+    for(int row = 0; row < rows; ++row) {
+        for(int col = 0; col < cols; ++col) {
+            table += cells[row * cols + col];
+            table += col + 1 < cols ? '\t' : '\n';
+        }
+    }
+    return table;
+}
+
+void BenchmarkLoadTexts(std::ostream& out) {
+    //Лист ограничен 16384 строками: 1M ячеек - 20 групп по 5 столбцов
+    const int rows = 10000;
+    const int groups = 20;
+    const int cols = groups * 5;
+    out << "Bulk load: " << rows << "x" << cols << " table, numbers, text and fill-down formulas\n";
+
+    const std::vector<std::string> cells = MakeBulkCells(rows, groups);
+    const std::string table = JoinTable(cells, rows, cols);
+
+    for(const bool batch : {false, true}) {
+        Sheet sheet;
+        const double ms = MeasureMs([&] {
+            if(batch) {
+                sheet.BeginBatch();
+            }
+            for(int row = 0; row < rows; ++row) {
+                for(int col = 0; col < cols; ++col) {
+                    sheet.SetCell({row, col}, cells[row * cols + col]);
+                }
+            }
+            sheet.CommitBatch();
+        });
+        PrintRow(out, batch ? "batch SetCell" : "SetCell loop", ms);
+    }
+    for(const size_t threads : {1, 4}) {
+        Sheet sheet;
+        sheet.SetRecalcThreads(threads);
+        std::istringstream input(table);
+        const double ms = MeasureMs([&] {
+            sheet.LoadTexts(input);
+        });
+        PrintRow(out, "LoadTexts, " + std::to_string(threads) + (threads == 1 ? " thread" : " threads"), ms,
+                 std::to_string(static_cast<int>(table.size() / (ms / 1000) / (1 << 20))) + " MB/s, "
+                 + std::to_string(sheet.GetSharedFormulaCount()) + " formula forms");
+    }
+}
+
+//==== Snapshot: binary save/load vs parsing the texts ====
+void BenchmarkSnapshot(std::ostream& out) {
+    const int rows = 10000;
+    const int groups = 20;
+    const int cols = groups * 5;
+    out << "Snapshot: " << rows << "x" << cols << " table, save and load vs LoadTexts\n";
+
+    const std::string table = JoinTable(MakeBulkCells(rows, groups), rows, cols);
+    Sheet source;
+    std::istringstream input(table);
+    source.LoadTexts(input);
+    std::ostringstream values;
+    source.PrintValues(values);
+
+    auto throughput = [](size_t bytes, double ms) {
+        return std::to_string(static_cast<int>(bytes / (ms / 1000) / (1 << 20))) + " MB/s";
+    };
+    for(const bool with_values : {false, true}) {
+        std::ostringstream output;
+        const double save_ms = MeasureMs([&] {
+            source.SaveSnapshot(output, with_values);
+        });
+        const std::string snapshot = output.str();
+        PrintRow(out, with_values ? "save with values" : "save without values", save_ms,
+                 throughput(snapshot.size(), save_ms) + ", " + std::to_string(snapshot.size() >> 20) + " MB");
+
+        Sheet sheet;
+        const double load_ms = MeasureMs([&] {
+            sheet.LoadSnapshot(snapshot.data(), snapshot.size());
+        });
+        PrintRow(out, with_values ? "load with values" : "load without values", load_ms,
+                 throughput(snapshot.size(), load_ms));
+        std::ostringstream loaded_values;
+        const double print_ms = MeasureMs([&] {
+            sheet.PrintValues(loaded_values);
+        });
+        PrintRow(out, "  then PrintValues", print_ms,
+                 std::to_string(sheet.GetFormulaEvaluationCount()) + " evaluations"
+                 + (loaded_values.str() == values.str() ? "" : ", VALUES DIFFER"));
+        if(with_values) {
+            //Из файла: отображение в память
+            const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.snapshot").string();
+            std::ofstream(path, std::ios::binary) << snapshot;
+            Sheet mapped;
+            const double mapped_ms = MeasureMs([&] {
+                mapped.LoadSnapshot(path);
+            });
+            std::filesystem::remove(path);
+            PrintRow(out, "load from mapped file", mapped_ms, throughput(snapshot.size(), mapped_ms));
+        }
+    }
+    Sheet sheet;
+    std::istringstream texts(table);
+    const double ms = MeasureMs([&] {
+        sheet.LoadTexts(texts);
+        std::ostringstream loaded_values;
+        sheet.PrintValues(loaded_values);
+    });
+    PrintRow(out, "LoadTexts + PrintValues", ms, throughput(table.size(), ms));
+}
+
+//==== Journal: cost of group commit, replay vs SetCell, recovery after a checkpoint ====
+void BenchmarkJournal(std::ostream& out) {
+    out << "Journal: SetCell with a journal, replay on open, recovery after Checkpoint\n";
+    const auto directory = std::filesystem::temp_directory_path();
+    const auto journal_path = (directory / "spreadsheet_bench.journal").string();
+    const auto snapshot_path = (directory / "spreadsheet_bench.snapshot").string();
+
+    //Правки: числа и формулы, протянутые вниз, в 20 столбцах; каждая ячейка правится дважды
+    const int rows = 5000;
+    const int cols = 20;
+    auto edit_text = [](int row, int col, int pass) {
+        if(col % 2 == 0) {
+            return std::to_string(row * pass + col);
+        }
+        return "=" + Position{row, col - 1}.ToString() + "*" + std::to_string(pass) + "+1";
+    };
+    auto make_edits = [&](Sheet& sheet, int edit_count) {
+        for(int idx = 0; idx < edit_count; ++idx) {
+            const int cell = idx % (rows * cols);
+            sheet.SetCell({cell / cols, cell % cols}, edit_text(cell / cols, cell % cols, 1 + idx / (rows * cols)));
+        }
+    };
+
+    const int fsync_edits = 500;
+    for(const size_t group_commit : {0, 1, 64, 4096}) {
+        std::filesystem::remove(journal_path);
+        Sheet sheet;
+        if(group_commit != 0) {
+            sheet.OpenJournal(journal_path, group_commit);
+        }
+        const int edit_count = group_commit == 1 ? fsync_edits : rows * cols;
+        const double ms = MeasureMs([&] {
+            make_edits(sheet, edit_count);
+            sheet.SyncJournal();
+        });
+        PrintRow(out, group_commit == 0 ? "SetCell, no journal" : "SetCell, group commit " + std::to_string(group_commit),
+                 ms, std::to_string(static_cast<int>(edit_count / (ms / 1000))) + " edits/s");
+    }
+
+    std::filesystem::remove(journal_path);
+    std::filesystem::remove(snapshot_path);
+    const int edit_count = 2 * rows * cols;
+    {
+        Sheet sheet;
+        sheet.OpenJournal(journal_path, 4096);
+        make_edits(sheet, edit_count);
+    }
+    {
+        Sheet sheet;
+        const double ms = MeasureMs([&] {
+            make_edits(sheet, edit_count);
+        });
+        PrintRow(out, "apply " + std::to_string(edit_count) + " edits by SetCell", ms);
+    }
+    {
+        Sheet sheet;
+        const double ms = MeasureMs([&] {
+            sheet.OpenJournal(journal_path);
+        });
+        PrintRow(out, "replay journal on open", ms,
+                 std::to_string(sheet.GetJournalSize() >> 10) + " KB journal");
+        const double checkpoint_ms = MeasureMs([&] {
+            sheet.Checkpoint(snapshot_path);
+        });
+        PrintRow(out, "Checkpoint", checkpoint_ms);
+        sheet.SetCell({0, 0}, "1");
+    }
+    {
+        Sheet sheet;
+        const double ms = MeasureMs([&] {
+            sheet.LoadSnapshot(snapshot_path);
+            sheet.OpenJournal(journal_path);
+        });
+        PrintRow(out, "recover: snapshot + short journal", ms);
+    }
+    std::filesystem::remove(journal_path);
+    std::filesystem::remove(snapshot_path);
+}
+
+//==== Export: PrintValues/PrintTexts vs writing every cell through the stream ====
+void BenchmarkExport(std::ostream& out) {
+    const int rows = 10000;
+    const int groups = 20;
+    const int cols = groups * 5;
+    out << "Export: " << rows << "x" << cols << " table, PrintValues/PrintTexts vs operator<< per cell\n";
+
+    Sheet sheet;
+    std::istringstream input(JoinTable(MakeBulkCells(rows, groups), rows, cols));
+    sheet.LoadTexts(input);
+    sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+
+    //Прежняя выгрузка: каждая ячейка печатной области через GetCell и operator<<
+    auto print_per_cell = [&sheet](std::ostream& output, bool values) {
+        const Size size = sheet.GetPrintableSize();
+        for(int row = 0; row < size.rows; ++row) {
+            for(int col = 0; col < size.cols; ++col) {
+                if(col > 0) {
+                    output << '\t';
+                }
+                if(const auto cell = sheet.GetCell({row, col})) {
+                    if(values) {
+                        std::visit([&output](const auto& value) {
+                            output << value;
+                        }, cell->GetValue());
+                    } else {
+                        output << cell->GetText();
+                    }
+                }
+            }
+            output << '\n';
+        }
+    };
+    for(const bool values : {true, false}) {
+        std::string result;
+        for(const bool per_cell : {true, false}) {
+            std::ostringstream output;
+            const double ms = MeasureMs([&] {
+                if(per_cell) {
+                    print_per_cell(output, values);
+                } else if(values) {
+                    sheet.PrintValues(output);
+                } else {
+                    sheet.PrintTexts(output);
+                }
+            });
+            const std::string printed = output.str();
+            const bool is_same = result.empty() || printed == result;
+            result = printed;
+            PrintRow(out, std::string(per_cell ? "operator<< per cell, " : "")
+                              + (values ? "PrintValues" : "PrintTexts"), ms,
+                     std::to_string(static_cast<int>(printed.size() / (ms / 1000) / (1 << 20))) + " MB/s"
+                     + (is_same ? "" : ", OUTPUT DIFFERS"));
+        }
+    }
+}
+
+//==== Parallel export: ExportValues by row bands vs PrintValues ====
+void BenchmarkExportValues(std::ostream& out) {
+    const int rows = 10000;
+    const int groups = 20;
+    const int cols = groups * 5;
+    out << "Parallel export: " << rows << "x" << cols << " table, values in cache, "
+        << std::thread::hardware_concurrency() << " hardware threads\n";
+
+    Sheet sheet;
+    std::istringstream input(JoinTable(MakeBulkCells(rows, groups), rows, cols));
+    sheet.LoadTexts(input);
+    sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+
+    std::ostringstream expected;
+    const double print_ms = MeasureMs([&] {
+        sheet.PrintValues(expected);
+    });
+    const size_t bytes = expected.str().size();
+    auto throughput = [bytes](double ms) {
+        return std::to_string(static_cast<int>(bytes / (ms / 1000) / (1 << 20))) + " MB/s";
+    };
+    PrintRow(out, "PrintValues", print_ms, throughput(print_ms));
+    for(const size_t threads : {1, 2, 4, 8}) {
+        sheet.SetRecalcThreads(threads);
+        std::ostringstream output;
+        const double ms = MeasureMs([&] {
+            sheet.ExportValues(output);
+        });
+        PrintRow(out, "ExportValues, " + std::to_string(threads) + (threads == 1 ? " thread" : " threads"), ms,
+                 throughput(ms) + (output.str() == expected.str() ? "" : ", OUTPUT DIFFERS"));
+    }
+}
+
+//==== Range functions: SUM(A1:A500) vs A1+A2+...+A500 ====
+void BenchmarkRangeSum(std::ostream& out) {
+    out << "Range functions: SUM over a range vs a chain of additions, 500 cells\n";
+
+    const int rows = 500;
+    std::string additions = "=A1";
+    for(int row = 1; row < rows; ++row) {
+        additions += "+" + Position{row, 0}.ToString();
+    }
+    const std::vector<std::pair<std::string, std::string>> formulas{
+        {"SUM(A1:A500)", "=SUM(A1:A500)"},
+        {"A1+...+A500", additions},
+    };
+
+    const int formula_count = 200;
+    const int edits = 1000;
+    for(const auto& [name, formula] : formulas) {
+        Sheet sheet;
+        sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+        for(int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row));
+        }
+
+        //Каждая формула - ребра к ячейкам столбца (или одно ребро к вершине диапазона)
+        const double set_ms = MeasureMs([&] {
+            for(int col = 1; col <= formula_count; ++col) {
+                sheet.SetCell({0, col}, formula);
+            }
+        });
+        const auto& graph = sheet.GetDependencyGraph();
+        PrintRow(out, name + ", set " + std::to_string(formula_count) + " formulas", set_ms,
+                 std::to_string(graph.EdgeCount()) + " edges, " + std::to_string(graph.NodeCount()) + " nodes, "
+                 + std::to_string(graph.MemoryUsage() / 1024) + " KB graph");
+
+        const double edit_ms = MeasureMs([&] {
+            for(int i = 0; i < edits; ++i) {
+                sheet.SetCell({i % rows, 0}, std::to_string(i));
+            }
+        });
+        PrintRow(out, name + ", " + std::to_string(edits) + " eager edits", edit_ms,
+                 "B1 = " + std::to_string(std::get<double>(sheet.GetCell({0, 1})->GetValue())));
+    }
+}
+
+//==== Range index: поиск диапазонов ячейки, дерево интервалов vs перебор ====
+void BenchmarkRangeIndex(std::ostream& out) {
+    out << "Range index: 100000 rolling windows of 100 rows in columns A:G\n";
+
+    //Окна A(i):A(i+99), затем B(i):B(i+99) и т.д.: строк листа не хватает на одну колонку
+    const int window_count = 100000;
+    const int window = 100;
+    const int windows_in_column = Position::MAX_ROWS - window + 1;
+    const int formula_col = 10;
+    std::vector<Range> ranges;
+    RangeIndex<int> index;
+    for(int i = 0; i < window_count; ++i) {
+        const Position first{i % windows_in_column, i / windows_in_column};
+        ranges.push_back({first, {first.row + window - 1, first.col}});
+        index.Insert(ranges.back(), i);
+    }
+    auto query_pos = [&](int i) {
+        return Position{(i * 7919) % Position::MAX_ROWS, i % (window_count / windows_in_column)};
+    };
+
+    const int queries = 100000;
+    const int linear_queries = 1000;
+    size_t found = 0;
+    const double index_ms = MeasureMs([&] {
+        for(int i = 0; i < queries; ++i) {
+            index.ForEachContaining(query_pos(i), [&found](const Range&, int) {
+                ++found;
+            });
+        }
+    });
+    PrintRow(out, "interval tree, " + std::to_string(queries) + " lookups", index_ms,
+             std::to_string(found / queries) + " ranges/lookup, " + std::to_string(index.MemoryUsage() / 1024) + " KB");
+
+    found = 0;
+    const double linear_ms = MeasureMs([&] {
+        for(int i = 0; i < linear_queries; ++i) {
+            const Position pos = query_pos(i);
+            found += std::count_if(ranges.begin(), ranges.end(), [pos](const Range& range) {
+                return range.Contains(pos);
+            });
+        }
+    });
+    PrintRow(out, "linear scan, " + std::to_string(linear_queries) + " lookups", linear_ms,
+             std::to_string(found / linear_queries) + " ranges/lookup");
+
+    //Лист: правка ячейки без вершины находит формулы своих окон через индекс и пересчитывает их
+    Sheet sheet;
+    sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+    const double set_ms = MeasureMs([&] {
+        for(int i = 0; i < window_count; ++i) {
+            const Position pos{i % windows_in_column, formula_col + i / windows_in_column};
+            sheet.SetCell(pos, "=SUM(" + ranges[i].ToString() + ")");
+        }
+    });
+    PrintRow(out, "eager sheet, set formulas", set_ms,
+             std::to_string(sheet.GetDependencyGraph().MemoryUsage() / 1024) + " KB graph");
+
+    const int edits = 10000;
+    const double edit_ms = MeasureMs([&] {
+        for(int i = 0; i < edits; ++i) {
+            sheet.SetCell(query_pos(i), std::to_string(i));
+        }
+    });
+    PrintRow(out, std::to_string(edits) + " eager edits, ~100 formulas each", edit_ms);
+}
+
+//==== Range totals: SUM и AVERAGE по разностям vs MAX, который каждый раз читает весь диапазон ====
+void BenchmarkRangeTotals(std::ostream& out) {
+    out << "Range totals: 100 formulas over A1:A16000, eager edits of single cells\n";
+
+    const int rows = 16000;
+    const int formula_count = 100;
+    for(const std::string function : {"SUM", "AVERAGE", "MAX"}) {
+        Sheet sheet;
+        sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+        for(int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row % 100));
+        }
+        for(int col = 1; col <= formula_count; ++col) {
+            sheet.SetCell({0, col}, "=" + function + "(A1:A16000)+" + std::to_string(col));
+        }
+
+        const bool reads_range = function == "MAX";
+        const int edits = reads_range ? 100 : 10000;
+        const double ms = MeasureMs([&] {
+            for(int i = 0; i < edits; ++i) {
+                sheet.SetCell({(i * 7919) % rows, 0}, std::to_string(i % 1000));
+            }
+        });
+        PrintRow(out, function + ", " + std::to_string(edits) + " edits" + (reads_range ? ", reads range" : ", delta totals"), ms,
+                 std::to_string(ms * 1000 / edits) + " us/edit, B1 = "
+                 + std::to_string(std::get<double>(sheet.GetCell({0, 1})->GetValue())));
+    }
+}
+}//namespace
+
+void RunBenchmarks(std::ostream& out) {
+    BenchmarkCellIndex(out);
+    BenchmarkSheetArena(out);
+    BenchmarkCellLayout(out);
+    BenchmarkDependencyChain(out);
+    BenchmarkCycleCheck(out);
+    BenchmarkBatchEdit(out);
+    BenchmarkRecalcMode(out);
+    BenchmarkEarlyCutoff(out);
+    BenchmarkInvalidation(out);
+    BenchmarkDeepChain(out);
+    BenchmarkParallelRecalc(out);
+    BenchmarkFormulaEvaluation(out);
+    BenchmarkFormulaParsing(out);
+    BenchmarkSharedFormulas(out);
+    BenchmarkColumnBlocks(out);
+    BenchmarkLoadTexts(out);
+    BenchmarkSnapshot(out);
+    BenchmarkJournal(out);
+    BenchmarkExport(out);
+    BenchmarkExportValues(out);
+    BenchmarkErrorPropagation(out);
+    BenchmarkRangeSum(out);
+    BenchmarkRangeIndex(out);
+    BenchmarkRangeTotals(out);
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <iosfwd>
+
+//Бенчмарки производительности таблицы. Запуск: spreadsheet --bench
+void RunBenchmarks(std::ostream& out);
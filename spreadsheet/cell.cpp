@@ -1,10 +1,13 @@
 #include "cell.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <charconv>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <optional>
-#include <stack>
 #include <sstream>
 
 ///Марина, привет! Воспользовался моментом, что бы переписать реализацию через std::variant вместо наследования и Impl_
@@ -19,291 +22,432 @@
 
 namespace{
 struct CellTextGetter {
-    const SheetInterface& sheet;
-
     std::string operator()(std::monostate) {
         return "";
     }
 
-    std::string operator()(std::string str) {
-        return str;
+    std::string operator()(double number);
+
+    std::string operator()(const Cell::TextPtr& str) {
+        return std::string(*str);
     }
 
-    std::string operator()(const Cell::FormulaPtr& formula) {
-        return FORMULA_SIGN + formula->GetExpression();
+    std::string operator()(const Cell::NumberTextPtr& number) {
+        return std::string(number->text);
+    }
+
+    std::string operator()(const Cell::FormulaDataPtr& formula_data) {
+        return FORMULA_SIGN + formula_data->formula->GetExpression();
     }
 };
 
-std::optional<double> StrToDouble(const std::string& txt) {
-    double conv_double;
-    std::stringstream ss(txt);
-    ss >> conv_double;
+struct CellValueGetter {
+    Cell::Value operator()(std::monostate) {
+        //Для пустой ячейки возвращаем std::variant<double> == 0.0;
+        return 0.0;
+    }
 
-    //return the double if conversion successful, otherwise nullopt
-    return (!ss.fail() && ss.eof())
-               ? std::optional<double>{conv_double}
-               : std::optional<double>{};
-}
-}//namespace
+    Cell::Value operator()(double number) {
+        return number;
+    }
 
-//========== Cell Public ==========
-Cell::Cell(SheetInterface& sheet)
-    : sheet_(sheet) {
-}
+    Cell::Value operator()(const Cell::TextPtr& str) {
+        return std::string(std::string_view(*str).substr((*str)[0] == ESCAPE_SIGN ? 1 : 0));
+    }
 
-Cell::~Cell() {}
+    Cell::Value operator()(const Cell::NumberTextPtr& number) {
+        return number->value;
+    }
 
-void Cell::Set(Position pos, std::string text) {
-    //Store pos for DFS algorithms (to identify this cell in tree)
-    pos_in_sheet_ = pos;
+    Cell::Value operator()(const Cell::FormulaDataPtr& formula_data) {
+        const double value = formula_data->GetBoxedValue();
+        if(FormulaError::IsBoxed(value)) {
+            return FormulaError::Unbox(value);
+        }
+        return value;
+    }
+};
 
-    //1.Empty
-    if(text.empty()) {
-        Clear();
-        return;
+//Значение ячейки-операнда формулы, ошибки упакованы в double
+struct CellOperandGetter {
+    double operator()(std::monostate) {
+        return 0.0;
     }
-    CellData new_data;
 
-    //2.Formula
-    if(text[0] == FORMULA_SIGN && text.size() > 1) {
-        //remove leading '=' when parsing formula string
-        auto new_formula_obj = ParseFormula(text.substr(1));
+    double operator()(double number) {
+        return number;
+    }
 
-        if(!new_formula_obj) {
-            throw std::runtime_error("Invalid formula object returned by ParseFormula() in Cell::Set");
+    double operator()(const Cell::TextPtr& str) {
+        //Текст "'" - пустая строка, как и пустая ячейка, трактуется как 0
+        if(*str == std::string_view(&ESCAPE_SIGN, 1)) {
+            return 0.0;
         }
+        return FormulaError(FormulaError::Category::Value).Box();
+    }
 
-        const auto new_cell_refs = new_formula_obj->GetReferencedCells();
+    double operator()(const Cell::NumberTextPtr& number) {
+        return number->value;
+    }
 
-        if(CheckFormulaForCycle(&new_cell_refs)) {
-            throw CircularDependencyException("Circular dependency when adding new formula to cell");
-        }
+    double operator()(const Cell::FormulaDataPtr& formula_data) {
+        return formula_data->GetBoxedValue();
+    }
+};
 
-        //no parsing or cycle errors:
-        new_data = std::move(new_formula_obj);
+//Значение ячейки диапазона: пустые и текстовые ячейки пропускаются
+struct CellRangeValueGetter {
+    std::optional<double> operator()(std::monostate) {
+        return std::nullopt;
     }
-    //3.Text
-    else {
-        new_data = text;
 
-        //3.1.Double as text -> store in cache and read from cache, when using in formula
-        //keep string input to preserve format for GetText (otherwise changes to 1.00000 etc)
-        if(auto dbl_opt = StrToDouble(text)) {
-            cache_ = dbl_opt.value();
+    std::optional<double> operator()(double number) {
+        return number;
+    }
+
+    std::optional<double> operator()(const Cell::TextPtr&) {
+        return std::nullopt;
+    }
+
+    std::optional<double> operator()(const Cell::NumberTextPtr& number) {
+        return number->value;
+    }
+
+    std::optional<double> operator()(const Cell::FormulaDataPtr& formula_data) {
+        return formula_data->GetBoxedValue();
+    }
+};
+
+std::optional<double> StrToDouble(const std::string& txt) {
+    //Быстрый путь без потока: обычная запись числа, разобранная целиком.
+    //Остальное (пробелы, '+', переполнение, текст) - через поток, как раньше
+    const char* first = txt.data();
+    const char* last = txt.data() + txt.size();
+    const char* digits = !txt.empty() && txt[0] == '-' ? first + 1 : first;
+    if(digits != last && ((*digits >= '0' && *digits <= '9') || *digits == '.')) {
+        double value;
+        if(auto [end, ec] = std::from_chars(first, last, value); ec == std::errc{} && end == last) {
+            return value;
         }
     }
 
-    //4.New cell data was processed without exceptions, swap
-    Clear();
-    std::swap(data_variant_, new_data);
+    //Поток читает число только после пробелов со знака, точки или цифры: остальной текст - не число
+    const auto number_start = std::find_if_not(first, last, [](char ch) {
+        return std::isspace(static_cast<unsigned char>(ch));
+    });
+    if(number_start == last || !std::strchr("+-.0123456789", *number_start)) {
+        return std::nullopt;
+    }
+
+    double conv_double;
+    std::stringstream ss(txt);
+    ss >> conv_double;
+
+    //return the double if conversion successful, otherwise nullopt
+    return (!ss.fail() && ss.eof())
+               ? std::optional<double>{conv_double}
+               : std::optional<double>{};
+}
+
+//Каноническая (кратчайшая, без потери точности) запись числа
+std::string FormatNumber(double number) {
+    char buffer[32];
+    auto [end, ec] = std::to_chars(std::begin(buffer), std::end(buffer), number);
+    return ec == std::errc{} ? std::string(buffer, end) : std::string{};
+}
 
-    //5.Add this cell to new ref cells as Dependent (if formula)
-    AddAsDependentToRefCells();
+std::string CellTextGetter::operator()(double number) {
+    return FormatNumber(number);
 }
+}//namespace
+
+static_assert(sizeof(Cell) <= 24, "Cell must stay compact: move new per-cell data out of line");
+
+//========== Cell Public ==========
+Cell::~Cell() {}
 
-///Здесь немного поменялась логика, поэтому уже не сделать через Set с передачей пустой строки (как было в замечанни в ревью)
-///Надеюсь такой вариант тоже подойдет! (т.е. теперь наоборот Set("") с пустой строкой происходит через Clear() )
 void Cell::Clear() {
-    //When changing an existing non-empty cell, process dependents and invalidate caches
-    if(!IsEmpty()) {
-        RemoveCellFromDependents();
-        InvalidateDependentCellsCaches();
-        InvalidateCache();
-    }
     data_variant_ = std::monostate();
 }
 
 Cell::Value Cell::GetValue() const {
-    //0.Для пустой ячейки возвращаем std::variant<double> == 0.0;
-    if(IsEmpty()) {
-        return 0.0;
-    }
+    return std::visit(CellValueGetter{}, data_variant_);
+}
 
-    //1.Возвращает кеш, если он есть
-    if(cache_.has_value()) {
-        return cache_.value();
-    }
+double Cell::GetOperandValue() const {
+    return std::visit(CellOperandGetter{}, data_variant_);
+}
 
-    //2.Записать double в кэш, если это возможно
-    if(HasFormula()) {
-        auto formula_result = AsFormula()->Evaluate(sheet_);
+std::string Cell::GetText() const {
+    return std::visit(CellTextGetter{}, data_variant_);
+}
 
-        if(std::holds_alternative<FormulaError>(formula_result)) {
-            //Формула вернула ошибку
-            return std::get<FormulaError>(formula_result);
-        } else {
-            cache_ = std::get<double>(formula_result);
-        }
+void Cell::AppendText(std::string& out) const {
+    if(const auto number = std::get_if<double>(&data_variant_)) {
+        char buffer[32];
+        const auto [end, ec] = std::to_chars(std::begin(buffer), std::end(buffer), *number);
+        out.append(buffer, ec == std::errc{} ? end : buffer);
+    } else if(const auto text = std::get_if<TextPtr>(&data_variant_)) {
+        out += **text;
+    } else if(const auto number_text = std::get_if<NumberTextPtr>(&data_variant_)) {
+        out += (*number_text)->text;
+    } else if(HasFormula()) {
+        out += FORMULA_SIGN;
+        out += AsFormula().formula->GetExpression();
     }
+}
 
-    //3.Вернуть текст, если ячейка не содержит число или формулу
-    //(числовые ячейки, заданные строкой, всегда имеют валидный кэщ)
-    if(HasString()) {
-        return AsString()[0] == ESCAPE_SIGN ? AsString().substr(1) : AsString();
-    }
-    //4.Иначе вернуть значения заново посчитаного Кэша
-    else {
-        return cache_.value();
-    }
+std::optional<double> Cell::GetRangeValue() const {
+    return std::visit(CellRangeValueGetter{}, data_variant_);
 }
 
-std::string Cell::GetText() const {
-    return std::visit(CellTextGetter{sheet_}, data_variant_);
+const FormulaInterface* Cell::GetFormula() const {
+    return HasFormula() ? AsFormula().formula.get() : nullptr;
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
     if(HasFormula()) {
-        return AsFormula()->GetReferencedCells();
+        return AsFormula().formula->GetReferencedCells();
     }
     return {};
 }
 
 void Cell::InvalidateCache() const {
+    ResetCache();
+}
+
+bool Cell::ResetCache() const {
     //Invalidate only for formula cells
-    if(HasFormula()) {
-        cache_.reset();
-    }
+    return HasFormula() && AsFormula().cache.Reset();
 }
 
+namespace {
+//Кадр стека вычисления: формула и следующая ее ссылка, которую нужно проверить
+struct EvaluationFrame {
+    const Cell::FormulaData* formula_data;
+    Cell::FormulaData::PrecedentCursor cursor;
+};
 
-//==== Работа с зависимыми ячейками ====
-std::vector<Position> Cell::GetDependentCells() const {
-    //Store dep cells as set, to avoid duplicates. Return as vec for compatibility
-    return {dependent_cells_.begin(), dependent_cells_.end()};
-}
+//Свой стек у каждого потока пересчета; буфер переиспользуется между вычислениями
+thread_local std::vector<EvaluationFrame> evaluation_stack;
 
-void Cell::AddDependentCells(Position pos) const {
-    dependent_cells_.insert(pos);
+//Неглубокие ссылки вычисляются рекурсивно (без второго поиска ячеек), глубже - явным стеком
+constexpr size_t MAX_RECURSIVE_EVALUATION_DEPTH = 64;
+thread_local size_t evaluation_depth = 0;
 
-    for(const auto& dep_cell : sheet_.GetCell(pos)->GetDependentCells()) {
-        dependent_cells_.insert(dep_cell);
+struct EvaluationDepthGuard {
+    EvaluationDepthGuard() {
+        ++evaluation_depth;
+    }
+    ~EvaluationDepthGuard() {
+        --evaluation_depth;
+    }
+};
+}//namespace
+
+double Cell::FormulaData::GetBoxedValue() const {
+    //1.Возвращает кеш, если он есть
+    if(const auto cached = cache.Load()) {
+        return *cached;
     }
-}
 
-void Cell::RemoveDependentCells(Position pos) const {
-    dependent_cells_.erase(pos);
+    //2.Обычно ссылки уже в кеше или цепочка короткая: вычислить сразу, ссылки - рекурсивно
+    if(evaluation_depth < MAX_RECURSIVE_EVALUATION_DEPTH) {
+        EvaluationDepthGuard guard;
+        EvaluateAndStore();
+        return *cache.Load();
+    }
+
+    //3.Глубокая цепочка - без рекурсии: невычисленные влияющие формулы кладутся на явный стек
+    //и вычисляются раньше зависимых. Формула вычисляется, только когда все ее ссылки уже в кеше,
+    //поэтому глубина цепочки ограничена только памятью.
+    //Циклов в листе нет, и одна формула не попадает на стек дважды
+    auto& stack = evaluation_stack;
+    const size_t stack_base = stack.size();
+    stack.push_back({this, BeginPrecedents()});
+    while(stack.size() > stack_base) {
+        auto& frame = stack.back();
+        const FormulaData* pending = frame.formula_data->FindUncachedPrecedent(frame.cursor);
+        if(pending) {
+            stack.push_back({pending, pending->BeginPrecedents()});
+            continue;
+        }
 
-    for(const auto& dep_cell : sheet_.GetCell(pos)->GetDependentCells()) {
-        dependent_cells_.erase(dep_cell);
+        const FormulaData* ready = frame.formula_data;
+        stack.pop_back();
+        if(!ready->cache.Load()) {
+            ready->EvaluateAndStore();
+        }
     }
+    return *cache.Load();
 }
 
+Cell::FormulaData::PrecedentCursor Cell::FormulaData::BeginPrecedents() const {
+    const auto ranges = formula->GetReferencedRanges();
+    return {formula->GetReferencedCellsRange().begin(), ranges.begin(),
+            ranges.empty() ? Position::NONE : ranges.begin()->first};
+}
 
-//==== Проходы графа ячеек по DFS ====
-//Проверить формулу на циклическую зависимость
-bool Cell::CheckFormulaForCycle(const std::vector<Position>* start_cell_refs) {
-    auto next_cells_getter = [](const CellInterface* cell_ptr) {
-        return cell_ptr->GetReferencedCells();
+const Cell::FormulaData* Cell::FormulaData::FindUncachedPrecedent(PrecedentCursor& cursor) const {
+    //Лист хранит только ячейки Cell
+    auto uncached_formula = [this](Position pos) -> const FormulaData* {
+        const auto cell_ptr = static_cast<const Cell*>(sheet.GetCell(pos));
+        if(!cell_ptr || !cell_ptr->HasFormula() || cell_ptr->AsFormula().cache.Load()) {
+            return nullptr;
+        }
+        return &cell_ptr->AsFormula();
     };
 
-    //Ничего не делать с ячейками при проходе
-    auto function_on_cells = [](const CellInterface* cell_ptr){};
-
-    return PerformDFS(pos_in_sheet_, next_cells_getter, function_on_cells, start_cell_refs);
-}
+    //1.Single cell refs
+    const auto refs_end = formula->GetReferencedCellsRange().end();
+    for(; cursor.next_ref != refs_end; ++cursor.next_ref) {
+        if(const auto precedent = uncached_formula(*cursor.next_ref)) {
+            ++cursor.next_ref;
+            return precedent;
+        }
+    }
 
-//Добавить эту ячейку в списки зависимых ячеек всем новым referenced cells
-void Cell::AddAsDependentToRefCells() {
-    //Non-dfs version
-    for(auto& ref_cell_pos : GetReferencedCells()) {
-        if(auto ref_cell_ptr =sheet_.GetCell(ref_cell_pos)) {
-            ref_cell_ptr->AddDependentCells(pos_in_sheet_);
+    //2.Cells of ranges, row by row: positions without cells are skipped by the sheet
+    const auto ranges_end = formula->GetReferencedRanges().end();
+    while(cursor.next_range != ranges_end) {
+        const Range& range = *cursor.next_range;
+        const Position pos = sheet.FindNextCell(range, cursor.next_cell);
+        if(pos == Position::NONE) {
+            if(++cursor.next_range != ranges_end) {
+                cursor.next_cell = cursor.next_range->first;
+            }
+            continue;
+        }
+        if(pos.col < range.last.col) {
+            cursor.next_cell = {pos.row, pos.col + 1};
+        } else if(pos.row < range.last.row) {
+            cursor.next_cell = {pos.row + 1, range.first.col};
+        } else if(++cursor.next_range != ranges_end) {
+            cursor.next_cell = cursor.next_range->first;
+        }
+        if(const auto precedent = uncached_formula(pos)) {
+            return precedent;
         }
     }
+    return nullptr;
+}
 
-    /// Нужно ли проходить все дерево по dfs для добавления/удаления DependentCells?
-    //DFS version
-    // //Ничего не делать, если в ячейке не формула
-    // if(!HasFormula()) {
-    //     return;
-    // }
+void Cell::FormulaData::EvaluateAndStore() const {
+    evaluations.fetch_add(1, std::memory_order_relaxed);
+    const auto result = formula->Evaluate(sheet);
+    const double value = std::holds_alternative<double>(result) ? std::get<double>(result)
+                                                                : std::get<FormulaError>(result).Box();
+    cache.Store(value);
+}
 
-    // auto next_cells_getter = [](const CellInterface* cell_ptr) {
-    //     return cell_ptr->GetReferencedCells();
-    // };
+bool Cell::UpdateValue() const {
+    if(!HasFormula()) {
+        return true;
+    }
+    const auto& formula_data = AsFormula();
+    const auto old_value = formula_data.cache.Load();
+    formula_data.cache.Reset();
+    return !old_value || !IsSameOperand(*old_value, formula_data.GetBoxedValue());
+}
 
-    // auto function_on_cells = [&](const CellInterface* cell_ptr) {
-    //     cell_ptr->AddDependentCells(pos_in_sheet_);
-    // };
+bool Cell::StoreComputedValue(double value) const {
+    const auto& formula_data = AsFormula();
+    if(formula_data.cache.Load()) {
+        return false;
+    }
+    formula_data.evaluations.fetch_add(1, std::memory_order_relaxed);
+    formula_data.cache.Store(value);
+    return true;
+}
+
+bool Cell::IsSameOperand(double lhs, double rhs) {
+    return std::memcmp(&lhs, &rhs, sizeof(double)) == 0;
+}
 
-    // PerformDFS(pos_in_sheet_, next_cells_getter, function_on_cells);
+//==== Variant check/access =====
+bool Cell::IsEmpty() const {
+    return std::holds_alternative<std::monostate>(data_variant_);
+}
+bool Cell::HasFormula() const {
+    return std::holds_alternative<FormulaDataPtr>(data_variant_);
+}
+bool Cell::NeedsEvaluation() const {
+    return HasFormula() && !AsFormula().cache.Load();
 }
 
-//При изменении ячейки, удалить ее (и ее зависимости) из зависимостей своих предыдущих RefCells
-void Cell::RemoveCellFromDependents() {
-    //Non-dfs version
-    for(auto& ref_cell_pos : GetReferencedCells()) {
-        if(auto ref_cell_ptr = sheet_.GetCell(ref_cell_pos)) {
-            ref_cell_ptr->RemoveDependentCells(pos_in_sheet_);
+Cell::CellData Cell::MakeData(std::string text, Position pos, const SheetInterface& sheet, FormulaCache& formulas,
+                               EvaluationCounter& evaluations, const std::string* formula_key) {
+    //1.Empty
+    if(text.empty()) {
+        return std::monostate();
+    }
+
+    //2.Formula
+    if(IsFormulaText(text)) {
+        //remove leading '=' when parsing formula string, in place: no copy of the text
+        text.erase(0, 1);
+        auto new_formula_obj = formula_key ? formulas.Parse(std::move(text), pos, *formula_key)
+                                           : formulas.Parse(std::move(text), pos);
+
+        if(!new_formula_obj) {
+            throw std::runtime_error("Invalid formula object returned by FormulaCache::Parse() in Cell::MakeData");
         }
+
+        return MakeFormulaData(std::move(new_formula_obj), sheet, evaluations);
     }
 
-    // auto next_cells_getter = [](const CellInterface* cell_ptr) {
-    //     return cell_ptr->GetReferencedCells();
-    // };
+    //3.Text or number
+    return ParseTextData(std::move(text), formulas.Resource());
+}
 
-    // auto function_on_cells = [&](const CellInterface* cell_ptr) {
-    //     cell_ptr->RemoveDependentCells(pos_in_sheet_);
-    // };
+bool Cell::IsFormulaText(std::string_view text) {
+    return text.size() > 1 && text[0] == FORMULA_SIGN;
+}
 
-    // PerformDFS(pos_in_sheet_, next_cells_getter, function_on_cells);
+Cell::CellData Cell::MakeFormulaData(FormulaPtr formula, const SheetInterface& sheet, EvaluationCounter& evaluations) {
+    //FormulaData is not movable (atomic cache): constructed in place, in the arena of the formula
+    std::pmr::memory_resource* resource = formula.get_deleter().resource;
+    return MakeArenaSelfUnique<FormulaData>(resource, std::move(formula), sheet, evaluations);
 }
 
-//При изменении ячейки, сбросить кеш всех зависимых ячеек
-void Cell::InvalidateDependentCellsCaches() {
-    auto next_cells_getter = [](const CellInterface* cell_ptr) {
-        return cell_ptr->GetDependentCells();
-    };
+Cell::CellData Cell::MakeTextData(std::string_view text, std::pmr::memory_resource* resource) {
+    return MakeArenaSelfUnique<Text>(resource, text, resource);
+}
 
-    auto function_on_cells = [](const CellInterface* cell_ptr) {
-        cell_ptr->InvalidateCache();
-    };
+Cell::CellData Cell::MakeNumberTextData(double value, std::string_view text, std::pmr::memory_resource* resource) {
+    return MakeArenaSelfUnique<NumberText>(resource, NumberText{value, Text(text, resource)});
+}
 
-    PerformDFS(pos_in_sheet_, next_cells_getter, function_on_cells);
+std::optional<double> Cell::TryMakeNumberData(const std::string& text) {
+    if(auto dbl_opt = StrToDouble(text); dbl_opt && FormatNumber(*dbl_opt) == text) {
+        return dbl_opt;
+    }
+    return std::nullopt;
 }
 
-//==== Variant check/access =====
-//TODO: Public or Private?
-bool Cell::IsEmpty() const {
-    return std::holds_alternative<std::monostate>(data_variant_);
+const Cell::CellData& Cell::GetData() const {
+    return data_variant_;
 }
-bool Cell::HasDouble() const {
-    //return std::holds_alternative<double>(data_variant_);
-    return cache_.has_value();
+
+void Cell::SetData(CellData data) {
+    std::swap(data_variant_, data);
 }
-bool Cell::HasString() const {
-    return std::holds_alternative<std::string>(data_variant_);
+
+Cell::CellData Cell::ParseTextData(std::string text, std::pmr::memory_resource* resource) {
+    //Double as text -> keep string input only if needed to preserve format for GetText
+    //(otherwise changes to 1.00000 etc)
+    if(auto dbl_opt = StrToDouble(text)) {
+        if(FormatNumber(*dbl_opt) == text) {
+            return *dbl_opt;
+        }
+        return MakeNumberTextData(*dbl_opt, text, resource);
+    }
+    return MakeTextData(text, resource);
 }
-bool Cell::HasFormula() const {
-    return std::holds_alternative<FormulaPtr>(data_variant_);
-}
-
-// double Cell::AsDouble() const {
-//     if(HasDouble()) {
-//         //return std::get<double>(data_variant_);
-//         return cache_.value();
-//     } else if (HasFormula()) {
-//         auto formula_result = AsFormula()->Evaluate(sheet_);
-//         if(std::holds_alternative<double>(formula_result)) {
-//             cache_ = std::get<double>(formula_result);
-//             return cache_.value();
-//         } else {
-//             throw std::get<FormulaError>(formula_result);
-//         }
-//     } else {
-//         throw std::runtime_error("Bad Double access attempt: does not hold and is not convertible to Double");
-//     }
-// }
-
-std::string Cell::AsString() const {
-    if(!HasString()) {
-        throw std::runtime_error("Bad String-variant access attempt: does not hold str");
-    }
-    return std::get<std::string>(data_variant_);
-}
-const Cell::FormulaPtr& Cell::AsFormula() const {
+
+const Cell::FormulaData& Cell::AsFormula() const {
     if(!HasFormula()) {
         throw std::runtime_error("Bad Formula-variant access attempt: does not hold formula");
     }
-    return std::get<FormulaPtr>(data_variant_);
+    return *std::get<FormulaDataPtr>(data_variant_);
 }
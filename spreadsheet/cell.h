@@ -1,150 +1,231 @@
 #pragma once
 
+#include "arena.h"
 #include "common.h"
 #include "formula.h"
 
-#include <unordered_set>
-#include <stack>
-
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+
+//Компактная ячейка: vptr + variant из 16 байт, т.е. не более 24 байт для числовых и текстовых ячеек.
+//Позиция и зависимые ячейки хранятся в Sheet, ссылка на лист - только в данных формулы.
 class Cell : public CellInterface {
 public:
-    Cell(SheetInterface& sheet);
+    Cell() = default;
     ~Cell();
 
-    //Position передается для алгоритма DFS, которому нужна позиция стартовой ячейки
-    void Set(Position sheet_pos, std::string text);
+    //Счетчик вычислений формул (промахов кеша), общий для ячеек листа
+    using EvaluationCounter = std::atomic<uint64_t>;
+
+    //Задает содержимое ячейки. Для формулы до изменения ячейки вызывается check_refs(formula),
+    //который бросает исключение при циклической зависимости - тогда ячейка не изменяется.
+    //pos - позиция ячейки, formulas - кеш общих формул листа, evaluations - счетчик вычислений листа
+    template <typename RefsChecker>
+    void Set(std::string text, Position pos, const SheetInterface& sheet, FormulaCache& formulas,
+             EvaluationCounter& evaluations, RefsChecker check_refs);
     void Clear();
 
     bool IsEmpty() const;
+    bool HasFormula() const;
+    //Формула, значения которой нет в кеше
+    bool NeedsEvaluation() const;
 
     Value GetValue() const override;
+    double GetOperandValue() const override;
     std::string GetText() const override;
 
-    std::vector<Position> GetReferencedCells() const override;
-    void InvalidateCache() const override;
+    //Выгрузка листа (Sheet::PrintValues/PrintTexts): текст или значение ячейки дописываются к out
+    //без промежуточных строк. Число значения записывает write_number(out, number)
+    void AppendText(std::string& out) const;
+    template <typename NumberWriter>
+    void AppendValue(std::string& out, NumberWriter&& write_number) const;
 
-    //=== Dependent cells interface ====
-    //uses const & mutable to work via const CellInterface*
-    std::vector<Position> GetDependentCells() const override;
-    void AddDependentCells(Position pos) const override;
-    void RemoveDependentCells(Position pos) const override;
+    //Значение ячейки в диапазоне аргумента функции (SUM(A1:B5)): число или упакованная ошибка формулы,
+    //nullopt для пустой и текстовой ячейки - такие ячейки функции пропускают
+    std::optional<double> GetRangeValue() const;
 
-    //Псевдонимы типов используемых в реализации cell
-    using FormulaPtr = std::unique_ptr<FormulaInterface>;
+    //Формула ячейки или nullptr
+    const FormulaInterface* GetFormula() const;
 
-    ///Можно было бы использовать еще double в variant, но тогда для вывод "числовых" ячеек через GetText()
-    /// должен быть задан формат (иначе напр. заданная как 1.0 ячейка будет выведена как 1.00000)
-    /// из-за преобразования to_string(double). Вместо этого "числовые" ячейки используют Кеш для хранения своего
-    /// числового значения (вычисляется сразу в Cell::Set и не инвалидируется)
-    using CellData = std::variant<std::monostate,/*double?*/ std::string, FormulaPtr>;
+    std::vector<Position> GetReferencedCells() const override;
+    void InvalidateCache() const override;
 
-private:
-    //Внутрення реализация функционала ячейки
-    CellData data_variant_;
+    //Сбрасывает кеш формулы. Возвращает false, если кеша уже не было (ячейка уже "грязная"):
+    //значение без кеша никто не читал, поэтому и у всех зависимых ячеек кеша тоже нет
+    bool ResetCache() const;
 
-    //Кэш для формульной/текстовой ячейки
-    mutable std::optional<double> cache_;
+    //Вычисляет формулу заново. Возвращает false, если значение ячейки как операнда
+    //(GetOperandValue) не изменилось - тогда зависимые ячейки можно не пересчитывать
+    bool UpdateValue() const;
 
-    //Контейнер ячеек, значение которых зависит от этой ячейки -> инвалидация кеша при изменении
-    mutable std::unordered_set<Position, PositionHash> dependent_cells_;
+    //Сохраняет в кеш формулы значение (ошибка упакована), вычисленное вне ячейки - для блока формул
+    //одной формы, вычисляемого по столбцу (Sheet). Считается вычислением формулы.
+    //false - кеш уже есть, значение не сохранено
+    bool StoreComputedValue(double value) const;
 
-    //Позиция ячейки в таблице
-    Position pos_in_sheet_;
+    //Псевдонимы типов используемых в реализации cell
+    using FormulaPtr = FormulaCache::FormulaPtr;
+    //Текст ячейки в арене листа
+    using Text = std::pmr::string;
+
+    //Числовая ячейка, текст которой отличается от канонической записи числа (напр. "1.0"),
+    //хранит исходный текст для GetText()
+    struct NumberText {
+        double value;
+        Text text;
+
+        Text::allocator_type get_allocator() const {
+            return text.get_allocator();
+        }
+    };
 
-    //Ссылка на Sheet для обработки зависимостей от других ячеек
-    SheetInterface& sheet_;
+    //Кэш значения формулы, публикуется атомарно: ячейки одного уровня графа
+    //вычисляются параллельно и читают кэш общих влияющих ячеек.
+    //Хранит и числа, и ошибки (упакованные в NaN, см. FormulaError::Box): значение формулы -
+    //конечное число или упакованная ошибка, поэтому пустой кэш кодируется битами другого NaN
+    class ValueCache {
+    public:
+        std::optional<double> Load() const {
+            const uint64_t bits = bits_.load(std::memory_order_acquire);
+            if(bits == EMPTY) {
+                return std::nullopt;
+            }
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
 
-    //Пройти по графу ячеек, применяя к каждой функцию SetterFunc только один раз
-    //Для получения "исходящих ребер" графа для ячейки используется GetterFunc
-    //Прекратит обход и вернет true при обнаружении цикла
-    //Если передан указатель на объект формулы стартовой ячейки,
-    //то при начале обхода будет использовать он, а не GetterFunc
-    template <typename GetterFunc, typename SetterFunc>
-    bool PerformDFS(Position start_cell, GetterFunc get_next_cells, SetterFunc perform_func_on_cell,
-                     const std::vector<Position>* start_cell_refs = nullptr);
+        void Store(double value) const {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            bits_.store(bits, std::memory_order_release);
+        }
 
-    //Проверить формулу на циклическую зависимость
-    bool CheckFormulaForCycle(const std::vector<Position>* start_cell_refs);
+        //Возвращает true, если в кеше было значение
+        bool Reset() const {
+            //Пустой кеш только читается: повторный сброс не пишет в чужие строки кеша
+            if(bits_.load(std::memory_order_relaxed) == EMPTY) {
+                return false;
+            }
+            return bits_.exchange(EMPTY, std::memory_order_acq_rel) != EMPTY;
+        }
 
-    //Добавить эту ячейку в списки зависимых ячеек всем новым referenced cells
-    void AddAsDependentToRefCells();
+    private:
+        static constexpr uint64_t EMPTY = ~uint64_t{0};
+        mutable std::atomic<uint64_t> bits_{EMPTY};
+    };
 
-    //При изменении ячейки, удалит ее из зависимостей своих предыдущих RefCells
-    void RemoveCellFromDependents();
+    //Данные формульной ячейки вынесены из ячейки, чтобы не увеличивать размер остальных ячеек
+    struct FormulaData {
+        FormulaData(FormulaPtr formula, const SheetInterface& sheet, EvaluationCounter& evaluations)
+            : formula(std::move(formula))
+            , sheet(sheet)
+            , evaluations(evaluations) {
+        }
 
-    //При изменении ячейки, сбросить кэш зависимых ячеек
-    void InvalidateDependentCellsCaches();
+        FormulaPtr formula;
+        const SheetInterface& sheet;
+        EvaluationCounter& evaluations;
 
-    //Функции проверки доступа различных значений
-    bool HasDouble() const;
-    bool HasString() const;
-    bool HasFormula() const;
+        //Кэш значения формулы (или ошибки)
+        ValueCache cache;
 
-    std::string AsString() const;
-    const FormulaPtr& AsFormula() const;
-};
+        //Значение из кеша или вычисленное и сохраненное в кеш; ошибка упакована в double
+        double GetBoxedValue() const;
 
-template <typename GetterFunc, typename SetterFunc>
-bool Cell::PerformDFS(Position start_cell, GetterFunc get_next_cells, SetterFunc perform_func_on_cell,
-                 const std::vector<Position>* start_cell_refs) {
-    CellColorMap cell_colors;
-    std::stack<Position> cell_stack;
+        //Следующая проверяемая ссылка формулы: сначала отдельные ячейки, затем ячейки диапазонов
+        struct PrecedentCursor {
+            const Position* next_ref = nullptr;
+            const Range* next_range = nullptr;
+            Position next_cell;
+        };
+        PrecedentCursor BeginPrecedents() const;
 
-    //Lambda for checking cell color in the map
-    auto is_white_vertex = [&cell_colors](const Position& pos) {
-        return cell_colors.count(pos) == 0 || cell_colors.at(pos) == VertexColor::white;
+        //Первая формула без кеша среди ссылок, начиная с cursor; cursor сдвигается за нее
+        const FormulaData* FindUncachedPrecedent(PrecedentCursor& cursor) const;
+        //Вычисляет формулу, ссылки которой уже в кеше, и сохраняет значение в кеш
+        void EvaluateAndStore() const;
+
+        //Данные размещены в той же арене, что и формула
+        std::pmr::polymorphic_allocator<std::byte> get_allocator() const {
+            return formula.get_deleter().resource;
+        }
     };
 
-    cell_stack.push(start_cell);
+    //Значения операнда равны побитово: одинаковые числа (0 и -0 различаются) или одинаковые ошибки
+    static bool IsSameOperand(double lhs, double rhs);
+
+    ///Число с канонической записью (GetText() восстанавливается из double) хранится прямо в ячейке,
+    /// остальное содержимое - вне ячейки, в арене листа, по указателю в 8 байт (удалитель без состояния)
+    using TextPtr = ArenaSelfPtr<Text>;
+    using NumberTextPtr = ArenaSelfPtr<NumberText>;
+    using FormulaDataPtr = ArenaSelfPtr<FormulaData>;
+    using CellData = std::variant<std::monostate, double, TextPtr, NumberTextPtr, FormulaDataPtr>;
+
+    //Разбирает текст в данные ячейки, не изменяя ни одной ячейки (FormulaException при ошибке в формуле).
+    //Пакетное изменение листа сначала готовит данные всех ячеек, потом применяет их через SetData.
+    //formula_key - относительная запись формулы, если она уже получена (FormulaCache::MakeKey).
+    //Данные размещаются в арене formulas.Resource(), поэтому готовятся в потоке, изменяющем лист;
+    //в других потоках - только TryMakeNumberData
+    static CellData MakeData(std::string text, Position pos, const SheetInterface& sheet, FormulaCache& formulas,
+                             EvaluationCounter& evaluations, const std::string* formula_key = nullptr);
+    //Число с канонической записью, которое хранится прямо в ячейке, без арены. Потокобезопасно
+    static std::optional<double> TryMakeNumberData(const std::string& text);
+    //Текст ячейки задает формулу
+    static bool IsFormulaText(std::string_view text);
+    //Данные ячейки с уже разобранной формулой, в арене формулы
+    static CellData MakeFormulaData(FormulaPtr formula, const SheetInterface& sheet, EvaluationCounter& evaluations);
+    //Данные текстовой (не формульной) ячейки из снимка, в арене resource
+    static CellData MakeTextData(std::string_view text, std::pmr::memory_resource* resource);
+    static CellData MakeNumberTextData(double value, std::string_view text, std::pmr::memory_resource* resource);
+    //Данные ячейки как есть: снимок листа пишет их без текста
+    const CellData& GetData() const;
+    void SetData(CellData data);
 
-    //Начать DFS
-    while(!cell_stack.empty()) {
-        Position vertex = cell_stack.top();
-        cell_stack.pop();
+private:
+    //Внутрення реализация функционала ячейки
+    CellData data_variant_;
 
-        //Skip empty cells, GetCell could be nullptr
-        auto vertex_cell_ptr = sheet_.GetCell(vertex);
-        if(!vertex_cell_ptr) {
-            continue;
-        }
+    //Разбирает текстовое (не формульное) содержимое: текст или число
+    static CellData ParseTextData(std::string text, std::pmr::memory_resource* resource);
 
-        if(is_white_vertex(vertex)) {
-            cell_colors[vertex] = VertexColor::grey;
+    const FormulaData& AsFormula() const;
+};
 
-            perform_func_on_cell(vertex_cell_ptr);
+template <typename RefsChecker>
+void Cell::Set(std::string text, Position pos, const SheetInterface& sheet, FormulaCache& formulas,
+               EvaluationCounter& evaluations, RefsChecker check_refs) {
+    CellData new_data = MakeData(std::move(text), pos, sheet, formulas, evaluations);
 
-            //положить серую вершину в стэк для нахождения обратного пути
-            cell_stack.push(vertex);
-        }
+    //throws on cycle, cell is not changed
+    if(const auto formula_data = std::get_if<FormulaDataPtr>(&new_data)) {
+        check_refs(*(*formula_data)->formula);
+    }
 
-        //Для первой вершины при поиске цикла, ее содержание в sheet_ еще не было изменено,
-        //Поэтому нужно взять RefCells напрямую из объекта формулы
-        const auto& incident_vertices = (vertex == start_cell && start_cell_refs)
-                                      ? *start_cell_refs
-                                      : get_next_cells(vertex_cell_ptr);
-
-        //для каждого исходящего ребра (v,w):
-        for(const Position& next_cell : incident_vertices) {
-            if(is_white_vertex(next_cell)) {
-                cell_stack.push(next_cell);
-                auto next_cell_ptr = sheet_.GetCell(next_cell);
-
-                //Add empty cell in case it doesn't exist in sheet
-                if(!next_cell_ptr) {
-                    sheet_.SetCell(next_cell, "");
-                }
-                perform_func_on_cell(next_cell_ptr);
-            }
-            //серая вершина попадается в стеке только на обратном пути
-            else if (cell_colors[next_cell] == VertexColor::grey) {
-                cell_colors[next_cell] = VertexColor::black;
-            }
-            //Черная вершина -> найден цикл!
-            else if (cell_colors[next_cell] == VertexColor::black) {
-                return true;
-            }
-        }
+    //New cell data was processed without exceptions, swap
+    std::swap(data_variant_, new_data);
+}
+
+template <typename NumberWriter>
+void Cell::AppendValue(std::string& out, NumberWriter&& write_number) const {
+    if(const auto text = std::get_if<TextPtr>(&data_variant_)) {
+        const Text& str = **text;
+        out.append(str.data() + (str[0] == ESCAPE_SIGN ? 1 : 0), str.data() + str.size());
+        return;
+    }
+    //not a text: the operand value is the value, an error is boxed
+    const double value = GetOperandValue();
+    if(FormulaError::IsBoxed(value)) {
+        out += FormulaError::Unbox(value).ToString();
+    } else {
+        write_number(out, value);
     }
-    //Нет цикла
-    return false;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <iosfwd>
 #include <memory>
 #include <optional>
@@ -36,14 +38,6 @@ struct PositionHash {
 
 using CellsPosSet = std::unordered_set<Position, PositionHash>;
 
-enum class VertexColor {
-    white,
-    grey,
-    black,
-};
-
-using CellColorMap = std::unordered_map<Position, VertexColor, PositionHash>;
-
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -51,6 +45,24 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек A1:B5 (включительно): first - левый верхний угол, last - правый нижний.
+// FromCorners упорядочивает углы, поэтому B5:A1 и A1:B5 - один диапазон.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    // Число ячеек диапазона
+    size_t CellCount() const;
+    std::string ToString() const;
+
+    static Range FromCorners(Position lhs, Position rhs);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -68,14 +80,44 @@ public:
 
     std::string_view ToString() const;
 
+    // Ошибка, упакованная в double (NaN-boxing): "тихий" NaN с категорией в младших битах.
+    // При вычислении формулы ошибки передаются как обычные числа, без исключений;
+    // упакованная ошибка не совпадает ни с одним NaN, который дает арифметика.
+    double Box() const;
+    static bool IsBoxed(double value);
+    // value - упакованная ошибка
+    static FormulaError Unbox(double value);
+
     static inline std::string ARITHM_ERR_MSG = "#ARITHM!";
     static inline std::string REF_ERR_MSG = "#REF!";
     static inline std::string VALUE_ERR_MSG = "#VALUE!";
 
 private:
     Category category_;
+
+    static constexpr uint64_t BOX_BITS = 0x7FFC'E000'0000'0000;
+    static constexpr uint64_t BOX_CATEGORY_MASK = 0xFF;
 };
 
+inline double FormulaError::Box() const {
+    const uint64_t bits = BOX_BITS | static_cast<uint64_t>(category_);
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline bool FormulaError::IsBoxed(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return (bits & ~BOX_CATEGORY_MASK) == BOX_BITS;
+}
+
+inline FormulaError FormulaError::Unbox(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return static_cast<Category>(bits & BOX_CATEGORY_MASK);
+}
+
 std::ostream& operator<<(std::ostream& output, FormulaError fe);
 
 // Исключение, выбрасываемое при попытке передать в метод некорректную позицию
@@ -121,13 +163,13 @@ public:
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
 
+    // Значение ячейки как операнда формулы: число, 0 для пустой ячейки,
+    // иначе упакованная ошибка (FormulaError::Box) - #VALUE! для текста или ошибка формулы.
+    // В отличие от GetValue() не копирует текст ячейки
+    virtual double GetOperandValue() const = 0;
+
     //Сброс кэша ячейки (cache_ is mutable)
     virtual void InvalidateCache() const = 0;
-
-    //Доступ и изменение зависимых ячеек (dep_cells is mutable)
-    virtual std::vector<Position> GetDependentCells() const = 0;
-    virtual void AddDependentCells(Position pos) const = 0;
-    virtual void RemoveDependentCells(Position pos) const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -174,6 +216,25 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Дописывает в values значения ячеек диапазона для агрегатных функций (SUM(A1:B5) и т.п.),
+    // построчно: числа и ошибки формул (упакованные в NaN, см. FormulaError::Box).
+    // Пустые и текстовые ячейки пропускаются
+    virtual void GetRangeValues(Range range, std::vector<double>& values) const = 0;
+
+    // Сумма и число значений диапазона (тех же, что дописывает GetRangeValues) для SUM, COUNT и AVERAGE
+    struct RangeTotals {
+        double sum = 0;
+        size_t count = 0;
+    };
+    // Итоги диапазона без сбора значений, если таблица их хранит; nullopt - в диапазоне есть ошибки
+    // или итогов нет, тогда значения собираются GetRangeValues
+    virtual std::optional<RangeTotals> GetRangeTotals(Range range) const = 0;
+
+    // Первая позиция диапазона не раньше from (построчно), где есть ячейка, или Position::NONE.
+    // Позиции без ячеек пропускаются без обращения к каждой: обход разреженного диапазона
+    // стоит по числу его ячеек, а не по площади
+    virtual Position FindNextCell(Range range, Position from) const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -0,0 +1,30 @@
+#include "crc32.h"
+
+#include <array>
+
+namespace {
+//Таблица на байт
+const std::array<uint32_t, 256>& CrcTable() {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> result{};
+        for(uint32_t idx = 0; idx < 256; ++idx) {
+            uint32_t crc = idx;
+            for(int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+            }
+            result[idx] = crc;
+        }
+        return result;
+    }();
+    return table;
+}
+}//namespace
+
+uint32_t Crc32(const char* data, size_t size, uint32_t crc) {
+    const auto& table = CrcTable();
+    crc = ~crc;
+    for(size_t idx = 0; idx < size; ++idx) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[idx])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//CRC32 (IEEE 802.3) данных журнала и снимка. crc - результат для предыдущих данных:
+//Crc32(b, Crc32(a)) - то же, что CRC32 данных a и b подряд
+uint32_t Crc32(const char* data, size_t size, uint32_t crc = 0);
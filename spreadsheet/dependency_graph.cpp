@@ -0,0 +1,822 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+namespace {
+//Уплотнять массив ребер, только если в нем накопилось достаточно мусора
+constexpr size_t MIN_GARBAGE_TO_COMPACT = 1024;
+constexpr uint32_t MIN_SPAN_CAPACITY = 2;
+}//namespace
+
+//==== AdjacencyArrays ====
+AdjacencyArrays::Neighbours AdjacencyArrays::Get(NodeId node) const {
+    if(node >= spans_.size()) {
+        return {};
+    }
+    const Span& span = spans_[node];
+    const NodeId* first = edges_.data() + span.offset;
+    return {first, first + span.size};
+}
+
+void AdjacencyArrays::Add(NodeId node, NodeId neighbour) {
+    if(spans_.size() <= node) {
+        spans_.resize(node + 1);
+    }
+    if(spans_[node].size == spans_[node].capacity) {
+        Grow(node);
+    }
+
+    Span& span = spans_[node];
+    edges_[span.offset + span.size] = neighbour;
+    ++span.size;
+    ++edge_count_;
+}
+
+void AdjacencyArrays::Remove(NodeId node, NodeId neighbour) {
+    if(node >= spans_.size()) {
+        return;
+    }
+    Span& span = spans_[node];
+    const auto first = edges_.begin() + span.offset;
+    const auto last = first + span.size;
+
+    //order of neighbours is not kept: swap with the last one
+    auto it = std::find(first, last, neighbour);
+    if(it != last) {
+        *it = *(last - 1);
+        --span.size;
+        --edge_count_;
+    }
+}
+
+void AdjacencyArrays::Clear(NodeId node) {
+    if(node >= spans_.size()) {
+        return;
+    }
+    Span& span = spans_[node];
+    edge_count_ -= span.size;
+    garbage_ += span.capacity;
+    span = {};
+}
+
+size_t AdjacencyArrays::EdgeCount() const {
+    return edge_count_;
+}
+
+size_t AdjacencyArrays::MemoryUsage() const {
+    return spans_.capacity() * sizeof(Span) + edges_.capacity() * sizeof(NodeId);
+}
+
+void AdjacencyArrays::Save(SnapshotWriter& out) const {
+    out.WriteArray(spans_);
+    out.WriteArray(edges_);
+}
+
+void AdjacencyArrays::Load(SnapshotReader& in, size_t node_limit) {
+    in.ReadArray(spans_);
+    in.ReadArray(edges_);
+    if(spans_.size() > node_limit) {
+        throw SnapshotException("Adjacency arrays in snapshot are corrupted");
+    }
+    edge_count_ = 0;
+    size_t used = 0;
+    for(const Span& span : spans_) {
+        const bool is_valid = span.size <= span.capacity
+                              && uint64_t{span.offset} + span.capacity <= edges_.size()
+                              && std::all_of(edges_.begin() + span.offset, edges_.begin() + span.offset + span.size,
+                                             [node_limit](NodeId neighbour) {
+                                                 return neighbour != 0 && neighbour < node_limit;
+                                             });
+        if(!is_valid) {
+            throw SnapshotException("Adjacency arrays in snapshot are corrupted");
+        }
+        edge_count_ += span.size;
+        used += span.capacity;
+    }
+    garbage_ = edges_.size() > used ? edges_.size() - used : 0;
+}
+
+void AdjacencyArrays::Grow(NodeId node) {
+    Span& span = spans_[node];
+    const uint32_t new_capacity = std::max(MIN_SPAN_CAPACITY, span.capacity * 2);
+
+    //1.Span is the last one in the array -> extend it in place
+    if(span.capacity > 0 && span.offset + span.capacity == edges_.size()) {
+        edges_.resize(span.offset + new_capacity);
+        span.capacity = new_capacity;
+        return;
+    }
+
+    //2.Otherwise move it to the end, old place becomes garbage
+    const uint32_t new_offset = static_cast<uint32_t>(edges_.size());
+    edges_.resize(edges_.size() + new_capacity);
+    std::copy_n(edges_.begin() + span.offset, span.size, edges_.begin() + new_offset);
+    garbage_ += span.capacity;
+    span.offset = new_offset;
+    span.capacity = new_capacity;
+
+    if(garbage_ >= MIN_GARBAGE_TO_COMPACT && garbage_ * 2 > edges_.size()) {
+        Compact();
+    }
+}
+
+void AdjacencyArrays::Compact() {
+    std::vector<NodeId> compacted;
+    compacted.reserve(edges_.size() - garbage_);
+
+    for(Span& span : spans_) {
+        const uint32_t new_offset = static_cast<uint32_t>(compacted.size());
+        compacted.insert(compacted.end(), edges_.begin() + span.offset,
+                         edges_.begin() + span.offset + span.capacity);
+        span.offset = span.capacity > 0 ? new_offset : 0;
+    }
+
+    edges_ = std::move(compacted);
+    garbage_ = 0;
+}
+
+//==== DependencyGraph ====
+DependencyGraph::NodeId DependencyGraph::FindNode(Position pos) const {
+    auto slot = node_index_.Find(pos);
+    return slot ? *slot : NONE;
+}
+
+Position DependencyGraph::GetPosition(NodeId node) const {
+    return node_positions_[node];
+}
+
+void DependencyGraph::SetPrecedents(Position pos, const std::vector<Position>& refs, const std::vector<Range>& ranges) {
+    NodeId node = FindNode(pos);
+    if(node == NONE && refs.empty() && ranges.empty()) {
+        return;
+    }
+    const bool refs_itself = std::binary_search(refs.begin(), refs.end(), pos)
+                             || std::any_of(ranges.begin(), ranges.end(), [pos](const Range& range) {
+                                    return range.Contains(pos);
+                                });
+    if(refs_itself) {
+        throw CircularDependencyException("Formula references its own cell");
+    }
+    if(node == NONE) {
+        node = GetOrAddNode(pos, false);
+    }
+
+    //1.Remove old edges (ref -> node); removing edges keeps the order valid
+    const auto old_refs = precedents_.Get(node);
+    const std::vector<NodeId> old_ref_nodes(old_refs.begin(), old_refs.end());
+    for(NodeId ref_node : old_ref_nodes) {
+        RemoveEdge(ref_node, node);
+    }
+
+    //2.Add new direct edges (cells, then ranges), on cycle roll back to the old ones
+    std::vector<NodeId> new_ref_nodes;
+    new_ref_nodes.reserve(refs.size() + ranges.size());
+    for(size_t idx = 0; idx < refs.size() + ranges.size(); ++idx) {
+        const NodeId ref_node = idx < refs.size() ? GetOrAddNode(refs[idx], true)
+                                                  : GetOrAddRangeNode(ranges[idx - refs.size()]);
+        if(!AddEdge(ref_node, node)) {
+            for(NodeId added_node : new_ref_nodes) {
+                RemoveEdge(added_node, node);
+            }
+            //old graph was acyclic, restoring its edges cannot fail
+            for(NodeId old_node : old_ref_nodes) {
+                AddEdge(old_node, node);
+            }
+
+            ReleaseIfIsolated(ref_node);
+            for(NodeId added_node : new_ref_nodes) {
+                ReleaseIfIsolated(added_node);
+            }
+            ReleaseIfIsolated(node);
+            throw CircularDependencyException("Circular dependency when adding new formula to cell");
+        }
+        new_ref_nodes.push_back(ref_node);
+    }
+
+    //3.Release refs that became isolated
+    for(NodeId ref_node : old_ref_nodes) {
+        ReleaseIfIsolated(ref_node);
+    }
+    ReleaseIfIsolated(node);
+}
+
+void DependencyGraph::SetPrecedents(const std::vector<CellRefs>& cells_refs) {
+    size_t new_edge_count = 0;
+    for(const auto& [pos, refs, ranges] : cells_refs) {
+        const bool refs_itself = std::binary_search(refs.begin(), refs.end(), pos)
+                                 || std::any_of(ranges.begin(), ranges.end(), [pos = pos](const Range& range) {
+                                        return range.Contains(pos);
+                                    });
+        if(refs_itself) {
+            throw CircularDependencyException("Formula references its own cell");
+        }
+        new_edge_count += refs.size() + ranges.size();
+    }
+
+    //1.Small batch: drop old refs of all cells, then add new ones with incremental check per cell.
+    //Intermediate graphs are subgraphs of the final one, so a cycle is found only if the final graph has it.
+    //Restoring old refs adds edges of the old acyclic graph and cannot fail
+    if(new_edge_count < EdgeCount()) {
+        std::vector<CellRefs> old_refs;
+        old_refs.reserve(cells_refs.size());
+        for(const auto& cell_refs : cells_refs) {
+            old_refs.push_back({cell_refs.pos, GetPrecedents(cell_refs.pos), GetPrecedentRanges(cell_refs.pos)});
+            SetPrecedents(cell_refs.pos, {});
+        }
+        for(size_t idx = 0; idx < cells_refs.size(); ++idx) {
+            try {
+                SetPrecedents(cells_refs[idx].pos, cells_refs[idx].refs, cells_refs[idx].ranges);
+            } catch(const CircularDependencyException&) {
+                for(size_t done = 0; done < idx; ++done) {
+                    SetPrecedents(cells_refs[done].pos, {});
+                }
+                for(const auto& [pos, refs, ranges] : old_refs) {
+                    SetPrecedents(pos, refs, ranges);
+                }
+                throw;
+            }
+        }
+        return;
+    }
+
+    //2.Large batch: rewire all cells, then one topological sort of the whole graph
+    std::vector<NodeId> nodes(cells_refs.size(), NONE);
+    std::vector<std::vector<NodeId>> old_ref_nodes(cells_refs.size());
+    std::vector<NodeId> new_ref_nodes;
+    for(size_t idx = 0; idx < cells_refs.size(); ++idx) {
+        const auto& [pos, refs, ranges] = cells_refs[idx];
+        NodeId node = FindNode(pos);
+        if(node == NONE && refs.empty() && ranges.empty()) {
+            continue;
+        }
+        if(node == NONE) {
+            node = GetOrAddNode(pos, false);
+        }
+        nodes[idx] = node;
+
+        const auto old_refs = precedents_.Get(node);
+        old_ref_nodes[idx].assign(old_refs.begin(), old_refs.end());
+        new_ref_nodes.clear();
+        for(const Position& ref : refs) {
+            new_ref_nodes.push_back(GetOrAddNode(ref, true));
+        }
+        //new range node is after all nodes in the order: its edges from cells keep the order valid
+        for(const Range& range : ranges) {
+            new_ref_nodes.push_back(GetOrAddRangeNode(range));
+        }
+        ReplacePrecedentsUnchecked(node, new_ref_nodes);
+    }
+
+    //3.On cycle restore old edges: order was not changed and is still valid for them
+    const bool is_acyclic = RebuildOrder();
+    std::vector<NodeId> released;
+    for(size_t idx = cells_refs.size(); idx-- > 0;) {
+        const NodeId node = nodes[idx];
+        if(node == NONE) {
+            continue;
+        }
+        const auto refs = precedents_.Get(node);
+        released.insert(released.end(), refs.begin(), refs.end());
+        if(!is_acyclic) {
+            ReplacePrecedentsUnchecked(node, old_ref_nodes[idx]);
+        }
+        released.insert(released.end(), old_ref_nodes[idx].begin(), old_ref_nodes[idx].end());
+        released.push_back(node);
+    }
+
+    //4.Release refs that became isolated
+    for(NodeId node : released) {
+        ReleaseIfIsolated(node);
+    }
+    if(!is_acyclic) {
+        throw CircularDependencyException("Circular dependency in batch of new formulas");
+    }
+}
+
+DependencyGraph::Neighbours DependencyGraph::GetPrecedents(NodeId node) const {
+    return precedents_.Get(node);
+}
+
+DependencyGraph::Neighbours DependencyGraph::GetDependents(NodeId node) const {
+    return dependents_.Get(node);
+}
+
+std::vector<Position> DependencyGraph::GetPrecedents(Position pos) const {
+    std::vector<Position> result;
+    const NodeId node = FindNode(pos);
+    if(node == NONE) {
+        return result;
+    }
+    for(NodeId precedent : precedents_.Get(node)) {
+        if(!IsRangeNode(precedent)) {
+            result.push_back(node_positions_[precedent]);
+        }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+std::vector<Range> DependencyGraph::GetPrecedentRanges(Position pos) const {
+    std::vector<Range> result;
+    const NodeId node = FindNode(pos);
+    if(node == NONE) {
+        return result;
+    }
+    for(NodeId precedent : precedents_.Get(node)) {
+        if(IsRangeNode(precedent)) {
+            result.push_back(GetRange(precedent));
+        }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+std::vector<Position> DependencyGraph::GetDependents(Position pos) const {
+    //Cell without a node can still be in ranges
+    std::vector<NodeId> dependents;
+    if(const NodeId node = FindNode(pos); node != NONE) {
+        const auto direct = dependents_.Get(node);
+        dependents.assign(direct.begin(), direct.end());
+    } else {
+        FindRangeNodes(pos, dependents);
+    }
+
+    std::vector<Position> result;
+    for(NodeId dependent : dependents) {
+        if(!IsRangeNode(dependent)) {
+            result.push_back(node_positions_[dependent]);
+            continue;
+        }
+        for(NodeId range_dependent : dependents_.Get(dependent)) {
+            result.push_back(node_positions_[range_dependent]);
+        }
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+bool DependencyGraph::HasDependents(Position pos) const {
+    const NodeId node = FindNode(pos);
+    if(node == NONE) {
+        return false;
+    }
+    const auto dependents = dependents_.Get(node);
+    return std::any_of(dependents.begin(), dependents.end(), [this](NodeId dependent) {
+        return !IsRangeNode(dependent);
+    });
+}
+
+bool DependencyGraph::IsRangeNode(NodeId node) const {
+    return node_positions_[node] == RANGE_NODE_POSITION;
+}
+
+Range DependencyGraph::GetRange(NodeId node) const {
+    return node_ranges_.at(node).range;
+}
+
+DependencyGraph::NodeId DependencyGraph::FindRangeNode(Range range) const {
+    const NodeId* node = range_nodes_.Find(range);
+    return node ? *node : NONE;
+}
+
+uint32_t DependencyGraph::GetRangeSerial(NodeId node) const {
+    return node_ranges_.at(node).serial;
+}
+
+void DependencyGraph::FindRangeNodes(Position pos, std::vector<NodeId>& out) const {
+    range_nodes_.ForEachContaining(pos, [&out](const Range&, NodeId node) {
+        out.push_back(node);
+    });
+}
+
+uint32_t DependencyGraph::GetOrder(NodeId node) const {
+    return order_[node];
+}
+
+std::vector<size_t> DependencyGraph::SplitIntoLevels(std::vector<NodeId>& nodes) const {
+    levels_.resize(node_positions_.size());
+
+    //1.Level of a node is one more than the max level of its precedents from nodes
+    for(NodeId node : nodes) {
+        levels_[node] = 1;
+    }
+    uint32_t level_count = 0;
+    for(NodeId node : nodes) {
+        uint32_t level = 1;
+        auto after = [&](NodeId precedent) {
+            if(levels_[precedent] != 0) {
+                level = std::max(level, levels_[precedent] + 1);
+            }
+        };
+        for(NodeId precedent : precedents_.Get(node)) {
+            //range is not evaluated: the node goes after the cells of the range
+            if(IsRangeNode(precedent)) {
+                for(NodeId range_cell : precedents_.Get(precedent)) {
+                    after(range_cell);
+                }
+            } else {
+                after(precedent);
+            }
+        }
+        levels_[node] = level;
+        level_count = std::max(level_count, level);
+    }
+
+    //2.Counting sort by level, topological order is kept inside levels
+    std::vector<size_t> bounds(level_count + 1, 0);
+    for(NodeId node : nodes) {
+        ++bounds[levels_[node]];
+    }
+    for(size_t level = 1; level <= level_count; ++level) {
+        bounds[level] += bounds[level - 1];
+    }
+    std::vector<NodeId> sorted(nodes.size());
+    std::vector<size_t> next(bounds.begin(), bounds.end() - 1);
+    for(NodeId node : nodes) {
+        sorted[next[levels_[node] - 1]++] = node;
+        levels_[node] = 0;
+    }
+    nodes = std::move(sorted);
+    return bounds;
+}
+
+size_t DependencyGraph::NodeCount() const {
+    return node_index_.Size();
+}
+
+size_t DependencyGraph::NodeIdLimit() const {
+    return node_positions_.size();
+}
+
+size_t DependencyGraph::RangeCount() const {
+    return range_nodes_.Size();
+}
+
+size_t DependencyGraph::EdgeCount() const {
+    return precedents_.EdgeCount();
+}
+
+size_t DependencyGraph::MemoryUsage() const {
+    return node_index_.MemoryUsage()
+           + node_positions_.capacity() * sizeof(Position)
+           + free_nodes_.capacity() * sizeof(NodeId)
+           + (order_.capacity() + visit_mark_.capacity()) * sizeof(uint32_t)
+           + precedents_.MemoryUsage() + dependents_.MemoryUsage()
+           + range_nodes_.MemoryUsage()
+           + node_ranges_.size() * (sizeof(RangeNodeData) + sizeof(NodeId) + 2 * sizeof(void*));
+}
+
+namespace {
+//Вершина диапазона в снимке графа
+struct RangeNodeRecord {
+    DependencyGraph::NodeId node;
+    uint32_t serial;
+    Range range;
+};
+}//namespace
+
+void DependencyGraph::Save(SnapshotWriter& out) const {
+    out.WriteArray(node_positions_);
+    out.WriteArray(free_nodes_);
+    out.WriteArray(order_);
+    out.Write(next_low_order_);
+    out.Write(next_high_order_);
+
+    std::vector<RangeNodeRecord> range_records;
+    range_records.reserve(node_ranges_.size());
+    for(const auto& [node, data] : node_ranges_) {
+        range_records.push_back({node, data.serial, data.range});
+    }
+    std::sort(range_records.begin(), range_records.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.node < rhs.node;
+    });
+    out.WriteArray(range_records);
+    out.Write(next_range_serial_);
+    range_nodes_.Save(out);
+
+    precedents_.Save(out);
+    dependents_.Save(out);
+}
+
+void DependencyGraph::Load(SnapshotReader& in) {
+    auto check = [](bool is_valid) {
+        if(!is_valid) {
+            throw SnapshotException("Dependency graph in snapshot is corrupted");
+        }
+    };
+
+    in.ReadArray(node_positions_);
+    in.ReadArray(free_nodes_);
+    in.ReadArray(order_);
+    next_low_order_ = in.Read<uint32_t>();
+    next_high_order_ = in.Read<uint32_t>();
+    const size_t node_limit = node_positions_.size();
+    check(node_limit > 0 && order_.size() == node_limit);
+    check(std::all_of(free_nodes_.begin(), free_nodes_.end(), [&](NodeId node) {
+        return node != NONE && node < node_limit && node_positions_[node] == Position::NONE;
+    }));
+
+    std::vector<RangeNodeRecord> range_records;
+    in.ReadArray(range_records);
+    next_range_serial_ = in.Read<uint32_t>();
+    range_nodes_.Load(in);
+    check(range_records.size() == range_nodes_.Size());
+    for(const auto& [node, serial, range] : range_records) {
+        const NodeId* indexed = range_nodes_.Find(range);
+        check(node < node_limit && node_positions_[node] == RANGE_NODE_POSITION && indexed && *indexed == node);
+        node_ranges_.emplace(node, RangeNodeData{range, serial});
+    }
+    check(node_ranges_.size() == range_records.size());
+
+    precedents_.Load(in, node_limit);
+    dependents_.Load(in, node_limit);
+
+    //Позиция -> вершина строится по позициям вершин
+    for(NodeId node = 1; node < node_limit; ++node) {
+        const Position pos = node_positions_[node];
+        if(pos == Position::NONE || pos == RANGE_NODE_POSITION) {
+            continue;
+        }
+        check(pos.IsValid() && FindNode(pos) == NONE);
+        node_index_.Insert(pos, node);
+    }
+    check(node_ranges_.size() + node_index_.Size() + free_nodes_.size() + 1 == node_limit);
+    visit_mark_.assign(node_limit, 0);
+    visit_epoch_ = 0;
+}
+
+DependencyGraph::NodeId DependencyGraph::GetOrAddNode(Position pos, bool as_precedent) {
+    if(NodeId node = FindNode(pos); node != NONE) {
+        return node;
+    }
+
+    //Cell of ranges gets edges cell -> range; without precedents it can go to the start of the order
+    const bool is_in_range = range_nodes_.Contains(pos);
+    const NodeId node = AllocateNode(pos, as_precedent || is_in_range);
+    node_index_.Insert(pos, node);
+    if(is_in_range) {
+        range_nodes_.ForEachContaining(pos, [&](const Range&, NodeId range_node) {
+            AddEdge(node, range_node);
+        });
+    }
+    return node;
+}
+
+DependencyGraph::NodeId DependencyGraph::GetOrAddRangeNode(Range range) {
+    if(const NodeId* node = range_nodes_.Find(range)) {
+        return *node;
+    }
+
+    //At the end of the order: edges from the cells of the range do not change it
+    const NodeId node = AllocateNode(RANGE_NODE_POSITION, false);
+    range_nodes_.Insert(range, node);
+    node_ranges_.emplace(node, RangeNodeData{range, next_range_serial_++});
+    node_index_.ForEachInRange(range, [&](Position, NodeId cell_node) {
+        AddEdge(cell_node, node);
+    });
+    return node;
+}
+
+DependencyGraph::NodeId DependencyGraph::AllocateNode(Position pos, bool as_precedent) {
+    NodeId node;
+    if(!free_nodes_.empty()) {
+        node = free_nodes_.back();
+        free_nodes_.pop_back();
+        node_positions_[node] = pos;
+    } else {
+        node = static_cast<NodeId>(node_positions_.size());
+        node_positions_.push_back(pos);
+        order_.push_back(0);
+        visit_mark_.push_back(0);
+    }
+
+    //new node has no edges: any place in the order is valid
+    if(next_low_order_ == 0 || next_high_order_ == std::numeric_limits<uint32_t>::max()) {
+        RenumberOrder();
+    }
+    order_[node] = as_precedent ? next_low_order_-- : next_high_order_++;
+    return node;
+}
+
+void DependencyGraph::FreeNode(NodeId node) {
+    precedents_.Clear(node);
+    dependents_.Clear(node);
+    node_positions_[node] = Position::NONE;
+    free_nodes_.push_back(node);
+}
+
+//==== Pearce-Kelly: инкрементальный топологический порядок ====
+bool DependencyGraph::AddEdge(NodeId precedent, NodeId dependent) {
+    const uint32_t lower_bound = order_[dependent];
+    const uint32_t upper_bound = order_[precedent];
+
+    //Order is violated only if precedent is after dependent:
+    //then only nodes with order in (lower_bound, upper_bound) are affected
+    if(upper_bound > lower_bound) {
+        StartVisit();
+        if(!CollectForwardRegion(dependent, upper_bound, precedent)) {
+            return false;
+        }
+        CollectBackwardRegion(precedent, lower_bound);
+        Reorder();
+    }
+
+    precedents_.Add(dependent, precedent);
+    dependents_.Add(precedent, dependent);
+    return true;
+}
+
+void DependencyGraph::RemoveEdge(NodeId precedent, NodeId dependent) {
+    precedents_.Remove(dependent, precedent);
+    dependents_.Remove(precedent, dependent);
+}
+
+void DependencyGraph::ReplacePrecedentsUnchecked(NodeId node, const std::vector<NodeId>& ref_nodes) {
+    for(NodeId ref_node : precedents_.Get(node)) {
+        dependents_.Remove(ref_node, node);
+    }
+    precedents_.Clear(node);
+    for(NodeId ref_node : ref_nodes) {
+        precedents_.Add(node, ref_node);
+        dependents_.Add(ref_node, node);
+    }
+}
+
+bool DependencyGraph::RebuildOrder() {
+    //1.Число еще не упорядоченных влияющих вершин; вершины без них - начало порядка
+    std::vector<uint32_t> pending(node_positions_.size(), 0);
+    std::vector<NodeId> sorted;
+    size_t live_count = 0;
+    for(NodeId node = 1; node < node_positions_.size(); ++node) {
+        if(node_positions_[node] == Position::NONE) {
+            continue;
+        }
+        ++live_count;
+        pending[node] = static_cast<uint32_t>(precedents_.Get(node).size());
+        if(pending[node] == 0) {
+            sorted.push_back(node);
+        }
+    }
+
+    //2.Вершина встает в порядок, когда упорядочены все ее влияющие
+    for(size_t idx = 0; idx < sorted.size(); ++idx) {
+        for(NodeId dependent : dependents_.Get(sorted[idx])) {
+            if(--pending[dependent] == 0) {
+                sorted.push_back(dependent);
+            }
+        }
+    }
+    //Вершины цикла так и не освободились
+    if(sorted.size() != live_count) {
+        return false;
+    }
+
+    next_low_order_ = ORDER_MIDDLE - static_cast<uint32_t>(sorted.size() / 2) - 1;
+    next_high_order_ = next_low_order_ + 1;
+    for(NodeId node : sorted) {
+        order_[node] = next_high_order_++;
+    }
+    return true;
+}
+
+bool DependencyGraph::CollectForwardRegion(NodeId start, uint32_t upper_bound, NodeId target) {
+    forward_region_.clear();
+    search_stack_.assign(1, start);
+    visit_mark_[start] = visit_epoch_;
+
+    while(!search_stack_.empty()) {
+        const NodeId node = search_stack_.back();
+        search_stack_.pop_back();
+        forward_region_.push_back(node);
+
+        for(NodeId next : dependents_.Get(node)) {
+            //target is reachable from start -> new edge closes a cycle
+            if(next == target) {
+                return false;
+            }
+            if(order_[next] < upper_bound && visit_mark_[next] != visit_epoch_) {
+                visit_mark_[next] = visit_epoch_;
+                search_stack_.push_back(next);
+            }
+        }
+    }
+    return true;
+}
+
+void DependencyGraph::CollectBackwardRegion(NodeId start, uint32_t lower_bound) {
+    backward_region_.clear();
+    search_stack_.assign(1, start);
+    visit_mark_[start] = visit_epoch_;
+
+    while(!search_stack_.empty()) {
+        const NodeId node = search_stack_.back();
+        search_stack_.pop_back();
+        backward_region_.push_back(node);
+
+        for(NodeId next : precedents_.Get(node)) {
+            if(order_[next] > lower_bound && visit_mark_[next] != visit_epoch_) {
+                visit_mark_[next] = visit_epoch_;
+                search_stack_.push_back(next);
+            }
+        }
+    }
+}
+
+void DependencyGraph::Reorder() {
+    auto by_order = [this](NodeId lhs, NodeId rhs) {
+        return order_[lhs] < order_[rhs];
+    };
+    std::sort(backward_region_.begin(), backward_region_.end(), by_order);
+    std::sort(forward_region_.begin(), forward_region_.end(), by_order);
+
+    //Pool of order numbers of both regions
+    free_orders_.clear();
+    for(NodeId node : backward_region_) {
+        free_orders_.push_back(order_[node]);
+    }
+    for(NodeId node : forward_region_) {
+        free_orders_.push_back(order_[node]);
+    }
+    std::sort(free_orders_.begin(), free_orders_.end());
+
+    //Backward region (precedents of new edge) goes first, relative order inside regions is kept
+    size_t idx = 0;
+    for(NodeId node : backward_region_) {
+        order_[node] = free_orders_[idx++];
+    }
+    for(NodeId node : forward_region_) {
+        order_[node] = free_orders_[idx++];
+    }
+}
+
+void DependencyGraph::StartVisit() {
+    if(++visit_epoch_ == 0) {
+        std::fill(visit_mark_.begin(), visit_mark_.end(), 0);
+        visit_epoch_ = 1;
+    }
+}
+
+void DependencyGraph::RenumberOrder() {
+    std::vector<NodeId> live_nodes;
+    for(NodeId node = 1; node < node_positions_.size(); ++node) {
+        if(!(node_positions_[node] == Position::NONE)) {
+            live_nodes.push_back(node);
+        }
+    }
+    std::sort(live_nodes.begin(), live_nodes.end(), [this](NodeId lhs, NodeId rhs) {
+        return order_[lhs] < order_[rhs];
+    });
+
+    next_low_order_ = ORDER_MIDDLE - static_cast<uint32_t>(live_nodes.size() / 2) - 1;
+    next_high_order_ = next_low_order_ + 1;
+    for(NodeId node : live_nodes) {
+        order_[node] = next_high_order_++;
+    }
+}
+
+void DependencyGraph::ReleaseIfIsolated(NodeId node) {
+    if(node_positions_[node] == Position::NONE) {
+        return;
+    }
+
+    //1.Range without formulas: its cells may become isolated
+    if(IsRangeNode(node)) {
+        if(!dependents_.Get(node).empty()) {
+            return;
+        }
+        const auto cells = precedents_.Get(node);
+        const std::vector<NodeId> cell_nodes(cells.begin(), cells.end());
+        for(NodeId cell_node : cell_nodes) {
+            RemoveEdge(cell_node, node);
+        }
+        const auto it = node_ranges_.find(node);
+        range_nodes_.Erase(it->second.range);
+        node_ranges_.erase(it);
+        FreeNode(node);
+
+        for(NodeId cell_node : cell_nodes) {
+            ReleaseIfIsolated(cell_node);
+        }
+        return;
+    }
+
+    //2.Cell without precedents, that only ranges depend on: without a node it is found by the ranges
+    if(!precedents_.Get(node).empty()) {
+        return;
+    }
+    const auto dependents = dependents_.Get(node);
+    const bool in_ranges_only = std::all_of(dependents.begin(), dependents.end(), [this](NodeId dependent) {
+        return IsRangeNode(dependent);
+    });
+    if(!in_ranges_only) {
+        return;
+    }
+    while(!dependents_.Get(node).empty()) {
+        RemoveEdge(node, *dependents_.Get(node).begin());
+    }
+    node_index_.Extract(node_positions_[node]);
+    FreeNode(node);
+}
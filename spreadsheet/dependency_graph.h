@@ -0,0 +1,223 @@
+#pragma once
+
+#include "common.h"
+#include "range_index.h"
+#include "snapshot.h"
+#include "tiled_index.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+//Списки смежности всех вершин в одном непрерывном массиве (CSR).
+//У каждой вершины есть отрезок [offset, offset + capacity) с запасом под новые ребра;
+//переполненный отрезок переносится в конец массива, освободившееся место
+//собирается при уплотнении, когда мусора становится больше половины массива.
+class AdjacencyArrays {
+public:
+    using NodeId = uint32_t;
+
+    //Непрерывный отрезок соседей вершины
+    struct Neighbours {
+        const NodeId* first = nullptr;
+        const NodeId* last = nullptr;
+
+        const NodeId* begin() const {
+            return first;
+        }
+        const NodeId* end() const {
+            return last;
+        }
+        size_t size() const {
+            return last - first;
+        }
+        bool empty() const {
+            return first == last;
+        }
+    };
+
+    Neighbours Get(NodeId node) const;
+
+    void Add(NodeId node, NodeId neighbour);
+    void Remove(NodeId node, NodeId neighbour);
+    void Clear(NodeId node);
+
+    size_t EdgeCount() const;
+    size_t MemoryUsage() const;
+
+    //Снимок массивов как есть (см. snapshot.h). Соседи и отрезки снимка проверяются
+    //по node_limit - числу вершин графа; SnapshotException, если они выходят за границы
+    void Save(SnapshotWriter& out) const;
+    void Load(SnapshotReader& in, size_t node_limit);
+
+private:
+    struct Span {
+        uint32_t offset = 0;
+        uint32_t size = 0;
+        uint32_t capacity = 0;
+    };
+
+    std::vector<Span> spans_;
+    std::vector<NodeId> edges_;
+    size_t edge_count_ = 0;
+    size_t garbage_ = 0;
+
+    //Переносит отрезок вершины в конец массива с удвоенной емкостью
+    void Grow(NodeId node);
+    void Compact();
+};
+
+//Граф зависимостей листа: хранит только прямые ребра "ячейка -> ячейка, на которую она ссылается".
+//Вершины есть только у ячеек, участвующих в ребрах; позиция -> вершина хранится тайлами.
+//Списки влияющих (precedents) и зависимых (dependents) ячеек доступны за O(степени).
+//Граф поддерживает топологический порядок вершин (влияющие раньше зависимых) по алгоритму
+//Pearce-Kelly: при добавлении ребра перестраивается только участок порядка между его концами.
+//Диапазон аргумента функции (SUM(A1:B500)) - одна вершина: одно ребро "диапазон -> формула" на все его ячейки.
+//Ребра "ячейка -> диапазон" есть только у ячеек диапазона, у которых и так есть вершина (формул со ссылками
+//и ячеек, на которые ссылаются): они держат порядок. Ячейка без вершины находит свои диапазоны в RangeIndex.
+class DependencyGraph {
+public:
+    using NodeId = AdjacencyArrays::NodeId;
+    using Neighbours = AdjacencyArrays::Neighbours;
+
+    static constexpr NodeId NONE = 0;
+
+    NodeId FindNode(Position pos) const;
+    Position GetPosition(NodeId node) const;
+
+    //Заменяет прямые ссылки ячейки pos на refs и диапазоны ranges (отсортированы и без повторов).
+    //Бросает CircularDependencyException, если новые ссылки образуют цикл; граф при этом не меняется
+    void SetPrecedents(Position pos, const std::vector<Position>& refs, const std::vector<Range>& ranges = {});
+
+    //Новые прямые ссылки ячейки (refs и ranges - отсортированы и без повторов)
+    struct CellRefs {
+        Position pos;
+        std::vector<Position> refs;
+        std::vector<Range> ranges = {};
+    };
+
+    //Заменяет прямые ссылки сразу нескольких различных ячеек. Пакет, сравнимый по числу ребер с графом,
+    //перестраивает ребра без поддержки порядка и проверяет циклы одним проходом по всему графу;
+    //небольшой пакет проверяется по ребрам, как SetPrecedents.
+    //Бросает CircularDependencyException, если новые ссылки образуют цикл; граф при этом не меняется
+    void SetPrecedents(const std::vector<CellRefs>& cells_refs);
+
+    Neighbours GetPrecedents(NodeId node) const;
+    Neighbours GetDependents(NodeId node) const;
+
+    //Отдельные ячейки-ссылки формулы pos, без диапазонов
+    std::vector<Position> GetPrecedents(Position pos) const;
+    //Диапазоны формулы pos (отсортированы)
+    std::vector<Range> GetPrecedentRanges(Position pos) const;
+    //Формулы, ссылающиеся на ячейку pos напрямую или через диапазон (отсортированы)
+    std::vector<Position> GetDependents(Position pos) const;
+    //На ячейку pos ссылается формула напрямую, не через диапазон
+    bool HasDependents(Position pos) const;
+
+    //Вершина диапазона: у нее нет позиции, GetPosition() для нее не используется
+    bool IsRangeNode(NodeId node) const;
+    Range GetRange(NodeId node) const;
+    //Вершина диапазона или NONE
+    NodeId FindRangeNode(Range range) const;
+    //Номер создания вершины диапазона (от 1): id освобожденной вершины переиспользуется,
+    //номер - нет. Кеш, привязанный к вершине диапазона, действителен, пока номер тот же
+    uint32_t GetRangeSerial(NodeId node) const;
+    //Дописывает в out вершины диапазонов, содержащих pos: O(log R + диапазонов через строку pos)
+    void FindRangeNodes(Position pos, std::vector<NodeId>& out) const;
+
+    //Топологический номер вершины: у влияющей ячейки он меньше, чем у зависимой
+    uint32_t GetOrder(NodeId node) const;
+
+    //Переставляет вершины nodes (в топологическом порядке) по уровням: вершина уровня k
+    //ссылается только на вершины nodes уровней < k, вершины одного уровня независимы.
+    //Возвращает границы уровней: уровень k - [bounds[k], bounds[k + 1])
+    std::vector<size_t> SplitIntoLevels(std::vector<NodeId>& nodes) const;
+
+    //Число вершин ячеек, без вершин диапазонов
+    size_t NodeCount() const;
+    //Все id вершин меньше NodeIdLimit()
+    size_t NodeIdLimit() const;
+    size_t RangeCount() const;
+    size_t EdgeCount() const;
+    size_t MemoryUsage() const;
+
+    //Снимок графа (см. snapshot.h): массивы вершин, ребер, топологического порядка и индекс диапазонов
+    //пишутся как есть, при загрузке циклы не проверяются и порядок не строится заново.
+    //Load - только в новый граф; SnapshotException, если ссылки снимка выходят за вершины графа
+    void Save(SnapshotWriter& out) const;
+    void Load(SnapshotReader& in);
+
+private:
+    //Вершина для позиции хранится как id; 0 (NONE) - вершины нет
+    TiledIndex<NodeId> node_index_;
+    //node -> позиция, индекс 0 не используется
+    std::vector<Position> node_positions_{Position::NONE};
+    std::vector<NodeId> free_nodes_;
+
+    //Позиция вершины диапазона в node_positions_
+    static inline const Position RANGE_NODE_POSITION{-2, -2};
+    RangeIndex<NodeId> range_nodes_;
+    struct RangeNodeData {
+        Range range;
+        uint32_t serial;
+    };
+    std::unordered_map<NodeId, RangeNodeData> node_ranges_;
+    uint32_t next_range_serial_ = 1;
+
+    AdjacencyArrays precedents_;
+    AdjacencyArrays dependents_;
+
+    //node -> топологический номер. Вершина без ребер может стоять где угодно:
+    //новая ячейка-формула ставится в конец порядка, новая ячейка по ссылке - в начало,
+    //тогда загрузка цепочки в любом направлении не нарушает порядок
+    static constexpr uint32_t ORDER_MIDDLE = 1u << 31;
+    std::vector<uint32_t> order_{0};
+    uint32_t next_low_order_ = ORDER_MIDDLE - 1;
+    uint32_t next_high_order_ = ORDER_MIDDLE;
+
+    //Метки посещения для поиска Pearce-Kelly: вершина посещена, если visit_mark_[node] == visit_epoch_.
+    //Буферы переиспользуются между вызовами, чтобы не выделять память на каждое ребро
+    std::vector<uint32_t> visit_mark_{0};
+    uint32_t visit_epoch_ = 0;
+    std::vector<NodeId> search_stack_;
+    std::vector<NodeId> forward_region_;
+    std::vector<NodeId> backward_region_;
+    std::vector<uint32_t> free_orders_;
+    //node -> уровень + 1 для SplitIntoLevels, 0 - вершина не входит в разбиение
+    mutable std::vector<uint32_t> levels_;
+
+    NodeId GetOrAddNode(Position pos, bool as_precedent);
+    //Новая вершина диапазона получает ребра от вершин его ячеек
+    NodeId GetOrAddRangeNode(Range range);
+    //Новая вершина без ребер: в начале порядка (as_precedent) или в конце
+    NodeId AllocateNode(Position pos, bool as_precedent);
+    void FreeNode(NodeId node);
+
+    //Добавляет ребро precedent -> dependent, восстанавливая топологический порядок.
+    //Возвращает false (ребро не добавлено), если ребро замыкает цикл
+    bool AddEdge(NodeId precedent, NodeId dependent);
+    void RemoveEdge(NodeId precedent, NodeId dependent);
+
+    //Заменяет входящие ребра node на ref_nodes без проверки цикла и поддержки порядка
+    void ReplacePrecedentsUnchecked(NodeId node, const std::vector<NodeId>& ref_nodes);
+
+    //Строит топологический порядок всех вершин заново (Kahn).
+    //Возвращает false, если в графе есть цикл - тогда порядок не меняется
+    bool RebuildOrder();
+
+    //Поиск Pearce-Kelly: вершины, достижимые из start по зависимым, с номером < upper_bound.
+    //Возвращает false, если среди них встретился target (цикл)
+    bool CollectForwardRegion(NodeId start, uint32_t upper_bound, NodeId target);
+    //Вершины, из которых достижим start, с номером > lower_bound
+    void CollectBackwardRegion(NodeId start, uint32_t lower_bound);
+    //Ставит backward-регион перед forward-регионом на тех же топологических номерах
+    void Reorder();
+    void StartVisit();
+
+    //Перенумеровывает порядок подряд вокруг ORDER_MIDDLE, когда номера с одного из краев кончились
+    void RenumberOrder();
+
+    //Освобождает вершину без ребер, ее id переиспользуется. Ячейка, у которой остались только ребра
+    //в диапазоны, и диапазон, на который больше не ссылается ни одна формула, тоже освобождаются
+    void ReleaseIfIsolated(NodeId node);
+};
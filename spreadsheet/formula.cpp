@@ -5,7 +5,9 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <iterator>
 #include <sstream>
+#include <string_view>
 #include <tuple>
 
 using namespace std::literals;
@@ -47,25 +49,58 @@ std::string_view FormulaError::ToString() const {
 }
 
 namespace {
-class Formula : public FormulaInterface {
-public:
-    explicit Formula(std::string expression) try
-        : ast_(ParseFormulaAST(std::move(expression))) {
-    } catch (const std::exception& ex) {
+FormulaAST ParseFormulaOrThrow(std::string_view expression, std::pmr::memory_resource* resource) {
+    try {
+        return ParseFormulaAST(expression, resource);
+    } catch (const std::exception&) {
         //unable to parse
         throw FormulaException("Unable to parse Fomula");
     }
+}
 
-    Value Evaluate(const SheetInterface& sheet) const override {
-        try {
-            return ast_.Execute(sheet);
-        } catch(FormulaError& fr) {
-            return fr;
+//Пустой поток для печати формулы, свой у каждого потока: создание потока дороже печати короткой формулы
+std::ostringstream& ExpressionStream() {
+    thread_local std::ostringstream stream;
+    stream.clear();
+    stream.str({});
+    return stream;
+}
+
+//Все ячейки формулы: отдельные ссылки и ячейки диапазонов, отсортированы и без повторов
+std::vector<Position> ListReferencedCells(FormulaInterface::CellsRange cells, FormulaInterface::RangesList ranges) {
+    //The list from AST is already sorted
+    std::vector<Position> ref_cells(cells.begin(), cells.end());
+
+    //Cells of ranges are merged in: sort again only if there are ranges
+    if(!ranges.empty()) {
+        for(const Range& range : ranges) {
+            for(int row = range.first.row; row <= range.last.row; ++row) {
+                for(int col = range.first.col; col <= range.last.col; ++col) {
+                    ref_cells.push_back({row, col});
+                }
+            }
         }
+        std::sort(ref_cells.begin(), ref_cells.end());
+    }
+
+    auto end_of_unique = std::unique(ref_cells.begin(), ref_cells.end());
+
+    ref_cells.resize(end_of_unique - ref_cells.begin());
+    return ref_cells;
+}
+
+class Formula : public FormulaInterface {
+public:
+    explicit Formula(std::string expression, std::pmr::memory_resource* resource)
+        : ast_(ParseFormulaOrThrow(expression, resource)) {
+    }
+
+    Value Evaluate(const SheetInterface& sheet) const override {
+        return ast_.Execute(sheet);
     }
 
     std::string GetExpression() const override{
-        std::stringstream ss;
+        std::ostringstream& ss = ExpressionStream();
         try {
             ast_.PrintFormula(ss);
         } catch (const std::exception& ex) {
@@ -76,21 +111,195 @@ public:
     }
 
     std::vector<Position> GetReferencedCells() const override {
-        const auto& ref_cells_list = ast_.GetReferencedCells();
+        return ListReferencedCells(ast_.GetReferencedCells(), ast_.GetReferencedRanges());
+    }
 
-        //The list from AST is already sorted
-        std::vector<Position> ref_cells(ref_cells_list.begin(), ref_cells_list.end());
-        auto end_of_unique = std::unique(ref_cells.begin(), ref_cells.end());
+    CellsRange GetReferencedCellsRange() const override {
+        return ast_.GetReferencedCells();
+    }
 
-        ref_cells.resize(end_of_unique - ref_cells.begin());
-        return ref_cells;
+    RangesList GetReferencedRanges() const override {
+        return ast_.GetReferencedRanges();
     }
 
 private:
     FormulaAST ast_;
 };
+
+//Формула из кеша общих формул: AST другой ячейки, все ссылки сдвинуты на offset.
+//Сдвиг сохраняет порядок, поэтому сдвинутые списки ссылок остаются отсортированными
+class SharedFormula : public FormulaInterface {
+public:
+    SharedFormula(std::shared_ptr<const FormulaAST> ast, Position offset, std::pmr::memory_resource* resource)
+        : ast_(std::move(ast))
+        , offset_(offset)
+        , resource_(resource) {
+        if(offset_ == Position{}) {
+            return;
+        }
+        //ячейки и диапазоны - в одном блоке арены
+        const auto cells = ast_->GetReferencedCells();
+        const auto ranges = ast_->GetReferencedRanges();
+        refs_ = static_cast<Position*>(resource_->allocate(RefsSize(), alignof(Range)));
+        Position* out = refs_;
+        for(const Position& cell : cells) {
+            *out++ = Shift(cell);
+        }
+        Range* out_range = reinterpret_cast<Range*>(out);
+        for(const Range& range : ranges) {
+            *out_range++ = {Shift(range.first), Shift(range.last)};
+        }
+    }
+
+    ~SharedFormula() override {
+        if(refs_) {
+            resource_->deallocate(refs_, RefsSize(), alignof(Range));
+        }
+    }
+
+    Value Evaluate(const SheetInterface& sheet) const override {
+        return ast_->Execute(sheet, offset_);
+    }
+
+    std::string GetExpression() const override {
+        std::ostringstream& ss = ExpressionStream();
+        ast_->PrintFormula(ss, offset_);
+        return ss.str();
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return ListReferencedCells(GetReferencedCellsRange(), GetReferencedRanges());
+    }
+
+    CellsRange GetReferencedCellsRange() const override {
+        if(!refs_) {
+            return ast_->GetReferencedCells();
+        }
+        return {refs_, refs_ + CellCount()};
+    }
+
+    RangesList GetReferencedRanges() const override {
+        if(!refs_) {
+            return ast_->GetReferencedRanges();
+        }
+        const Range* first = reinterpret_cast<const Range*>(refs_ + CellCount());
+        return {first, first + RangeCount()};
+    }
+
+    SharedForm GetSharedForm() const override {
+        return {ast_.get(), offset_};
+    }
+
+    bool EvaluateColumnBoxed(const SheetInterface& sheet, size_t count, double* results) const override {
+        return ast_->ExecuteColumnBoxed(sheet, offset_, count, results);
+    }
+
+private:
+    std::shared_ptr<const FormulaAST> ast_;
+    Position offset_;
+    std::pmr::memory_resource* resource_;
+    //Сдвинутые ячейки, за ними - сдвинутые диапазоны; nullptr при нулевом сдвиге
+    Position* refs_ = nullptr;
+
+    Position Shift(Position pos) const {
+        return {pos.row + offset_.row, pos.col + offset_.col};
+    }
+
+    size_t CellCount() const {
+        const auto cells = ast_->GetReferencedCells();
+        return cells.end() - cells.begin();
+    }
+
+    size_t RangeCount() const {
+        const auto ranges = ast_->GetReferencedRanges();
+        return ranges.end() - ranges.begin();
+    }
+
+    size_t RefsSize() const {
+        return sizeof(Position) * CellCount() + sizeof(Range) * RangeCount();
+    }
+};
 }  // namespace
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression,
+                                               std::pmr::memory_resource* resource) {
+    return std::make_unique<Formula>(std::move(expression), resource);
+}
+
+FormulaCache::FormulaCache(std::pmr::memory_resource* resource)
+    : resource_(resource) {
+}
+
+FormulaCache::~FormulaCache() = default;
+
+FormulaCache::FormulaPtr FormulaCache::Parse(std::string expression, Position pos) {
+    if(!MakeKey(expression, pos, key_)) {
+        key_.clear();
+    }
+    return Parse(std::move(expression), pos, key_);
+}
+
+bool FormulaCache::MakeKey(std::string_view expression, Position pos, std::string& key) {
+    return MakeRelativeFormulaKey(expression, pos, key);
+}
+
+FormulaCache::FormulaPtr FormulaCache::Parse(std::string expression, Position pos, const std::string& key) {
+    if(key.empty()) {
+        //the text has an error: parsing reports it
+        return MakeArenaUniqueAs<FormulaInterface, Formula>(resource_, std::move(expression), resource_);
+    }
+    return MakeFormula(FindOrParse(expression, pos, key), pos);
+}
+
+FormulaCache::Form FormulaCache::ParseForm(std::string expression, Position pos) {
+    if(!MakeKey(expression, pos, key_)) {
+        //not cached: parsing reports the error
+        return {MakeSharedAST(expression), pos};
+    }
+    return FindOrParse(expression, pos, key_);
+}
+
+FormulaCache::FormulaPtr FormulaCache::MakeFormula(const Form& form, Position pos) const {
+    return MakeArenaUniqueAs<FormulaInterface, SharedFormula>(
+        resource_, form.ast, Position{pos.row - form.anchor.row, pos.col - form.anchor.col}, resource_);
+}
+
+std::pmr::memory_resource* FormulaCache::Resource() const {
+    return resource_;
+}
+
+FormulaCache::Form FormulaCache::FindOrParse(const std::string& expression, Position pos, const std::string& key) {
+    auto it = formulas_.find(key);
+    std::shared_ptr<const FormulaAST> ast = it != formulas_.end() ? it->second.ast.lock() : nullptr;
+    if(!ast) {
+        ast = MakeSharedAST(expression);
+        if(it != formulas_.end()) {
+            it->second = SharedAST{ast, pos};
+        } else {
+            SweepUnused();
+            it = formulas_.emplace(key, SharedAST{ast, pos}).first;
+        }
+    }
+    return {std::move(ast), it->second.anchor};
+}
+
+std::shared_ptr<const FormulaAST> FormulaCache::MakeSharedAST(const std::string& expression) const {
+    //the AST is freed with its last formula, the control block - when the cache drops the form
+    FormulaAST* ast = MakeArenaUnique<FormulaAST>(resource_, ParseFormulaOrThrow(expression, resource_)).release();
+    return std::shared_ptr<const FormulaAST>(ast, ArenaDeleter<FormulaAST>{resource_},
+                                             std::pmr::polymorphic_allocator<FormulaAST>(resource_));
+}
+
+size_t FormulaCache::Size() const {
+    return formulas_.size();
+}
+
+void FormulaCache::SweepUnused() {
+    if(formulas_.size() < sweep_size_) {
+        return;
+    }
+    for(auto it = formulas_.begin(); it != formulas_.end();) {
+        it = it->second.ast.expired() ? formulas_.erase(it) : std::next(it);
+    }
+    sweep_size_ = std::max(MIN_SWEEP_SIZE, formulas_.size() * 2);
 }
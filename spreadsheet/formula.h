@@ -1,14 +1,22 @@
 #pragma once
 
+#include "arena.h"
 #include "common.h"
 
 #include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+class FormulaAST;
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции над ячейками, диапазонами и выражениями: SUM(A1:B5,C7*2), MIN, MAX, AVERAGE, COUNT
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -16,6 +24,38 @@ class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
 
+    //Непрерывный массив позиций, принадлежащий формуле
+    struct CellsRange {
+        const Position* first = nullptr;
+        const Position* last = nullptr;
+
+        const Position* begin() const {
+            return first;
+        }
+        const Position* end() const {
+            return last;
+        }
+        bool empty() const {
+            return first == last;
+        }
+    };
+
+    //Непрерывный массив диапазонов, принадлежащий формуле
+    struct RangesList {
+        const Range* first = nullptr;
+        const Range* last = nullptr;
+
+        const Range* begin() const {
+            return first;
+        }
+        const Range* end() const {
+            return last;
+        }
+        bool empty() const {
+            return first == last;
+        }
+    };
+
     virtual ~FormulaInterface() = default;
 
     // Обратите внимание, что в метод Evaluate() ссылка на таблицу передаётся 
@@ -32,10 +72,103 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ячейки диапазонов (SUM(A1:B5)) входят в список все, поэтому для
+    // больших диапазонов список большой - граф листа использует два метода ниже.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ячейки отдельных ссылок (без ячеек диапазонов) без копирования: отсортированы,
+    // но могут повторяться. Массив действителен, пока существует формула
+    virtual CellsRange GetReferencedCellsRange() const = 0;
+
+    // Диапазоны формулы: отсортированы, без повторов. Массив действителен, пока существует формула
+    virtual RangesList GetReferencedRanges() const = 0;
+
+    // Общее AST формулы из FormulaCache и сдвиг ее ссылок от ячейки, для которой AST разобрано.
+    // У формул одной формы - одно AST; ast == nullptr - формула разобрана отдельно
+    struct SharedForm {
+        const FormulaAST* ast = nullptr;
+        Position offset;
+    };
+    virtual SharedForm GetSharedForm() const {
+        return {};
+    }
+
+    // Значения формул count ячеек столбца, начиная с ячейки этой формулы, ошибки упакованы (FormulaError::Box).
+    // Формулы всех этих ячеек - одной формы (одно GetSharedForm().ast): байткод выполняется
+    // по столбцам операндов сразу для всех ячеек. false - формула так не вычисляется, results не заполнен
+    virtual bool EvaluateColumnBoxed(const SheetInterface& /* sheet */, size_t /* count */,
+                                     double* /* results */) const {
+        return false;
+    }
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+// Узлы AST и список ячеек размещаются в арене, выделенной из resource.
+std::unique_ptr<FormulaInterface> ParseFormula(
+    std::string expression, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+// Кеш общих формул (shared formulas) листа. Формулы одной формы - с одинаковой относительной
+// записью R1C1, как у протянутых вниз =A2*B2 в C2 и =A3*B3 в C3 (R[0]C[-2]*R[0]C[-1]) -
+// разбираются один раз и делят одно неизменяемое AST. Формула ячейки хранит только смещение
+// от ячейки, для которой AST разобрано, и сдвинутые на него списки ссылок.
+// Не потокобезопасен: формулы разбираются в потоке, изменяющем лист.
+class FormulaCache {
+public:
+    // resource - память для формул, их AST и списков ссылок (обычно арена листа)
+    explicit FormulaCache(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    ~FormulaCache();
+
+    // Формула, размещенная в resource кеша
+    using FormulaPtr = ArenaBasePtr<FormulaInterface>;
+
+    // Как ParseFormula, для формулы ячейки pos
+    FormulaPtr Parse(std::string expression, Position pos);
+
+    // Относительная запись формулы ячейки pos - ключ кеша. Кеш не используется, поэтому записи
+    // можно готовить заранее в нескольких потоках. false - в тексте ошибка, ее сообщит Parse
+    static bool MakeKey(std::string_view expression, Position pos, std::string& key);
+    // Как Parse, с записью key, заранее полученной MakeKey (пустая - запись не получена)
+    FormulaPtr Parse(std::string expression, Position pos, const std::string& key);
+
+    // Форма формулы: общее AST и ячейка, для которой оно разобрано
+    struct Form {
+        std::shared_ptr<const FormulaAST> ast;
+        Position anchor;
+    };
+    // Форма формулы expression ячейки pos из кеша или разобранная и добавленная в кеш.
+    // Бросает FormulaException, как Parse
+    Form ParseForm(std::string expression, Position pos);
+    // Формула формы form для ячейки pos, без разбора текста (загрузка снимка листа)
+    FormulaPtr MakeFormula(const Form& form, Position pos) const;
+
+    // Память формул кеша
+    std::pmr::memory_resource* Resource() const;
+
+    // Число форм в кеше (форма без формул удаляется не сразу)
+    size_t Size() const;
+
+private:
+    // Кеш не продлевает жизнь AST: оно освобождается вместе с последней формулой этой формы
+    struct SharedAST {
+        std::weak_ptr<const FormulaAST> ast;
+        // Ячейка, для которой разобрано AST
+        Position anchor;
+    };
+
+    // Форма по готовой записи key (непустой)
+    Form FindOrParse(const std::string& expression, Position pos, const std::string& key);
+    // Разобранное AST, общее для формул одной формы; бросает FormulaException
+    std::shared_ptr<const FormulaAST> MakeSharedAST(const std::string& expression) const;
+
+    // Формы, AST которых уже освобождено, удаляются, когда кеш вырос вдвое
+    static constexpr size_t MIN_SWEEP_SIZE = 1024;
+
+    std::pmr::memory_resource* resource_;
+    std::unordered_map<std::string, SharedAST> formulas_;
+    size_t sweep_size_ = MIN_SWEEP_SIZE;
+    // Буфер относительной записи, переиспользуется
+    std::string key_;
+
+    void SweepUnused();
+};
@@ -0,0 +1,259 @@
+#include "journal.h"
+
+#include "crc32.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define JOURNAL_HAS_FSYNC 1
+#endif
+
+namespace {
+constexpr char JOURNAL_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'J', 'N', 'L'};
+constexpr uint32_t JOURNAL_VERSION = 1;
+
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+//Заголовок кадра: размер изменений кадра и их CRC32
+struct FrameHeader {
+    uint32_t size;
+    uint32_t crc;
+};
+
+//Изменения кадра: операция, строка, столбец, у set - длина и текст; числа - varint
+void PutVarint(std::string& out, uint64_t value) {
+    while(value >= 0x80) {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+bool GetVarint(const char*& data, const char* end, uint64_t& value) {
+    value = 0;
+    for(int shift = 0; shift < 64 && data != end; shift += 7) {
+        const auto byte = static_cast<uint8_t>(*data++);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Разбирает изменения кадра; false - кадр поврежден (on_edit может быть уже вызван)
+bool DecodeFrame(const char* data, const char* end, const Journal::OnEdit& on_edit) {
+    while(data != end) {
+        const auto op = static_cast<Journal::Op>(*data++);
+        uint64_t row = 0;
+        uint64_t col = 0;
+        if((op != Journal::Op::set && op != Journal::Op::clear)
+           || !GetVarint(data, end, row) || !GetVarint(data, end, col)) {
+            return false;
+        }
+        const Position pos{static_cast<int>(std::min<uint64_t>(row, Position::MAX_ROWS)),
+                           static_cast<int>(std::min<uint64_t>(col, Position::MAX_COLS))};
+        if(!pos.IsValid()) {
+            return false;
+        }
+        std::string_view text;
+        if(op == Journal::Op::set) {
+            uint64_t text_size = 0;
+            if(!GetVarint(data, end, text_size) || text_size > static_cast<uint64_t>(end - data)) {
+                return false;
+            }
+            text = std::string_view(data, text_size);
+            data += text_size;
+        }
+        if(on_edit) {
+            on_edit(op, pos, text);
+        }
+    }
+    return true;
+}
+}//namespace
+
+Journal::Journal(const std::string& path, uint64_t valid_size, size_t group_commit)
+    : path_(path)
+    , group_commit_(std::max<size_t>(group_commit, 1)) {
+    if(valid_size == 0) {
+        Reset();
+        return;
+    }
+    //the torn tail of the last run is cut off: new frames follow the last whole one
+    OpenAt(valid_size);
+    size_ = valid_size;
+}
+
+Journal::~Journal() {
+    try {
+        Sync();
+    } catch(const JournalException&) {
+        //not reported from a destructor: call Sync to see the error
+    }
+    if(file_) {
+        std::fclose(file_);
+    }
+}
+
+uint64_t Journal::Read(const char* data, size_t size, const OnEdit& on_edit) {
+    if(size == 0) {
+        return 0;
+    }
+    JournalHeader header{};
+    if(size < sizeof(header)) {
+        throw JournalException("Not a sheet journal");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if(std::memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0) {
+        throw JournalException("Not a sheet journal");
+    }
+    if(header.version != JOURNAL_VERSION) {
+        throw JournalException("Unsupported journal version " + std::to_string(header.version));
+    }
+
+    size_t offset = sizeof(header);
+    while(size - offset >= sizeof(FrameHeader)) {
+        FrameHeader frame{};
+        std::memcpy(&frame, data + offset, sizeof(frame));
+        const char* payload = data + offset + sizeof(frame);
+        if(frame.size > size - offset - sizeof(frame) || Crc32(payload, frame.size) != frame.crc
+           || !DecodeFrame(payload, payload + frame.size, nullptr)) {
+            break;
+        }
+        DecodeFrame(payload, payload + frame.size, on_edit);
+        offset += sizeof(frame) + frame.size;
+    }
+    return offset;
+}
+
+void Journal::Add(Op op, Position pos, std::string_view text) {
+    if(frame_.empty()) {
+        //place for the frame header
+        frame_.resize(sizeof(FrameHeader));
+    }
+    frame_ += static_cast<char>(op);
+    PutVarint(frame_, pos.row);
+    PutVarint(frame_, pos.col);
+    if(op == Op::set) {
+        PutVarint(frame_, text.size());
+        frame_ += text;
+    }
+}
+
+void Journal::CommitFrame() {
+    if(frame_.empty()) {
+        return;
+    }
+    const size_t payload_size = frame_.size() - sizeof(FrameHeader);
+    if(payload_size > UINT32_MAX) {
+        frame_.clear();
+        throw JournalException("Journal frame is too large");
+    }
+    const FrameHeader header{static_cast<uint32_t>(payload_size), Crc32(frame_.data() + sizeof(FrameHeader), payload_size)};
+    std::memcpy(frame_.data(), &header, sizeof(header));
+    if(pending_.empty()) {
+        pending_.swap(frame_);
+    } else {
+        pending_ += frame_;
+    }
+    frame_.clear();
+    size_ += sizeof(FrameHeader) + payload_size;
+    if(++pending_frames_ >= group_commit_) {
+        Sync();
+    }
+}
+
+void Journal::DropFrame() {
+    frame_.clear();
+}
+
+void Journal::Sync() {
+    if(pending_.empty() || !file_) {
+        return;
+    }
+    if(torn_) {
+        //the failed write may have left part of pending_ in the file: rewriting it after that part
+        //would put a broken frame in the middle of the journal
+        OpenAt(synced_size_);
+    }
+    torn_ = true;
+    if(WriteFile(pending_.data(), pending_.size()) != pending_.size()) {
+        throw JournalException("Cannot write journal " + path_);
+    }
+    SyncFile();
+    torn_ = false;
+    pending_.clear();
+    pending_frames_ = 0;
+    synced_size_ = size_;
+}
+
+void Journal::Reset() {
+    if(file_) {
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+    pending_.clear();
+    pending_frames_ = 0;
+    file_ = std::fopen(path_.c_str(), "wb");
+    if(!file_) {
+        throw JournalException("Cannot create journal " + path_);
+    }
+    JournalHeader header{};
+    std::memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    if(std::fwrite(&header, sizeof(header), 1, file_) != 1) {
+        throw JournalException("Cannot write journal " + path_);
+    }
+    size_ = sizeof(header);
+    SyncFile();
+    synced_size_ = size_;
+    torn_ = false;
+}
+
+uint64_t Journal::Size() const {
+    return size_;
+}
+
+size_t Journal::WriteFile(const char* data, size_t size) {
+    return std::fwrite(data, 1, size, file_);
+}
+
+void Journal::OpenAt(uint64_t size) {
+    if(file_) {
+        //what is left in the stdio buffer is written here and cut off below
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+    std::error_code error;
+    if(std::filesystem::file_size(path_, error) != size) {
+        std::filesystem::resize_file(path_, size, error);
+        if(error) {
+            throw JournalException("Cannot truncate journal " + path_ + ": " + error.message());
+        }
+    }
+    file_ = std::fopen(path_.c_str(), "ab");
+    if(!file_) {
+        throw JournalException("Cannot open journal " + path_);
+    }
+    synced_size_ = size;
+}
+
+void Journal::SyncFile() {
+    if(std::fflush(file_) != 0) {
+        throw JournalException("Cannot write journal " + path_);
+    }
+#ifdef JOURNAL_HAS_FSYNC
+    if(::fsync(::fileno(file_)) != 0) {
+        throw JournalException("Cannot sync journal " + path_);
+    }
+#endif
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+//Журнал изменений листа (Sheet::OpenJournal): файл только дописывается. Заголовок с версией,
+//затем кадры: размер данных, их CRC32 и сами изменения ячеек. Кадр - одно изменение SetCell/ClearCell
+//или весь пакет CommitBatch/LoadTexts, поэтому при чтении кадр применяется целиком или не применяется.
+//Оборванный или поврежденный кадр (сбой во время записи) и все кадры после него отбрасываются
+
+//Файл не является журналом, другой версии или не записывается
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class Journal {
+public:
+    enum class Op : uint8_t {
+        set = 1,
+        clear = 2,
+    };
+    using OnEdit = std::function<void(Op op, Position pos, std::string_view text)>;
+
+    //Открывает журнал для дописывания после первых valid_size байт (см. Read); нет файла - создает новый.
+    //Кадры записываются и сбрасываются на диск (fsync) группами по group_commit кадров
+    Journal(const std::string& path, uint64_t valid_size, size_t group_commit);
+    //Дописывает и сбрасывает на диск незаписанные кадры
+    virtual ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    //Читает журнал data: для каждого целого кадра по порядку вызывает on_edit для каждого изменения кадра.
+    //Возвращает размер целой части журнала; пустые данные - пустой журнал.
+    //JournalException, если data - не журнал или журнал другой версии
+    static uint64_t Read(const char* data, size_t size, const OnEdit& on_edit);
+
+    //Добавляет изменение к текущему кадру
+    void Add(Op op, Position pos, std::string_view text = {});
+    //Завершает текущий кадр; при накоплении group_commit кадров пишет их и сбрасывает на диск
+    void CommitFrame();
+    //Отменяет текущий кадр (изменение не применилось)
+    void DropFrame();
+    //Пишет и сбрасывает на диск все завершенные кадры. При ошибке кадры остаются незаписанными:
+    //следующий Sync сначала отрезает оборванную запись
+    void Sync();
+    //Оставляет только заголовок: все изменения журнала уже в снимке (Sheet::Checkpoint)
+    void Reset();
+
+    //Размер журнала с незаписанными кадрами, байт
+    uint64_t Size() const;
+
+protected:
+    //Дописывает size байт data в файл; возвращает число записанных байт
+    virtual size_t WriteFile(const char* data, size_t size);
+
+private:
+    std::string path_;
+    std::FILE* file_ = nullptr;
+    size_t group_commit_;
+    //Завершенные, но не записанные кадры
+    std::string pending_;
+    size_t pending_frames_ = 0;
+    //Текущий кадр
+    std::string frame_;
+    uint64_t size_ = 0;
+    //Размер файла после последней удачной записи
+    uint64_t synced_size_ = 0;
+    //Последняя запись оборвалась: в файле после synced_size_ может быть часть кадров
+    bool torn_ = false;
+
+    //Открывает файл для дописывания после первых size байт, отрезая остальное
+    void OpenAt(uint64_t size);
+    //Сбрасывает записанное на диск
+    void SyncFile();
+};
@@ -1,8 +1,29 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <limits>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string_view>
 
+#include "FormulaAST.h"
+#include "benchmarks.h"
 #include "common.h"
+#include "crc32.h"
+#include "dependency_graph.h"
 #include "formula.h"
+#include "journal.h"
+#include "range_index.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -355,11 +376,1782 @@ void TestDependentCellHandling() {
 
     sheet->SetCell("A5"_pos, "=A6");
 
-    ASSERT_EQUAL(sheet->GetCell("A6"_pos)->GetDependentCells().size(), 5u);
+    //Граф хранит только прямые зависимости
+    const auto& concrete_sheet = dynamic_cast<const Sheet&>(*sheet);
+    ASSERT_EQUAL(concrete_sheet.GetDependentCells("A6"_pos), std::vector{"A5"_pos});
+    ASSERT_EQUAL(concrete_sheet.GetDependentCells("A5"_pos),
+                 (std::vector{"A1"_pos, "A2"_pos, "A3"_pos, "A4"_pos}));
+    ASSERT_EQUAL(concrete_sheet.GetPrecedentCells("A5"_pos), std::vector{"A6"_pos});
 
     sheet->ClearCell("A5"_pos);
 
-    ASSERT_EQUAL(sheet->GetCell("A6"_pos)->GetDependentCells().size(), 0);
+    ASSERT_EQUAL(concrete_sheet.GetDependentCells("A6"_pos).size(), 0u);
+    ASSERT_EQUAL(concrete_sheet.GetDependentCells("A5"_pos).size(), 4u);
+    ASSERT(concrete_sheet.GetPrecedentCells("A5"_pos).empty());
+}
+
+void TestSparseStorage() {
+    auto sheet = CreateSheet();
+    sheet->SetCell(Position{10000, 10000}, "far");
+    sheet->SetCell("B2"_pos, "near");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{10001, 10001}));
+    ASSERT(sheet->GetCell(Position{10000, 9999}) == nullptr);
+    ASSERT(sheet->GetCell(Position{9999, 10000}) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell(Position{10000, 10000})->GetText(), "far");
+
+    sheet->ClearCell(Position{10000, 10000});
+    ASSERT(sheet->GetCell(Position{10000, 10000}) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+    //Ячейки на границах тайлов
+    for(int i = 60; i < 70; ++i) {
+        sheet->SetCell(Position{i, i}, std::to_string(i));
+    }
+    for(int i = 60; i < 70; ++i) {
+        ASSERT_EQUAL(sheet->GetCell(Position{i, i})->GetText(), std::to_string(i));
+    }
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{70, 70}));
+}
+
+void TestSheetArenaStats() {
+    auto sheet = CreateSheet();
+    const auto& concrete_sheet = dynamic_cast<const Sheet&>(*sheet);
+
+    const int cell_count = 1000;
+    for(int row = 0; row < cell_count; ++row) {
+        sheet->SetCell(Position{row, 0}, "=1+2*(3-" + std::to_string(row) + ")");
+    }
+    auto stats = concrete_sheet.GetAllocationStats();
+    ASSERT(stats.requested.allocations >= 2u * cell_count);
+    ASSERT(stats.upstream.allocations * 10 < stats.requested.allocations);
+    ASSERT_EQUAL(sheet->GetCell(Position{5, 0})->GetValue(), CellInterface::Value(-3.0));
+
+    //тексты ячеек - тоже в арене: ячейка, текст и его буфер, ячейка и число с текстом
+    const size_t allocations = stats.requested.allocations;
+    for(int row = 0; row < cell_count; ++row) {
+        sheet->SetCell(Position{row, 1}, "text longer than a short string buffer " + std::to_string(row));
+        sheet->SetCell(Position{row, 2}, "1.0");
+    }
+    stats = concrete_sheet.GetAllocationStats();
+    ASSERT(stats.requested.allocations - allocations >= 5u * cell_count);
+
+    for(int row = 0; row < cell_count; ++row) {
+        for(int col = 0; col < 3; ++col) {
+            sheet->ClearCell(Position{row, col});
+        }
+    }
+    //в арене остались только блоки управления форм, которые кеш формул удаляет не сразу
+    stats = concrete_sheet.GetAllocationStats();
+    ASSERT_EQUAL(stats.requested.allocations - stats.requested.deallocations, concrete_sheet.GetSharedFormulaCount());
+    ASSERT(stats.requested.bytes_in_use * 10 < stats.requested.peak_bytes_in_use);
+}
+
+void TestCompactCell() {
+    static_assert(sizeof(Cell) <= 24);
+
+    auto sheet = CreateSheet();
+    const auto& concrete_sheet = dynamic_cast<const Sheet&>(*sheet);
+
+    sheet->SetCell("A1"_pos, "5");
+    sheet->SetCell("A2"_pos, "1.0");
+    sheet->SetCell("A3"_pos, "1e3");
+    sheet->SetCell("A4"_pos, "-0.25");
+    sheet->SetCell("A5"_pos, "'12");
+    sheet->SetCell("B1"_pos, "=A1+A2+A3+A4");
+
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "5");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "1.0");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "1e3");
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetText(), "-0.25");
+    ASSERT_EQUAL(sheet->GetCell("A5"_pos)->GetText(), "'12");
+    ASSERT_EQUAL(sheet->GetCell("A5"_pos)->GetValue(), CellInterface::Value(std::string("12")));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1005.75));
+
+    ASSERT_EQUAL(concrete_sheet.GetDependentCells("A1"_pos), std::vector{"B1"_pos});
+    ASSERT(concrete_sheet.GetDependentCells("A5"_pos).empty());
+    ASSERT(concrete_sheet.GetDependentCells("B1"_pos).empty());
+}
+
+void TestDependencyGraphChain() {
+    DependencyGraph graph;
+    const int chain_length = 20000;
+    auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+
+    for(int i = 1; i < chain_length; ++i) {
+        graph.SetPrecedents(chain_pos(i), {chain_pos(i - 1)});
+    }
+    ASSERT_EQUAL(graph.EdgeCount(), static_cast<size_t>(chain_length - 1));
+    ASSERT_EQUAL(graph.NodeCount(), static_cast<size_t>(chain_length));
+    ASSERT_EQUAL(graph.GetDependents(chain_pos(0)), std::vector{chain_pos(1)});
+    ASSERT_EQUAL(graph.GetPrecedents(chain_pos(500)), std::vector{chain_pos(499)});
+
+    //Все ячейки ссылаются на первую: массив ребер первой вершины растет и переезжает
+    for(int i = 1; i < chain_length; ++i) {
+        graph.SetPrecedents(chain_pos(i), {chain_pos(0)});
+    }
+    ASSERT_EQUAL(graph.EdgeCount(), static_cast<size_t>(chain_length - 1));
+    ASSERT_EQUAL(graph.GetDependents(chain_pos(0)).size(), static_cast<size_t>(chain_length - 1));
+    ASSERT(graph.GetDependents(chain_pos(1)).empty());
+
+    for(int i = 1; i < chain_length; ++i) {
+        graph.SetPrecedents(chain_pos(i), {});
+    }
+    ASSERT_EQUAL(graph.EdgeCount(), 0u);
+    ASSERT_EQUAL(graph.NodeCount(), 0u);
+}
+
+void TestIncrementalCycleCheck() {
+    auto sheet = CreateSheet();
+    //Ромб - не цикл
+    sheet->SetCell("A1"_pos, "=1");
+    sheet->SetCell("B1"_pos, "=A1");
+    sheet->SetCell("C1"_pos, "=A1");
+    sheet->SetCell("D1"_pos, "=B1+C1");
+    sheet->SetCell("E1"_pos, "=D1+A1+B1");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("E1"_pos)->GetValue()), 4.0);
+
+    //Отклоненная формула не создает ни ячейку, ни ячейки по ссылкам
+    const Size size_before = sheet->GetPrintableSize();
+    try {
+        sheet->SetCell("Z20"_pos, "=Z20+Y30");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    ASSERT(sheet->GetCell("Z20"_pos) == nullptr);
+    ASSERT(sheet->GetCell("Y30"_pos) == nullptr);
+
+    try {
+        sheet->SetCell("Z20"_pos, "=Y30+");
+        ASSERT(false);
+    } catch(const FormulaException&) {
+    }
+    ASSERT(sheet->GetCell("Z20"_pos) == nullptr);
+    ASSERT(sheet->GetCell("Y30"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), size_before);
+
+    //Цикл через длинную цепочку: граф и ячейка не меняются
+    try {
+        sheet->SetCell("A1"_pos, "=X1+E1");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=1");
+    ASSERT(sheet->GetCell("X1"_pos) == nullptr);
+
+    const auto& concrete = static_cast<const Sheet&>(*sheet);
+    ASSERT(concrete.GetPrecedentCells("A1"_pos).empty());
+    ASSERT_EQUAL(concrete.GetDependentCells("A1"_pos), (std::vector{"B1"_pos, "C1"_pos, "E1"_pos}));
+}
+
+void TestTopologicalOrderRandom() {
+    const int cell_count = 40;
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> cell_dist(0, cell_count - 1);
+
+    DependencyGraph graph;
+    std::vector<std::vector<Position>> refs(cell_count);
+    auto cell_pos = [](int i) {
+        return Position{i, 0};
+    };
+
+    //Достижима ли ячейка to из from по ссылкам формул
+    auto reaches = [&](int from, int to) {
+        std::vector<bool> visited(cell_count);
+        std::vector<int> stack{from};
+        while(!stack.empty()) {
+            const int cur = stack.back();
+            stack.pop_back();
+            if(cur == to) {
+                return true;
+            }
+            for(const Position& ref : refs[cur]) {
+                if(!visited[ref.row]) {
+                    visited[ref.row] = true;
+                    stack.push_back(ref.row);
+                }
+            }
+        }
+        return false;
+    };
+
+    for(int step = 0; step < 3000; ++step) {
+        const int cell = cell_dist(gen);
+        std::vector<Position> new_refs;
+        for(int k = cell_dist(gen) % 4; k > 0; --k) {
+            new_refs.push_back(cell_pos(cell_dist(gen)));
+        }
+        std::sort(new_refs.begin(), new_refs.end());
+        new_refs.erase(std::unique(new_refs.begin(), new_refs.end()), new_refs.end());
+
+        bool has_cycle = false;
+        for(const Position& ref : new_refs) {
+            has_cycle = has_cycle || reaches(ref.row, cell);
+        }
+
+        bool caught = false;
+        try {
+            graph.SetPrecedents(cell_pos(cell), new_refs);
+        } catch(const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT_EQUAL(caught, has_cycle);
+        if(!caught) {
+            refs[cell] = new_refs;
+        }
+
+        //Граф совпадает с эталоном, порядок топологический
+        for(int i = 0; i < cell_count; ++i) {
+            ASSERT_EQUAL(graph.GetPrecedents(cell_pos(i)), refs[i]);
+            for(const Position& ref : refs[i]) {
+                ASSERT(graph.GetOrder(graph.FindNode(ref)) < graph.GetOrder(graph.FindNode(cell_pos(i))));
+            }
+        }
+    }
+}
+
+void TestEagerRecalc() {
+    auto lazy_sheet = std::make_unique<Sheet>();
+    auto eager_sheet = std::make_unique<Sheet>();
+    eager_sheet->SetRecalcMode(Sheet::RecalcMode::eager);
+    ASSERT(eager_sheet->GetRecalcMode() == Sheet::RecalcMode::eager);
+
+    auto set_both = [&](Position pos, const std::string& text) {
+        lazy_sheet->SetCell(pos, text);
+        eager_sheet->SetCell(pos, text);
+    };
+    auto check_equal = [&](const std::vector<Position>& cells) {
+        for(const Position& pos : cells) {
+            ASSERT_EQUAL(lazy_sheet->GetCell(pos)->GetValue(), eager_sheet->GetCell(pos)->GetValue());
+        }
+    };
+    const std::vector cells{"A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos, "E1"_pos};
+
+    set_both("B1"_pos, "=A1*2");
+    set_both("C1"_pos, "=A1+B1");
+    set_both("D1"_pos, "=B1/C1");
+    set_both("E1"_pos, "=D1+C1+B1");
+    set_both("A1"_pos, "3");
+    check_equal(cells);
+    ASSERT_EQUAL(std::get<double>(eager_sheet->GetCell("E1"_pos)->GetValue()), 6 + 9 + 6.0 / 9);
+
+    //Ошибки тоже пересчитываются без исключений
+    set_both("A1"_pos, "0");
+    check_equal(cells);
+    set_both("A1"_pos, "text");
+    check_equal(cells);
+    lazy_sheet->ClearCell("A1"_pos);
+    eager_sheet->ClearCell("A1"_pos);
+    check_equal({"B1"_pos, "C1"_pos, "D1"_pos, "E1"_pos});
+
+    //Переключение режима на заполненном листе
+    eager_sheet->SetRecalcMode(Sheet::RecalcMode::lazy);
+    set_both("A1"_pos, "5");
+    eager_sheet->SetRecalcMode(Sheet::RecalcMode::eager);
+    check_equal(cells);
+    ASSERT_EQUAL(std::get<double>(eager_sheet->GetCell("C1"_pos)->GetValue()), 15.0);
+}
+
+void TestThreadPool() {
+    ThreadPool pool(4);
+    ASSERT_EQUAL(pool.ThreadCount(), 4u);
+
+    std::vector<int> hits(10000);
+    for(int round = 0; round < 10; ++round) {
+        pool.ParallelFor(hits.size(), [&](size_t idx) {
+            ++hits[idx];
+        });
+    }
+    ASSERT(std::all_of(hits.begin(), hits.end(), [](int hit) { return hit == 10; }));
+
+    bool caught = false;
+    try {
+        pool.ParallelFor(100, [](size_t idx) {
+            if(idx == 42) {
+                throw std::runtime_error("task failed");
+            }
+        });
+    } catch(const std::runtime_error&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestParallelRecalc() {
+    //Независимые кластеры: в каждом цепочка с ветвлениями и ошибками
+    auto load = [](Sheet& sheet) {
+        for(int cluster = 0; cluster < 300; ++cluster) {
+            const int col = cluster * 2;
+            sheet.SetCell({0, col}, std::to_string(cluster % 7));
+            for(int row = 1; row < 20; ++row) {
+                const auto prev = Position{row - 1, col}.ToString();
+                const auto source = Position{0, col}.ToString();
+                sheet.SetCell({row, col}, "=" + prev + "/3+" + source + "/" + std::to_string(row % 5));
+                sheet.SetCell({row, col + 1}, "=" + prev + "*" + prev + "-1");
+            }
+        }
+    };
+
+    Sheet serial;
+    Sheet parallel;
+    parallel.SetRecalcThreads(4);
+    ASSERT_EQUAL(parallel.GetRecalcThreads(), 4u);
+    load(serial);
+    load(parallel);
+
+    auto check_identical = [&] {
+        const Size size = serial.GetPrintableSize();
+        for(int row = 0; row < size.rows; ++row) {
+            for(int col = 0; col < size.cols; ++col) {
+                ASSERT_EQUAL(serial.GetCell({row, col}) == nullptr, parallel.GetCell({row, col}) == nullptr);
+                if(!serial.GetCell({row, col})) {
+                    continue;
+                }
+                const auto lhs = serial.GetCell({row, col})->GetValue();
+                const auto rhs = parallel.GetCell({row, col})->GetValue();
+                ASSERT_EQUAL(lhs.index(), rhs.index());
+                if(std::holds_alternative<double>(lhs)) {
+                    const double lhs_value = std::get<double>(lhs);
+                    const double rhs_value = std::get<double>(rhs);
+                    ASSERT(std::memcmp(&lhs_value, &rhs_value, sizeof(double)) == 0);
+                }
+            }
+        }
+    };
+
+    parallel.Recalculate();
+    check_identical();
+
+    serial.SetRecalcMode(Sheet::RecalcMode::eager);
+    parallel.SetRecalcMode(Sheet::RecalcMode::eager);
+    for(int cluster = 0; cluster < 300; cluster += 3) {
+        serial.SetCell({0, cluster * 2}, std::to_string(cluster + 1));
+        parallel.SetCell({0, cluster * 2}, std::to_string(cluster + 1));
+    }
+    check_identical();
+}
+
+void TestBytecodeMatchesTree() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3");
+    sheet->SetCell("B1"_pos, "0.1");
+    sheet->SetCell("C1"_pos, "text");
+    sheet->SetCell("D1"_pos, "=1/0");
+    sheet->SetCell("E1"_pos, "1e300");
+
+    const std::vector<std::string> formulas{
+        "1", "A1", "-A1", "+(A1-B1)", "A1+B1*3-2/7", "(A1+B1)*(A1-B1)/-(B1+2)",
+        "A1/B1/B1*A1-(1-(2-(3-(4-(5-A1)))))", "F1+G1", "A1+C1", "D1*2", "A1/0", "E1*E1", "C1+D1",
+        "1/0+C1", "C1+1/0", "-(1e300*1e300)", "+A1", "--A1", "-(2*3)-B1*-4", "(1+2)/(A1-3)",
+        "1+2+3+4+5+6+7+8+9+10+11+12+13+14+15+16+17+18+19+20",
+        "1+(2+(3+(4+(5+(6+(7+(8+(9+(10+(11+(12+(13+(14+(15+(16+(17+(18+(19+(20+(21+(22+(23+(24+(25+"
+        "(26+(27+(28+(29+(30+(31+(32+(33+(34+A1)))))))))))))))))))))))))))))))))",
+        "SUM(A1:E1)", "MAX(A1,B1,C1)", "MIN(A1:B1,-A1)", "AVERAGE(F1:G1)", "COUNT(A1:E1,C1,1)",
+        "SUM(1,2,3)*SUM(A1:B1)", "SUM(C1+1,D1)", "MAX(D1,A1)", "AVERAGE(A1,B1,SUM(A1:B1,MAX(A1,4)))", "SUM(E1,E1)",
+    };
+
+    for(const auto& formula : formulas) {
+        const auto tree = ParseFormulaAST(formula, std::pmr::get_default_resource(), FormulaAST::Evaluator::tree);
+        const auto bytecode = ParseFormulaAST(formula);
+        ASSERT(tree.GetEvaluator() == FormulaAST::Evaluator::tree);
+        ASSERT(bytecode.GetEvaluator() == FormulaAST::Evaluator::bytecode);
+
+        std::ostringstream tree_text;
+        std::ostringstream bytecode_text;
+        tree.PrintFormula(tree_text);
+        bytecode.PrintFormula(bytecode_text);
+        ASSERT_EQUAL(tree_text.str(), bytecode_text.str());
+
+        const auto tree_value = tree.Execute(*sheet);
+        const auto bytecode_value = bytecode.Execute(*sheet);
+        ASSERT_EQUAL(tree_value.index(), bytecode_value.index());
+        if(std::holds_alternative<double>(tree_value)) {
+            const double lhs = std::get<double>(tree_value);
+            const double rhs = std::get<double>(bytecode_value);
+            ASSERT(std::memcmp(&lhs, &rhs, sizeof(double)) == 0);
+        } else {
+            ASSERT_EQUAL(std::get<FormulaError>(tree_value), std::get<FormulaError>(bytecode_value));
+        }
+    }
+}
+
+//Случайная формула по грамматике Formula.g4 для сверки парсеров
+std::string MakeRandomFormula(std::mt19937& rng, int depth) {
+    std::uniform_int_distribution<int> kind(0, depth > 0 ? 6 : 1);
+    switch(kind(rng)) {
+        case 0: {
+            static const std::vector<std::string> numbers{"0", "1", "42", "3.5", ".5", "2e3", "2E-3", "1.5e+2", "007"};
+            return numbers[std::uniform_int_distribution<size_t>(0, numbers.size() - 1)(rng)];
+        }
+        case 1: {
+            Position pos{std::uniform_int_distribution<int>(0, 40)(rng), std::uniform_int_distribution<int>(0, 40)(rng)};
+            return pos.ToString();
+        }
+        case 2:
+            return "(" + MakeRandomFormula(rng, depth - 1) + ")";
+        case 3:
+            return std::string(rng() % 2 ? "-" : "+") + MakeRandomFormula(rng, depth - 1);
+        case 6: {
+            static const std::vector<std::string> names{"SUM", "MIN", "MAX", "AVERAGE", "COUNT"};
+            std::string call = names[rng() % names.size()] + "(";
+            const int arg_count = 1 + static_cast<int>(rng() % 3);
+            for(int arg = 0; arg < arg_count; ++arg) {
+                call += arg > 0 ? "," : "";
+                call += rng() % 3 == 0 ? MakeRandomFormula(rng, 0) + ":" + MakeRandomFormula(rng, 0)
+                                       : MakeRandomFormula(rng, depth - 1);
+            }
+            return call + ")";
+        }
+        default: {
+            static const char ops[] = "+-*/";
+            const std::string spaces = rng() % 4 == 0 ? " " : "";
+            return MakeRandomFormula(rng, depth - 1) + spaces + ops[rng() % 4] + spaces + MakeRandomFormula(rng, depth - 1);
+        }
+    }
+}
+
+void TestNativeParserMatchesAntlr() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3");
+    sheet->SetCell("B2"_pos, "0.25");
+
+    std::vector<std::string> formulas{
+        "1", "1.", ".5", "2E3", "1e", "1e+", "1e-400", "1e400", "1.2.3", "A1B2", "ZZZZ1", "A0", "a1",
+        "XFD16384", "XFE1", "A16385", " 1 + A1 ", "\t(1)\n", "", " ", "()", "(1", "1)", "1+", "*1", "1 2",
+        "--+-1", "1+-+2", "A1*-B2", "A", "1$", "1..5", "A1.5", "1e5e5", "A1/0",
+        "SUM(A1)", "SUM(A1:B2)", "SUM( A1 : B2 , 1)", "SUM()", "SUM(A1:B2:C3)", "SUM(A1:1)", "SUM(1:A1)",
+        "SUMA1", "SUMX(1)", "SUM 1", "SUM(1,)", "A1:B2", "(A1:B2)", "MAX(ZZZZ1:A1)", "COUNT(A0,1)", "AVERAGE((A1))",
+    };
+    std::mt19937 rng(20240917);
+    for(int idx = 0; idx < 500; ++idx) {
+        formulas.push_back(MakeRandomFormula(rng, 6));
+    }
+    //Мусор из символов грамматики и рядом с ней
+    const std::string alphabet = "0123456789.eE+-*/() AZaz$\t";
+    for(int idx = 0; idx < 500; ++idx) {
+        std::string garbage(rng() % 12, ' ');
+        for(char& c : garbage) {
+            c = alphabet[rng() % alphabet.size()];
+        }
+        formulas.push_back(std::move(garbage));
+    }
+
+    //Какой ошибкой закончился разбор: 0 - успех, 1 - FormulaException, 2 - ошибка синтаксиса
+    auto parse = [](const std::string& formula, FormulaAST::Parser parser, std::optional<FormulaAST>& ast) {
+        try {
+            ast.emplace(ParseFormulaAST(formula, std::pmr::get_default_resource(), FormulaAST::Evaluator::bytecode, parser));
+            return 0;
+        } catch(const FormulaException&) {
+            return 1;
+        } catch(const std::exception&) {
+            return 2;
+        }
+    };
+    for(const auto& formula : formulas) {
+        std::optional<FormulaAST> native;
+        std::optional<FormulaAST> antlr;
+        const int native_result = parse(formula, FormulaAST::Parser::native, native);
+        const int antlr_result = parse(formula, FormulaAST::Parser::antlr, antlr);
+        AssertEqual(native_result, antlr_result, formula);
+        if(native_result != 0) {
+            continue;
+        }
+
+        std::ostringstream native_text;
+        std::ostringstream antlr_text;
+        native->PrintFormula(native_text);
+        antlr->PrintFormula(antlr_text);
+        AssertEqual(native_text.str(), antlr_text.str(), formula);
+
+        native_text.str({});
+        antlr_text.str({});
+        native->Print(native_text);
+        antlr->Print(antlr_text);
+        AssertEqual(native_text.str(), antlr_text.str(), formula);
+
+        const auto native_cells = native->GetReferencedCells();
+        const auto antlr_cells = antlr->GetReferencedCells();
+        Assert(std::equal(native_cells.begin(), native_cells.end(), antlr_cells.begin(), antlr_cells.end()), formula);
+
+        const auto native_value = native->Execute(*sheet);
+        const auto antlr_value = antlr->Execute(*sheet);
+        AssertEqual(native_value.index(), antlr_value.index(), formula);
+        if(std::holds_alternative<double>(native_value)) {
+            const double lhs = std::get<double>(native_value);
+            const double rhs = std::get<double>(antlr_value);
+            Assert(std::memcmp(&lhs, &rhs, sizeof(double)) == 0, formula);
+        }
+    }
+}
+
+void TestFormulaErrorBoxing() {
+    for(auto category : {FormulaError::Category::Ref, FormulaError::Category::Value, FormulaError::Category::Arithmetic}) {
+        const double boxed = FormulaError(category).Box();
+        ASSERT(std::isnan(boxed));
+        ASSERT(FormulaError::IsBoxed(boxed));
+        ASSERT_EQUAL(FormulaError::Unbox(boxed), FormulaError(category));
+    }
+    ASSERT(!FormulaError::IsBoxed(1.0));
+    //NaN и бесконечности из арифметики - не упакованные ошибки
+    const double zero = 0.0;
+    ASSERT(!FormulaError::IsBoxed(zero / zero));
+    ASSERT(!FormulaError::IsBoxed(std::numeric_limits<double>::quiet_NaN()));
+    ASSERT(!FormulaError::IsBoxed(std::numeric_limits<double>::infinity()));
+
+    //Первой остается ошибка, возникшая первой в порядке вычисления
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "text");
+    sheet->SetCell("B1"_pos, "=1/0");
+    sheet->SetCell("C1"_pos, "=A1+B1");
+    sheet->SetCell("D1"_pos, "=B1+A1");
+    sheet->SetCell("E1"_pos, "=-(A1*2)/0");
+    sheet->SetCell("F1"_pos, "=1e300*1e300+A1");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet->GetCell("F1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+}
+
+void TestErrorValueCache() {
+    Sheet sheet;
+    //Цепочка B1..B100 от ошибки в A1
+    sheet.SetCell("A1"_pos, "=1/0");
+    for(int row = 0; row < 100; ++row) {
+        const std::string ref = row == 0 ? "A1" : Position{row - 1, 1}.ToString();
+        sheet.SetCell({row, 1}, "=" + ref + "+1");
+    }
+
+    //Каждая формула вычисляется один раз, ошибки берутся из кеша
+    const uint64_t before_print = sheet.GetFormulaEvaluationCount();
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before_print, 101u);
+    sheet.PrintValues(out);
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before_print, 101u);
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    //Изменение корня сбрасывает кешированные ошибки
+    sheet.SetCell("A1"_pos, "=1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B100"_pos)->GetValue()), 101.0);
+    sheet.SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    const uint64_t before_read = sheet.GetFormulaEvaluationCount();
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before_read, 50u);
+}
+
+void TestEagerEarlyCutoff() {
+    Sheet sheet;
+    sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+    sheet.SetCell("A1"_pos, "5");
+    for(int row = 0; row < 100; ++row) {
+        const std::string ref = row == 0 ? "A1" : Position{row - 1, 1}.ToString();
+        sheet.SetCell({row, 1}, "=" + ref + "+1");
+    }
+    //C1 не зависит от значения A1, его зависимые D1..D100 не пересчитываются
+    sheet.SetCell("C1"_pos, "=A1*0");
+    for(int row = 0; row < 100; ++row) {
+        const std::string ref = row == 0 ? "C1" : Position{row - 1, 3}.ToString();
+        sheet.SetCell({row, 3}, "=" + ref + "+1");
+    }
+
+    //"Touch": то же значение другим текстом - вычисляется только сама ячейка
+    uint64_t before = sheet.GetFormulaEvaluationCount();
+    sheet.SetCell("A1"_pos, "=5");
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before, 1u);
+    before = sheet.GetFormulaEvaluationCount();
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before, 0u);
+
+    //Отсечение внутри: B1..B100 и C1 пересчитываются, D1..D100 - нет
+    before = sheet.GetFormulaEvaluationCount();
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before, 101u);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B100"_pos)->GetValue()), 107.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D100"_pos)->GetValue()), 100.0);
+
+    //Ошибка тоже сравнивается как значение
+    sheet.SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    before = sheet.GetFormulaEvaluationCount();
+    sheet.SetCell("A1"_pos, "other text");
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before, 0u);
+
+    //Очистка ячейки: 0 вместо 0
+    sheet.SetCell("A1"_pos, "0");
+    before = sheet.GetFormulaEvaluationCount();
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before, 0u);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B100"_pos)->GetValue()), 100.0);
+}
+
+void TestLazyInvalidationStopsAtDirtyCells() {
+    Sheet sheet;
+    //Ромб A1 -> B1, C1 -> D1 и цепочка от D1
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=A1*10");
+    sheet.SetCell("D1"_pos, "=B1+C1");
+    for(int row = 1; row < 50; ++row) {
+        sheet.SetCell({row, 3}, "=" + Position{row - 1, 3}.ToString() + "+1");
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D50"_pos)->GetValue()), 12.0 + 49);
+
+    //Повторные правки без чтения: зависимые уже без кеша
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A1"_pos, "3");
+    //Частичное чтение: B1 вычислен, D1 и цепочка - нет
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 4.0);
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 40.0);
+    sheet.SetCell("B1"_pos, "=A1-1");
+
+    const uint64_t before = sheet.GetFormulaEvaluationCount();
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D50"_pos)->GetValue()), 43.0 + 49);
+    //Каждая ячейка без кеша вычисляется один раз: B1, D1..D50 (C1 в кеше)
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount() - before, 51u);
+}
+
+void TestDeepChainEvaluation() {
+    //Нарастающий итог на 200000 ячеек: колонка B - значения, колонка C - сумма (змейкой по парам колонок)
+    const int length = 200000;
+    auto value_pos = [](int idx) {
+        return Position{idx % Position::MAX_ROWS, 2 * (idx / Position::MAX_ROWS)};
+    };
+    auto total_pos = [&](int idx) {
+        return Position{value_pos(idx).row, value_pos(idx).col + 1};
+    };
+
+    Sheet sheet;
+    for(int idx = 0; idx < length; ++idx) {
+        sheet.SetCell(value_pos(idx), "1");
+        const std::string prev = idx == 0 ? "0" : total_pos(idx - 1).ToString();
+        sheet.SetCell(total_pos(idx), "=" + prev + "+" + value_pos(idx).ToString());
+    }
+
+    //Холодное чтение конца цепочки не уходит в рекурсию на 200000 уровней
+    const auto last = total_pos(length - 1);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell(last)->GetValue()), static_cast<double>(length));
+    ASSERT_EQUAL(sheet.GetFormulaEvaluationCount(), static_cast<uint64_t>(length));
+
+    //Ошибка в начале цепочки доходит до конца
+    sheet.SetCell(value_pos(0), "text");
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    //Цепочка со ссылкой на большой разреженный диапазон: проверяются только ячейки диапазона, а не вся его площадь
+    class CountingSheet : public Sheet {
+    public:
+        mutable size_t get_cell_calls = 0;
+
+        const CellInterface* GetCell(Position pos) const override {
+            ++get_cell_calls;
+            return Sheet::GetCell(pos);
+        }
+        CellInterface* GetCell(Position pos) override {
+            ++get_cell_calls;
+            return Sheet::GetCell(pos);
+        }
+    };
+    CountingSheet sparse;
+    sparse.SetCell("A1"_pos, "1");
+    sparse.SetCell("M8000"_pos, "=A1*2");
+    sparse.SetCell("Z16000"_pos, "3");
+    const int chain = 2000;
+    for(int row = 0; row < chain; ++row) {
+        const std::string prev = row == 0 ? "0" : Position{row - 1, 27}.ToString();
+        sparse.SetCell({row, 27}, "=" + prev + "+SUM(A1:Z16000)");
+    }
+    sparse.get_cell_calls = 0;
+    ASSERT_EQUAL(sparse.GetCell({chain - 1, 27})->GetValue(), CellInterface::Value(6.0 * chain));
+    ASSERT(sparse.get_cell_calls < static_cast<size_t>(20 * chain));
+}
+
+void TestBatchEdit() {
+    for(auto mode : {Sheet::RecalcMode::lazy, Sheet::RecalcMode::eager}) {
+        Sheet sheet;
+        sheet.SetRecalcMode(mode);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+
+        //До CommitBatch лист не меняется, у ячейки учитывается только последнее изменение
+        sheet.BeginBatch();
+        ASSERT(sheet.IsInBatch());
+        sheet.SetCell("A1"_pos, "=");
+        sheet.SetCell("A2"_pos, "=A1*10");
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("C1"_pos, "=B1+A2");
+        sheet.SetCell("D1"_pos, "text");
+        sheet.ClearCell("D1"_pos);
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 2.0);
+        sheet.CommitBatch();
+        ASSERT(!sheet.IsInBatch());
+
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 5.0);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 56.0);
+        ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 3}));
+        ASSERT_EQUAL(sheet.GetDependentCells("A1"_pos), (std::vector<Position>{"B1"_pos, "A2"_pos}));
+
+        std::ostringstream before;
+        sheet.PrintTexts(before);
+        auto assert_unchanged = [&] {
+            std::ostringstream after;
+            sheet.PrintTexts(after);
+            ASSERT_EQUAL(after.str(), before.str());
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 56.0);
+            ASSERT_EQUAL(sheet.GetDependentCells("A1"_pos), (std::vector<Position>{"B1"_pos, "A2"_pos}));
+            ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+        };
+
+        //Цикл через несколько ячеек пакета: откат всего пакета
+        sheet.BeginBatch();
+        sheet.SetCell("E1"_pos, "=F5");
+        sheet.SetCell("A1"_pos, "=C1");
+        sheet.SetCell("B1"_pos, "=A1");
+        try {
+            sheet.CommitBatch();
+            ASSERT(false);
+        } catch(const CircularDependencyException&) {
+        }
+        ASSERT(!sheet.IsInBatch());
+        assert_unchanged();
+
+        //Ошибка разбора формулы: лист тоже не меняется
+        sheet.BeginBatch();
+        sheet.SetCell("E1"_pos, "=F5");
+        sheet.SetCell("A1"_pos, "=1+");
+        try {
+            sheet.CommitBatch();
+            ASSERT(false);
+        } catch(const FormulaException&) {
+        }
+        assert_unchanged();
+
+        sheet.BeginBatch();
+        sheet.SetCell("E1"_pos, "=F5");
+        sheet.RollbackBatch();
+        sheet.CommitBatch();
+        assert_unchanged();
+
+        //Ссылка меняет направление: старое B1 -> A1 и новое A1 -> B1 в одном пакете - не цикл
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "=B1*2");
+        sheet.SetCell("B1"_pos, "7");
+        sheet.CommitBatch();
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 7.0 + 140);
+    }
+
+    //Большой пакет (больше ребер, чем в графе) проверяется одной сортировкой графа
+    Sheet sheet;
+    sheet.BeginBatch();
+    for(int row = 1; row < 1000; ++row) {
+        sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    }
+    sheet.SetCell({0, 0}, "=A1000");
+    try {
+        sheet.CommitBatch();
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetDependencyGraph().NodeCount(), 0u);
+    ASSERT(sheet.GetCell({500, 0}) == nullptr);
+
+    sheet.BeginBatch();
+    for(int row = 999; row > 0; --row) {
+        sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    }
+    sheet.SetCell({0, 0}, "1");
+    sheet.CommitBatch();
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({999, 0})->GetValue()), 1000.0);
+    const auto& graph = sheet.GetDependencyGraph();
+    ASSERT(graph.GetOrder(graph.FindNode({0, 0})) < graph.GetOrder(graph.FindNode({999, 0})));
+}
+
+void TestRangeFunctions() {
+    using namespace std::literals;
+    using Value = CellInterface::Value;
+    for(auto mode : {Sheet::RecalcMode::lazy, Sheet::RecalcMode::eager}) {
+        Sheet sheet;
+        sheet.SetRecalcMode(mode);
+        for(int row = 0; row < 500; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row + 1));
+        }
+        sheet.SetCell("B1"_pos, "=SUM(A1:A500)");
+        sheet.SetCell("B2"_pos, "=MIN(A1:A500)");
+        sheet.SetCell("B3"_pos, "=MAX(A500:A1)");
+        sheet.SetCell("B4"_pos, "=AVERAGE(A1:A500)");
+        sheet.SetCell("B5"_pos, "=COUNT(A1:A500,C1:C10)");
+        auto value = [&sheet](Position pos) {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        ASSERT_EQUAL(value("B1"_pos), Value(125250.0));
+        ASSERT_EQUAL(value("B2"_pos), Value(1.0));
+        ASSERT_EQUAL(value("B3"_pos), Value(500.0));
+        ASSERT_EQUAL(value("B4"_pos), Value(250.5));
+        ASSERT_EQUAL(value("B5"_pos), Value(500.0));
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=MAX(A1:A500)"s);
+
+        //Диапазон - одна вершина графа и одно ребро на формулу, у ячеек диапазона вершин нет
+        const auto& graph = sheet.GetDependencyGraph();
+        ASSERT_EQUAL(graph.RangeCount(), 2u);
+        ASSERT_EQUAL(graph.EdgeCount(), 6u);
+        ASSERT_EQUAL(graph.NodeCount(), 5u);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetReferencedCells().size(), 500u);
+        ASSERT_EQUAL(sheet.GetDependentCells("A7"_pos),
+                     (std::vector{"B1"_pos, "B2"_pos, "B3"_pos, "B4"_pos, "B5"_pos}));
+
+        //Изменение ячейки без вершины доходит до формул через диапазон
+        sheet.SetCell("A1"_pos, "1001");
+        ASSERT_EQUAL(value("B1"_pos), Value(126250.0));
+        ASSERT_EQUAL(value("B2"_pos), Value(2.0));
+        ASSERT_EQUAL(value("B3"_pos), Value(1001.0));
+
+        //Текстовые и пустые ячейки пропускаются
+        sheet.SetCell("A2"_pos, "text");
+        sheet.ClearCell("A3"_pos);
+        ASSERT_EQUAL(value("B1"_pos), Value(126245.0));
+        ASSERT_EQUAL(value("B2"_pos), Value(4.0));
+        ASSERT_EQUAL(value("B4"_pos), Value(126245.0 / 498));
+        ASSERT_EQUAL(value("B5"_pos), Value(498.0));
+        //пустая ячейка и 0 равны как операнды, но COUNT их различает
+        sheet.SetCell("A3"_pos, "0");
+        ASSERT_EQUAL(value("B5"_pos), Value(499.0));
+        ASSERT_EQUAL(value("B2"_pos), Value(0.0));
+        sheet.ClearCell("A3"_pos);
+        ASSERT_EQUAL(value("B5"_pos), Value(498.0));
+
+        //Формула внутри диапазона вычисляется раньше функции
+        sheet.SetCell("A4"_pos, "=A5*2");
+        ASSERT_EQUAL(value("B1"_pos), Value(126251.0));
+        sheet.SetCell("A5"_pos, "6");
+        ASSERT_EQUAL(value("B1"_pos), Value(126254.0));
+
+        //Ошибки: SUM, MIN, MAX передают первую, COUNT не считает; пустой набор
+        sheet.SetCell("C1"_pos, "=1/0");
+        sheet.SetCell("B6"_pos, "=SUM(C1:C10)+1");
+        sheet.SetCell("B7"_pos, "=MAX(A1:A10,C1)");
+        sheet.SetCell("B8"_pos, "=AVERAGE(D1:D5)");
+        sheet.SetCell("B9"_pos, "=MIN(D1:D5)+COUNT(D1:D5)");
+        ASSERT_EQUAL(value("B5"_pos), Value(498.0));
+        ASSERT_EQUAL(value("B6"_pos), Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("B7"_pos), Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("B8"_pos), Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("B9"_pos), Value(0.0));
+
+        //Ячейка-аргумент берется по ссылке (текст пропускается), выражение - по значению
+        sheet.SetCell("B10"_pos, "=SUM(A2,A4,2*A4)");
+        sheet.SetCell("B11"_pos, "=SUM(A2+0,C1)");
+        ASSERT_EQUAL(value("B10"_pos), Value(36.0));
+        ASSERT_EQUAL(value("B11"_pos), Value(FormulaError::Category::Value));
+        //#VALUE! формулы и текст равны как операнды, но текст в MIN пропускается
+        sheet.SetCell("D1"_pos, "=A2*1");
+        sheet.SetCell("B12"_pos, "=MIN(D1)");
+        ASSERT_EQUAL(value("B12"_pos), Value(FormulaError::Category::Value));
+        sheet.SetCell("D1"_pos, "text");
+        ASSERT_EQUAL(value("B12"_pos), Value(0.0));
+        sheet.ClearCell("B12"_pos);
+
+        //Циклы через диапазон, ячейка не меняется
+        for(const auto& [pos, text] : {std::pair{"A10"_pos, "=B1"s}, {"A10"_pos, "=SUM(A1:A20)"s}, {"C5"_pos, "=B5+1"s}}) {
+            try {
+                sheet.SetCell(pos, text);
+                ASSERT(false);
+            } catch(const CircularDependencyException&) {
+            }
+        }
+        ASSERT_EQUAL(value("A10"_pos), Value(10.0));
+        ASSERT(sheet.GetCell("C5"_pos) == nullptr);
+
+        //Вершина диапазона освобождается вместе с последней формулой
+        sheet.SetCell("B5"_pos, "=1");
+        sheet.SetCell("B6"_pos, "1");
+        sheet.SetCell("B7"_pos, "1");
+        //A1:A500, C1:C10 и ячейки-аргументы A2, A4, C1 (диапазоны из одной ячейки)
+        ASSERT_EQUAL(graph.RangeCount(), 5u);
+        ASSERT_EQUAL(sheet.GetDependentCells("C1"_pos), std::vector{"B11"_pos});
+        ASSERT_EQUAL(value("B1"_pos), Value(126254.0));
+    }
+
+    //Разбор: печать без пробелов, ячейки диапазонов в отсортированном списке без повторов
+    auto formula = ParseFormula("SUM(B2:A1, 3 ,(C1))+B1");
+    ASSERT_EQUAL(formula->GetExpression(), "SUM(A1:B2,3,C1)+B1"s);
+    ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"A1"_pos, "B1"_pos, "C1"_pos, "A2"_pos, "B2"_pos}));
+    for(const auto& text : {"SUM()", "SUM(A1:B2+1)", "A1:B2", "SUMX(1)", "sum(1)", "SUM(A1:ZZZZ1)", "COUNT(1,)"}) {
+        try {
+            ParseFormula(text);
+            ASSERT(false);
+        } catch(const FormulaException&) {
+        }
+    }
+
+    //Глубокая цепочка через диапазоны вычисляется без рекурсии
+    Sheet chain;
+    chain.SetCell("A1"_pos, "1");
+    for(int row = 1; row < Position::MAX_ROWS; ++row) {
+        const std::string prev = Position{row - 1, 0}.ToString();
+        chain.SetCell({row, 0}, "=SUM(" + prev + ":" + prev + ")+1");
+    }
+    ASSERT_EQUAL(chain.GetCell({Position::MAX_ROWS - 1, 0})->GetValue(), Value(static_cast<double>(Position::MAX_ROWS)));
+}
+
+void TestRangeIndex() {
+    RangeIndex<int> index;
+    std::vector<std::pair<Range, int>> reference;
+    std::mt19937 gen(17);
+    std::uniform_int_distribution<int> coord_dist(0, 30);
+    auto random_pos = [&] {
+        return Position{coord_dist(gen), coord_dist(gen) / 3};
+    };
+
+    //Сверка с перебором на случайных вставках и удалениях
+    for(int step = 0; step < 4000; ++step) {
+        if(reference.empty() || gen() % 3 != 0) {
+            const auto range = Range::FromCorners(random_pos(), random_pos());
+            if(index.Find(range) == nullptr) {
+                index.Insert(range, step);
+                reference.push_back({range, step});
+            }
+        } else {
+            const size_t victim = gen() % reference.size();
+            ASSERT(index.Erase(reference[victim].first));
+            ASSERT(!index.Erase(reference[victim].first));
+            reference.erase(reference.begin() + victim);
+        }
+        ASSERT_EQUAL(index.Size(), reference.size());
+
+        const Position pos = random_pos();
+        std::vector<int> found;
+        index.ForEachContaining(pos, [&found](const Range&, int value) {
+            found.push_back(value);
+        });
+        std::vector<int> expected;
+        for(const auto& [range, value] : reference) {
+            if(range.Contains(pos)) {
+                expected.push_back(value);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        std::sort(expected.begin(), expected.end());
+        ASSERT_EQUAL(found, expected);
+        ASSERT_EQUAL(index.Contains(pos), !expected.empty());
+    }
+
+    //Скользящие окна: ячейка находит только окна, которые ее покрывают
+    RangeIndex<int> windows;
+    for(int row = 0; row < 10000; ++row) {
+        windows.Insert({{row, 0}, {row + 9, 0}}, row);
+    }
+    std::vector<int> found;
+    windows.ForEachContaining({5000, 0}, [&found](const Range&, int value) {
+        found.push_back(value);
+    });
+    std::sort(found.begin(), found.end());
+    ASSERT_EQUAL(found, (std::vector{4991, 4992, 4993, 4994, 4995, 4996, 4997, 4998, 4999, 5000}));
+    ASSERT(!windows.Contains({5000, 1}));
+}
+
+void TestRangeTotals() {
+    using Value = CellInterface::Value;
+    for(auto mode : {Sheet::RecalcMode::lazy, Sheet::RecalcMode::eager}) {
+        Sheet sheet;
+        sheet.SetRecalcMode(mode);
+        double expected_sum = 0;
+        for(int row = 0; row < 1000; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row % 10));
+            expected_sum += row % 10;
+        }
+        sheet.SetCell("B1"_pos, "=SUM(A1:A1000)");
+        sheet.SetCell("B2"_pos, "=COUNT(A1:A1000)");
+        sheet.SetCell("B3"_pos, "=AVERAGE(A1:A1000)+SUM(A1:A1000,1)");
+        auto value = [&sheet](Position pos) {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        ASSERT_EQUAL(value("B1"_pos), Value(expected_sum));
+
+        //Правки чисел, текста и пустых ячеек меняют итоги на разность, дольше EXACT_TOTALS_PERIOD
+        std::mt19937 gen(5);
+        std::vector<std::optional<double>> column(1000);
+        for(int row = 0; row < 1000; ++row) {
+            column[row] = row % 10;
+        }
+        auto column_sum = [&column] {
+            double sum = 0;
+            for(const auto& number : column) {
+                sum += number.value_or(0);
+            }
+            return sum;
+        };
+        auto column_count = [&column] {
+            return static_cast<double>(std::count_if(column.begin(), column.end(), [](const auto& number) {
+                return number.has_value();
+            }));
+        };
+        for(int step = 0; step < 3000; ++step) {
+            const int row = static_cast<int>(gen() % 1000);
+            switch(gen() % 4) {
+                case 0:
+                    sheet.SetCell({row, 0}, "text");
+                    column[row].reset();
+                    break;
+                case 1:
+                    sheet.ClearCell({row, 0});
+                    column[row].reset();
+                    break;
+                default: {
+                    const double number = static_cast<double>(gen() % 1000) / 4;
+                    sheet.SetCell({row, 0}, std::to_string(number));
+                    column[row] = number;
+                }
+            }
+            if(step % 100 == 0) {
+                ASSERT_EQUAL(value("B1"_pos), Value(column_sum()));
+                ASSERT_EQUAL(value("B2"_pos), Value(column_count()));
+                ASSERT_EQUAL(value("B3"_pos), Value(column_sum() / column_count() + column_sum() + 1));
+            }
+        }
+
+        //Формула в диапазоне: изменение ее значения сбрасывает итоги
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=C1*2");
+        sheet.SetCell("C1"_pos, "5");
+        column[0] = 1;
+        column[1] = 10;
+        ASSERT_EQUAL(value("B1"_pos), Value(column_sum()));
+        sheet.SetCell("C1"_pos, "7");
+        column[1] = 14;
+        ASSERT_EQUAL(value("B1"_pos), Value(column_sum()));
+        sheet.SetCell("C1"_pos, "=1/0");
+        ASSERT_EQUAL(value("B1"_pos), Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("B2"_pos), Value(column_count() - 1));
+        sheet.ClearCell("A2"_pos);
+        column[1].reset();
+        ASSERT_EQUAL(value("B1"_pos), Value(column_sum()));
+        ASSERT_EQUAL(value("B2"_pos), Value(column_count()));
+    }
+
+    //Параллельный пересчет: много формул над одним диапазоном читают одни итоги
+    Sheet sheet;
+    sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+    sheet.SetRecalcThreads(4);
+    for(int row = 0; row < 600; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "=SUM(A1:A600)+" + std::to_string(row));
+    }
+    sheet.SetCell("C1"_pos, "=A1");
+    sheet.SetCell("A1"_pos, "1000");
+    sheet.Recalculate();
+    for(int row = 0; row < 600; ++row) {
+        ASSERT_EQUAL(sheet.GetCell({row, 1})->GetValue(), Value(179700.0 + 1000 + row));
+    }
+
+    //Итоги складываются тем же ядром, что и значения SUM без итогов: с округлением результат тот же
+    class NoTotalsSheet : public Sheet {
+    public:
+        std::optional<RangeTotals> GetRangeTotals(Range) const override {
+            return std::nullopt;
+        }
+    };
+    Sheet with_totals;
+    NoTotalsSheet without_totals;
+    for(Sheet* target : {&with_totals, static_cast<Sheet*>(&without_totals)}) {
+        for(int row = 0; row < 70; ++row) {
+            target->SetCell({row, 0}, row % 2 != 0 ? "1" : row % 4 == 0 ? "1e16" : "-1e16");
+        }
+        target->SetCell("B1"_pos, "=SUM(A1:A70)");
+        target->SetCell("B2"_pos, "=SUM(A1:A70,0.5,A1:A70)");
+        target->SetCell("B3"_pos, "=AVERAGE(A1:A70)");
+    }
+    for(const auto pos : {"B1"_pos, "B2"_pos, "B3"_pos}) {
+        ASSERT_EQUAL(with_totals.GetCell(pos)->GetValue(), without_totals.GetCell(pos)->GetValue());
+    }
+}
+
+void TestSharedFormulas() {
+    using namespace std::literals;
+    using Value = CellInterface::Value;
+    //Протянутая вниз формула: одна форма на весь столбец
+    const int rows = 1000;
+    Sheet shared_sheet;
+    Sheet distinct_sheet;
+    for(int row = 0; row < rows; ++row) {
+        const std::string n = std::to_string(row + 1);
+        shared_sheet.SetCell({row, 0}, std::to_string(row));
+        shared_sheet.SetCell({row, 1}, "2");
+        shared_sheet.SetCell({row, 2}, "=A" + n + "*B" + n);
+        shared_sheet.SetCell({row, 3}, "=SUM(A" + n + ":C" + n + ")+C" + n);
+        //формулы с разными константами не делят AST
+        distinct_sheet.SetCell({row, 0}, std::to_string(row));
+        distinct_sheet.SetCell({row, 1}, "2");
+        distinct_sheet.SetCell({row, 2}, "=A" + n + "*" + std::to_string(row + 2));
+        distinct_sheet.SetCell({row, 3}, "=SUM(A" + n + ":C" + n + ")+" + std::to_string(row + 2));
+    }
+    ASSERT_EQUAL(shared_sheet.GetSharedFormulaCount(), 2u);
+    //в арене и AST, и данные формул ячеек, которые у формул одной формы не общие
+    ASSERT(shared_sheet.GetAllocationStats().requested.bytes_in_use * 3
+           < distinct_sheet.GetAllocationStats().requested.bytes_in_use);
+
+    //Текст, ссылки и значения - свои у каждой ячейки
+    ASSERT_EQUAL(shared_sheet.GetCell("C500"_pos)->GetText(), "=A500*B500"s);
+    ASSERT_EQUAL(shared_sheet.GetCell("D7"_pos)->GetText(), "=SUM(A7:C7)+C7"s);
+    ASSERT_EQUAL(shared_sheet.GetCell("D7"_pos)->GetReferencedCells(),
+                 (std::vector<Position>{"A7"_pos, "B7"_pos, "C7"_pos}));
+    ASSERT_EQUAL(shared_sheet.GetPrecedentCells("C42"_pos), (std::vector<Position>{"A42"_pos, "B42"_pos}));
+    ASSERT_EQUAL(shared_sheet.GetDependentCells("C42"_pos), (std::vector<Position>{"D42"_pos}));
+    ASSERT_EQUAL(shared_sheet.GetCell("C500"_pos)->GetValue(), Value(998.0));
+    ASSERT_EQUAL(shared_sheet.GetCell("D500"_pos)->GetValue(), Value(499.0 + 2 + 998 * 2));
+
+    //Изменение одной ячейки не трогает формулы других ячеек той же формы
+    shared_sheet.SetCell("A500"_pos, "10");
+    shared_sheet.SetCell("C501"_pos, "=A501+B501");
+    ASSERT_EQUAL(shared_sheet.GetCell("C500"_pos)->GetValue(), Value(20.0));
+    ASSERT_EQUAL(shared_sheet.GetCell("C501"_pos)->GetValue(), Value(502.0));
+    ASSERT_EQUAL(shared_sheet.GetCell("C502"_pos)->GetValue(), Value(1002.0));
+
+    //Ссылки влево, вверх и к краю листа; форма из другой ячейки - та же
+    Sheet sheet;
+    sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("B2"_pos, "=A1+1");
+    sheet.SetCell("C3"_pos, "=B2+1");
+    sheet.SetCell("D4"_pos, "=C3+1");
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 1u);
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), Value(6.0));
+    sheet.SetCell("A1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), Value(FormulaError::Category::Arithmetic));
+    sheet.SetCell("XFD16384"_pos, "=XFC16383");
+    sheet.SetCell("XFC16383"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("XFD16384"_pos)->GetValue(), Value(7.0));
+    ASSERT_EQUAL(sheet.GetCell("XFD16384"_pos)->GetText(), "=XFC16383"s);
+
+    //Цикл через формулы одной формы
+    try {
+        sheet.SetCell("A1"_pos, "=D4+1");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    //Неверная формула не попадает в кеш
+    try {
+        sheet.SetCell("E5"_pos, "=D4+");
+        ASSERT(false);
+    } catch(const FormulaException&) {
+    }
+    ASSERT(sheet.GetCell("E5"_pos) == nullptr);
+
+    //Пакет и форма, AST которой уже освобождено
+    for(int row = 0; row < 4; ++row) {
+        sheet.ClearCell({row, row});
+    }
+    sheet.BeginBatch();
+    for(int row = 1; row < 100; ++row) {
+        sheet.SetCell({row, 1}, "=A" + std::to_string(row) + "+1");
+    }
+    sheet.SetCell("A1"_pos, "1");
+    sheet.CommitBatch();
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), Value(1.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetText(), "=A99+1"s);
+
+    //Кеш формул сам по себе
+    FormulaCache cache;
+    auto first = cache.Parse("A1 + MAX(B1:C2)", "D5"_pos);
+    auto second = cache.Parse("A2 + MAX(B2:C3)", "D6"_pos);
+    ASSERT_EQUAL(cache.Size(), 1u);
+    ASSERT_EQUAL(second->GetExpression(), "A2+MAX(B2:C3)"s);
+    const auto ranges = second->GetReferencedRanges();
+    ASSERT(std::vector<Range>(ranges.begin(), ranges.end()) == (std::vector<Range>{Range{"B2"_pos, "C3"_pos}}));
+    first.reset();
+    ASSERT_EQUAL(second->GetReferencedCells().size(), 5u);
+}
+
+void TestColumnBlocks() {
+    using Value = CellInterface::Value;
+    //Протянутые формулы с ошибками, текстом, пустыми ячейками и делением на 0 в операндах
+    const int rows = 300;
+    Sheet lazy_sheet;
+    Sheet eager_sheet;
+    for(auto* sheet : {&lazy_sheet, &eager_sheet}) {
+        for(int row = 0; row < rows; ++row) {
+            const std::string n = std::to_string(row + 1);
+            if(row % 37 == 5) {
+                sheet->SetCell({row, 0}, "text");
+            } else if(row % 41 == 7) {
+                sheet->SetCell({row, 0}, "=1/0");
+            } else if(row % 43 != 9) {
+                sheet->SetCell({row, 0}, std::to_string(row) + ".5");
+            }
+            sheet->SetCell({row, 2}, std::to_string(row % 5));
+            sheet->SetCell({row, 1}, "=A" + n + "/C" + n + "-(A" + n + "-C" + n + ")*2");
+            sheet->SetCell({row, 3}, "=SUM(A" + n + ":C" + n + ")+B" + n);
+        }
+    }
+    ASSERT_EQUAL(eager_sheet.GetFormulaEvaluationCount(), 0u);
+    eager_sheet.SetRecalcMode(Sheet::RecalcMode::eager);
+    //Каждая формула вычислена один раз
+    const uint64_t formula_count = 2 * rows + rows / 41 + 1;
+    ASSERT_EQUAL(eager_sheet.GetFormulaEvaluationCount(), formula_count);
+
+    auto check_same = [&] {
+        for(int row = 0; row < rows; ++row) {
+            for(int col = 1; col < 4; col += 2) {
+                ASSERT_EQUAL(eager_sheet.GetCell({row, col})->GetValue(), lazy_sheet.GetCell({row, col})->GetValue());
+            }
+        }
+    };
+    check_same();
+    ASSERT_EQUAL(eager_sheet.GetCell("B2"_pos)->GetValue(), Value(1.5 / 1 - 0.5 * 2));
+    ASSERT_EQUAL(eager_sheet.GetCell("B1"_pos)->GetValue(), Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(eager_sheet.GetCell("B6"_pos)->GetValue(), Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(eager_sheet.GetCell("B8"_pos)->GetValue(), Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(eager_sheet.GetCell("B10"_pos)->GetValue(), Value(8.0));
+    ASSERT_EQUAL(eager_sheet.GetCell("D10"_pos)->GetValue(), Value(20.0));
+    ASSERT_EQUAL(eager_sheet.GetCell("D8"_pos)->GetValue(), Value(FormulaError::Category::Arithmetic));
+
+    //Пересчет и пакет в eager режиме идут теми же блоками
+    eager_sheet.SetRecalcThreads(4);
+    eager_sheet.Recalculate();
+    ASSERT_EQUAL(eager_sheet.GetFormulaEvaluationCount(), 2 * formula_count);
+    check_same();
+    eager_sheet.BeginBatch();
+    lazy_sheet.BeginBatch();
+    for(int row = 0; row < rows; ++row) {
+        eager_sheet.SetCell({row, 2}, std::to_string(row % 3 + 1));
+        lazy_sheet.SetCell({row, 2}, std::to_string(row % 3 + 1));
+    }
+    eager_sheet.CommitBatch();
+    lazy_sheet.CommitBatch();
+    check_same();
+}
+
+void TestLoadTexts() {
+    using namespace std::literals;
+    using Value = CellInterface::Value;
+    auto texts = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    };
+    auto values = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    };
+
+    //PrintTexts и обратно: больше буфера чтения и окна разбора, формулы разбираются в потоках
+    Sheet source;
+    const int rows = 4000;
+    for(int row = 0; row < rows; ++row) {
+        const std::string n = std::to_string(row + 1);
+        source.SetCell({row, 0}, std::to_string(row) + ".25");
+        source.SetCell({row, 1}, row % 7 == 0 ? "'=text" : "text " + n);
+        for(int col = 2; col < 30; ++col) {
+            source.SetCell({row, col}, "=A" + n + "*" + std::to_string(col) + "+SUM(A" + n + ":B" + n + ")");
+        }
+        if(row % 100 == 0) {
+            source.SetCell({row, 40}, "=Z" + n + "/0");
+        }
+    }
+    Sheet loaded;
+    loaded.SetRecalcThreads(4);
+    loaded.SetRecalcMode(Sheet::RecalcMode::eager);
+    std::istringstream tsv(texts(source));
+    loaded.LoadTexts(tsv);
+    ASSERT_EQUAL(loaded.GetFormulaEvaluationCount(), static_cast<uint64_t>(rows * 28 + rows / 100));
+    ASSERT(loaded.GetPrintableSize() == source.GetPrintableSize());
+    ASSERT(texts(loaded) == texts(source));
+    ASSERT(values(loaded) == values(source));
+    ASSERT_EQUAL(loaded.GetPrecedentCells("C17"_pos), std::vector<Position>{"A17"_pos});
+    ASSERT_EQUAL(loaded.GetSharedFormulaCount(), 29u);
+
+    //csv: кавычки, разделители и переводы строк в поле, \r\n
+    Sheet sheet;
+    sheet.SetCell("C1"_pos, "old");
+    sheet.SetCell("A3"_pos, "kept");
+    std::istringstream csv("\"a,b\",2\r\n\"line1\nline2\",\"say \"\"hi\"\"\",\"\"\r\n,=B1*2\r\n");
+    sheet.LoadTexts(csv, Sheet::TableFormat::csv);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "a,b"s);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "line1\nline2"s);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "say \"hi\""s);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "old"s);
+    ASSERT(sheet.GetCell("C2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "kept"s);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), Value(4.0));
+
+    //Ошибка в любой ячейке таблицы - лист как до загрузки
+    const std::string before = texts(sheet);
+    auto load_fails = [&](const std::string& table) {
+        std::istringstream input(table);
+        try {
+            sheet.LoadTexts(input);
+            return false;
+        } catch(const FormulaException&) {
+        } catch(const CircularDependencyException&) {
+        } catch(const InvalidPositionException&) {
+        }
+        return texts(sheet) == before;
+    };
+    ASSERT(load_fails("1\t2\n=1+\n"));
+    ASSERT(load_fails("=B5\n\n\n\n=A1\t=A5\n"));
+    ASSERT(load_fails("1\n" + std::string(Position::MAX_COLS, '\t') + "x\n"));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), Value(2.0));
+
+    //В пакете таблица только запоминается
+    sheet.BeginBatch();
+    std::istringstream batch_table("5\n\t=A1+B1");
+    sheet.LoadTexts(batch_table);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "a,b"s);
+    sheet.SetCell("B1"_pos, "10");
+    sheet.CommitBatch();
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), Value(15.0));
+}
+
+void TestSnapshot() {
+    using namespace std::literals;
+    using Value = CellInterface::Value;
+    auto texts = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    };
+    auto values = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    };
+
+    Sheet source;
+    const int rows = 300;
+    for(int row = 0; row < rows; ++row) {
+        const std::string n = std::to_string(row + 1);
+        source.SetCell({row, 0}, std::to_string(row) + ".5");
+        source.SetCell({row, 1}, row % 5 == 0 ? "'=text" : row % 5 == 1 ? "007" : "text " + n);
+        source.SetCell({row, 2}, "=A" + n + "*2+SUM(A1:A" + n + ")");
+        source.SetCell({row, 3}, "=C" + n + "/0");
+    }
+    source.SetCell("F1"_pos, "=SUM(C1:C300)");
+    source.SetCell("F2"_pos, "=G5");
+    source.SetCell("F3"_pos, "=1+2");
+    const std::string source_values = values(source);
+
+    //Через файл: значения формул из снимка, без вычислений
+    const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+    {
+        std::ofstream output(path, std::ios::binary);
+        source.SaveSnapshot(output);
+    }
+    Sheet loaded;
+    loaded.LoadSnapshot(path);
+    std::filesystem::remove(path);
+    ASSERT(loaded.GetPrintableSize() == source.GetPrintableSize());
+    ASSERT(texts(loaded) == texts(source));
+    ASSERT(values(loaded) == source_values);
+    ASSERT_EQUAL(loaded.GetFormulaEvaluationCount(), 0u);
+    ASSERT_EQUAL(loaded.GetSharedFormulaCount(), source.GetSharedFormulaCount());
+    ASSERT_EQUAL(loaded.GetCell("B1"_pos)->GetText(), "'=text"s);
+    ASSERT_EQUAL(loaded.GetCell("B2"_pos)->GetText(), "007"s);
+    ASSERT_EQUAL(loaded.GetCell("B2"_pos)->GetValue(), Value(7.0));
+    ASSERT(loaded.GetCell("G5"_pos) != nullptr && loaded.GetCell("G5"_pos)->GetText().empty());
+    ASSERT_EQUAL(loaded.GetDependentCells("C3"_pos), source.GetDependentCells("C3"_pos));
+
+    //Граф и диапазоны снимка работают: изменения доходят до зависимых
+    loaded.SetCell("A1"_pos, "100.5");
+    source.SetCell("A1"_pos, "100.5");
+    loaded.SetCell("G5"_pos, "=F3*2");
+    source.SetCell("G5"_pos, "=F3*2");
+    ASSERT(values(loaded) == values(source));
+    ASSERT_EQUAL(loaded.GetCell("F2"_pos)->GetValue(), Value(6.0));
+    try {
+        loaded.SetCell("A1"_pos, "=F1");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+
+    //Без значений: eager вычисляет формулы при загрузке
+    std::ostringstream without_values;
+    source.SaveSnapshot(without_values, false);
+    const std::string snapshot = without_values.str();
+    Sheet eager;
+    eager.SetRecalcMode(Sheet::RecalcMode::eager);
+    eager.LoadSnapshot(snapshot.data(), snapshot.size());
+    ASSERT_EQUAL(eager.GetFormulaEvaluationCount(), static_cast<uint64_t>(2 * rows + 4));
+    ASSERT(values(eager) == values(source));
+    //итоги диапазонов снимка есть сразу, без правок листа
+    ASSERT(eager.GetRangeTotals(Range{"C1"_pos, "C300"_pos}).has_value());
+
+    //Поврежденный снимок - SnapshotException, лист остается пустым
+    auto load_fails = [&texts](const std::string& data) {
+        Sheet sheet;
+        try {
+            sheet.LoadSnapshot(data.data(), data.size());
+            return false;
+        } catch(const SnapshotException&) {
+        }
+        return sheet.GetPrintableSize() == Size{0, 0} && texts(sheet).empty();
+    };
+    ASSERT(load_fails(""));
+    ASSERT(load_fails("NOTASNAPSHOT" + snapshot.substr(12)));
+    for(size_t size : {8ul, 16ul, 100ul, snapshot.size() / 2, snapshot.size() - 8}) {
+        ASSERT(load_fails(snapshot.substr(0, size)));
+    }
+    std::string other_version = snapshot;
+    ++other_version[8];
+    ASSERT(load_fails(other_version));
+    std::string bad_form = snapshot;
+    bad_form.replace(bad_form.find("A1*2"), 4, "A1*)");
+    ASSERT(load_fails(bad_form));
+    //любой измененный байт ловит CRC32
+    for(size_t idx = 0; idx < snapshot.size(); idx += 97) {
+        std::string flipped = snapshot;
+        flipped[idx] ^= static_cast<char>(1 << (idx % 8));
+        ASSERT(load_fails(flipped));
+    }
+    //и с верной CRC32 форма не сдвигается за пределы листа: A2 ссылалась бы на B16385
+    Sheet filled;
+    filled.SetCell("A1"_pos, "=B1+123456");
+    filled.SetCell("A2"_pos, "=B2+123456");
+    std::ostringstream filled_snapshot;
+    filled.SaveSnapshot(filled_snapshot);
+    std::string shifted_out = filled_snapshot.str();
+    ASSERT(!load_fails(shifted_out));
+    shifted_out.replace(shifted_out.find("B1+123456"), 9, "B16384+12");
+    const uint64_t crc = Crc32(shifted_out.data(), shifted_out.size() - 8);
+    std::memcpy(shifted_out.data() + shifted_out.size() - 8, &crc, sizeof(crc));
+    ASSERT(load_fails(shifted_out));
+
+    //Только в пустой лист
+    try {
+        loaded.LoadSnapshot(snapshot.data(), snapshot.size());
+        ASSERT(false);
+    } catch(const std::logic_error&) {
+    }
+    try {
+        MappedFile missing(path);
+        ASSERT(false);
+    } catch(const SnapshotException&) {
+    }
+}
+
+void TestJournal() {
+    using namespace std::literals;
+    using Value = CellInterface::Value;
+    auto texts = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    };
+    const auto directory = std::filesystem::temp_directory_path();
+    const auto journal_path = (directory / "spreadsheet_test.journal").string();
+    const auto snapshot_path = (directory / "spreadsheet_test.snapshot").string();
+    std::filesystem::remove(journal_path);
+    std::filesystem::remove(snapshot_path);
+    auto recover = [&](Sheet& sheet) {
+        if(std::filesystem::exists(snapshot_path)) {
+            sheet.LoadSnapshot(snapshot_path);
+        }
+        sheet.OpenJournal(journal_path);
+    };
+
+    std::string expected;
+    {
+        Sheet sheet;
+        sheet.OpenJournal(journal_path);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("B1"_pos, "text");
+        sheet.SetCell("B2"_pos, "x");
+        sheet.ClearCell("B2"_pos);
+        //Неудачные изменения не записываются
+        try {
+            sheet.SetCell("A1"_pos, "=A2");
+            ASSERT(false);
+        } catch(const CircularDependencyException&) {
+        }
+        try {
+            sheet.SetCell("C1"_pos, "=1+");
+            ASSERT(false);
+        } catch(const FormulaException&) {
+        }
+        sheet.BeginBatch();
+        sheet.SetCell("C1"_pos, "=SUM(A1:A2)");
+        sheet.SetCell("C2"_pos, "=C1*2");
+        sheet.CommitBatch();
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "=C2");
+        try {
+            sheet.CommitBatch();
+            ASSERT(false);
+        } catch(const CircularDependencyException&) {
+        }
+        std::istringstream table("\t\t\t5\n\t\t\t=D1*3");
+        sheet.LoadTexts(table);
+        expected = texts(sheet);
+        ASSERT(sheet.GetJournalSize() > 16);
+    }
+
+    //Восстановление после "сбоя": журнал применяется одним пакетом
+    {
+        Sheet sheet;
+        recover(sheet);
+        ASSERT(texts(sheet) == expected);
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), Value(15.0));
+        ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+        try {
+            sheet.LoadSnapshot(nullptr, 0);
+            ASSERT(false);
+        } catch(const std::logic_error&) {
+        }
+    }
+
+    //Оборванный последний кадр отбрасывается, новые кадры пишутся после последнего целого
+    const auto whole_size = std::filesystem::file_size(journal_path);
+    {
+        std::ofstream(journal_path, std::ios::binary | std::ios::app) << "\x20\0\0\0garbage"s;
+        Sheet sheet;
+        recover(sheet);
+        ASSERT(texts(sheet) == expected);
+        ASSERT_EQUAL(sheet.GetJournalSize(), whole_size);
+        sheet.SetCell("E1"_pos, "after");
+        expected = texts(sheet);
+    }
+    {
+        Sheet sheet;
+        recover(sheet);
+        ASSERT(texts(sheet) == expected);
+    }
+
+    //Групповой сброс: кадры пишутся группами
+    {
+        Sheet sheet;
+        sheet.OpenJournal(journal_path, 100);
+        const auto synced_size = std::filesystem::file_size(journal_path);
+        for(int row = 0; row < 10; ++row) {
+            sheet.SetCell({row, 5}, std::to_string(row));
+        }
+        ASSERT_EQUAL(std::filesystem::file_size(journal_path), synced_size);
+        ASSERT(sheet.GetJournalSize() > synced_size);
+        sheet.SyncJournal();
+        ASSERT_EQUAL(std::filesystem::file_size(journal_path), sheet.GetJournalSize());
+        sheet.SetCell("F11"_pos, "=SUM(F1:F10)");
+        expected = texts(sheet);
+    }
+
+    //Снимок очищает журнал; повторное применение журнала к снимку ничего не меняет
+    const auto old_journal = journal_path + ".old";
+    {
+        Sheet sheet;
+        recover(sheet);
+        ASSERT(texts(sheet) == expected);
+        std::filesystem::copy_file(journal_path, old_journal, std::filesystem::copy_options::overwrite_existing);
+        sheet.Checkpoint(snapshot_path);
+        ASSERT_EQUAL(sheet.GetJournalSize(), 16u);
+        ASSERT_EQUAL(std::filesystem::file_size(journal_path), 16u);
+        sheet.SetCell("A1"_pos, "10");
+        expected = texts(sheet);
+    }
+    {
+        Sheet sheet;
+        recover(sheet);
+        ASSERT(texts(sheet) == expected);
+        ASSERT_EQUAL(sheet.GetCell("F11"_pos)->GetValue(), Value(45.0));
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), Value(42.0));
+        sheet.CloseJournal();
+        ASSERT_EQUAL(sheet.GetJournalSize(), 0u);
+    }
+    std::filesystem::rename(old_journal, journal_path);
+    {
+        Sheet sheet;
+        recover(sheet);
+        ASSERT_EQUAL(sheet.GetCell("F11"_pos)->GetValue(), Value(45.0));
+    }
+
+    //Оборванная запись (например, кончилось место) не дублируется повторным Sync
+    {
+        class ShortWriteJournal : public Journal {
+        public:
+            using Journal::Journal;
+            bool short_write = true;
+
+        protected:
+            size_t WriteFile(const char* data, size_t size) override {
+                if(short_write) {
+                    short_write = false;
+                    return Journal::WriteFile(data, size / 2);
+                }
+                return Journal::WriteFile(data, size);
+            }
+        };
+        {
+            ShortWriteJournal journal(journal_path, 0, 100);
+            journal.Add(Journal::Op::set, "A1"_pos, "first");
+            journal.CommitFrame();
+            journal.Add(Journal::Op::set, "A2"_pos, "second");
+            journal.CommitFrame();
+            try {
+                journal.Sync();
+                ASSERT(false);
+            } catch(const JournalException&) {
+            }
+            journal.Add(Journal::Op::clear, "A1"_pos);
+            journal.CommitFrame();
+            journal.Sync();
+            ASSERT_EQUAL(std::filesystem::file_size(journal_path), journal.Size());
+        }
+        std::ifstream in(journal_path, std::ios::binary);
+        const std::string data{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+        std::vector<std::string> edits;
+        const auto read_size = Journal::Read(data.data(), data.size(), [&](Journal::Op op, Position pos, std::string_view text) {
+            edits.push_back(std::to_string(static_cast<int>(op)) + pos.ToString() + std::string(text));
+        });
+        ASSERT_EQUAL(read_size, data.size());
+        ASSERT((edits == std::vector<std::string>{"1A1first", "1A2second", "2A1"}));
+    }
+
+    std::ofstream(journal_path, std::ios::binary | std::ios::trunc) << "not a journal";
+    try {
+        Sheet sheet;
+        sheet.OpenJournal(journal_path);
+        ASSERT(false);
+    } catch(const JournalException&) {
+    }
+    std::filesystem::remove(journal_path);
+    std::filesystem::remove(snapshot_path);
+}
+
+void TestExportFormat() {
+    //Выгрузка как прежний вывод: каждая ячейка печатной области через operator<< потока
+    auto reference = [](const Sheet& sheet, std::ostream& out, bool values) {
+        const Size size = sheet.GetPrintableSize();
+        for(int row = 0; row < size.rows; ++row) {
+            for(int col = 0; col < size.cols; ++col) {
+                if(col > 0) {
+                    out << '\t';
+                }
+                const auto cell = sheet.GetCell({row, col});
+                if(!cell) {
+                    continue;
+                }
+                if(values) {
+                    std::visit([&out](const auto& value) {
+                        out << value;
+                    }, cell->GetValue());
+                } else {
+                    out << cell->GetText();
+                }
+            }
+            out << '\n';
+        }
+    };
+    auto matches = [&](const Sheet& sheet, const std::function<void(std::ostream&)>& set_format) {
+        for(const bool values : {true, false}) {
+            std::ostringstream expected;
+            std::ostringstream actual;
+            set_format(expected);
+            set_format(actual);
+            reference(sheet, expected, values);
+            if(values) {
+                sheet.PrintValues(actual);
+            } else {
+                sheet.PrintTexts(actual);
+            }
+            if(actual.str() != expected.str()) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    Sheet sheet;
+    const std::vector<std::string> texts{
+        "0", "-0", "1.5", "0.1", "1e-7", "123456789", "1234567", "1e21", "-2.5e-300", "007", "1.0",
+        "=0.1+0.2", "=1/3", "=2/3*1000000", "=1/0", "=A1+ZZ1", "=1e300*1e10", "=A100", "'=escaped", "'", "text",
+    };
+    for(size_t idx = 0; idx < texts.size(); ++idx) {
+        sheet.SetCell({static_cast<int>(idx), static_cast<int>(idx % 3) * 70}, texts[idx]);
+    }
+    //пустые ячейки, на которые ссылаются формулы, - в индексе
+    sheet.SetCell({30, 1}, "=B200+C31");
+    sheet.SetCell({200, 139}, "last");
+    ASSERT(sheet.GetCell({30, 2}) != nullptr);
+    ASSERT(matches(sheet, [](std::ostream&) {}));
+    ASSERT(matches(sheet, [](std::ostream& out) {
+        out.precision(12);
+    }));
+    ASSERT(matches(sheet, [](std::ostream& out) {
+        out << std::fixed << std::setprecision(2);
+    }));
+    ASSERT(matches(sheet, [](std::ostream& out) {
+        out << std::scientific << std::uppercase << std::showpos;
+    }));
+    ASSERT(matches(Sheet{}, [](std::ostream&) {}));
+
+    //больше буфера выгрузки
+    Sheet large;
+    for(int row = 0; row < 3000; ++row) {
+        for(int col = 0; col < 100; col += 3) {
+            large.SetCell({row, col}, std::to_string(row * 0.37 + col) + "1");
+        }
+    }
+    ASSERT(matches(large, [](std::ostream&) {}));
+}
+
+void TestExportValues() {
+    auto print_values = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    auto fill = [](Sheet& sheet) {
+        for(int row = 0; row < 3000; ++row) {
+            const std::string n = std::to_string(row + 1);
+            sheet.SetCell({row, 0}, std::to_string(row * 0.37));
+            sheet.SetCell({row, 1}, row % 11 == 0 ? "'text" : "=A" + n + "/" + std::to_string(row % 5));
+            if(row > 0) {
+                sheet.SetCell({row, 2}, "=C" + std::to_string(row) + "+B" + n);
+            }
+            if(row % 7 == 0) {
+                sheet.SetCell({row, 3 + row % 40}, "=SUM(A1:A" + n + ")");
+            }
+        }
+    };
+
+    Sheet expected_sheet;
+    fill(expected_sheet);
+    const std::string expected = print_values(expected_sheet);
+
+    //Формулы без кеша вычисляются до выгрузки, полосы - в потоках
+    for(const size_t threads : {1, 4}) {
+        Sheet sheet;
+        sheet.SetRecalcThreads(threads);
+        fill(sheet);
+        std::ostringstream out;
+        sheet.ExportValues(out);
+        ASSERT(out.str() == expected);
+        const auto evaluations = sheet.GetFormulaEvaluationCount();
+        std::ostringstream again;
+        again << std::fixed;
+        sheet.ExportValues(again);
+        ASSERT_EQUAL(sheet.GetFormulaEvaluationCount(), evaluations);
+        std::ostringstream fixed;
+        fixed << std::fixed;
+        expected_sheet.PrintValues(fixed);
+        ASSERT(again.str() == fixed.str());
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    Sheet sheet;
+    sheet.SetRecalcThreads(4);
+    fill(sheet);
+    std::FILE* file = std::tmpfile();
+    sheet.ExportValues(fileno(file));
+    std::rewind(file);
+    std::string exported(expected.size() + 1, '\0');
+    exported.resize(std::fread(exported.data(), 1, exported.size(), file));
+    std::fclose(file);
+    ASSERT(exported == expected);
+#endif
 }
 
 void PrintSheet(std::ostream& out, const std::unique_ptr<SheetInterface>& sheet) {
@@ -459,7 +2251,12 @@ void TestCyclic2() {
 
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
+    if(argc > 1 && std::string_view(argv[1]) == "--bench") {
+        RunBenchmarks(std::cout);
+        return 0;
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
@@ -481,6 +2278,33 @@ int main() {
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
     RUN_TEST(tr, TestDependentCellHandling);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestSheetArenaStats);
+    RUN_TEST(tr, TestCompactCell);
+    RUN_TEST(tr, TestDependencyGraphChain);
+    RUN_TEST(tr, TestIncrementalCycleCheck);
+    RUN_TEST(tr, TestTopologicalOrderRandom);
+    RUN_TEST(tr, TestEagerRecalc);
+    RUN_TEST(tr, TestThreadPool);
+    RUN_TEST(tr, TestParallelRecalc);
+    RUN_TEST(tr, TestBytecodeMatchesTree);
+    RUN_TEST(tr, TestNativeParserMatchesAntlr);
+    RUN_TEST(tr, TestFormulaErrorBoxing);
+    RUN_TEST(tr, TestErrorValueCache);
+    RUN_TEST(tr, TestEagerEarlyCutoff);
+    RUN_TEST(tr, TestLazyInvalidationStopsAtDirtyCells);
+    RUN_TEST(tr, TestDeepChainEvaluation);
+    RUN_TEST(tr, TestBatchEdit);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestRangeIndex);
+    RUN_TEST(tr, TestRangeTotals);
+    RUN_TEST(tr, TestSharedFormulas);
+    RUN_TEST(tr, TestColumnBlocks);
+    RUN_TEST(tr, TestLoadTexts);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestJournal);
+    RUN_TEST(tr, TestExportFormat);
+    RUN_TEST(tr, TestExportValues);
     // RUN_TEST(tr, TestClearPrint);
     RUN_TEST(tr, TestExample);
     RUN_TEST(tr, TestCyclic2);
@@ -0,0 +1,257 @@
+#pragma once
+
+#include "common.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+
+//Индекс диапазонов для поиска всех диапазонов, содержащих ячейку.
+//Декартово дерево (treap) диапазонов, упорядоченных по столбцу, затем по строке левого верхнего угла;
+//в каждой вершине - прямоугольник, охватывающий все диапазоны поддерева (как в R-дереве).
+//Поиск заходит только в поддеревья, чей прямоугольник содержит ячейку: для диапазонов одного
+//столбца это дерево интервалов строк, O(log n + k), k - число найденных диапазонов.
+//Время не зависит от площади диапазонов. Вершины лежат в одном векторе, освобожденные переиспользуются.
+template <typename T>
+class RangeIndex {
+public:
+    //Добавляет диапазон, которого еще нет в индексе
+    void Insert(Range range, T value) {
+        assert(Find(range) == nullptr);
+        uint32_t entry;
+        if(!free_entries_.empty()) {
+            entry = free_entries_.back();
+            free_entries_.pop_back();
+        } else {
+            entry = static_cast<uint32_t>(entries_.size());
+            entries_.emplace_back();
+        }
+        entries_[entry] = Entry{range, std::move(value), NextPriority(), NONE, NONE, range};
+        root_ = Insert(root_, entry);
+        ++size_;
+    }
+
+    //Удаляет диапазон; false, если его нет
+    bool Erase(Range range) {
+        const size_t size_before = size_;
+        root_ = Erase(root_, range);
+        return size_ != size_before;
+    }
+
+    const T* Find(Range range) const {
+        uint32_t entry = root_;
+        while(entry != NONE) {
+            const Entry& current = entries_[entry];
+            if(current.range == range) {
+                return &current.value;
+            }
+            entry = Less(range, current.range) ? current.left : current.right;
+        }
+        return nullptr;
+    }
+
+    //Вызывает func(range, value) для всех диапазонов, содержащих pos
+    template <typename Func>
+    void ForEachContaining(Position pos, Func&& func) const {
+        ForEachContaining(root_, pos, func);
+    }
+
+    bool Contains(Position pos) const {
+        bool found = false;
+        ForEachContaining(pos, [&found](const Range&, const T&) {
+            found = true;
+        });
+        return found;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    size_t MemoryUsage() const {
+        return sizeof(*this) + entries_.capacity() * sizeof(Entry) + free_entries_.capacity() * sizeof(uint32_t);
+    }
+
+    //Снимок индекса (см. snapshot.h): вершины дерева пишутся как есть и при загрузке не перестраиваются
+    void Save(SnapshotWriter& out) const {
+        out.WriteArray(entries_);
+        out.WriteArray(free_entries_);
+        out.Write(root_);
+        out.Write(random_state_);
+        out.Write(static_cast<uint64_t>(size_));
+    }
+
+    //SnapshotException, если ссылки дерева снимка выходят за вершины или дерево не совпадает с размером
+    void Load(SnapshotReader& in) {
+        in.ReadArray(entries_);
+        in.ReadArray(free_entries_);
+        root_ = in.Read<uint32_t>();
+        random_state_ = in.Read<uint32_t>();
+        size_ = static_cast<size_t>(in.Read<uint64_t>());
+
+        const bool has_bad_free = std::any_of(free_entries_.begin(), free_entries_.end(), [this](uint32_t entry) {
+            return entry == NONE || entry >= entries_.size();
+        });
+        if(entries_.empty() || root_ >= entries_.size() || has_bad_free) {
+            throw SnapshotException("Range index in snapshot is corrupted");
+        }
+        //каждая вершина достижима из корня ровно один раз
+        std::vector<bool> visited(entries_.size());
+        std::vector<uint32_t> stack;
+        size_t reached = 0;
+        if(root_ != NONE) {
+            stack.push_back(root_);
+        }
+        while(!stack.empty()) {
+            const uint32_t entry = stack.back();
+            stack.pop_back();
+            if(entry >= entries_.size() || visited[entry]) {
+                throw SnapshotException("Range index in snapshot is corrupted");
+            }
+            visited[entry] = true;
+            ++reached;
+            for(const uint32_t child : {entries_[entry].left, entries_[entry].right}) {
+                if(child != NONE) {
+                    stack.push_back(child);
+                }
+            }
+        }
+        if(reached != size_) {
+            throw SnapshotException("Range index in snapshot is corrupted");
+        }
+    }
+
+private:
+    static constexpr uint32_t NONE = 0;
+
+    struct Entry {
+        Range range;
+        T value{};
+        uint32_t priority = 0;
+        uint32_t left = NONE;
+        uint32_t right = NONE;
+        //Прямоугольник, охватывающий диапазоны поддерева
+        Range bounds;
+    };
+
+    //Вершина 0 не используется (NONE)
+    std::vector<Entry> entries_{Entry{}};
+    std::vector<uint32_t> free_entries_;
+    uint32_t root_ = NONE;
+    size_t size_ = 0;
+    uint32_t random_state_ = 2463534242u;
+
+    //xorshift32: приоритеты treap, детерминированные от запуска к запуску
+    uint32_t NextPriority() {
+        random_state_ ^= random_state_ << 13;
+        random_state_ ^= random_state_ >> 17;
+        random_state_ ^= random_state_ << 5;
+        return random_state_;
+    }
+
+    static bool Less(const Range& lhs, const Range& rhs) {
+        return std::tie(lhs.first.col, lhs.first.row, lhs.last.col, lhs.last.row)
+               < std::tie(rhs.first.col, rhs.first.row, rhs.last.col, rhs.last.row);
+    }
+
+    void Update(uint32_t entry) {
+        Entry& current = entries_[entry];
+        current.bounds = current.range;
+        for(uint32_t child : {current.left, current.right}) {
+            if(child == NONE) {
+                continue;
+            }
+            const Range& child_bounds = entries_[child].bounds;
+            current.bounds.first.row = std::min(current.bounds.first.row, child_bounds.first.row);
+            current.bounds.first.col = std::min(current.bounds.first.col, child_bounds.first.col);
+            current.bounds.last.row = std::max(current.bounds.last.row, child_bounds.last.row);
+            current.bounds.last.col = std::max(current.bounds.last.col, child_bounds.last.col);
+        }
+    }
+
+    //Делит поддерево на диапазоны < range (left) и > range (right)
+    void Split(uint32_t entry, const Range& range, uint32_t& left, uint32_t& right) {
+        if(entry == NONE) {
+            left = right = NONE;
+            return;
+        }
+        if(Less(entries_[entry].range, range)) {
+            Split(entries_[entry].right, range, entries_[entry].right, right);
+            left = entry;
+        } else {
+            Split(entries_[entry].left, range, left, entries_[entry].left);
+            right = entry;
+        }
+        Update(entry);
+    }
+
+    //Все диапазоны left меньше всех диапазонов right
+    uint32_t Merge(uint32_t left, uint32_t right) {
+        if(left == NONE || right == NONE) {
+            return left == NONE ? right : left;
+        }
+        if(entries_[left].priority > entries_[right].priority) {
+            entries_[left].right = Merge(entries_[left].right, right);
+            Update(left);
+            return left;
+        }
+        entries_[right].left = Merge(left, entries_[right].left);
+        Update(right);
+        return right;
+    }
+
+    uint32_t Insert(uint32_t root, uint32_t entry) {
+        if(root == NONE) {
+            return entry;
+        }
+        if(entries_[entry].priority > entries_[root].priority) {
+            Split(root, entries_[entry].range, entries_[entry].left, entries_[entry].right);
+            Update(entry);
+            return entry;
+        }
+        if(Less(entries_[entry].range, entries_[root].range)) {
+            entries_[root].left = Insert(entries_[root].left, entry);
+        } else {
+            entries_[root].right = Insert(entries_[root].right, entry);
+        }
+        Update(root);
+        return root;
+    }
+
+    uint32_t Erase(uint32_t root, const Range& range) {
+        if(root == NONE) {
+            return NONE;
+        }
+        Entry& current = entries_[root];
+        if(current.range == range) {
+            const uint32_t merged = Merge(current.left, current.right);
+            entries_[root] = Entry{};
+            free_entries_.push_back(root);
+            --size_;
+            return merged;
+        }
+        if(Less(range, current.range)) {
+            current.left = Erase(current.left, range);
+        } else {
+            current.right = Erase(current.right, range);
+        }
+        Update(root);
+        return root;
+    }
+
+    template <typename Func>
+    void ForEachContaining(uint32_t entry, Position pos, Func& func) const {
+        //Правые поддеревья обходятся в цикле: рекурсия только влево, глубина - высота дерева
+        while(entry != NONE && entries_[entry].bounds.Contains(pos)) {
+            const Entry& current = entries_[entry];
+            ForEachContaining(current.left, pos, func);
+            if(current.range.Contains(pos)) {
+                func(current.range, current.value);
+            }
+            entry = current.right;
+        }
+    }
+};
@@ -1,31 +1,292 @@
 #include "sheet.h"
 
+#include "FormulaAST.h"
 #include "cell.h"
 #include "common.h"
+#include "snapshot.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <locale>
 #include <optional>
+#include <sstream>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
 
 using namespace std::literals;
 
+namespace {
+//Ссылки формулы для графа: отдельные ячейки без повторов и диапазоны
+DependencyGraph::CellRefs GetFormulaRefs(Position pos, const FormulaInterface* formula) {
+    DependencyGraph::CellRefs cell_refs{pos, {}, {}};
+    if(!formula) {
+        return cell_refs;
+    }
+    const auto refs = formula->GetReferencedCellsRange();
+    cell_refs.refs.assign(refs.begin(), refs.end());
+    cell_refs.refs.erase(std::unique(cell_refs.refs.begin(), cell_refs.refs.end()), cell_refs.refs.end());
+    const auto ranges = formula->GetReferencedRanges();
+    cell_refs.ranges.assign(ranges.begin(), ranges.end());
+    return cell_refs;
+}
+
+//Читает таблицу блоками по TABLE_BUFFER_SIZE байт и вызывает on_field(pos, text) для каждого непустого поля.
+//Строки разделены '\n' ("\r\n" тоже), поля - separator. quoted (csv): поле, начатое кавычкой, продолжается
+//до закрывающей кавычки, в том числе через разделители и переводы строк, "" в нем - кавычка
+template<typename OnField>
+void ReadTable(std::istream& input, char separator, bool quoted, OnField on_field) {
+    constexpr size_t TABLE_BUFFER_SIZE = 1 << 20;
+    std::vector<char> buffer(TABLE_BUFFER_SIZE);
+    std::string field;
+    Position pos{0, 0};
+    bool at_field_start = true;
+    bool in_quotes = false;
+    //Предыдущий символ - закрывающая кавычка: следующая кавычка - экранированная
+    bool after_quotes = false;
+
+    auto end_field = [&](bool is_row_end) {
+        if(is_row_end && !field.empty() && field.back() == '\r') {
+            field.pop_back();
+        }
+        if(!field.empty()) {
+            on_field(pos, field);
+            field.clear();
+        }
+        at_field_start = true;
+        after_quotes = false;
+    };
+    auto is_stop = [separator, quoted](char ch) {
+        return ch == separator || ch == '\n' || (quoted && ch == '"');
+    };
+
+    for(;;) {
+        input.read(buffer.data(), buffer.size());
+        const char* it = buffer.data();
+        const char* const last = it + input.gcount();
+        if(it == last) {
+            break;
+        }
+        while(it != last) {
+            if(in_quotes) {
+                const char* const quote = std::find(it, last, '"');
+                field.append(it, quote);
+                if(quote != last) {
+                    in_quotes = false;
+                    after_quotes = true;
+                }
+                it = quote == last ? last : quote + 1;
+                continue;
+            }
+            const char* const stop = std::find_if(it, last, is_stop);
+            if(stop != it) {
+                field.append(it, stop);
+                at_field_start = false;
+                after_quotes = false;
+            }
+            if(stop == last) {
+                break;
+            }
+            if(*stop == separator) {
+                end_field(false);
+                ++pos.col;
+            } else if(*stop == '\n') {
+                end_field(true);
+                ++pos.row;
+                pos.col = 0;
+            } else {
+                //кавычка
+                if(after_quotes) {
+                    field.push_back('"');
+                }
+                if(after_quotes || at_field_start) {
+                    in_quotes = true;
+                } else {
+                    field.push_back('"');
+                }
+                at_field_start = false;
+                after_quotes = false;
+            }
+            it = stop + 1;
+        }
+    }
+    end_field(true);
+}
+
+//Запись числа значения, как у output << number: to_chars с точностью потока.
+//Если формат потока не по умолчанию (fixed, showpos, другая локаль...), число пишет сам поток
+class NumberFormatter {
+public:
+    explicit NumberFormatter(const std::ostream& output)
+        : precision_(static_cast<int>(output.precision()))
+        , is_plain_((output.flags() & (std::ios::floatfield | std::ios::showpoint | std::ios::showpos
+                                       | std::ios::uppercase)) == 0
+                    && output.getloc() == std::locale::classic()) {
+        if(!is_plain_) {
+            formatter_.copyfmt(output);
+        }
+    }
+
+    void operator()(std::string& out, double number) {
+        if(is_plain_) {
+            char buffer[64];
+            const auto [end, ec] = std::to_chars(std::begin(buffer), std::end(buffer), number,
+                                                 std::chars_format::general, precision_);
+            if(ec == std::errc{}) {
+                out.append(buffer, end);
+                return;
+            }
+        }
+        formatter_.str({});
+        formatter_ << number;
+        out += formatter_.str();
+    }
+
+private:
+    int precision_;
+    bool is_plain_;
+    std::ostringstream formatter_;
+};
+
+std::function<void(const char*, size_t)> StreamWriter(std::ostream& output) {
+    return [&output](const char* data, size_t size) {
+        output.write(data, static_cast<std::streamsize>(size));
+    };
+}
+
+void WriteToFd(int fd, const char* data, size_t size) {
+    while(size > 0) {
+#ifdef _WIN32
+        const auto written = ::_write(fd, data, static_cast<unsigned>(std::min<size_t>(size, INT_MAX)));
+#else
+        const auto written = ::write(fd, data, size);
+#endif
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "Cannot write sheet values");
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+}
+
+//Двоичный снимок листа: заголовок, тексты ячеек и форм, формы формул, ячейки, граф (см. SaveSnapshot)
+constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+//Форма формулы: текст формулы ячейки pos
+struct SnapshotForm {
+    Position pos;
+    uint64_t text_offset;
+    uint64_t text_size;
+};
+
+struct SnapshotCell {
+    enum Kind : uint8_t {
+        EMPTY,
+        NUMBER,
+        TEXT,
+        NUMBER_TEXT,
+        FORMULA,
+    };
+
+    Position pos;
+    uint8_t kind;
+    //у формулы есть значение value
+    uint8_t has_value;
+    uint16_t reserved;
+    uint32_t text_size;
+    //смещение текста или номер формы формулы
+    uint64_t ref;
+    //число или значение формулы (ошибка упакована)
+    double value;
+};
+static_assert(sizeof(SnapshotCell) == 32, "Snapshot cell layout is part of the format");
+}//namespace
+
 Sheet::~Sheet() {}
 
 void Sheet::SetCell(Position pos, std::string text) {
     //1.Get existing, or make new cell
+    CheckCellPos(pos);
+    if(is_in_batch_) {
+        RecordBatchEdit(pos, std::move(text), false);
+        return;
+    }
+    if(journal_) {
+        journal_->Add(Journal::Op::set, pos, text);
+    }
+    const bool is_new_cell = GetCellRawPtr(pos) == nullptr;
     auto& cell_ptr = GetRefOrMakeNewCell(pos);
+    const bool was_empty = cell_ptr->IsEmpty();
+    //в eager режиме значение уже в кеше
+    const double old_value = recalc_mode_ == RecalcMode::eager ? cell_ptr->GetOperandValue() : 0;
+    const bool was_in_ranges = recalc_mode_ == RecalcMode::eager && cell_ptr->GetRangeValue().has_value();
+    const bool was_formula = cell_ptr->HasFormula();
+    const auto old_range_value = was_formula ? std::nullopt : cell_ptr->GetRangeValue();
 
-    //2.Set Cell Value (Check for cycle inside the Cell::Set method)
+    //2.Set Cell Value (graph is rewired & checked for cycle before the cell is changed)
     if(cell_ptr->GetText() != text) { //2.1.Check cell doesn't have same text already
-        cell_ptr->Set(pos, text);
-    }
+        bool refs_updated = false;
+        try {
+            cell_ptr->Set(std::move(text), pos, *this, formulas_, formula_evaluations_, [&](const FormulaInterface& formula) {
+                //throws CircularDependencyException and leaves graph unchanged
+                const auto new_refs = GetFormulaRefs(pos, &formula);
+                graph_.SetPrecedents(pos, new_refs.refs, new_refs.ranges);
+                refs_updated = true;
+            });
+        } catch(...) {
+            if(refs_updated) {
+                const auto old_refs = GetFormulaRefs(pos, cell_ptr->GetFormula());
+                graph_.SetPrecedents(pos, old_refs.refs, old_refs.ranges);
+            }
+            //do not leave a phantom empty cell after rejected formula
+            if(is_new_cell) {
+                cell_index_.Extract(pos);
+            }
+            if(journal_) {
+                journal_->DropFrame();
+            }
+            throw;
+        }
 
-    //3.1.If the cell is beyond current print area (max/bottom right cell), increase print area
-    UpdPrintAreaSize(pos);
+        //2.2.New cell data was set without exceptions: text cell has no refs
+        if(!refs_updated) {
+            graph_.SetPrecedents(pos, {});
+        }
+        MakeReferencedCells(pos);
+        UpdateRangeTotals(pos, was_formula, old_range_value);
+        ProcessCellChange(pos, old_value, was_in_ranges);
+    }
 
-    //3.2.Increment cell in row count (num of non-empty cells contained in row)
-    UpdCellInRowCount(pos);
+    //3.Update non-empty cell counters & print area
+    UpdPrintArea(pos, was_empty, cell_ptr->IsEmpty());
+    if(journal_) {
+        journal_->CommitFrame();
+    }
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -37,16 +298,566 @@ CellInterface* Sheet::GetCell(Position pos) {
 }
 
 void Sheet::ClearCell(Position pos) {
-    if(!HasCell(pos)) {
+    if(is_in_batch_) {
+        CheckCellPos(pos);
+        RecordBatchEdit(pos, {}, true);
         return;
     }
     //will not create new cell, make sure it exists
     auto cell_ptr = GetCellRawPtr(pos);
     if(cell_ptr) {
+        const bool was_empty = cell_ptr->IsEmpty();
+        const double old_value = recalc_mode_ == RecalcMode::eager ? cell_ptr->GetOperandValue() : 0;
+        const bool was_in_ranges = recalc_mode_ == RecalcMode::eager && cell_ptr->GetRangeValue().has_value();
+        const bool was_formula = cell_ptr->HasFormula();
+        const auto old_range_value = was_formula ? std::nullopt : cell_ptr->GetRangeValue();
         cell_ptr->Clear();
 
+        if(!was_empty) {
+            graph_.SetPrecedents(pos, {});
+            UpdateRangeTotals(pos, was_formula, old_range_value);
+            ProcessCellChange(pos, old_value, was_in_ranges);
+        }
+
         //Upd index & print_area
+        UpdPrintArea(pos, was_empty, true);
         ProcessCellClear(pos);
+        if(journal_) {
+            journal_->Add(Journal::Op::clear, pos);
+            journal_->CommitFrame();
+        }
+    }
+}
+
+SheetArena::Stats Sheet::GetAllocationStats() const {
+    return arena_.GetStats();
+}
+
+size_t Sheet::GetSharedFormulaCount() const {
+    return formulas_.Size();
+}
+
+std::vector<Position> Sheet::GetDependentCells(Position pos) const {
+    CheckCellPos(pos);
+    return graph_.GetDependents(pos);
+}
+
+std::vector<Position> Sheet::GetPrecedentCells(Position pos) const {
+    CheckCellPos(pos);
+    return graph_.GetPrecedents(pos);
+}
+
+const DependencyGraph& Sheet::GetDependencyGraph() const {
+    return graph_;
+}
+
+void Sheet::SetRecalcMode(RecalcMode mode) {
+    if(recalc_mode_ == mode) {
+        return;
+    }
+    recalc_mode_ = mode;
+    if(recalc_mode_ == RecalcMode::eager) {
+        RecalcAllCells();
+    }
+}
+
+Sheet::RecalcMode Sheet::GetRecalcMode() const {
+    return recalc_mode_;
+}
+
+void Sheet::SetRecalcThreads(size_t thread_count) {
+    if(thread_count == GetRecalcThreads()) {
+        return;
+    }
+    recalc_pool_ = thread_count > 1 ? std::make_unique<ThreadPool>(thread_count) : nullptr;
+}
+
+size_t Sheet::GetRecalcThreads() const {
+    return recalc_pool_ ? recalc_pool_->ThreadCount() : 1;
+}
+
+void Sheet::Recalculate() {
+    cell_index_.ForEach([](Position, const CellPtr& cell_ptr) {
+        cell_ptr->InvalidateCache();
+    });
+    for(auto& cache : range_totals_) {
+        cache.serial.store(0, std::memory_order_relaxed);
+    }
+    RecalcAllCells();
+}
+
+uint64_t Sheet::GetFormulaEvaluationCount() const {
+    return formula_evaluations_.load(std::memory_order_relaxed);
+}
+
+void Sheet::BeginBatch() {
+    is_in_batch_ = true;
+}
+
+void Sheet::CommitBatch() {
+    if(!is_in_batch_) {
+        return;
+    }
+    //Only the last edit of each cell is kept
+    std::vector<BatchEdit> edits = TakeBatchEdits();
+    //the batch is one journal frame: it is replayed whole or not at all
+    if(journal_) {
+        for(const auto& edit : edits) {
+            journal_->Add(edit.is_clear ? Journal::Op::clear : Journal::Op::set, edit.pos, edit.text);
+        }
+    }
+
+    //1.Parse everything before the sheet is changed: FormulaException leaves the sheet as it was
+    try {
+        PreparedEdits prepared;
+        PrepareEdits(edits, prepared);
+        ApplyEdits(prepared);
+    } catch(...) {
+        if(journal_) {
+            journal_->DropFrame();
+        }
+        throw;
+    }
+    if(journal_) {
+        journal_->CommitFrame();
+    }
+}
+
+void Sheet::PrepareEdits(std::vector<BatchEdit>& edits, PreparedEdits& prepared) {
+    std::vector<char> is_skipped;
+    std::vector<char> is_made;
+    std::vector<std::string> formula_keys;
+    std::vector<Cell::CellData> new_data;
+    std::vector<DependencyGraph::CellRefs> new_refs;
+    auto for_each_edit = [this](size_t count, const std::function<void(size_t)>& func) {
+        if(recalc_pool_ && count >= MIN_PARALLEL_CELLS) {
+            recalc_pool_->ParallelFor(count, func);
+            return;
+        }
+        for(size_t idx = 0; idx < count; ++idx) {
+            func(idx);
+        }
+    };
+
+    for(size_t window = 0; window < edits.size(); window += PARSE_WINDOW) {
+        BatchEdit* const window_edits = edits.data() + window;
+        const size_t count = std::min(PARSE_WINDOW, edits.size() - window);
+        is_skipped.assign(count, false);
+        formula_keys.resize(count);
+        new_data.clear();
+        new_data.resize(count);
+        new_refs.resize(count);
+
+        //a.In pool threads: the sheet and the formula cache are only read, the arena is not used
+        is_made.assign(count, false);
+        for_each_edit(count, [&](size_t idx) {
+            auto& edit = window_edits[idx];
+            const Cell* cell_ptr = GetCellRawPtr(edit.pos);
+            if(edit.is_clear ? cell_ptr == nullptr : cell_ptr && cell_ptr->GetText() == edit.text) {
+                is_skipped[idx] = true;
+            } else if(!Cell::IsFormulaText(edit.text)) {
+                if(const auto number = Cell::TryMakeNumberData(edit.text)) {
+                    new_data[idx] = *number;
+                    is_made[idx] = true;
+                }
+            } else if(!FormulaCache::MakeKey(std::string_view(edit.text).substr(1), edit.pos, formula_keys[idx])) {
+                formula_keys[idx].clear();
+            }
+        });
+
+        //b.Formula cache and arena are not thread-safe: formulas and texts are made in this thread
+        for(size_t idx = 0; idx < count; ++idx) {
+            auto& edit = window_edits[idx];
+            if(!is_skipped[idx] && !is_made[idx]) {
+                new_data[idx] = Cell::MakeData(std::move(edit.text), edit.pos, *this, formulas_, formula_evaluations_,
+                                               &formula_keys[idx]);
+            }
+        }
+
+        //c.In pool threads: refs for the graph
+        for_each_edit(count, [&](size_t idx) {
+            if(is_skipped[idx]) {
+                return;
+            }
+            const FormulaInterface* formula = nullptr;
+            if(const auto formula_data = std::get_if<Cell::FormulaDataPtr>(&new_data[idx])) {
+                formula = (*formula_data)->formula.get();
+            }
+            new_refs[idx] = GetFormulaRefs(window_edits[idx].pos, formula);
+        });
+
+        for(size_t idx = 0; idx < count; ++idx) {
+            if(is_skipped[idx]) {
+                continue;
+            }
+            const Position pos = window_edits[idx].pos;
+            prepared.positions.push_back(pos);
+            prepared.data.push_back(std::move(new_data[idx]));
+            const auto node = graph_.FindNode(pos);
+            const bool had_refs = node != DependencyGraph::NONE && !graph_.GetPrecedents(node).empty();
+            if(had_refs || !new_refs[idx].refs.empty() || !new_refs[idx].ranges.empty()) {
+                prepared.refs.push_back(std::move(new_refs[idx]));
+            }
+            if(window_edits[idx].is_clear) {
+                prepared.cleared.push_back(pos);
+            }
+        }
+    }
+}
+
+void Sheet::ApplyEdits(PreparedEdits& prepared) {
+    //2.One cycle check for all new refs: throws CircularDependencyException and leaves graph unchanged
+    graph_.SetPrecedents(prepared.refs);
+
+    //3.Nothing can fail anymore: set cell data.
+    //Totals are updated only if some range has them: a new range node has none
+    range_totals_.resize(graph_.NodeIdLimit());
+    const bool has_range_totals = std::any_of(range_totals_.begin(), range_totals_.end(), [](const auto& cache) {
+        return cache.serial.load(std::memory_order_relaxed) != 0;
+    });
+    for(size_t idx = 0; idx < prepared.positions.size(); ++idx) {
+        const Position pos = prepared.positions[idx];
+        auto& cell_ptr = GetRefOrMakeNewCell(pos);
+        const bool was_empty = cell_ptr->IsEmpty();
+        const bool was_formula = cell_ptr->HasFormula();
+        const auto old_range_value = was_formula ? std::nullopt : cell_ptr->GetRangeValue();
+        cell_ptr->SetData(std::move(prepared.data[idx]));
+        UpdPrintArea(pos, was_empty, cell_ptr->IsEmpty());
+        if(has_range_totals) {
+            UpdateRangeTotals(pos, was_formula, old_range_value);
+        }
+    }
+    for(const auto& cell_refs : prepared.refs) {
+        MakeReferencedCells(cell_refs.pos);
+    }
+    //cleared cell stays in index, if another cell of the batch refers to it
+    for(const auto pos : prepared.cleared) {
+        ProcessCellClear(pos);
+    }
+
+    //4.One invalidation pass from all changed cells.
+    //Changed cells have no cache: a walk from another cell stops at them, their own walk goes further
+    dirty_nodes_.clear();
+    for(const auto pos : prepared.positions) {
+        CollectDirtyDependents(pos);
+    }
+    if(recalc_mode_ != RecalcMode::eager) {
+        return;
+    }
+
+    //5.Eager: changed formulas and their dependents, each once in topological order
+    for(const auto pos : prepared.positions) {
+        const auto cell_ptr = GetCellRawPtr(pos);
+        if(!cell_ptr || !cell_ptr->HasFormula()) {
+            continue;
+        }
+        if(const auto node = graph_.FindNode(pos); node != DependencyGraph::NONE) {
+            dirty_nodes_.push_back(node);
+        } else {
+            cell_ptr->GetValue();
+        }
+    }
+    std::sort(dirty_nodes_.begin(), dirty_nodes_.end(), [this](auto lhs, auto rhs) {
+        return graph_.GetOrder(lhs) < graph_.GetOrder(rhs);
+    });
+    EvaluateNodes(dirty_nodes_);
+}
+
+void Sheet::RollbackBatch() {
+    TakeBatchEdits();
+}
+
+bool Sheet::IsInBatch() const {
+    return is_in_batch_;
+}
+
+void Sheet::LoadTexts(std::istream& input, TableFormat format) {
+    //Fields of one table are different cells: no batch index needed
+    std::vector<BatchEdit> edits;
+    PreparedEdits prepared;
+    //the table is one journal frame, as a batch
+    Journal* journal = is_in_batch_ ? nullptr : journal_.get();
+    try {
+        ReadTable(input, format == TableFormat::csv ? ',' : '\t', format == TableFormat::csv,
+                  [&](Position pos, std::string& text) {
+                      CheckCellPos(pos);
+                      if(journal) {
+                          journal->Add(Journal::Op::set, pos, text);
+                      }
+                      edits.push_back(BatchEdit{pos, std::move(text)});
+                      //parse the table while reading: texts of parsed formulas are freed
+                      if(!is_in_batch_ && edits.size() == PARSE_WINDOW) {
+                          PrepareEdits(edits, prepared);
+                          edits.clear();
+                      }
+                  });
+        if(is_in_batch_) {
+            for(auto& edit : edits) {
+                RecordBatchEdit(edit.pos, std::move(edit.text), false);
+            }
+            return;
+        }
+        PrepareEdits(edits, prepared);
+        ApplyEdits(prepared);
+    } catch(...) {
+        if(journal) {
+            journal->DropFrame();
+        }
+        throw;
+    }
+    if(journal) {
+        journal->CommitFrame();
+    }
+}
+
+void Sheet::SaveSnapshot(std::ostream& output, bool with_values) const {
+    std::string texts;
+    std::vector<SnapshotForm> forms;
+    std::vector<SnapshotCell> cells;
+    cells.reserve(cell_index_.Size());
+    //Формулы одной формы пишут одну форму
+    std::unordered_map<const FormulaAST*, uint64_t> form_ids;
+    auto add_text = [&texts](std::string_view text, SnapshotCell& record) {
+        record.text_size = static_cast<uint32_t>(text.size());
+        record.ref = texts.size();
+        texts += text;
+    };
+
+    cell_index_.ForEach([&](Position pos, const CellPtr& cell_ptr) {
+        SnapshotCell record{pos, SnapshotCell::EMPTY, false, 0, 0, 0, 0};
+        const auto& data = cell_ptr->GetData();
+        if(const auto number = std::get_if<double>(&data)) {
+            record.kind = SnapshotCell::NUMBER;
+            record.value = *number;
+        } else if(const auto text = std::get_if<Cell::TextPtr>(&data)) {
+            record.kind = SnapshotCell::TEXT;
+            add_text(**text, record);
+        } else if(const auto number_text = std::get_if<Cell::NumberTextPtr>(&data)) {
+            record.kind = SnapshotCell::NUMBER_TEXT;
+            record.value = (*number_text)->value;
+            add_text((*number_text)->text, record);
+        } else if(const auto formula_data = std::get_if<Cell::FormulaDataPtr>(&data)) {
+            const auto& formula = *(*formula_data)->formula;
+            const auto* ast = formula.GetSharedForm().ast;
+            auto it = ast ? form_ids.find(ast) : form_ids.end();
+            if(it == form_ids.end()) {
+                const std::string expression = formula.GetExpression();
+                forms.push_back(SnapshotForm{pos, texts.size(), expression.size()});
+                texts += expression;
+                it = form_ids.emplace(ast ? ast : reinterpret_cast<const FormulaAST*>(&formula), forms.size() - 1).first;
+            }
+            record.kind = SnapshotCell::FORMULA;
+            record.ref = it->second;
+            if(const auto value = (*formula_data)->cache.Load(); value && with_values) {
+                record.has_value = true;
+                record.value = *value;
+            }
+        }
+        cells.push_back(record);
+    });
+
+    SnapshotWriter out(output);
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    out.Write(header);
+    out.WriteArray(texts.data(), texts.size());
+    out.WriteArray(forms);
+    out.WriteArray(cells);
+    graph_.Save(out);
+    out.WriteChecksum();
+    if(!output) {
+        throw SnapshotException("Cannot write snapshot");
+    }
+}
+
+void Sheet::LoadSnapshot(const std::string& path) {
+    const MappedFile file(path);
+    LoadSnapshot(file.Data(), file.Size());
+}
+
+void Sheet::LoadSnapshot(const char* data, size_t size) {
+    if(cell_index_.Size() != 0 || graph_.NodeIdLimit() > 1 || is_in_batch_ || journal_) {
+        throw std::logic_error("Snapshot is loaded only into an empty sheet without a journal");
+    }
+    auto check = [](bool is_valid) {
+        if(!is_valid) {
+            throw SnapshotException("Snapshot is corrupted");
+        }
+    };
+
+    SnapshotReader in(data, size);
+    const auto header = in.Read<SnapshotHeader>();
+    if(std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        throw SnapshotException("Not a sheet snapshot");
+    }
+    if(header.version != SNAPSHOT_VERSION) {
+        throw SnapshotException("Unsupported snapshot version " + std::to_string(header.version));
+    }
+    in.VerifyChecksum();
+    const auto [texts, texts_size] = in.ReadArrayView<char>();
+    const auto [form_records, form_count] = in.ReadArrayView<SnapshotForm>();
+    const auto [cell_records, cell_count] = in.ReadArrayView<SnapshotCell>();
+    DependencyGraph graph;
+    graph.Load(in);
+    check(in.AtEnd());
+    auto get_text = [&, texts = texts, texts_size = texts_size](uint64_t offset, uint64_t text_size) {
+        check(offset <= texts_size && text_size <= texts_size - offset);
+        return std::string_view(texts + offset, text_size);
+    };
+
+    //1.Each form is parsed once
+    std::vector<FormulaCache::Form> forms;
+    forms.reserve(form_count);
+    for(size_t idx = 0; idx < form_count; ++idx) {
+        const auto& record = form_records[idx];
+        check(record.pos.IsValid());
+        try {
+            forms.push_back(formulas_.ParseForm(std::string(get_text(record.text_offset, record.text_size)), record.pos));
+        } catch(const FormulaException&) {
+            throw SnapshotException("Snapshot has an invalid formula");
+        }
+    }
+
+    //2.Cells are made aside: a corrupted snapshot leaves the sheet empty
+    TiledIndex<CellPtr> cell_index;
+    for(size_t idx = 0; idx < cell_count; ++idx) {
+        const auto& record = cell_records[idx];
+        const Position pos = record.pos;
+        const auto slot = pos.IsValid() ? cell_index.Find(pos) : nullptr;
+        check(pos.IsValid() && !(slot && *slot));
+        auto cell_ptr = MakeArenaUnique<Cell>(arena_.Resource());
+        switch(record.kind) {
+            case SnapshotCell::EMPTY:
+                break;
+            case SnapshotCell::NUMBER:
+                cell_ptr->SetData(record.value);
+                break;
+            case SnapshotCell::TEXT:
+                cell_ptr->SetData(Cell::MakeTextData(get_text(record.ref, record.text_size), arena_.Resource()));
+                break;
+            case SnapshotCell::NUMBER_TEXT:
+                cell_ptr->SetData(
+                    Cell::MakeNumberTextData(record.value, get_text(record.ref, record.text_size), arena_.Resource()));
+                break;
+            case SnapshotCell::FORMULA: {
+                check(record.ref < forms.size());
+                auto formula = formulas_.MakeFormula(forms[record.ref], pos);
+                //the form shifted to this cell must not reference cells beyond the sheet
+                for(const Position ref : formula->GetReferencedCellsRange()) {
+                    check(ref.IsValid());
+                }
+                for(const Range& range : formula->GetReferencedRanges()) {
+                    check(range.IsValid());
+                }
+                auto cell_data = Cell::MakeFormulaData(std::move(formula), *this, formula_evaluations_);
+                if(record.has_value) {
+                    std::get<Cell::FormulaDataPtr>(cell_data)->cache.Store(record.value);
+                }
+                cell_ptr->SetData(std::move(cell_data));
+                break;
+            }
+            default:
+                check(false);
+        }
+        cell_index.Insert(pos, std::move(cell_ptr));
+    }
+    //every cell of the graph exists in the sheet
+    for(DependencyGraph::NodeId node = 1; node < graph.NodeIdLimit(); ++node) {
+        const Position pos = graph.GetPosition(node);
+        if(pos == Position::NONE || graph.IsRangeNode(node)) {
+            continue;
+        }
+        const auto slot = cell_index.Find(pos);
+        check(slot && *slot);
+    }
+
+    //3.Nothing can fail anymore
+    cell_index_ = std::move(cell_index);
+    graph_ = std::move(graph);
+    //the cache has a slot for every range node of the snapshot: SUM over them uses totals right away
+    range_totals_.resize(graph_.NodeIdLimit());
+    cell_index_.ForEach([this](Position pos, const CellPtr& cell_ptr) {
+        UpdPrintArea(pos, true, cell_ptr->IsEmpty());
+    });
+    //eager: formulas saved without values are evaluated now
+    if(recalc_mode_ == RecalcMode::eager) {
+        RecalcAllCells();
+    }
+}
+
+void Sheet::OpenJournal(const std::string& path, size_t group_commit) {
+    if(journal_ || is_in_batch_) {
+        throw std::logic_error("Journal is opened once, outside of a batch");
+    }
+    uint64_t valid_size = 0;
+    if(std::filesystem::exists(path)) {
+        std::optional<MappedFile> file;
+        try {
+            file.emplace(path);
+        } catch(const SnapshotException&) {
+            throw JournalException("Cannot read journal " + path);
+        }
+        //replay: last edit of each cell, one graph update, as CommitBatch
+        BeginBatch();
+        try {
+            valid_size = Journal::Read(file->Data(), file->Size(), [this](Journal::Op op, Position pos, std::string_view text) {
+                RecordBatchEdit(pos, std::string(text), op == Journal::Op::clear);
+            });
+            CommitBatch();
+        } catch(...) {
+            RollbackBatch();
+            throw;
+        }
+    }
+    journal_ = std::make_unique<Journal>(path, valid_size, group_commit);
+}
+
+void Sheet::SyncJournal() {
+    if(journal_) {
+        journal_->Sync();
+    }
+}
+
+void Sheet::CloseJournal() {
+    if(journal_) {
+        journal_->Sync();
+        journal_.reset();
+    }
+}
+
+uint64_t Sheet::GetJournalSize() const {
+    return journal_ ? journal_->Size() : 0;
+}
+
+void Sheet::Checkpoint(const std::string& snapshot_path) {
+    if(is_in_batch_) {
+        throw std::logic_error("Checkpoint is made outside of a batch");
+    }
+    //the old snapshot is replaced only by a complete new one
+    const std::string temp_path = snapshot_path + ".tmp";
+    {
+        std::ofstream output(temp_path, std::ios::binary | std::ios::trunc);
+        if(!output) {
+            throw SnapshotException("Cannot create snapshot " + temp_path);
+        }
+        SaveSnapshot(output);
+        output.close();
+        if(!output) {
+            throw SnapshotException("Cannot write snapshot " + temp_path);
+        }
+    }
+    SyncPath(temp_path);
+    std::error_code error;
+    std::filesystem::rename(temp_path, snapshot_path, error);
+    if(error) {
+        throw SnapshotException("Cannot replace snapshot " + snapshot_path + ": " + error.message());
+    }
+    //the rename is durable, when the directory is synced
+    const auto directory = std::filesystem::path(snapshot_path).parent_path();
+    SyncPath(directory.empty() ? "." : directory.string());
+    if(journal_) {
+        journal_->Reset();
     }
 }
 
@@ -56,138 +867,546 @@ Size Sheet::GetPrintableSize() const {
 
 //index[row][col]
 void Sheet::PrintValues(std::ostream& output) const {
-    auto value_getter = [&](const Cell* ptr) {
-        return ptr->GetValue();
-    };
-    OutputAllCells(output, value_getter);
+    ExportCells(true, false, output, StreamWriter(output));
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    auto text_getter = [&](const Cell* ptr) {
-        return ptr->GetText();
-    };
-    OutputAllCells(output, text_getter);
+    ExportCells(false, false, output, StreamWriter(output));
+}
+
+void Sheet::ExportValues(std::ostream& output) {
+    //eager: all values are already in cache
+    if(recalc_mode_ != RecalcMode::eager) {
+        RecalcAllCells();
+    }
+    ExportCells(true, true, output, StreamWriter(output));
+}
+
+void Sheet::ExportValues(int fd) {
+    if(recalc_mode_ != RecalcMode::eager) {
+        RecalcAllCells();
+    }
+    const std::ostringstream format;
+    ExportCells(true, true, format, [fd](const char* data, size_t size) {
+        WriteToFd(fd, data, size);
+    });
+}
+
+void Sheet::GetRangeValues(Range range, std::vector<double>& values) const {
+    //Пустые слоты индекса и невыделенные тайлы диапазона не просматриваются
+    cell_index_.ForEachInRange(range, [&values](Position, const CellPtr& cell_ptr) {
+        if(const auto value = cell_ptr->GetRangeValue()) {
+            values.push_back(*value);
+        }
+    });
+}
+
+std::optional<SheetInterface::RangeTotals> Sheet::GetRangeTotals(Range range) const {
+    if(range.CellCount() < MIN_TOTALS_CELLS) {
+        return std::nullopt;
+    }
+    const auto node = graph_.FindRangeNode(range);
+    if(node == DependencyGraph::NONE || node >= range_totals_.size()) {
+        return std::nullopt;
+    }
+    auto& cache = range_totals_[node];
+    const uint32_t serial = graph_.GetRangeSerial(node);
+    if(cache.serial.load(std::memory_order_acquire) == serial) {
+        return cache.totals;
+    }
+
+    //Значения собираются, как для SUM без итогов, и складываются тем же ядром: результат SUM не зависит
+    //от того, есть ли итоги. Буфер свой у каждого потока пересчета; вложенное вычисление формулы
+    //диапазона дописывает свои значения после base и убирает их
+    thread_local std::vector<double> values;
+    const size_t base = values.size();
+    GetRangeValues(range, values);
+    RangeTotals totals{SumRangeValues(values.data() + base, values.size() - base), values.size() - base};
+    values.resize(base);
+    //ошибки (и бесконечности) не кешируются: первую ошибку найдет GetRangeValues
+    if(!std::isfinite(totals.sum)) {
+        return std::nullopt;
+    }
+    std::lock_guard lock(range_totals_mutex_);
+    if(cache.serial.load(std::memory_order_relaxed) != serial) {
+        cache.totals = totals;
+        cache.delta_count = 0;
+        cache.serial.store(serial, std::memory_order_release);
+    }
+    return totals;
+}
+
+Position Sheet::FindNextCell(Range range, Position from) const {
+    return cell_index_.FindNext(range, from);
+}
+
+void Sheet::ExportCells(bool values, bool parallel, const std::ostream& format,
+                        const std::function<void(const char*, size_t)>& write) const {
+    const int rows = print_size_.rows;
+    const int band_rows = std::max(1, EXPORT_BAND_CELLS / std::max(1, print_size_.cols));
+    const size_t band_count = (rows + band_rows - 1) / band_rows;
+    if(!parallel || !recalc_pool_ || band_count < 2) {
+        std::string buffer;
+        buffer.reserve(2 * EXPORT_BUFFER);
+        NumberFormatter write_number(format);
+        for(int row = 0; row < rows; row += band_rows) {
+            AppendRows(buffer, row, std::min(rows, row + band_rows), values, write_number);
+            if(buffer.size() >= EXPORT_BUFFER) {
+                write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+        write(buffer.data(), buffer.size());
+        return;
+    }
+
+    //Bands of one wave are formatted in parallel, then written in order; buffers are reused
+    std::vector<std::string> buffers(std::min(band_count, recalc_pool_->ThreadCount() * EXPORT_BANDS_PER_THREAD));
+    for(size_t first_band = 0; first_band < band_count; first_band += buffers.size()) {
+        const size_t count = std::min(buffers.size(), band_count - first_band);
+        recalc_pool_->ParallelFor(count, [&](size_t idx) {
+            const int first_row = static_cast<int>((first_band + idx) * band_rows);
+            NumberFormatter write_number(format);
+            buffers[idx].clear();
+            AppendRows(buffers[idx], first_row, std::min(rows, first_row + band_rows), values, write_number);
+        });
+        for(size_t idx = 0; idx < count; ++idx) {
+            write(buffers[idx].data(), buffers[idx].size());
+        }
+    }
+}
+
+template<typename NumberWriter>
+void Sheet::AppendRows(std::string& buffer, int first_row, int end_row, bool values, NumberWriter& write_number) const {
+    const int cols = print_size_.cols;
+    for(int row = first_row; row < end_row; ++row) {
+        //written: the column, which separators are already written
+        int written = 0;
+        if(cols > 0) {
+            cell_index_.ForEachInRange(Range{{row, 0}, {row, cols - 1}}, [&](Position pos, const CellPtr& cell_ptr) {
+                buffer.append(pos.col - written, '\t');
+                written = pos.col;
+                if(values) {
+                    cell_ptr->AppendValue(buffer, write_number);
+                } else {
+                    cell_ptr->AppendText(buffer);
+                }
+            });
+            buffer.append(cols - 1 - written, '\t');
+        }
+        buffer += '\n';
+    }
 }
 
 Sheet::CellPtr& Sheet::GetRefOrMakeNewCell(Position pos) {
     CheckCellPos(pos);
 
-    UpdIndexSize(pos);
-    auto& cell = cell_index_.at(pos.row).at(pos.col);
-
     //do not overwrite cells that are not nullptr
-    if(cell) {
-        return cell;
+    if(auto slot = cell_index_.Find(pos); slot && *slot) {
+        return *slot;
     }
 
     //make new empty cell
-    cell = std::make_unique<Cell>(*this);
-    cell->Set(pos, "");
-
-    return cell;
+    return cell_index_.Insert(pos, MakeArenaUnique<Cell>(arena_.Resource()));
 }
 
 Cell* Sheet::GetCellRawPtr(Position pos) {
-    return HasCell(pos) ? cell_index_.at(pos.row).at(pos.col).get()
-                        : nullptr;
+    CheckCellPos(pos);
+    auto slot = cell_index_.Find(pos);
+    return slot ? slot->get() : nullptr;
 }
 
 const Cell* Sheet::GetCellRawPtr(Position pos) const {
-    return HasCell(pos) ? cell_index_.at(pos.row).at(pos.col).get()
-                        : nullptr;
+    CheckCellPos(pos);
+    auto slot = cell_index_.Find(pos);
+    return slot ? slot->get() : nullptr;
 }
 
-//===== Print area and index size helper func ====
-void Sheet::UpdPrintAreaSize(Position pos) {
-    if(print_size_.rows <= pos.row) {
-        print_size_.rows = pos.row + 1;
+//===== Print area and index helper func ====
+void Sheet::UpdPrintArea(Position pos, bool was_empty, bool is_empty) {
+    if(was_empty == is_empty) {
+        return;
+    }
+
+    //1.Cell became non-empty -> increase counters and print area
+    if(!is_empty) {
+        if(non_empty_in_row_.size() <= static_cast<size_t>(pos.row)) {
+            non_empty_in_row_.resize(pos.row + 1);
+        }
+        if(non_empty_in_col_.size() <= static_cast<size_t>(pos.col)) {
+            non_empty_in_col_.resize(pos.col + 1);
+        }
+        ++non_empty_in_row_[pos.row];
+        ++non_empty_in_col_[pos.col];
+
+        print_size_.rows = std::max(print_size_.rows, pos.row + 1);
+        print_size_.cols = std::max(print_size_.cols, pos.col + 1);
+        return;
+    }
+
+    //2.Cell became empty -> shrink print area if cell was at edge
+    if(--non_empty_in_row_[pos.row] < 0 || --non_empty_in_col_[pos.col] < 0) {
+        throw std::runtime_error("Decrementing row or col with 0 cells");
+    }
+    while(print_size_.rows > 0 && non_empty_in_row_[print_size_.rows - 1] == 0) {
+        --print_size_.rows;
     }
-    if(print_size_.cols <= pos.col) {
-        print_size_.cols = pos.col + 1;
+    while(print_size_.cols > 0 && non_empty_in_col_[print_size_.cols - 1] == 0) {
+        --print_size_.cols;
     }
 }
 
-//resizes index if new cell outside current scope
-void Sheet::UpdIndexSize(Position pos) {
-    CheckCellPos(pos);
+void Sheet::ProcessCellClear(Position pos) {
+    //Cell is still referenced by formulas -> keep it as empty cell
+    if(graph_.HasDependents(pos)) {
+        return;
+    }
+    //Otherwise delete it from index (frees tile, if it was the last cell in it)
+    cell_index_.Extract(pos);
+}
+
+void Sheet::RecordBatchEdit(Position pos, std::string text, bool is_clear) {
+    if(auto slot = batch_index_.Find(pos); slot && *slot != 0) {
+        batch_edits_[*slot - 1] = {pos, std::move(text), is_clear};
+        return;
+    }
+    batch_edits_.push_back({pos, std::move(text), is_clear});
+    batch_index_.Insert(pos, static_cast<uint32_t>(batch_edits_.size()));
+}
+
+std::vector<Sheet::BatchEdit> Sheet::TakeBatchEdits() {
+    is_in_batch_ = false;
+    std::vector<BatchEdit> edits = std::move(batch_edits_);
+    batch_edits_.clear();
+    for(const auto& edit : edits) {
+        batch_index_.Extract(edit.pos);
+    }
+    return edits;
+}
 
-    if(cell_index_.size() <= static_cast<size_t>(pos.row)) {
-        cell_index_.resize(pos.row + 1);
+void Sheet::CheckCellPos(Position pos) const {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("Invalid pos passed to Sheet");
     }
-    if(cell_index_[pos.row].size() <= static_cast<size_t>(pos.col)) {
-        cell_index_[pos.row].resize(pos.col + 1);
+}
+
+//==== Работа с зависимыми ячейками ====
+void Sheet::MakeReferencedCells(Position pos) {
+    const auto node = graph_.FindNode(pos);
+    if(node == DependencyGraph::NONE) {
+        return;
+    }
+    //Referenced cells exist in sheet as empty cells, cells of ranges - only if they are set
+    for(const auto ref_node : graph_.GetPrecedents(node)) {
+        if(!graph_.IsRangeNode(ref_node)) {
+            GetRefOrMakeNewCell(graph_.GetPosition(ref_node));
+        }
     }
 }
 
-void Sheet::UpdCellInRowCount(Position pos, int count) {
-    //resize and update cell per row count
-    if(num_cells_in_row_.size() <= static_cast<size_t>(pos.row)) {
-        num_cells_in_row_.resize(pos.row + 1);
-    } else if(num_cells_in_row_[pos.row] == 0 && count < 0) {
-        throw std::runtime_error("Decrementing row with 0 cells");
+void Sheet::UpdateRangeTotals(Position pos, bool old_is_formula, std::optional<double> old_value) {
+    range_totals_.resize(graph_.NodeIdLimit());
+    changed_ranges_.clear();
+    graph_.FindRangeNodes(pos, changed_ranges_);
+    if(changed_ranges_.empty()) {
+        return;
+    }
+
+    //Значение формулы может быть еще не вычислено: итоги ее диапазонов считаются заново
+    const Cell* cell_ptr = GetCellRawPtr(pos);
+    const bool is_formula = cell_ptr && cell_ptr->HasFormula();
+    const auto new_value = cell_ptr && !is_formula ? cell_ptr->GetRangeValue() : std::nullopt;
+    const double delta = new_value.value_or(0) - old_value.value_or(0);
+    for(const auto node : changed_ranges_) {
+        auto& cache = range_totals_[node];
+        if(cache.serial.load(std::memory_order_relaxed) != graph_.GetRangeSerial(node)) {
+            continue;
+        }
+        if(old_is_formula || is_formula || ++cache.delta_count >= EXACT_TOTALS_PERIOD) {
+            ResetRangeTotals(node);
+            continue;
+        }
+        cache.totals.sum += delta;
+        cache.totals.count = cache.totals.count + new_value.has_value() - old_value.has_value();
+        if(!std::isfinite(cache.totals.sum)) {
+            ResetRangeTotals(node);
+        }
     }
-    num_cells_in_row_[pos.row] += count;
 }
 
-void Sheet::ProcessCellClear(Position pos) {
-    //Delete empty row from index
-    UpdCellInRowCount(pos, -1);
-    if(num_cells_in_row_[pos.row] == 0) {
-        cell_index_[pos.row].clear();
+void Sheet::ResetRangeTotals(DependencyGraph::NodeId range_node) {
+    if(range_node < range_totals_.size()) {
+        range_totals_[range_node].serial.store(0, std::memory_order_relaxed);
     }
+}
 
-    //or, Shrink row to rightmost non-empty cell (at least one non-empty)
-    else {
-        auto& cell_row = cell_index_[pos.row];
-        auto non_empty_cell_it = cell_row.end();
+//При изменении ячейки, сбросить кеш всех (транзитивно) зависимых ячеек.
+//Пустой кеш служит флагом "грязной" ячейки: у ее зависимых кеша тоже нет, обход дальше не идет.
+//Поэтому каждая ячейка сбрасывается один раз без отдельного множества посещенных,
+//а буферы обхода переиспользуются - правка не выделяет память
+void Sheet::InvalidateDependentCellsCaches(Position pos) {
+    dirty_nodes_.clear();
+    CollectDirtyDependents(pos);
+}
 
-        //iterate backwards through all nullptrs
-        do{
-            --non_empty_cell_it;
-        } while (*non_empty_cell_it == nullptr
-                 && non_empty_cell_it != cell_row.begin());
+void Sheet::CollectDirtyDependents(Position pos) {
+    //Cell without a node can still be in ranges: the walk starts from them
+    invalidate_stack_.clear();
+    const auto start_node = graph_.FindNode(pos);
+    if(start_node != DependencyGraph::NONE) {
+        invalidate_stack_.push_back(start_node);
+    } else {
+        graph_.FindRangeNodes(pos, invalidate_stack_);
+    }
 
-        cell_row.resize(non_empty_cell_it - cell_row.begin() + 1);
+    while(!invalidate_stack_.empty()) {
+        const auto node = invalidate_stack_.back();
+        invalidate_stack_.pop_back();
+        //итоги диапазонов самой ячейки pos уже обновлены (UpdateRangeTotals), формулы - сброшены
+        const bool is_dirty_formula = node != start_node && !graph_.IsRangeNode(node);
+
+        for(const auto dependent : graph_.GetDependents(node)) {
+            //range has no cache: the walk goes through it to its formulas
+            if(graph_.IsRangeNode(dependent)) {
+                if(is_dirty_formula) {
+                    ResetRangeTotals(dependent);
+                }
+                invalidate_stack_.push_back(dependent);
+            } else if(GetCellRawPtr(graph_.GetPosition(dependent))->ResetCache()) {
+                dirty_nodes_.push_back(dependent);
+                invalidate_stack_.push_back(dependent);
+            }
+        }
+    }
+}
+
+void Sheet::ProcessCellChange(Position pos, double old_value, bool was_in_ranges) {
+    if(recalc_mode_ != RecalcMode::eager) {
+        InvalidateDependentCellsCaches(pos);
+        return;
     }
 
-    //Shrink print area if cell is at edge
-    if(pos.row + 1 == print_size_.rows || pos.col + 1 == print_size_.cols) {
-        size_t max_col = 0;
-        for(const auto& row : cell_index_) {
-            if(max_col < row.size()) {
-                max_col = row.size();
+    //1.Early cutoff: "touch" edit (=A1*1 вместо =A1, 5 вместо =5) не меняет зависимые ячейки
+    const auto cell_ptr = GetCellRawPtr(pos);
+    if(Cell::IsSameOperand(old_value, cell_ptr->GetOperandValue())) {
+        //пустая ячейка и 0 различаются только для функций над диапазонами с этой ячейкой
+        if(was_in_ranges == cell_ptr->GetRangeValue().has_value()) {
+            return;
+        }
+        recalc_queue_.clear();
+        graph_.FindRangeNodes(pos, recalc_queue_);
+        if(recalc_queue_.empty()) {
+            return;
+        }
+    }
+
+    //2.Параллельный пересчет идет по уровням всех зависимых ячеек, без отсечения внутри
+    if(recalc_pool_) {
+        InvalidateDependentCellsCaches(pos);
+        RecalcDirtyCells(pos);
+        return;
+    }
+
+    RecalcChangedDependents(pos);
+}
+
+void Sheet::RecalcChangedDependents(Position pos) {
+    //min-куча по топологическому номеру: влияющие ячейки пересчитываются раньше зависимых
+    auto later = [this](auto lhs, auto rhs) {
+        return graph_.GetOrder(lhs) > graph_.GetOrder(rhs);
+    };
+    auto push_dependents = [&](DependencyGraph::NodeId changed) {
+        for(const auto dependent : graph_.GetDependents(changed)) {
+            recalc_queue_.push_back(dependent);
+            std::push_heap(recalc_queue_.begin(), recalc_queue_.end(), later);
+        }
+    };
+
+    //Cell without a node can still be in ranges: they are changed too
+    recalc_queue_.clear();
+    if(const auto node = graph_.FindNode(pos); node != DependencyGraph::NONE) {
+        push_dependents(node);
+    } else {
+        graph_.FindRangeNodes(pos, recalc_queue_);
+        std::make_heap(recalc_queue_.begin(), recalc_queue_.end(), later);
+    }
+    auto last_node = DependencyGraph::NONE;
+    while(!recalc_queue_.empty()) {
+        std::pop_heap(recalc_queue_.begin(), recalc_queue_.end(), later);
+        const auto current = recalc_queue_.back();
+        recalc_queue_.pop_back();
+
+        //Номера вершин различны: повторы одной вершины (от нескольких влияющих) идут подряд
+        if(current == last_node) {
+            continue;
+        }
+        last_node = current;
+
+        //range is not evaluated: a change of any its cell goes on to its formulas
+        if(graph_.IsRangeNode(current)) {
+            push_dependents(current);
+        } else if(GetCellRawPtr(graph_.GetPosition(current))->UpdateValue()) {
+            for(const auto dependent : graph_.GetDependents(current)) {
+                if(graph_.IsRangeNode(dependent)) {
+                    ResetRangeTotals(dependent);
+                }
             }
+            push_dependents(current);
         }
-        print_size_ = {FindLastNonEmptyRow() + 1, static_cast<int>(max_col)};
     }
 }
 
-void Sheet::CheckCellPos(Position pos) const {
-    if(!pos.IsValid()) {
-        throw InvalidPositionException("Invalid pos passed to Sheet");
+void Sheet::RecalcDirtyCells(Position pos) {
+    if(recalc_mode_ != RecalcMode::eager) {
+        return;
     }
+
+    //Влияющие ячейки идут раньше зависимых: при вычислении каждой ячейки
+    //ее ссылки уже в кеше, и каждая ячейка вычисляется ровно один раз
+    std::sort(dirty_nodes_.begin(), dirty_nodes_.end(), [this](auto lhs, auto rhs) {
+        return graph_.GetOrder(lhs) < graph_.GetOrder(rhs);
+    });
+
+    if(const auto cell_ptr = GetCellRawPtr(pos); cell_ptr && cell_ptr->HasFormula()) {
+        cell_ptr->GetValue();
+    }
+    EvaluateNodes(dirty_nodes_);
 }
 
-bool Sheet::HasCell(Position pos) const {
-    CheckCellPos(pos);
+void Sheet::RecalcAllCells() {
+    //Формулы без ссылок и зависимых не имеют вершины в графе, их порядок не важен.
+    //Формула с кешем не вычисляется, а у зависимых от формулы без кеша кеша тоже нет:
+    //вычисляемые вершины в топологическом порядке - подмножество, замкнутое по влияющим
+    std::vector<const Cell*> isolated_cells;
+    dirty_nodes_.clear();
+    cell_index_.ForEach([&](Position pos, const CellPtr& cell_ptr) {
+        if(cell_ptr->NeedsEvaluation()) {
+            if(const auto node = graph_.FindNode(pos); node != DependencyGraph::NONE) {
+                dirty_nodes_.push_back(node);
+            } else {
+                isolated_cells.push_back(cell_ptr.get());
+            }
+        }
+    });
+    std::sort(dirty_nodes_.begin(), dirty_nodes_.end(), [this](auto lhs, auto rhs) {
+        return graph_.GetOrder(lhs) < graph_.GetOrder(rhs);
+    });
+
+    if(recalc_pool_ && isolated_cells.size() >= MIN_PARALLEL_CELLS) {
+        recalc_pool_->ParallelFor(isolated_cells.size(), [&](size_t idx) {
+            isolated_cells[idx]->GetValue();
+        });
+    } else {
+        for(const auto cell_ptr : isolated_cells) {
+            cell_ptr->GetValue();
+        }
+    }
+    EvaluateNodes(dirty_nodes_);
+}
+
+void Sheet::EvaluateNodes(std::vector<DependencyGraph::NodeId>& nodes) {
+    if(nodes.size() < static_cast<size_t>(MIN_COLUMN_BLOCK)) {
+        for(const auto node : nodes) {
+            GetCellRawPtr(graph_.GetPosition(node))->GetValue();
+        }
+        return;
+    }
+
+    //Ячейки одного уровня не ссылаются друг на друга: их ссылки уже вычислены на прошлых уровнях,
+    //потоки только читают чужой кэш и публикуют свой
+    const auto level_bounds = graph_.SplitIntoLevels(nodes);
+    for(size_t level = 0; level + 1 < level_bounds.size(); ++level) {
+        EvaluateLevel(nodes.data() + level_bounds[level], level_bounds[level + 1] - level_bounds[level]);
+    }
+}
 
-    //Is within index sizes
-    return static_cast<size_t>(pos.row) < cell_index_.size()
-           && static_cast<size_t>(pos.col) < cell_index_[pos.row].size();
+void Sheet::EvaluateLevel(const DependencyGraph::NodeId* first, size_t count) {
+    FindColumnBlocks(first, count);
+    if(recalc_pool_ && count >= MIN_PARALLEL_CELLS) {
+        recalc_pool_->ParallelFor(column_blocks_.size(), [this](size_t idx) {
+            EvaluateColumnBlock(column_blocks_[idx]);
+        });
+        recalc_pool_->ParallelFor(scalar_nodes_.size(), [this](size_t idx) {
+            GetCellRawPtr(graph_.GetPosition(scalar_nodes_[idx]))->GetValue();
+        });
+        return;
+    }
+    for(const auto& block : column_blocks_) {
+        EvaluateColumnBlock(block);
+    }
+    for(const auto node : scalar_nodes_) {
+        GetCellRawPtr(graph_.GetPosition(node))->GetValue();
+    }
 }
 
-int Sheet::FindLastNonEmptyRow() const {
-    if(cell_index_.empty()) {
-        return -1;
+void Sheet::FindColumnBlocks(const DependencyGraph::NodeId* first, size_t count) {
+    column_blocks_.clear();
+    scalar_nodes_.clear();
+    if(count < static_cast<size_t>(MIN_COLUMN_BLOCK)) {
+        scalar_nodes_.assign(first, first + count);
+        return;
     }
-    auto last_non_empty = std::prev(cell_index_.end());
-    while(last_non_empty->size() == 0) {
-        if(last_non_empty == cell_index_.begin()) {
-            return -1;
+
+    level_marks_.resize(graph_.NodeIdLimit());
+    if(++level_epoch_ == 0) {
+        std::fill(level_marks_.begin(), level_marks_.end(), 0);
+        level_epoch_ = 1;
+    }
+    for(size_t idx = 0; idx < count; ++idx) {
+        level_marks_[first[idx]] = level_epoch_;
+    }
+    //Общее AST формулы ячейки pos, если ее вершина в этом уровне
+    auto level_form = [this](Position pos) -> FormulaInterface::SharedForm {
+        const auto node = pos.IsValid() ? graph_.FindNode(pos) : DependencyGraph::NONE;
+        if(node == DependencyGraph::NONE || level_marks_[node] != level_epoch_) {
+            return {};
+        }
+        const auto formula = GetCellRawPtr(pos)->GetFormula();
+        return formula ? formula->GetSharedForm() : FormulaInterface::SharedForm{};
+    };
+
+    for(size_t idx = 0; idx < count; ++idx) {
+        const Position pos = graph_.GetPosition(first[idx]);
+        const auto form = level_form(pos);
+        if(!form.ast) {
+            scalar_nodes_.push_back(first[idx]);
+            continue;
+        }
+        //блок начинается с ячейки, над которой нет формулы той же формы из этого уровня
+        if(level_form({pos.row - 1, pos.col}).ast == form.ast) {
+            continue;
+        }
+        int rows = 1;
+        while(level_form({pos.row + rows, pos.col}).ast == form.ast) {
+            ++rows;
+        }
+        if(rows < MIN_COLUMN_BLOCK) {
+            for(int row = 0; row < rows; ++row) {
+                scalar_nodes_.push_back(graph_.FindNode({pos.row + row, pos.col}));
+            }
+            continue;
+        }
+        for(int done = 0; done < rows; done += MAX_COLUMN_BLOCK) {
+            const Position block_first{pos.row + done, pos.col};
+            column_blocks_.push_back({block_first, std::min(MAX_COLUMN_BLOCK, rows - done),
+                                      GetCellRawPtr(block_first)->GetFormula()});
+        }
+    }
+}
+
+void Sheet::EvaluateColumnBlock(const ColumnBlock& block) const {
+    //Значения блока, свой буфер у каждого потока пересчета
+    thread_local std::vector<double> values;
+    values.resize(block.rows);
+    const bool is_evaluated = block.formula->EvaluateColumnBoxed(*this, block.rows, values.data());
+    for(int row = 0; row < block.rows; ++row) {
+        const Cell* cell_ptr = GetCellRawPtr({block.first.row + row, block.first.col});
+        if(is_evaluated) {
+            cell_ptr->StoreComputedValue(values[row]);
+        } else {
+            cell_ptr->GetValue();
         }
-        --last_non_empty;
     }
-    return last_non_empty - cell_index_.begin();
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,14 +1,31 @@
 #pragma once
 
+#include "arena.h"
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "journal.h"
+#include "thread_pool.h"
+#include "tiled_index.h"
 
-#include <stack>
+#include <atomic>
+#include <functional>
 #include <iostream>
-#include <type_traits>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 class Sheet : public SheetInterface {
 public:
+    //Режим пересчета формул:
+    //lazy - значение вычисляется при чтении, рекурсивно по влияющим ячейкам, и кешируется;
+    //eager - при каждом изменении зависимые ячейки пересчитываются по одному разу
+    //в топологическом порядке, чтение значения - только чтение кеша
+    enum class RecalcMode {
+        lazy,
+        eager,
+    };
+
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
@@ -23,86 +40,278 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    void GetRangeValues(Range range, std::vector<double>& values) const override;
+    //Итоги диапазона не меньше MIN_TOTALS_CELLS ячеек из кеша, см. RangeTotalsCache
+    std::optional<RangeTotals> GetRangeTotals(Range range) const override;
+    //Ищет по тайлам индекса ячеек, см. TiledIndex::FindNext
+    Position FindNextCell(Range range, Position from) const override;
+
+    //Статистика арены листа (ячейки, узлы AST формул и списки ссылок)
+    SheetArena::Stats GetAllocationStats() const;
+    //Число различных форм формул листа (см. FormulaCache)
+    size_t GetSharedFormulaCount() const;
+
+    //Ячейки, значение которых непосредственно зависит от ячейки pos, в том числе через диапазон (отсортированы)
+    std::vector<Position> GetDependentCells(Position pos) const;
+
+    //Ячейки, на которые непосредственно ссылается формула ячейки pos, без ячеек диапазонов (отсортированы)
+    std::vector<Position> GetPrecedentCells(Position pos) const;
+
+    const DependencyGraph& GetDependencyGraph() const;
+
+    //При переключении в eager сразу пересчитывает все формулы листа
+    void SetRecalcMode(RecalcMode mode);
+    RecalcMode GetRecalcMode() const;
+
+    //Число потоков пересчета; при 0 или 1 пересчет идет в вызывающем потоке.
+    //Независимые ячейки одного уровня графа вычисляются параллельно, результат не зависит от числа потоков
+    void SetRecalcThreads(size_t thread_count);
+    size_t GetRecalcThreads() const;
+
+    //Полный пересчет: сбрасывает кеш всех формул и вычисляет их заново
+    void Recalculate();
+
+    //Число вычислений формул листа (промахов кеша значений) с момента создания
+    uint64_t GetFormulaEvaluationCount() const;
+
+    //Пакетное изменение: после BeginBatch вызовы SetCell/ClearCell только запоминаются
+    //(позиция проверяется сразу), лист не меняется до CommitBatch
+    void BeginBatch();
+    //Применяет пакет: для каждой ячейки - только ее последнее изменение, все формулы разбираются
+    //до изменения листа, циклы проверяются одним проходом по графу, кеш сбрасывается одним обходом.
+    //При FormulaException или CircularDependencyException лист остается как до пакета, пакет отменяется
+    void CommitBatch();
+    //Отменяет незавершенный пакет
+    void RollbackBatch();
+    bool IsInBatch() const;
+
+    //Формат таблицы для LoadTexts: поля строки разделены табуляцией (как в PrintTexts) или запятой.
+    //В csv поле в двойных кавычках может содержать запятые и переводы строк, "" в нем - кавычка
+    enum class TableFormat {
+        tsv,
+        csv,
+    };
+    //Загружает тексты ячеек из таблицы, обратное PrintTexts: строки таблицы - строки листа от A1, поля - ячейки.
+    //Непустое поле заменяет текст ячейки, пустое ее не меняет. Таблица читается блоками, формулы готовятся
+    //к разбору в потоках пересчета (SetRecalcThreads), ссылки всех ячеек применяются к графу один раз,
+    //как в CommitBatch. При исключении (в том числе InvalidPositionException) лист остается как до загрузки.
+    //Внутри пакета поля таблицы только добавляются к пакету
+    void LoadTexts(std::istream& input, TableFormat format = TableFormat::tsv);
+
+    //Двоичный снимок листа (см. snapshot.h): ячейки без разбора текста, формы формул (текст каждой
+    //формы - один раз), граф зависимостей и, если with_values, вычисленные значения формул
+    void SaveSnapshot(std::ostream& output, bool with_values = true) const;
+    //Загружает снимок в пустой лист без журнала (иначе std::logic_error). Файл отображается в память: массивы графа
+    //копируются как есть, каждая форма формулы разбирается один раз, значения формул из снимка сразу
+    //в кеше - GetValue не пересчитывает их. SnapshotException - снимок поврежден или другой версии,
+    //лист при этом остается пустым
+    void LoadSnapshot(const std::string& path);
+    //Снимок в памяти; data выровнены на 8 байт
+    void LoadSnapshot(const char* data, size_t size);
+
+    //Параллельная выгрузка значений, побайтно равная PrintValues: формулы без значения в кеше сначала
+    //вычисляются по уровням графа (как в eager режиме), затем печатная область делится на полосы строк,
+    //полосы форматируются в свои буферы в потоках пересчета (SetRecalcThreads) и пишутся по порядку
+    void ExportValues(std::ostream& output);
+    //То же в файловый дескриптор, формат чисел - как у потока по умолчанию.
+    //std::system_error - ошибка записи
+    void ExportValues(int fd);
+
+    //Журнал изменений (см. journal.h): сначала применяет изменения журнала path одним пакетом, как CommitBatch,
+    //затем дописывает в него каждое успешное изменение листа: SetCell, ClearCell, пакет или LoadTexts - один кадр.
+    //Кадры сбрасываются на диск группами по group_commit: при сбое теряются не больше group_commit - 1
+    //последних изменений. Восстановление после сбоя - LoadSnapshot последнего Checkpoint и OpenJournal.
+    //JournalException - журнал не читается или не пишется; std::logic_error - журнал уже открыт или идет пакет
+    void OpenJournal(const std::string& path, size_t group_commit = 1);
+    //Сбрасывает на диск все кадры журнала
+    void SyncJournal();
+    //Сбрасывает кадры на диск и закрывает журнал
+    void CloseJournal();
+    //Размер журнала, байт; 0 - журнала нет
+    uint64_t GetJournalSize() const;
+    //Пишет снимок листа (с значениями) во временный файл, сбрасывает его на диск и заменяет им snapshot_path,
+    //затем очищает журнал: время восстановления не зависит от длины истории изменений.
+    //Сбой до очистки журнала безопасен: изменения журнала задают тексты ячеек, и их повторное
+    //применение к снимку, который их уже содержит, не меняет лист
+    void Checkpoint(const std::string& snapshot_path);
+
 private:
-    using CellPtr = std::unique_ptr<Cell>;
-    using CellRow = std::deque<CellPtr>;
+    using CellPtr = ArenaPtr<Cell>;
+
+    //NB: арена объявлена первой - освобождается последней, одним блоком после разрушения ячеек
+    SheetArena arena_;
+
+    //Формулы протянутых ячеек делят одно AST (см. FormulaCache); AST размещаются в арене
+    FormulaCache formulas_{arena_.Resource()};
 
-    //index[row][col]
-    std::deque<CellRow> cell_index_;
-    std::deque<int> num_cells_in_row_;
+    //index[pos] -> cell, хранится тайлами 64x64 (см. TiledIndex)
+    TiledIndex<CellPtr> cell_index_;
+
+    //Число ячеек с непустым текстом в каждой строке/столбце, для расчета печатной области
+    std::vector<int> non_empty_in_row_;
+    std::vector<int> non_empty_in_col_;
+
+    //Прямые зависимости между ячейками -> инвалидация кеша при изменении
+    DependencyGraph graph_;
 
     Size print_size_;
 
+    Cell::EvaluationCounter formula_evaluations_{0};
+
+    RecalcMode recalc_mode_ = RecalcMode::lazy;
+    //Транзитивно зависимые ячейки последнего изменения, буфер переиспользуется
+    std::vector<DependencyGraph::NodeId> dirty_nodes_;
+    //Стек обхода при сбросе кеша зависимых ячеек, буфер переиспользуется
+    std::vector<DependencyGraph::NodeId> invalidate_stack_;
+    //Куча вершин для пересчета по возрастанию топологического номера, буфер переиспользуется
+    std::vector<DependencyGraph::NodeId> recalc_queue_;
+
+    //Открытый журнал изменений, см. OpenJournal
+    std::unique_ptr<Journal> journal_;
+
+    //Изменение ячейки в незавершенном пакете
+    struct BatchEdit {
+        Position pos;
+        std::string text;
+        bool is_clear = false;
+    };
+    bool is_in_batch_ = false;
+    std::vector<BatchEdit> batch_edits_;
+    //pos -> номер изменения ячейки в batch_edits_ + 1: повторное изменение заменяет прежнее
+    TiledIndex<uint32_t> batch_index_;
+
+    //Итоги диапазона (сумма и число значений) для SUM, COUNT и AVERAGE, по id вершины диапазона.
+    //Правка числа или текста в диапазоне меняет итоги на разность значений за O(1),
+    //изменение значения формулы в диапазоне сбрасывает их. Раз в EXACT_TOTALS_PERIOD разностей
+    //итоги считаются заново, чтобы не накапливалась ошибка округления
+    struct RangeTotalsCache {
+        //Номер вершины диапазона (DependencyGraph::GetRangeSerial), для которой посчитаны итоги; 0 - итогов нет.
+        //Потоки пересчета читают итоги после acquire-чтения serial, записывают их под range_totals_mutex_
+        std::atomic<uint32_t> serial{0};
+        RangeTotals totals;
+        uint32_t delta_count = 0;
+
+        RangeTotalsCache() = default;
+        RangeTotalsCache(const RangeTotalsCache& other)
+            : serial(other.serial.load())
+            , totals(other.totals)
+            , delta_count(other.delta_count) {
+        }
+    };
+    //Меньший диапазон быстрее сложить заново
+    static constexpr size_t MIN_TOTALS_CELLS = 64;
+    static constexpr uint32_t EXACT_TOTALS_PERIOD = 1024;
+    //Размер меняется только вне пересчета, см. UpdateRangeTotals
+    mutable std::vector<RangeTotalsCache> range_totals_;
+    mutable std::mutex range_totals_mutex_;
+    //Диапазоны измененной ячейки, буфер переиспользуется
+    std::vector<DependencyGraph::NodeId> changed_ranges_;
+
+    //Меньше ячеек выгоднее пересчитать в одном потоке
+    static constexpr size_t MIN_PARALLEL_CELLS = 256;
+    std::unique_ptr<ThreadPool> recalc_pool_;
+
+    //Блок формул одной формы (общее AST, см. FormulaCache) в соседних строках столбца:
+    //вычисляется по столбцу одним проходом байткода (FormulaInterface::EvaluateColumnBoxed)
+    struct ColumnBlock {
+        Position first;
+        int rows;
+        //Формула первой ячейки блока
+        const FormulaInterface* formula;
+    };
+    //Более короткий блок вычисляется по ячейкам
+    static constexpr int MIN_COLUMN_BLOCK = 16;
+    //Длинный блок делится на части: часть - одна задача пула
+    static constexpr int MAX_COLUMN_BLOCK = 1024;
+    //Блоки и остальные ячейки текущего уровня, буферы переиспользуются
+    std::vector<ColumnBlock> column_blocks_;
+    std::vector<DependencyGraph::NodeId> scalar_nodes_;
+    //Вершина входит в текущий уровень, если level_marks_[node] == level_epoch_
+    std::vector<uint32_t> level_marks_;
+    uint32_t level_epoch_ = 0;
+
     Sheet::CellPtr& GetRefOrMakeNewCell(Position pos);
 
     Cell* GetCellRawPtr(Position pos);
     const Cell* GetCellRawPtr(Position pos) const;
 
-    CellPtr& MakeNewCell(Position pos);
+    //Обновляет счетчики непустых ячеек и печатную область при изменении пустоты ячейки pos
+    void UpdPrintArea(Position pos, bool was_empty, bool is_empty);
 
-    //Увеличивает размер отображаемой (печатной) области, когда ячейка выходит за пределы текущего размера
-    void UpdPrintAreaSize(Position pos);
-    void UpdIndexSize(Position pos);
+    //Удаляет очищенную ячейку из индекса, если на нее никто не ссылается
+    void ProcessCellClear(Position pos);
 
-    //По умолчанию увеличивает счетчик непустых ячеек в ряду на 1
-    void UpdCellInRowCount(Position pos, int count = 1);
+    //Запоминает изменение ячейки в пакете вместо прежнего изменения той же ячейки
+    void RecordBatchEdit(Position pos, std::string text, bool is_clear);
+    //Забирает изменения пакета и завершает его
+    std::vector<BatchEdit> TakeBatchEdits();
 
-    //Обновляет размеры индекса, счетчик непустых ячеек и PrintArea после стирания ячейки
-    void ProcessCellClear(Position pos);
+    //Изменения пакета, разобранные до изменения листа
+    struct PreparedEdits {
+        std::vector<Position> positions;
+        std::vector<Cell::CellData> data;
+        //Новые ссылки - только у ячеек, у которых есть старые или новые ссылки
+        std::vector<DependencyGraph::CellRefs> refs;
+        std::vector<Position> cleared;
+    };
+    //Изменения разбираются окнами: записи формул и данные текстов окна готовятся параллельно
+    static constexpr size_t PARSE_WINDOW = 1 << 16;
+    //Разбирает изменения edits различных ячеек и добавляет к prepared те, что меняют лист.
+    //Тексты edits забираются. FormulaException - лист не меняется
+    void PrepareEdits(std::vector<BatchEdit>& edits, PreparedEdits& prepared);
+    //Применяет разобранные изменения и пересчитывает зависимые ячейки в eager режиме.
+    //CircularDependencyException - лист не меняется
+    void ApplyEdits(PreparedEdits& prepared);
 
     //Выбросит исключение InvalidPositionException если pos не валиден
     void CheckCellPos(Position pos) const;
 
-    //Проверяет, есть ли в графе ячейна на позиции pos
-    bool HasCell(Position pos) const;
+    //Создать пустые ячейки для ссылок формулы ячейки pos (после успешной проверки на цикл)
+    void MakeReferencedCells(Position pos);
 
-    int  FindLastNonEmptyRow() const;
+    //Изменение ячейки pos для итогов ее диапазонов: old_is_formula - была ли в ячейке формула,
+    //old_value - прежнее значение для диапазонов (Cell::GetRangeValue), если формулы не было.
+    //Вызывается до пересчета зависимых ячеек
+    void UpdateRangeTotals(Position pos, bool old_is_formula, std::optional<double> old_value);
+    void ResetRangeTotals(DependencyGraph::NodeId range_node);
 
-    template<typename OutputValueGetter>
-    void OutputAllCells(std::ostream& out, OutputValueGetter out_get) const;
-};
+    //При изменении ячейки, сбросить кэш зависимых ячеек (они запоминаются в dirty_nodes_)
+    void InvalidateDependentCellsCaches(Position pos);
+    //Сбрасывает кеш зависимых ячеек pos и добавляет их к dirty_nodes_
+    void CollectDirtyDependents(Position pos);
 
-namespace {
-struct CellValuePrinter {
-    std::ostream& out;
-    void operator()(std::monostate) {
-        out << "";
-    }
-    void operator()(std::string str) {
-        out << str;
-    }
-    void operator()(double dbl) {
-        out << dbl;
-    }
-    void operator()(FormulaError err) {
-        out << err;
-    }
-};
+    //В eager режиме вычисляет ячейку pos и ее зависимые ячейки из dirty_nodes_ в топологическом порядке
+    void RecalcDirtyCells(Position pos);
+    //Изменение ячейки pos со значением-операндом old_value (см. Cell::GetOperandValue);
+    //was_in_ranges - входило ли старое значение в диапазоны (пустая ячейка и 0 для COUNT различаются).
+    //lazy: сбрасывает кеш зависимых ячеек. eager: вычисляет ячейку и, если ее значение изменилось,
+    //пересчитывает зависимые, отсекая ветви, где значение ячейки не изменилось (early cutoff)
+    void ProcessCellChange(Position pos, double old_value, bool was_in_ranges);
+    //Пересчет зависимых ячеек от измененной ячейки pos в топологическом порядке:
+    //зависимые ячейки попадают в очередь, только если значение их влияющей ячейки изменилось
+    void RecalcChangedDependents(Position pos);
+    //Вычисляет все формулы листа без значения в кеше в топологическом порядке
+    void RecalcAllCells();
+    //Вычисляет ячейки вершин nodes (в топологическом порядке) по уровням графа
+    void EvaluateNodes(std::vector<DependencyGraph::NodeId>& nodes);
+    //Вычисляет независимые ячейки одного уровня: блоки формул одной формы - по столбцу,
+    //остальные - по одной; параллельно, если есть пул
+    void EvaluateLevel(const DependencyGraph::NodeId* first, size_t count);
+    //Делит вершины уровня на column_blocks_ и scalar_nodes_
+    void FindColumnBlocks(const DependencyGraph::NodeId* first, size_t count);
+    void EvaluateColumnBlock(const ColumnBlock& block) const;
 
-}//namespace
-
-template<typename OutputValueGetter>
-void Sheet::OutputAllCells(std::ostream& out, OutputValueGetter out_get) const {
-    for(int row = 0; row < GetPrintableSize().rows; ++row) {
-        bool is_first = true;
-        for(int col = 0; col < GetPrintableSize().cols; ++col) {
-            if(!is_first) {
-                out << '\t';
-            }
-            is_first = false;
-
-            if(HasCell({row, col})) {
-                const auto cell_ptr = GetCellRawPtr({row,col});
-                if(cell_ptr) {
-                    auto cell_get_val = out_get(cell_ptr);
-                    if constexpr(std::is_same_v<Cell::Value, std::decay_t<decltype(cell_get_val)>>) {
-                        std::visit(CellValuePrinter{out}, cell_get_val);
-                    } else { //if not a variant, then it's a string
-                        out << cell_get_val;
-                    }
-                }
-            }
-        }
-        out << '\n';
-    }
-}
+    //Выгрузка печатной области полосами строк примерно по EXPORT_BAND_CELLS ячеек:
+    //buffer пишется через write(data, size), когда длиннее EXPORT_BUFFER. С пулом и parallel полосы
+    //форматируются параллельно, по EXPORT_BANDS_PER_THREAD полос на поток за раз.
+    //Формат чисел - как у потока format
+    static constexpr size_t EXPORT_BUFFER = 1 << 20;
+    static constexpr int EXPORT_BAND_CELLS = 1 << 16;
+    static constexpr size_t EXPORT_BANDS_PER_THREAD = 4;
+    void ExportCells(bool values, bool parallel, const std::ostream& format,
+                     const std::function<void(const char*, size_t)>& write) const;
+    //Дописывает к buffer строки [first_row, end_row) печатной области: значения (values) или тексты ячеек;
+    //числа значений записывает write_number(buffer, number). Обходятся только заполненные тайлы строки
+    template<typename NumberWriter>
+    void AppendRows(std::string& buffer, int first_row, int end_row, bool values, NumberWriter& write_number) const;
+};
@@ -0,0 +1,167 @@
+#include "snapshot.h"
+
+#include "crc32.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_HAS_MMAP 1
+#endif
+
+namespace {
+constexpr size_t SNAPSHOT_ALIGNMENT = 8;
+
+size_t AlignUp(size_t size) {
+    return (size + SNAPSHOT_ALIGNMENT - 1) & ~(SNAPSHOT_ALIGNMENT - 1);
+}
+
+//Заголовок массива: число элементов и размер элемента
+struct ArrayHeader {
+    uint64_t count;
+    uint32_t element_size;
+    uint32_t reserved;
+};
+}//namespace
+
+//==== SnapshotWriter ====
+SnapshotWriter::SnapshotWriter(std::ostream& output)
+    : output_(output) {
+}
+
+void SnapshotWriter::WriteChecksum() {
+    const uint32_t crc = crc_;
+    Write(crc);
+}
+
+uint64_t SnapshotWriter::Size() const {
+    return size_;
+}
+
+void SnapshotWriter::WriteArrayHeader(uint64_t count, uint32_t element_size) {
+    Write(ArrayHeader{count, element_size, 0});
+}
+
+void SnapshotWriter::WriteBytes(const void* data, size_t size) {
+    output_.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    size_ += size;
+    crc_ = Crc32(static_cast<const char*>(data), size, crc_);
+}
+
+void SnapshotWriter::Pad() {
+    static constexpr char zeros[SNAPSHOT_ALIGNMENT] = {};
+    WriteBytes(zeros, AlignUp(size_) - size_);
+}
+
+//==== SnapshotReader ====
+SnapshotReader::SnapshotReader(const char* data, size_t size)
+    : data_(data)
+    , size_(size) {
+}
+
+void SnapshotReader::VerifyChecksum() {
+    //CRC32, дополненный до 8 байт
+    constexpr size_t checksum_size = SNAPSHOT_ALIGNMENT;
+    if(size_ < checksum_size || size_ - checksum_size < offset_) {
+        throw SnapshotException("Snapshot is truncated");
+    }
+    uint64_t crc = 0;
+    std::memcpy(&crc, data_ + size_ - checksum_size, sizeof(crc));
+    if(Crc32(data_, size_ - checksum_size) != crc) {
+        throw SnapshotException("Snapshot is corrupted");
+    }
+    size_ -= checksum_size;
+}
+
+bool SnapshotReader::AtEnd() const {
+    return offset_ == size_;
+}
+
+size_t SnapshotReader::ReadArrayHeader(uint32_t element_size) {
+    const auto header = Read<ArrayHeader>();
+    if(header.element_size != element_size) {
+        throw SnapshotException("Snapshot array has unexpected element size");
+    }
+    if(header.count > (size_ - offset_) / element_size) {
+        throw SnapshotException("Snapshot is truncated");
+    }
+    return static_cast<size_t>(header.count);
+}
+
+const char* SnapshotReader::Take(size_t size) {
+    if(size > size_ - offset_) {
+        throw SnapshotException("Snapshot is truncated");
+    }
+    const char* data = data_ + offset_;
+    offset_ = std::min(size_, AlignUp(offset_ + size));
+    return data;
+}
+
+//==== MappedFile ====
+MappedFile::MappedFile(const std::string& path) {
+#ifdef SNAPSHOT_HAS_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw SnapshotException("Cannot open snapshot " + path);
+    }
+    struct stat file_stat {};
+    if(::fstat(fd, &file_stat) != 0) {
+        ::close(fd);
+        throw SnapshotException("Cannot read snapshot " + path);
+    }
+    size_ = static_cast<size_t>(file_stat.st_size);
+    if(size_ > 0) {
+        void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) {
+            ::close(fd);
+            throw SnapshotException("Cannot map snapshot " + path);
+        }
+        data_ = static_cast<const char*>(data);
+    }
+    //отображение остается действительным после закрытия файла
+    ::close(fd);
+#else
+    std::ifstream input(path, std::ios::binary);
+    if(!input) {
+        throw SnapshotException("Cannot open snapshot " + path);
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef SNAPSHOT_HAS_MMAP
+    if(data_) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
+
+const char* MappedFile::Data() const {
+    return data_;
+}
+
+size_t MappedFile::Size() const {
+    return size_;
+}
+
+void SyncPath(const std::string& path) {
+#ifdef SNAPSHOT_HAS_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw SnapshotException("Cannot open " + path);
+    }
+    const bool is_synced = ::fsync(fd) == 0;
+    ::close(fd);
+    if(!is_synced) {
+        throw SnapshotException("Cannot sync " + path);
+    }
+#endif
+}
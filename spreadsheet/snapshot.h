@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//Двоичный снимок листа (Sheet::SaveSnapshot/LoadSnapshot): заголовок с версией и последовательность
+//плоских массивов. Массив - число элементов и размер элемента, затем сами элементы, выровненные на 8 байт,
+//поэтому из отображенного в память файла массив читается одним memcpy или используется на месте.
+//Последние 8 байт - CRC32 всего снимка до них: поврежденный файл не загружается.
+//Числа пишутся в порядке байт машины: снимок переносим только между одинаковыми платформами
+
+//Файл не является снимком, другой версии или поврежден
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(std::ostream& output);
+
+    template <typename T>
+    void Write(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        WriteBytes(&value, sizeof(T));
+        Pad();
+    }
+
+    template <typename T>
+    void WriteArray(const T* data, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        WriteArrayHeader(count, sizeof(T));
+        WriteBytes(data, count * sizeof(T));
+        Pad();
+    }
+
+    template <typename T>
+    void WriteArray(const std::vector<T>& values) {
+        WriteArray(values.data(), values.size());
+    }
+
+    //Дописывает CRC32 всего записанного; пишется последним
+    void WriteChecksum();
+
+    //Записано байт с начала снимка
+    uint64_t Size() const;
+
+private:
+    std::ostream& output_;
+    uint64_t size_ = 0;
+    uint32_t crc_ = 0;
+
+    void WriteArrayHeader(uint64_t count, uint32_t element_size);
+    void WriteBytes(const void* data, size_t size);
+    //Дополняет запись нулями до границы 8 байт
+    void Pad();
+};
+
+//Читает снимок из памяти (обычно отображенного файла). Любой выход за границы данных
+//или несовпадение размера элемента - SnapshotException
+class SnapshotReader {
+public:
+    SnapshotReader(const char* data, size_t size);
+
+    template <typename T>
+    T Read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    //Массив на месте, без копирования: данные действительны, пока существует память снимка.
+    //Данные выровнены на 8 байт, если на 8 байт выровнено начало снимка
+    template <typename T>
+    std::pair<const T*, size_t> ReadArrayView() {
+        static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= 8);
+        const size_t count = ReadArrayHeader(sizeof(T));
+        return {reinterpret_cast<const T*>(Take(count * sizeof(T))), count};
+    }
+
+    template <typename T>
+    void ReadArray(std::vector<T>& values) {
+        const auto [data, count] = ReadArrayView<T>();
+        values.resize(count);
+        if(count > 0) {
+            std::memcpy(values.data(), data, count * sizeof(T));
+        }
+    }
+
+    //Сверяет CRC32 в конце снимка (см. SnapshotWriter::WriteChecksum) и отрезает его от данных.
+    //SnapshotException, если снимок поврежден
+    void VerifyChecksum();
+
+    bool AtEnd() const;
+
+private:
+    const char* data_;
+    size_t size_;
+    size_t offset_ = 0;
+
+    size_t ReadArrayHeader(uint32_t element_size);
+    //Указатель на следующие size байт; смещение сдвигается на size с выравниванием на 8
+    const char* Take(size_t size);
+};
+
+//Файл, отображенный в память только для чтения (mmap). Где mmap нет - файл читается в буфер
+class MappedFile {
+public:
+    //SnapshotException, если файл не открывается
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* Data() const;
+    size_t Size() const;
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<char> buffer_;
+};
+
+//Сбрасывает записанный файл на диск (fsync), где это поддерживается
+void SyncPath(const std::string& path);
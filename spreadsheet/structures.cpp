@@ -1,7 +1,7 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
 
 const int LETTERS = 26;
@@ -59,8 +59,8 @@ Position Position::FromString(std::string_view str) {
     }
 
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    const auto [row_end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (ec != std::errc{} || row_end != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
@@ -73,6 +73,35 @@ Position Position::FromString(std::string_view str) {
     return {row - 1, col - 1};
 }
 
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(Range rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+size_t Range::CellCount() const {
+    return static_cast<size_t>(last.row - first.row + 1) * static_cast<size_t>(last.col - first.col + 1);
+}
+
+std::string Range::ToString() const {
+    return first.ToString() + ':' + last.ToString();
+}
+
+Range Range::FromCorners(Position lhs, Position rhs) {
+    return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+            {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
 int PositionHash::operator()(const Position& pos) const {
     std::hash<int> int_hasher;
     return int_hasher(pos.row) * 769 + int_hasher(pos.col);
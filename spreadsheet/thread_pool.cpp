@@ -0,0 +1,135 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+    thread_count = std::max<size_t>(thread_count, 1);
+    for(size_t idx = 0; idx < thread_count; ++idx) {
+        queues_.push_back(std::make_unique<WorkerQueue>());
+    }
+    //Очередь 0 - вызывающего потока
+    for(size_t idx = 1; idx < thread_count; ++idx) {
+        workers_.emplace_back([this, idx] {
+            WorkerLoop(idx);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for(auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::ThreadCount() const {
+    return queues_.size();
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& func) {
+    if(count == 0) {
+        return;
+    }
+
+    //1.Split range into chunks, deal them round-robin to worker queues
+    const size_t chunk_size = std::max<size_t>(1, count / (ThreadCount() * CHUNKS_PER_THREAD));
+    const size_t chunk_count = (count + chunk_size - 1) / chunk_size;
+
+    job_ = &func;
+    error_ = nullptr;
+    pending_chunks_.store(chunk_count);
+    for(size_t chunk_idx = 0; chunk_idx < chunk_count; ++chunk_idx) {
+        const size_t begin = chunk_idx * chunk_size;
+        auto& queue = *queues_[chunk_idx % ThreadCount()];
+        std::lock_guard lock(queue.mutex);
+        queue.chunks.push_back({begin, std::min(begin + chunk_size, count)});
+    }
+
+    //2.Wake workers, run chunks in the calling thread too
+    {
+        std::lock_guard lock(mutex_);
+        ++generation_;
+    }
+    work_cv_.notify_all();
+    RunChunks(0);
+
+    //3.Wait for chunks taken by other workers
+    {
+        std::unique_lock lock(mutex_);
+        done_cv_.wait(lock, [this] {
+            return pending_chunks_.load() == 0;
+        });
+    }
+    job_ = nullptr;
+
+    if(error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t worker_idx) {
+    uint64_t seen_generation = 0;
+    while(true) {
+        {
+            std::unique_lock lock(mutex_);
+            work_cv_.wait(lock, [&] {
+                return stop_ || generation_ != seen_generation;
+            });
+            if(stop_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+        RunChunks(worker_idx);
+    }
+}
+
+void ThreadPool::RunChunks(size_t worker_idx) {
+    Chunk chunk;
+    while(PopChunk(worker_idx, chunk)) {
+        try {
+            for(size_t idx = chunk.begin; idx < chunk.end; ++idx) {
+                (*job_)(idx);
+            }
+        } catch(...) {
+            std::lock_guard lock(error_mutex_);
+            if(!error_) {
+                error_ = std::current_exception();
+            }
+        }
+
+        if(pending_chunks_.fetch_sub(1) == 1) {
+            std::lock_guard lock(mutex_);
+            done_cv_.notify_all();
+        }
+    }
+}
+
+bool ThreadPool::PopChunk(size_t worker_idx, Chunk& chunk) {
+    //Own queue: LIFO end
+    {
+        auto& queue = *queues_[worker_idx];
+        std::lock_guard lock(queue.mutex);
+        if(!queue.chunks.empty()) {
+            chunk = queue.chunks.back();
+            queue.chunks.pop_back();
+            return true;
+        }
+    }
+
+    //Steal from the other end of other queues
+    for(size_t offset = 1; offset < ThreadCount(); ++offset) {
+        auto& queue = *queues_[(worker_idx + offset) % ThreadCount()];
+        std::lock_guard lock(queue.mutex);
+        if(!queue.chunks.empty()) {
+            chunk = queue.chunks.front();
+            queue.chunks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Пул потоков с перехватом работы (work stealing) для параллельных циклов.
+//Диапазон итераций делится на порции, порции раскладываются по очередям потоков;
+//поток берет порции с конца своей очереди, а когда она пуста - с начала чужих.
+//Вызывающий поток тоже выполняет порции, поэтому пул из N потоков запускает N - 1 рабочих.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    //Число потоков вместе с вызывающим
+    size_t ThreadCount() const;
+
+    //Вызывает func(i) для всех i из [0, count) и возвращается после завершения всех вызовов.
+    //Первое исключение из func пробрасывается в вызывающий поток
+    void ParallelFor(size_t count, const std::function<void(size_t)>& func);
+
+private:
+    struct Chunk {
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    //Порций на поток: мелкие порции выравнивают нагрузку за счет перехвата
+    static constexpr size_t CHUNKS_PER_THREAD = 8;
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+
+    //Текущий цикл: меняется только когда порций нет, публикуется через мьютексы очередей
+    const std::function<void(size_t)>* job_ = nullptr;
+    std::atomic<size_t> pending_chunks_{0};
+
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+
+    void WorkerLoop(size_t worker_idx);
+
+    //Выполняет порции, пока они есть в своей или чужих очередях
+    void RunChunks(size_t worker_idx);
+    bool PopChunk(size_t worker_idx, Chunk& chunk);
+};
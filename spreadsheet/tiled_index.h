@@ -0,0 +1,224 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <memory>
+#include <utility>
+
+//Разреженный индекс ячеек таблицы.
+//Таблица делится на тайлы TILE_SIZE x TILE_SIZE, тайлы хранятся в двухуровневой radix-таблице
+//[полоса строк][столбец тайла] и выделяются только при первой записи в них.
+//Find/Insert/Extract - O(1), память пропорциональна числу заполненных тайлов.
+//Пустым считается слот, равный T{} (для указателей - nullptr).
+template <typename T>
+class TiledIndex {
+public:
+    static constexpr int TILE_BITS = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS;
+    static constexpr int TILE_MASK = TILE_SIZE - 1;
+    static constexpr int BAND_COUNT = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int TILES_IN_BAND = Position::MAX_COLS / TILE_SIZE;
+
+    //Возвращает указатель на слот позиции или nullptr, если тайл не выделен
+    T* Find(Position pos) {
+        Tile* tile = FindTile(pos);
+        return tile ? &tile->slots[SlotIndex(pos)] : nullptr;
+    }
+
+    const T* Find(Position pos) const {
+        const Tile* tile = FindTile(pos);
+        return tile ? &tile->slots[SlotIndex(pos)] : nullptr;
+    }
+
+    //Записывает значение в пустой слот, выделяя тайл при необходимости
+    T& Insert(Position pos, T value) {
+        auto& band = bands_[pos.row >> TILE_BITS];
+        if(!band) {
+            band = std::make_unique<Band>();
+        }
+        auto& tile = band->tiles[pos.col >> TILE_BITS];
+        if(!tile) {
+            tile = std::make_unique<Tile>();
+            ++band->size;
+            ++tile_count_;
+        }
+
+        T& slot = tile->slots[SlotIndex(pos)];
+        assert(slot == T{});
+        slot = std::move(value);
+        ++tile->size;
+        ++size_;
+        return slot;
+    }
+
+    //Забирает значение из слота; опустевшие тайл и полоса освобождаются
+    T Extract(Position pos) {
+        auto& band = bands_[pos.row >> TILE_BITS];
+        if(!band) {
+            return T{};
+        }
+        auto& tile = band->tiles[pos.col >> TILE_BITS];
+        if(!tile) {
+            return T{};
+        }
+
+        T& slot = tile->slots[SlotIndex(pos)];
+        if(slot == T{}) {
+            return T{};
+        }
+        T value = std::exchange(slot, T{});
+        --size_;
+
+        if(--tile->size == 0) {
+            tile.reset();
+            --tile_count_;
+            if(--band->size == 0) {
+                band.reset();
+            }
+        }
+        return value;
+    }
+
+    //Обход непустых слотов строки row по возрастанию столбца: func(col, const T&)
+    template <typename Func>
+    void ForEachInRow(int row, Func func) const {
+        const auto& band = bands_[row >> TILE_BITS];
+        if(!band) {
+            return;
+        }
+        const int local_row = (row & TILE_MASK) << TILE_BITS;
+        for(int tile_col = 0; tile_col < TILES_IN_BAND; ++tile_col) {
+            const auto& tile = band->tiles[tile_col];
+            if(!tile) {
+                continue;
+            }
+            for(int col = 0; col < TILE_SIZE; ++col) {
+                const T& slot = tile->slots[local_row + col];
+                if(!(slot == T{})) {
+                    func((tile_col << TILE_BITS) + col, slot);
+                }
+            }
+        }
+    }
+
+    //Обход непустых слотов диапазона построчно: func(Position, const T&).
+    //Невыделенные полосы и тайлы пропускаются целиком
+    template <typename Func>
+    void ForEachInRange(Range range, Func func) const {
+        int row = range.first.row;
+        while(row <= range.last.row) {
+            const auto& band = bands_[row >> TILE_BITS];
+            if(!band) {
+                row = ((row >> TILE_BITS) + 1) << TILE_BITS;
+                continue;
+            }
+            const int local_row = (row & TILE_MASK) << TILE_BITS;
+            for(int tile_col = range.first.col >> TILE_BITS; tile_col <= range.last.col >> TILE_BITS; ++tile_col) {
+                const auto& tile = band->tiles[tile_col];
+                if(!tile) {
+                    continue;
+                }
+                const int first_col = std::max(range.first.col, tile_col << TILE_BITS);
+                const int last_col = std::min(range.last.col, ((tile_col + 1) << TILE_BITS) - 1);
+                for(int col = first_col; col <= last_col; ++col) {
+                    const T& slot = tile->slots[local_row + (col & TILE_MASK)];
+                    if(!(slot == T{})) {
+                        func(Position{row, col}, slot);
+                    }
+                }
+            }
+            ++row;
+        }
+    }
+
+    //Первый непустой слот диапазона не раньше from (построчно) или Position::NONE.
+    //Невыделенные полосы и тайлы пропускаются целиком
+    Position FindNext(Range range, Position from) const {
+        int row = from.row;
+        int first_col = from.col;
+        while(row <= range.last.row) {
+            const auto& band = bands_[row >> TILE_BITS];
+            if(!band) {
+                row = ((row >> TILE_BITS) + 1) << TILE_BITS;
+                first_col = range.first.col;
+                continue;
+            }
+            const int local_row = (row & TILE_MASK) << TILE_BITS;
+            for(int tile_col = first_col >> TILE_BITS; tile_col <= range.last.col >> TILE_BITS; ++tile_col) {
+                const auto& tile = band->tiles[tile_col];
+                if(!tile) {
+                    continue;
+                }
+                const int begin_col = std::max(first_col, tile_col << TILE_BITS);
+                const int last_col = std::min(range.last.col, ((tile_col + 1) << TILE_BITS) - 1);
+                for(int col = begin_col; col <= last_col; ++col) {
+                    if(!(tile->slots[local_row + (col & TILE_MASK)] == T{})) {
+                        return {row, col};
+                    }
+                }
+            }
+            ++row;
+            first_col = range.first.col;
+        }
+        return Position::NONE;
+    }
+
+    //Обход всех непустых слотов: func(Position, const T&)
+    template <typename Func>
+    void ForEach(Func func) const {
+        for(int band_idx = 0; band_idx < BAND_COUNT; ++band_idx) {
+            if(!bands_[band_idx]) {
+                continue;
+            }
+            for(int row = band_idx << TILE_BITS; row < (band_idx + 1) << TILE_BITS; ++row) {
+                ForEachInRow(row, [&](int col, const T& slot) {
+                    func(Position{row, col}, slot);
+                });
+            }
+        }
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    size_t TileCount() const {
+        return tile_count_;
+    }
+
+    //Оценка памяти, занимаемой индексом (без самих значений, на которые указывают слоты)
+    size_t MemoryUsage() const {
+        size_t band_count = 0;
+        for(const auto& band : bands_) {
+            band_count += band ? 1 : 0;
+        }
+        return sizeof(*this) + band_count * sizeof(Band) + tile_count_ * sizeof(Tile);
+    }
+
+private:
+    struct Tile {
+        std::array<T, TILE_SIZE * TILE_SIZE> slots{};
+        int size = 0;
+    };
+
+    struct Band {
+        std::array<std::unique_ptr<Tile>, TILES_IN_BAND> tiles;
+        int size = 0;
+    };
+
+    std::array<std::unique_ptr<Band>, BAND_COUNT> bands_;
+    size_t size_ = 0;
+    size_t tile_count_ = 0;
+
+    static int SlotIndex(Position pos) {
+        return ((pos.row & TILE_MASK) << TILE_BITS) + (pos.col & TILE_MASK);
+    }
+
+    Tile* FindTile(Position pos) const {
+        const auto& band = bands_[pos.row >> TILE_BITS];
+        return band ? band->tiles[pos.col >> TILE_BITS].get() : nullptr;
+    }
+};